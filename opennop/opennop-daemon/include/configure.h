@@ -50,4 +50,6 @@
  */
 int configure(char *path, __u32 *localID, __u32 *packet_number, __u32 *packet_size, __u32 *thr_num, __u32 *fpPerPkt, __u32 *fpsFactor);
 
+unsigned round_down_to_power_of_2(unsigned x);
+
 #endif /* CONFIGURE_H_ */
@@ -46,8 +46,13 @@
 
 #include <linux/types.h>
 #include <stdint.h>
+#include <netinet/ip.h> // for tcpmagic and TCP options
+#include <netinet/tcp.h> // for tcpmagic and TCP options
 #include "01dedup.h"
 #include "solowan_rolling.h"
+#include "quicklz.h"
+#include "session.h"
+#include "recovery.h"
 
 #define CHUNK 400
 #define BUFFER_SIZE 1600
@@ -56,6 +61,126 @@
 #define OK 1
 #define HASH_NOT_FOUND 2
 
+#define TCPOPT_DICTIONARY 33 // Dictionary control option (epoch and store sizes)
+#define TCPOPT_DEDUP_FORMAT 34 // Highest compressed packet format supported, in SYN and SYN/ACK packets
+#define TCPOPT_PKTID 35 // 32 low bits of the pktId a packet sent as it is was stored with (DEDUP_FORMAT_INDEX)
+#define TCPOPT_DICTIONARY_HELLO 36 // Dictionary generation and sizes, in SYN and SYN/ACK packets
+
+// Value of the compression option (31): the packet format (DEDUP_FORMAT_FP, DEDUP_FORMAT_INDEX, or 0 if not
+// deduplicated), and DEDUP_FLAG_LZ if the result was then compressed with QuickLZ
+// Delta packets (see dedupDelta) are sent as DEDUP_FORMAT_FP, uncomp tells them apart. The format option (34)
+// has DEDUP_FLAG_DELTA set if the accelerator uncompresses them.
+// DEDUP_FLAG_RESENT is set in a retransmission sent as its first copy was (see tcp_resend_batched), and in the
+// format option if the accelerator uncompresses them.
+// DEDUP_FLAG_EXTENDED is only set in the format option, if the accelerator uncompresses the references
+// sent with DEDUP_EXTENDED (whole packet, self and spanning references).
+#define DEDUP_FORMAT_MASK 0x0f
+#define DEDUP_FLAG_EXTENDED 0x10
+#define DEDUP_FLAG_RESENT 0x20
+#define DEDUP_FLAG_DELTA 0x40
+#define DEDUP_FLAG_LZ 0x80
+
+#define PARTITION_NONE 0
+#define PARTITION_CLASS 1 // Partition by session class (TCP ports)
+#define MAX_CLASS_PORTS 16
+
+struct partition_class {
+	unsigned int quota; // Percent of the packet store
+	unsigned int numports;
+	__u16 ports[MAX_CLASS_PORTS];
+};
+
+#define MAX_PEER_SIZES 256
+
+struct peer_dictionary_size {
+	__u32 peerID; // Accelerator ID of the remote accelerator.
+	unsigned int size; // Packets of its dictionaries.
+};
+
+// Codec selection (see choose_codec): recent yield of each codec on a flow, in 1/256 of the bytes given to it.
+// A codec yielding less than CODEC_MIN_YIELD is skipped, but still tried every CODEC_EXPLORE packets of the flow.
+#define CODEC_DEDUP 1 // Matches are looked up; otherwise the packet is only cached
+#define CODEC_LZ 2 // Second stage compression
+#define CODEC_YIELD_INIT 64
+#define CODEC_MIN_YIELD 3
+#define CODEC_EXPLORE 16
+struct codec_model {
+	__u16 dedupYield;
+	__u16 lzYield;
+	__u32 packets;
+};
+
+// Dictionary handshake (see set_dictionary_hello_option): remote accelerators seen, the generation of their
+// dictionaries and whether they match ours. Entries are never removed, sessions keep their index plus one.
+#define MAX_DICTIONARY_PEERS 256
+#define DICT_MISMATCH_SIZE 1 // Packets of the dictionaries used with this accelerator
+#define DICT_MISMATCH_FPS 2 // fps_factor
+#define DICT_MISMATCH_PARAMS 4 // pkt_size, fp_per_pkt, unified_dictionary or dictionary_partition
+struct dictionary_peer {
+	__u32 peerID; // Accelerator ID of the remote accelerator.
+	__u32 hello; // Last dictionary hello option received from it.
+	__u32 restarts; // Generations seen after the first one.
+	__u32 flushes; // Dictionaries flushed after those restarts.
+	__u8 format; // Packet formats it uncompresses (see get_dedup_format_option).
+	int mismatch;
+};
+
+// Packets of a flow cached by the optimization thread and not yet acknowledged by the far host (see tcp_acked_batched):
+// runs of consecutive pktIds, with the sequence number following the data of the last one
+#define ACK_RUNS 16
+struct ack_run {
+	__u32 seqEnd;
+	int64_t first;
+	int64_t last;
+};
+
+// Match continuation of a flow (see DedupStream), kept by the optimization thread in a table indexed by connection
+#define DEDUP_STREAMS 1024
+struct dedup_stream {
+	pDeduplicator pd;
+	__u32 saddr;
+	__u32 daddr;
+	__u16 source;
+	__u16 dest;
+	DedupStream stream;
+	struct codec_model model;
+	struct ack_run runs[ACK_RUNS]; // Oldest first, from runHead
+	unsigned int runHead;
+	unsigned int runNum;
+};
+
+// Retransmission cache (see tcp_resend_batched): deduplicated data of the segments last sent by the optimization
+// thread, direct mapped by connection and sequence number
+#define RESEND_SLOTS 256
+struct resend_entry {
+	pDeduplicator pd;
+	__u32 saddr;
+	__u32 daddr;
+	__u16 source;
+	__u16 dest;
+	__u32 seq; // As received, before it is changed to mark the packet optimized
+	__u16 datasize; // TCP data of the segment
+	__u16 optlen; // Deduplicated data in buffer, 0 if the slot is empty
+	int format; // Format and flags the segment was sent with
+	int dedupformat; // Format given to dedup_batch
+	__u8 epoch;
+	__u8 *buffer;
+};
+
+// Packets deduplicated together by the optimization thread
+struct dedup_batch {
+	unsigned int num;
+	DedupBatchEntry entries[MAX_DEDUP_BATCH];
+	pDeduplicator pd[MAX_DEDUP_BATCH];
+	__u8 *ippacket[MAX_DEDUP_BATCH];
+	int format[MAX_DEDUP_BATCH]; // Format and flags of the session
+	int codec[MAX_DEDUP_BATCH]; // Codecs run on each packet, -1 if only cached
+	struct dedup_stream *flow[MAX_DEDUP_BATCH];
+	__u8 *buffers[MAX_DEDUP_BATCH]; // Deduplicated data of each packet
+	struct dedup_stream *streams; // Flows of the thread, DEDUP_STREAMS
+	struct resend_entry *resend; // Retransmission cache of the thread, RESEND_SLOTS, NULL if not used
+};
+
 typedef struct hashptr{
     uint16_t position;
     struct hashptr *next;
@@ -75,13 +200,97 @@ int cli_show_stats_out_dedup_thread(int client_fd, char **parameters, int numpar
 int cli_show_deduplication(int client_fd, char **parameters, int numparameters);
 int cli_deduplication_enable(int client_fd, char **parameters, int numparameters);
 int cli_deduplication_disable(int client_fd, char **parameters, int numparameters);
+int cli_dictionary_resize(int client_fd, char **parameters, int numparameters);
+int cli_show_dictionary_resize(int client_fd, char **parameters, int numparameters);
+int cli_show_dictionary_partitions(int client_fd, char **parameters, int numparameters);
+int cli_show_dictionary_maintenance(int client_fd, char **parameters, int numparameters);
+int cli_show_dictionary_peers(int client_fd, char **parameters, int numparameters);
 
-unsigned int tcp_optimize(pDeduplicator pd, __u8 *ippacket, __u8 *buffered_packet);
-unsigned int tcp_deoptimize(pDeduplicator pd, __u8 *ippacket, __u8 *buffered_packet);
-unsigned int tcp_cache_deoptim(pDeduplicator pd, __u8 *ippacket);
-unsigned int tcp_cache_optim(pDeduplicator pd, __u8 *ippacket);
+unsigned int tcp_optimize(pDeduplicator pd, unsigned int partition, int peer, int format, __u8 *ippacket, __u8 *buffered_packet,
+		__u8 *lzbuffer, qlz_state_compress *state_compress);
+unsigned int tcp_deoptimize(pDeduplicator pd, unsigned int partition, __u8 *ippacket, __u8 *buffered_packet,
+		__u8 *lzbuffer, qlz_state_decompress *state_decompress);
+void tcp_deoptimize_prefetch(pDeduplicator *pd, __u8 **ippacket, unsigned int num);
+unsigned int tcp_cache_deoptim(pDeduplicator pd, unsigned int partition, __u8 *ippacket);
+unsigned int tcp_cache_optim(pDeduplicator pd, unsigned int partition, int peer, __u8 *ippacket);
+int dedup_batch_init(struct dedup_batch *batch);
+void dedup_batch_free(struct dedup_batch *batch);
+void tcp_optimize_batched(struct dedup_batch *batch, pDeduplicator pd, unsigned int partition, int peer, int format, __u8 *ippacket,
+		__u8 *lzbuffer, qlz_state_compress *state_compress);
+void tcp_cache_optim_batched(struct dedup_batch *batch, pDeduplicator pd, unsigned int partition, int peer, int format, __u8 *ippacket,
+		__u8 *lzbuffer, qlz_state_compress *state_compress);
+void dedup_batch_run(struct dedup_batch *batch, __u8 *lzbuffer, qlz_state_compress *state_compress);
+unsigned int tcp_resend_batched(struct dedup_batch *batch, pDeduplicator pd, int format, __u8 *ippacket,
+		__u8 *lzbuffer, qlz_state_compress *state_compress);
+int tcp_refuse_batched(struct dedup_batch *batch, pDeduplicator pd, struct recovery_nack *nack, __u8 *chunk, __u16 *chunklen);
+void tcp_acked_batched(struct dedup_batch *batch, pDeduplicator pd, __u8 *ippacket, __u64 acked);
+int dedup_batch_size_set(unsigned int size);
+extern unsigned int dedup_batch_size;
+int dedup_helpers_set(unsigned int helpers);
+FPHelpers *new_dedup_helpers(int i);
+void setup_dictionary_helpers(pDeduplicator pd, FPHelpers *helpers);
+extern unsigned int dedup_helpers;
 int deduplication_enable();
 int deduplication_disable();
 extern int deduplication;
+int unified_dictionary_enable();
+int unified_dictionary_disable();
+extern int unified_dictionary;
+int dictionary_partition_set(char *mode);
+int partition_class_add(unsigned int quota, char *ports);
+int partition_borrow_set(int borrow);
+void setup_dictionary_partitions(pDeduplicator pd);
+unsigned int get_dictionary_partition(struct iphdr *iph, struct tcphdr *tcph);
+extern int dictionary_partition;
+int dictionary_shm_set(char *name);
+pDeduplicator new_dictionary(int worker, __u32 peerID, const char *role, int unified);
+int peer_dictionaries_enable();
+int peer_dictionaries_disable();
+int peer_dictionaries_max_set(unsigned int peers);
+int peer_dictionary_size_set(unsigned int size, char *peer);
+int peer_dictionaries_total_set(unsigned int size);
+unsigned int get_dictionary_size(__u32 peerID);
+unsigned int get_peer_dictionaries_total(void);
+extern int peer_dictionaries;
+extern unsigned int peer_dictionaries_max;
+int dictionary_hub_enable();
+int dictionary_hub_disable();
+void setup_dictionary_hub(pDeduplicator pd);
+extern int dictionary_hub;
+int dedup_format_set(unsigned int format);
+void check_dedup_format();
+__u8 get_local_dedup_format(void);
+void set_dedup_format_option(__u8 *ippacket);
+__u8 get_dedup_format_option(__u8 *ippacket);
+int get_session_dedup_format(struct session *thissession);
+void setup_dictionary_generation();
+void reset_dictionary_resize(pDeduplicator pd, __u32 peerID);
+void set_dictionary_hello_option(__u8 *ippacket, __u32 peerID, int worker);
+__u16 get_dictionary_hello_option(__u8 *ippacket, __u32 remoteID, int worker);
+__u32 dictionary_peer_restarts(__u16 hello);
+int dictionary_peer_mismatch(__u16 hello);
+void dictionary_peer_flushed(__u16 hello);
+int cli_show_dictionary_handshake(int client_fd, char **parameters, int numparameters);
+extern int dedup_format;
+int residue_compression_enable();
+int residue_compression_disable();
+extern int residue_compression;
+int codec_selection_enable();
+int codec_selection_disable();
+extern int codec_selection;
+int delta_encoding_enable();
+int delta_encoding_disable();
+void setup_dictionary_resemblance(pDeduplicator pd);
+extern int delta_encoding;
+int retransmission_cache_enable();
+int retransmission_cache_disable();
+extern int retransmission_cache;
+int acked_references_enable();
+int acked_references_disable();
+void setup_dictionary_acked(pDeduplicator pd);
+extern int acked_references;
+int dictionary_resize_max_set(unsigned int size);
+int dictionary_sweep_set(unsigned int buckets, unsigned int interval);
+void start_dictionary_maintenance(pDeduplicator pd);
 
 #endif /* DEDUPLICATION_H_ */
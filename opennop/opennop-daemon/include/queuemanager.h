@@ -48,6 +48,8 @@ int queue_packet(struct packet_head *queue, struct packet *thispacket);
 
 struct packet *dequeue_packet(struct packet_head *queue, int signal);
 
+u_int32_t dequeue_packets(struct packet_head *queue, struct packet **packets, u_int32_t max);
+
 u_int32_t move_queued_packets(struct packet_head *fromqueue,
 		struct packet_head *toqueue);
 
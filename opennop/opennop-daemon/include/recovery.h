@@ -0,0 +1,106 @@
+/*
+
+  recovery.h
+
+  This file is part of OpenNOP-SoloWAN distribution.
+
+  Copyright (C) 2014 Center for Open Middleware (COM)
+                     Universidad Politecnica de Madrid, SPAIN
+
+    OpenNOP-SoloWAN is an enhanced version of the Open Network Optimization
+    Platform (OpenNOP) developed to add it deduplication capabilities using
+    a modern dictionary based compression algorithm.
+
+    SoloWAN is a project of the Center for Open Middleware (COM) of Universidad
+    Politecnica de Madrid which aims to experiment with open-source based WAN
+    optimization solutions.
+
+  References:
+
+    SoloWAN: solowan@centeropenmiddleware.com
+             https://github.com/centeropenmiddleware/solowan/wiki
+    OpenNOP: http://www.opennop.org
+    Center for Open Middleware (COM): http://www.centeropenmiddleware.com
+    Universidad Politecnica de Madrid (UPM): http://www.upm.es
+
+  License:
+
+    OpenNOP-SoloWAN is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    OpenNOP-SoloWAN is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef RECOVERY_H_
+#define RECOVERY_H_
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <linux/types.h>
+
+/*
+ * Decode miss recovery: an accelerator that cannot uncompress a packet, because it does not hold a packet
+ * it references, holds it for a while (RECOVERY_HOLD) and tells the accelerator that sent it with a NACK over
+ * UDP (recovery_port). That accelerator stops referencing the missing packet, and answers with its data (chunk),
+ * which the first one caches before it uncompresses the packet held. If the answer does not come in time the
+ * packet is dropped, and its retransmission is sent as it is.
+ */
+#define RECOVERY_MAGIC 0x534f4c4e // NACK of this version of the protocol
+#define RECOVERY_CHUNK_MAGIC 0x534f4c43 // Answer to a NACK
+#define RECOVERY_INBOX 64 // NACKs waiting for each worker, newer ones are ignored
+#define RECOVERY_CHUNKS 8 // Answers waiting for each worker, newer ones are ignored
+#define RECOVERY_CHUNK_SIZE 1600 // Largest packet answered, as BUFFER_SIZE
+#define RECOVERY_HOLD 500 // Milliseconds a packet is held waiting for the answer
+#define RECOVERY_HELD 16 // Packets held by each worker, further ones are dropped
+
+// NACK, all fields in network byte order
+struct recovery_nack {
+	__u32 magic;
+	__u32 accelerator; // Accelerator ID of the sender, the one that could not uncompress the packet, and its source address.
+	__u32 saddr; // Flow of the packet
+	__u32 daddr;
+	__u16 source;
+	__u16 dest;
+	__u32 seq; // SEQ number of the segment, as sent by the host
+	__u32 hash; // Hash of the packet missing (DEDUP_FORMAT_FP)
+	__u64 ref; // FP (DEDUP_FORMAT_FP) or pktId (DEDUP_FORMAT_INDEX) missing, see refuseReference
+	__u8 format; // DEDUP_FORMAT_FP or DEDUP_FORMAT_INDEX
+	__u8 pad[7];
+};
+
+// Answer to a NACK, sent with only len bytes of data
+struct recovery_chunk {
+	struct recovery_nack nack; // As received, but magic and accelerator, the ID of the sender of the answer
+	__u16 len; // Of the packet missing, in network byte order
+	__u8 pad[6];
+	__u8 data[RECOVERY_CHUNK_SIZE];
+};
+
+// What happened to a packet held (see recovery_held)
+#define RECOVERY_PACKET_HELD 0
+#define RECOVERY_PACKET_RECOVERED 1
+#define RECOVERY_PACKET_DROPPED 2
+
+int recovery_port_set(unsigned int port);
+void create_recovery();
+void *recovery_function(void *data);
+int recovery_active(void);
+void recovery_nack(__u8 *ippacket, int format, uint64_t ref, uint32_t hash);
+void recovery_answer(struct recovery_nack *nack, __u8 *chunk, __u16 len);
+unsigned int recovery_take(int worker, struct recovery_nack *nacks, unsigned int max);
+int recovery_take_chunk(int worker, struct recovery_chunk *chunk);
+void recovery_refused(int refused);
+void recovery_held(int worker, unsigned int held, int event);
+int cli_show_recovery(int client_fd, char **parameters, int numparameters);
+extern unsigned int recovery_port;
+
+#endif /*RECOVERY_H_*/
@@ -59,11 +59,17 @@ struct session {
 	__u32 largerIPStartSEQ; // Stores the starting SEQ number.
 	__u32 largerIPseq; // Stores the TCP SEQ from the largerIP.
 	__u32 largerIPAccelerator; // Stores the AcceleratorIP of the largerIP.
+	__u8 largerIPFormat; // Stores the packet formats supported by the Accelerator of the largerIP (see set_dedup_format_option).
+	__u64 largerIPAcked; // Stores the highest ACK of the largerIP data, plus 1 << 32 once one was seen (see saveacknumber).
+	__u16 largerIPHello; // Stores the dictionary handshake entry of the Accelerator of the largerIP plus one, 0 if none (see get_dictionary_hello_option).
 	__u32 smallerIP; // Stores the smaller IP address.
 	__u16 smallerIPPort; // Stores the smaller IP port #.
 	__u32 smallerIPStartSEQ; // Stores the starting SEQ number.
 	__u32 smallerIPseq; // Stores the TCP SEQ from the smallerIP.
 	__u32 smallerIPAccelerator; // Stores the AcceleratorIP of the smallerIP.
+	__u8 smallerIPFormat; // Stores the packet formats supported by the Accelerator of the smallerIP (see set_dedup_format_option).
+	__u64 smallerIPAcked; // Stores the highest ACK of the smallerIP data, plus 1 << 32 once one was seen (see saveacknumber).
+	__u16 smallerIPHello; // Stores the dictionary handshake entry of the Accelerator of the smallerIP plus one, 0 if none (see get_dictionary_hello_option).
 	__u64 lastactive; // Stores the time this session was last active.
 	__u8 deadcounter; // Stores how many counts the session has been idle.
 	__u8 state; // Stores the TCP session state.
@@ -46,6 +46,8 @@
 #define SESSIONBUCKETS 65536 // Number of buckets in the hash table for session.
 #define TCP_SEQ_NUMBERS 4294967296
 #define HALF_TCP_SEQ_NUMBER 2147483648
+// Sequence number a is before b, also when the sequence numbers wrap around (RFC 1982)
+#define SEQ_BEFORE(a, b) ((__s32) ((__u32) (a) - (__u32) (b)) < 0)
 __u16 sessionhash(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP,
 		__u16 smallerIPPort);
 void freemem(struct session_head *currentlist);
@@ -65,6 +67,9 @@ int updateseq(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph,
 		struct session *thissession);
 int sourceisclient(__u32 largerIP, struct iphdr *iph, struct session *thisession);
 int saveacceleratorid(__u32 largerIP, __u32 acceleratorID, struct iphdr *iph, struct session *thissession);
+int savededupformat(__u32 largerIP, __u8 format, struct iphdr *iph, struct session *thissession);
+int savedictionaryhello(__u32 largerIP, __u16 hello, struct iphdr *iph, struct session *thissession);
+int saveacknumber(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph, struct session *thissession);
 int checkseqnumber(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph, struct session *thissession);
 int updateseqnumber(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph, struct session *thissession);
 
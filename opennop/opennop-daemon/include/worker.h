@@ -58,6 +58,7 @@
 #include <pthread.h>
 
 #include <sys/types.h>
+#include <sys/time.h>
 
 #include <linux/types.h>
 
@@ -67,6 +68,7 @@
 #include "packet.h"
 #include "lib/solowan_rolling.h"
 #include "counters.h"
+#include "recovery.h"
 
 #define MAXWORKERS 255 // Maximum number of workers to process packets.
 struct workercounters {
@@ -116,13 +118,51 @@ struct processor {
 	__u8 *dedup_buffer; // Buffer used for deduplication
 };
 
+/* Restarts of a remote accelerator a dictionary was last flushed for (see flush_restarted). */
+struct dictionary_flush {
+	__u32 peerID;
+	__u32 restarts;
+};
+
+/* State of the dictionaries of a remote accelerator, created in background (see get_peer_dictionary). */
+#define PEER_DICT_ALLOCATING 0
+#define PEER_DICT_READY 1
+#define PEER_DICT_FAILED 2 // Not enough memory, the worker dictionaries are used.
+
+/* Dictionaries used with one remote accelerator. */
+struct peer_dictionary {
+	__u32 peerID; // Accelerator ID of the remote accelerator.
+	int state; // The dictionaries are only used once PEER_DICT_READY.
+	unsigned int pkts; // Packets of its dictionaries (see peer_dictionaries_total).
+	pDeduplicator compressor;
+	pDeduplicator decompressor;
+	struct dictionary_flush compressorflush;
+	struct dictionary_flush decompressorflush;
+};
+
+/* Deoptimized packet waiting for a packet it references (see recovery.h). */
+struct held_packet {
+	struct packet *packet; // NULL if the slot is free
+	pDeduplicator decompressor;
+	unsigned int partition;
+	struct timeval held;
+};
+
 /* Structure contains the worker threads, queue, and status. */
 struct worker {
 	int workernum;
 	pDeduplicator compressor; // Pointer to compressor dictionary
 	pDeduplicator decompressor; // Pointer to decompressor dictionary
+	FPHelpers *helpers; // Fingerprint helpers of the compressor dictionaries, NULL if none.
+	struct peer_dictionary *peers; // Dictionaries of each remote accelerator, if per peer.
+	struct dictionary_flush compressorflush; // Of the worker dictionaries.
+	struct dictionary_flush decompressorflush;
+	unsigned int numpeers;
+	unsigned int peerpkts; // Packets of all peer dictionaries.
 	struct processor optimization; //Thread that will do all optimizations(input).  Coming from LAN.
 	struct processor deoptimization; //Thread that will undo optimizations(output).  Coming from WAN.
+	struct held_packet held[RECOVERY_HELD]; // Packets held by the deoptimization thread.
+	unsigned int numheld;
 	u_int32_t sessions; // Number of sessions assigned to the worker.
 	int state; // Marks this thread as active. 1=running, 0=stopping, -1=stopped.
 	pthread_mutex_t lock; // Lock for this worker when adding sessions.
@@ -141,6 +181,7 @@ void set_worker_state_running(struct worker *thisworker);
 void set_worker_state_stopped(struct worker *thisworker);
 void increment_worker_sessions(int i);
 void decrement_worker_sessions(int i);
+void wake_deoptimization(int i);
 int optimize_packet(__u8 queue, struct packet *thispacket);
 int deoptimize_packet(__u8 queue, struct packet *thispacket);
 void shutdown_workers();
@@ -150,5 +191,11 @@ struct session *closingsession(struct tcphdr *tcph, struct session *thissession)
 
 pDeduplicator get_worker_compressor(int i);
 pDeduplicator get_worker_decompressor(int i);
+struct peer_dictionary *get_peer_dictionary(struct worker *thisworker, __u32 peerID);
+pDeduplicator get_peer_decompressor(struct worker *thisworker, __u32 peerID);
+pDeduplicator find_peer_decompressor(struct worker *thisworker, __u32 peerID);
+pDeduplicator find_worker_peer_dictionary(int i, __u32 peerID, int compressor);
+unsigned int get_worker_peers(int i);
+struct peer_dictionary *get_worker_peer(int i, unsigned int p);
 
 #endif /*WORKER_H_*/
@@ -161,12 +161,12 @@ void *debugd_conn_process(void *arg) {
 
 		} else if (!memcmp(RSTD_SCMD, buf, CMD_LEN)) {
 			int si;
-			for (si=0;si<get_workers();si++) resetStatistics(get_worker_decompressor(si));
+			for (si=0;si<get_workers();si++) resetDecompStatistics(get_worker_decompressor(si));
 		} else if (!memcmp(GSTD_SCMD, buf, CMD_LEN)) {
 			Statistics ds;
 			int si;
 			for (si=0;si<get_workers(); si++) {
-				getStatistics(get_worker_decompressor(si),&ds);
+				getDecompStatistics(get_worker_decompressor(si),&ds);
 				memset(statsbuf, 0, STATS_BUF);
 				sprintf(statsbuf,"Decompressor statistics (thread %d)\n",si);
 				write(fd,statsbuf,strlen(statsbuf));
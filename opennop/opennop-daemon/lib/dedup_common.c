@@ -44,6 +44,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <assert.h>
 #include <pthread.h>
 
@@ -51,7 +52,17 @@
 #include <string.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sched.h>
 #include "solowan_rolling.h"
+#include "matchlen.h"
 #include "MurmurHash3.h"
 #include "logger.h"
 #include "debugd.h"
@@ -112,16 +123,47 @@ inline uint64_t ntoh64(unsigned char *p) {
         return res;
 }
 
-inline uint32_t hashFPStore(uint64_t fp) {
+int putVarint(unsigned char *p, uint64_t n) {
+	int len = 0;
+	while (n >= 0x80) {
+		p[len++] = (n & 0x7f) | 0x80;
+		n >>= 7;
+	}
+	p[len++] = n;
+	return len;
+}
+
+int getVarint(unsigned char *p, unsigned int avail, uint64_t *n) {
+	int len = 0;
+	uint64_t res = 0;
+	do {
+		if ((len >= avail) || (len >= MAX_VARINT_LEN)) return 0;
+		res |= (uint64_t) (p[len] & 0x7f) << (7*len);
+	} while (p[len++] & 0x80);
+	*n = res;
+	return len;
+}
+
+inline uint32_t hashFPStore(FPStore fpStore, uint64_t fp) {
 
     uint32_t h1, h2, h3, h4 ;
     fp = fp >> GAMMA;
     h1 = (uint32_t) (fp & 0xffffffff);
     h2 = (uint32_t) ((fp >> 32) & 0xffffffff);
     h3 = h1 ^ h2;
-    h4 = h3 & (FPSTORESIZE-1);
-    return h4 ^ (h3 >> 24);
+    h4 = h3 & (fpStore->size-1);
+    return (h4 ^ (h3 >> 24)) & (fpStore->size-1);
+
+}
+
+// In a unified dictionary each lane keeps its FPs in its own half of the FPStore (local lane the lower one),
+// so the entries of a lane never depend on the other lane and stay the same as those of the matching lane at the peer
+static inline uint32_t laneFPStore(FPStore fpStore, PktStore *pktStore, uint64_t fp, int64_t pktId) {
+	uint32_t fpHash = hashFPStore(fpStore, fp);
+	uint32_t half = fpStore->size >> 1;
 
+	if ((pktStore->peer == NULL) || (half == 0)) return fpHash;
+	return (fpHash & (half-1)) | ((pktId < 0) ? half : 0);
 }
 
 // Full calculation of the initial Rabin fingerprint
@@ -212,16 +254,37 @@ unsigned int calculateRelevantFPs(FPEntryB *pktFps, unsigned char *packet, uint1
         return fpNum;
 }
 
+// Hashes of the super fingerprints, odd multipliers (see calculateSuperFPs)
+static const uint64_t sfMultipliers[RESEMBLANCE_SF] = {
+	0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+// The 8 byte strings whose hash has its highest 2 bits equal to 0 are sampled, so the same strings are taken however
+// the packet contents are shifted. Packets shorter than 8 bytes get all ones.
+void calculateSuperFPs(uint32_t *sfs, unsigned char *packet, uint16_t pktlen) {
+
+	uint64_t w, h, min[RESEMBLANCE_SF];
+	int i, j;
+
+	for (j = 0; j < RESEMBLANCE_SF; j++) min[j] = UINT64_MAX;
+	for (i = 0; i + sizeof(uint64_t) <= pktlen; i++) {
+		memcpy(&w, packet + i, sizeof(uint64_t));
+		h = w * sfMultipliers[0];
+		if ((h >> 62) != 0) continue;
+		for (j = 0; j < RESEMBLANCE_SF; j++) {
+			w = (h ^ (h >> 31)) * sfMultipliers[j];
+			if (w < min[j]) min[j] = w;
+		}
+	}
+	for (j = 0; j < RESEMBLANCE_SF; j++) sfs[j] = (uint32_t) (min[j] >> 32);
+}
+
 // UNSAFE FUNCTION, must be called inside code with locks
 // getFPhash returns the FPEntryB given the FPStore, the PStore, the FP and the packet hash (returns NULL if not found) 
-inline FPEntryB *getFPhash(FPStore fpStore, PktStore *pktStore, uint64_t fp, uint32_t pktHash) {
-	uint32_t fpHash;
-	FPEntry *fpp;
+static FPEntryB *lookupFPhash(FPEntry *fpp, PktStore *pktStore, uint64_t fp, uint32_t pktHash) {
 	int bkt;
 	PktEntry *pkt;
 
-	fpHash = hashFPStore(fp);
-	fpp = &fpStore[fpHash];
 	for (bkt=0;bkt<PKTS_PER_FP;bkt++) {
 		if (fpp->pkts[bkt].fp == fp) {
 			pkt = getPkt(pktStore, fpp->pkts[bkt].pktId);
@@ -232,37 +295,75 @@ inline FPEntryB *getFPhash(FPStore fpStore, PktStore *pktStore, uint64_t fp, uin
 	else return &fpp->pkts[bkt];
 }
 
+inline FPEntryB *getFPhash(FPStore fpStore, PktStore *pktStore, uint64_t fp, uint32_t pktHash) {
+	FPEntryB *fpe;
+	uint32_t fpHash;
+
+	fpe = lookupFPhash(&fpStore->fpes[laneFPStore(fpStore, pktStore, fp, 1)], pktStore, fp, pktHash);
+	if ((fpe == NULL) && (pktStore->peer != NULL)) // Unified, peer lane
+		fpe = lookupFPhash(&fpStore->fpes[laneFPStore(fpStore, pktStore, fp, -1)], pktStore, fp, pktHash);
+	if ((fpe == NULL) && (fpStore->old != NULL)) { // Resizing, bucket may not be migrated yet
+		fpHash = hashFPStore(fpStore->old, fp);
+		if (fpHash >= fpStore->migrated) fpe = lookupFPhash(&fpStore->old->fpes[fpHash], pktStore, fp, pktHash);
+	}
+	return fpe;
+}
+
 // UNSAFE FUNCTION, must be called inside code with locks
 // getFPcontent returns the FPEntryB given the FPStore, the PStore, the FP and the packet chunk (returns NULL if not found) 
-inline FPEntryB *getFPcontent(FPStore fpStore, PktStore *pktStore, uint64_t fp, unsigned char *chunk) {
-	FPEntry *fpp;
-	uint32_t fpHash;
+static FPEntryB *lookupFPcontent(FPEntry *fpp, PktStore *pktStore, uint64_t fp, unsigned char *chunk) {
 	int bkt;
 	PktEntry *pkt;
 
-	fpHash = hashFPStore(fp);
-	fpp = &fpStore[fpHash];
 	for (bkt=0;bkt<PKTS_PER_FP;bkt++) {
-		if ((fpp->pkts[bkt].pktId > 0) && (fpp->pkts[bkt].fp == fp)) {
+		if ((fpp->pkts[bkt].pktId != 0) && (fpp->pkts[bkt].fp == fp)) {
 			pkt = getPkt(pktStore, fpp->pkts[bkt].pktId);
-			if ((pkt != NULL) && !memcmp(chunk,pkt->pkt+fpp->pkts[bkt].offset,BETA)) break;
+			if ((pkt != NULL) && sameBytes(chunk,pkt->pkt+fpp->pkts[bkt].offset,BETA)) break;
 		}
 	}
 	if (bkt == PKTS_PER_FP) return (FPEntryB *) NULL; // Not found
 	else return &fpp->pkts[bkt];
 }
 
+inline FPEntryB *getFPcontent(FPStore fpStore, PktStore *pktStore, uint64_t fp, unsigned char *chunk) {
+	FPEntryB *fpe;
+	uint32_t fpHash;
+
+	fpe = lookupFPcontent(&fpStore->fpes[laneFPStore(fpStore, pktStore, fp, 1)], pktStore, fp, chunk);
+	if ((fpe == NULL) && (pktStore->peer != NULL)) // Unified, peer lane
+		fpe = lookupFPcontent(&fpStore->fpes[laneFPStore(fpStore, pktStore, fp, -1)], pktStore, fp, chunk);
+	if ((fpe == NULL) && (fpStore->old != NULL)) { // Resizing, bucket may not be migrated yet
+		fpHash = hashFPStore(fpStore->old, fp);
+		if (fpHash >= fpStore->migrated) fpe = lookupFPcontent(&fpStore->old->fpes[fpHash], pktStore, fp, chunk);
+	}
+	return fpe;
+}
+
 // UNSAFE FUNCTION, must be called inside code with locks
+// Negative pktIds belong to the peer lane of a unified dictionary
 inline PktEntry *getPkt(PktStore *pktStore, int64_t pktId) {
-	if (pktStore->pktId < pktId) return NULL;
-	if (pktId < pktStore->pktId - PKTSTORESIZE) return NULL;
-	return &pktStore->pkts[pktId % PKTSTORESIZE];
+	if (pktId == 0) return NULL;
+	if (pktId < 0) {
+		if (pktStore->peer == NULL) return NULL;
+		pktStore = pktStore->peer;
+		pktId = -pktId;
+	}
+	if (pktStore->parts != NULL) { // Partitioned store, the slot is given by pktId
+		PktEntry *pktE = &pktStore->pkts[pktId % pktStore->size];
+		return (pktE->pktId == pktId) ? pktE : NULL;
+	}
+	if (pktStore->pktId <= pktId) return NULL;
+	if (pktId < pktStore->pktId - pktStore->size) return NULL;
+	if (pktId < pktStore->minPktId) return NULL;
+	if ((pktStore->old != NULL) && (pktId >= pktStore->migrated) && (pktId < pktStore->old->pktId))
+		return getPkt(pktStore->old, pktId); // Resizing, not moved yet
+	return &pktStore->pkts[pktId % pktStore->size];
 }
 
 // UNSAFE FUNCTION, must be called inside code with locks
 inline PktEntry *getPktHash(PktStore *pktStore, uint32_t pktHash) {
 #define BACKTRACELIM 1000
-	int64_t idx = pktStore->pktId % PKTSTORESIZE;
+	int64_t idx = pktStore->pktId % pktStore->size;
 	int curr = (int) idx;
 	int i;
 	if (idx >= BACKTRACELIM) {
@@ -273,44 +374,280 @@ inline PktEntry *getPktHash(PktStore *pktStore, uint32_t pktHash) {
 		for (i=curr; i >= 0; i--) {
 			if (pktStore->pkts[i].hash == pktHash) return &pktStore->pkts[i];
 		}
-		for (i=PKTSTORESIZE-1; i >= PKTSTORESIZE-BACKTRACELIM+curr; i--) {
+		for (i=pktStore->size-1; i >= (int) pktStore->size-BACKTRACELIM+curr; i--) {
 			if (pktStore->pkts[i].hash == pktHash) return &pktStore->pkts[i];
 		}
 	}
 	return NULL;
 }
 
+// Reference cursor (see RefCursor)
+
+void firstReference(RefCursor *c, unsigned char *optpkt, uint16_t optlen, int format) {
+	uint16_t offset;
+	int n;
+
+	c->optpkt = optpkt;
+	c->optlen = optlen;
+	c->format = format;
+	c->single = 0;
+	c->fp = 0;
+	c->pktId = 0;
+	c->pos = optlen + 1; // Malformed unless parsed below
+	if (optlen < sizeof(uint32_t) + sizeof(uint16_t)) return;
+	c->hash = ntoh32(optpkt);
+	if (format == DEDUP_FORMAT_INDEX) {
+		n = getVarint(optpkt+sizeof(uint32_t), optlen-sizeof(uint32_t), &c->pktId);
+		if ((n == 0) || (c->pktId > MAX_PKT_ID)) return;
+		c->pos = sizeof(uint32_t) + n;
+		if (c->pktId == 0) { // Whole packet reference
+			n = getVarint(optpkt+c->pos, optlen-c->pos, &c->pktId);
+			if ((n == 0) || (c->pos+n != optlen) || (c->pktId == 0) || (c->pktId > MAX_PKT_ID)) c->pos = optlen + 1;
+			else c->single = 1;
+		}
+		return;
+	}
+	offset = ntoh16(optpkt+sizeof(uint32_t));
+	if (optlen == PKT_REF_LEN) { // Whole packet reference
+		c->fp = PKT_FP(c->hash, offset);
+		c->single = 1;
+		c->pos = optlen;
+	} else if (offset == DELTA_MARK) { // Delta, the similar packet is found as whole packet references are
+		c->pos = sizeof(uint32_t) + sizeof(uint16_t);
+		if (optlen - c->pos < sizeof(uint32_t) + sizeof(uint16_t)) return;
+		c->hash = ntoh32(optpkt+c->pos);
+		c->fp = PKT_FP(c->hash, ntoh16(optpkt+c->pos+sizeof(uint32_t)));
+		c->single = 1;
+		c->pos = optlen;
+	} else c->pos = sizeof(uint32_t) + sizeof(uint16_t) + offset;
+}
+
+int nextReference(RefCursor *c, uint64_t *fp, uint32_t *hash, int64_t *pktId, uint16_t *offset) {
+	uint64_t chunk, delta, left, len;
+	uint16_t next;
+	int n;
+
+	if (c->single) {
+		c->single = 0;
+		*fp = c->fp;
+		*hash = c->hash;
+		*pktId = (c->fp != 0) ? 0 : (int64_t) c->pktId;
+		*offset = 0;
+		return 1;
+	}
+	if (c->format == DEDUP_FORMAT_INDEX) {
+		for (;;) {
+			if (c->pos == c->optlen) return 0;
+			if (c->pos > c->optlen) return -1;
+			n = getVarint(c->optpkt+c->pos, c->optlen-c->pos, &chunk);
+			c->pos += n;
+			if ((n == 0) || (chunk > c->optlen-c->pos)) return -1;
+			c->pos += chunk;
+			if (c->pos == c->optlen) return 0;
+			n = getVarint(c->optpkt+c->pos, c->optlen-c->pos, &delta);
+			c->pos += n;
+			if (n > 0) {
+				n = getVarint(c->optpkt+c->pos, c->optlen-c->pos, &left);
+				c->pos += n;
+			}
+			if (n > 0) {
+				n = getVarint(c->optpkt+c->pos, c->optlen-c->pos, &len);
+				c->pos += n;
+			}
+			if ((n == 0) || (delta >= c->pktId) || (left > MAX_PKT_SIZE())) return -1;
+			if (delta == 0) continue; // Self reference
+			*fp = 0;
+			*hash = 0;
+			*pktId = c->pktId - delta;
+			*offset = left;
+			return 1;
+		}
+	}
+	for (;;) {
+		if (c->pos > c->optlen) return -1;
+		// As in uncomp, bytes too short for a descriptor are the last uncompressed chunk
+		if (c->pos + sizeof(uint64_t) + sizeof(uint32_t) + 3*sizeof(uint16_t) > c->optlen) return 0;
+		*fp = ntoh64(c->optpkt+c->pos);
+		*hash = ntoh32(c->optpkt+c->pos+sizeof(uint64_t));
+		*offset = ntoh16(c->optpkt+c->pos+sizeof(uint64_t)+sizeof(uint32_t));
+		*pktId = 0;
+		c->pos += sizeof(uint64_t) + sizeof(uint32_t) + 2*sizeof(uint16_t);
+		next = ntoh16(c->optpkt+c->pos);
+		c->pos += sizeof(uint16_t);
+		c->pos = (next == 0xffff) ? c->optlen : c->pos + next;
+		if ((*fp != SELF_FP(c->hash)) || (*hash != c->hash)) return 1;
+	}
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Slot that would hold a packet, with no check: it may hold another packet or none (only for prefetching)
+PktEntry *getPktSlot(PktStore *pktStore, int64_t pktId) {
+	if (pktId == 0) return NULL;
+	if (pktId < 0) {
+		if (pktStore->peer == NULL) return NULL;
+		pktStore = pktStore->peer;
+		pktId = -pktId;
+	}
+	return &pktStore->pkts[pktId % pktStore->size];
+}
+
+void addProbeRef(DictProbe *probe, uint64_t fp, int64_t pktId, uint16_t offset) {
+	if (probe->num == PROBE_REFS) return;
+	probe->fp[probe->num] = fp;
+	probe->pktId[probe->num] = pktId;
+	probe->offset[probe->num] = offset;
+	probe->num++;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// One level of the lookahead of a probe (see DictProbe), each level reads what the previous one prefetched.
+// Returns the next stage, PROBE_DONE when the packet bytes have been prefetched.
+int advanceProbe(FPStore fpStore, PktStore *pktStore, DictProbe *probe) {
+	unsigned int i;
+	int bkt;
+	FPEntry *fpe;
+	PktEntry *slot;
+
+	for (i = 0; i < probe->num; i++) {
+		if (probe->fp[i] != 0) fpe = &fpStore->fpes[laneFPStore(fpStore, pktStore, probe->fp[i], 1)];
+		switch (probe->stage) {
+		case 0: // FPStore bucket, or PktStore entry if the pktId is known
+			if (probe->fp[i] != 0) __builtin_prefetch(fpe);
+			else if ((slot = getPktSlot(pktStore, probe->pktId[i])) != NULL) __builtin_prefetch(slot);
+			break;
+		case 1: // Bucket entries
+			if (probe->fp[i] != 0) __builtin_prefetch(fpe->pkts);
+			break;
+		case 2: // PktStore entries of the packets holding the FP
+			if ((probe->fp[i] == 0) || (fpe->pkts == NULL)) break;
+			for (bkt = PKTS_PER_FP-1; bkt >= 0; bkt--) {
+				if ((fpe->pkts[bkt].pktId != 0) && (fpe->pkts[bkt].fp == probe->fp[i])) {
+					probe->pktId[i] = fpe->pkts[bkt].pktId;
+					probe->offset[i] = fpe->pkts[bkt].offset;
+					if ((slot = getPktSlot(pktStore, probe->pktId[i])) != NULL) __builtin_prefetch(slot);
+				}
+			}
+			break;
+		case 3: // Packet bytes, a FP string may span two cache lines
+			slot = getPktSlot(pktStore, probe->pktId[i]);
+			if ((slot != NULL) && (slot->pkt != NULL)) {
+				__builtin_prefetch(slot->pkt + probe->offset[i]);
+				__builtin_prefetch(slot->pkt + probe->offset[i] + BETA - 1);
+			}
+			break;
+		}
+	}
+	if (probe->stage < PROBE_DONE) probe->stage++;
+	return probe->stage;
+}
+
 
 // UNSAFE FUNCTION, must be called inside code with locks
-inline int64_t putPkt(PktStore *pktStore, unsigned char *pkt, uint16_t pktlen, uint32_t pktHash) {
-	int32_t pktIdx = (int32_t) (pktStore->pktId % PKTSTORESIZE);
+// Takes the slot for a new packet of a partition, evicting a packet if needed (see PktPartitions)
+static int takePartitionSlot(PktPartitions *pp, unsigned int partition) {
+	int slot;
+	unsigned int i, victim;
+	int64_t excess, maxExcess;
+
+	STATS_BEGIN(pp->seq);
+	if ((pp->freeHead >= 0) && (pp->borrow || (pp->used[partition] < pp->quota[partition]))) {
+		slot = pp->freeHead;
+		pp->freeHead = pp->next[slot];
+	} else {
+		if ((pp->used[partition] > 0) && (!pp->borrow || (pp->used[partition] >= pp->quota[partition]))) {
+			victim = partition;
+		} else { // Partition most over its quota, the lowest one if several
+			victim = partition;
+			maxExcess = INT64_MIN;
+			for (i = 0; i < pp->num; i++) {
+				excess = (int64_t) pp->used[i] - pp->quota[i];
+				if ((pp->used[i] > 0) && (excess > maxExcess)) {
+					maxExcess = excess;
+					victim = i;
+				}
+			}
+		}
+		slot = pp->head[victim];
+		pp->head[victim] = pp->next[slot];
+		if (pp->head[victim] < 0) pp->tail[victim] = -1;
+		pp->used[victim]--;
+		pp->evictions[victim]++;
+	}
+
+	pp->next[slot] = -1;
+	if (pp->tail[partition] >= 0) pp->next[pp->tail[partition]] = slot;
+	else pp->head[partition] = slot;
+	pp->tail[partition] = slot;
+	pp->used[partition]++;
+	STATS_END(pp->seq);
+	return slot;
+}
+
+inline int64_t putPkt(PktStore *pktStore, unsigned int partition, unsigned char *pkt, uint16_t pktlen, uint32_t pktHash) {
+	int32_t pktIdx;
+	int64_t pktId;
+
+	if (pktStore->parts != NULL) {
+		if (partition >= pktStore->parts->num) partition = 0;
+		pktIdx = takePartitionSlot(pktStore->parts, partition);
+		pktId = pktStore->pktId++ * pktStore->size + pktIdx;
+	} else {
+		pktIdx = (int32_t) (pktStore->pktId % pktStore->size);
+		pktId = pktStore->pktId++;
+	}
 	memcpy(pktStore->pkts[pktIdx].pkt, pkt, pktlen);
 	pktStore->pkts[pktIdx].len = pktlen;
+	pktStore->pkts[pktIdx].acked = 0;
+	pktStore->pkts[pktIdx].refused = 0;
 	pktStore->pkts[pktIdx].hash = pktHash;
-	return pktStore->pktId++;
+	pktStore->pkts[pktIdx].pktId = pktId;
+	return pktId;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Stores a packet with the pktId the peer gave it, not partitioned stores only. The store moves on to that pktId,
+// so slots of packets not received keep older ones (their pktId in PktEntry does not match).
+// Returns 0 if the packet is too old to be stored, or too far ahead (see PKT_AHEAD).
+int64_t putPktAt(PktStore *pktStore, int64_t pktId, unsigned char *pkt, uint16_t pktlen, uint32_t pktHash) {
+	PktEntry *pktE;
+
+	if ((pktId <= 0) || (pktId < pktStore->pktId - pktStore->size) || PKT_AHEAD(pktStore, pktId)) return 0;
+	if ((pktStore->old != NULL) && (pktId < pktStore->old->pktId)) return 0; // Resizing, its slot may not be moved yet
+	pktE = &pktStore->pkts[pktId % pktStore->size];
+	if (pktE->pktId > pktId) return 0;
+	if (pktId >= pktStore->pktId) pktStore->pktId = pktId + 1;
+	memcpy(pktE->pkt, pkt, pktlen);
+	pktE->len = pktlen;
+	pktE->acked = 0;
+	pktE->refused = 0;
+	pktE->hash = pktHash;
+	pktE->pktId = pktId;
+	return pktId;
 }
 
 // UNSAFE FUNCTION, must be called inside code with locks
 inline void putFP(FPStore fpStore, PktStore *pktStore, uint64_t fp, int64_t pktId, uint16_t offset, Statistics *st) {
 	int fpidx;
 	int emptyPos = PKTS_PER_FP;
+	int found = PKTS_PER_FP;
 	PktEntry *pktE, *pktEbis;
 	uint32_t fpHash;
 	FPEntry *fpp;
+	FPEntryB *fpe;
 
-	fpHash = hashFPStore(fp);
-	fpp = &fpStore[fpHash];
-
-	for (fpidx = 0; fpidx < PKTS_PER_FP; fpidx++) {
- 		if (fpp->pkts[fpidx].pktId < pktId - PKTSTORESIZE) fpp->pkts[fpidx].pktId = 0;
-		if (fpp->pkts[fpidx].pktId == 0) emptyPos = fpidx;
-	}
+	fpHash = laneFPStore(fpStore, pktStore, fp, pktId);
+	fpp = &fpStore->fpes[fpHash];
 
+	// Stale entries are reclaimed by the maintenance task (see sweepFPStore), here they are just taken as empty.
+	// Empty and stale entries must be handled alike, so the result does not depend on when the bucket was swept.
 	// Search FP value
+	// In a unified dictionary the bucket only holds entries of this lane (see laneFPStore)
 	for (fpidx = 0; fpidx < PKTS_PER_FP; fpidx++) {
-		if (fpp->pkts[fpidx].fp == fp) break;
+		fpe = &fpp->pkts[fpidx];
+		if ((fpe->pktId == 0) || (getPkt(pktStore, fpe->pktId) == NULL)) emptyPos = fpidx;
+		else if ((found == PKTS_PER_FP) && (fpe->fp == fp)) found = fpidx;
 	}
-	if (fpidx == PKTS_PER_FP) { // FP value not present in database, store if possible
+	if (found == PKTS_PER_FP) { // FP value not present in database, store if possible
 		if (emptyPos < PKTS_PER_FP) {
 			fpp->pkts[emptyPos].fp = fp;
 			fpp->pkts[emptyPos].pktId = pktId;
@@ -321,11 +658,11 @@ inline void putFP(FPStore fpStore, PktStore *pktStore, uint64_t fp, int64_t pktI
 		}
 	} else { // FP value present in database. Update if not FP collision, else store if possible.
 		pktE = getPkt(pktStore,pktId);
-		pktEbis = getPkt(pktStore,fpp->pkts[fpidx].pktId);
-		if ((pktE != NULL) && (pktEbis != NULL) && !memcmp(pktEbis->pkt+fpp->pkts[fpidx].offset,pktE->pkt+offset,BETA)) { // Not FP collision, update
-			fpp->pkts[fpidx].fp = fp;
-			fpp->pkts[fpidx].pktId = pktId;
-			fpp->pkts[fpidx].offset = offset;
+		pktEbis = getPkt(pktStore,fpp->pkts[found].pktId);
+		if ((pktE != NULL) && (pktEbis != NULL) && !memcmp(pktEbis->pkt+fpp->pkts[found].offset,pktE->pkt+offset,BETA)) { // Not FP collision, update
+			fpp->pkts[found].fp = fp;
+			fpp->pkts[found].pktId = pktId;
+			fpp->pkts[found].offset = offset;
 		} else { // FP collision, store if possible
 			if (emptyPos < PKTS_PER_FP) {
 				fpp->pkts[emptyPos].fp = fp;
@@ -339,70 +676,1322 @@ inline void putFP(FPStore fpStore, PktStore *pktStore, uint64_t fp, int64_t pktI
 
 }
 
-// Initialization tasks
-pDeduplicator newDeduplicator(void) {
+// Packet store allocation, returns -1 (nothing left allocated) if there is not enough memory
+static int tryInitPktStore(PktStore *ps, unsigned int size) {
 
-        int i, j;
-	
-	pDeduplicator pd;
-	
-	pd = malloc(sizeof(Deduplicator));
-	if (pd == NULL) {
-		printf("Unable to allocate memory");
-		abort();
-	}
+	int i;
 
 	// Packet Counter
-	pd->ps.pktId = 1; // 0 means empty FPEntry
+	ps->pktId = 1; // 0 means empty FPEntry
+	ps->size = size;
+	ps->peer = NULL;
+	ps->minPktId = 1;
+	ps->old = NULL;
+	ps->migrated = 0;
+	ps->parts = NULL;
 	// Packet store
- 	pd->ps.pkts = malloc(PKT_STORE_SIZE()*sizeof(PktEntry));
+ 	ps->pkts = malloc(size*sizeof(PktEntry));
+	if (ps->pkts == NULL) return -1;
 
-        if (pd->ps.pkts == NULL) {
-		printf("Unable to allocate memory initializing hash table. Please, check num_pkt_cache_size value in opennop.conf\n");
-		abort();
-	}
-	
-        for (i = 0; i < PKT_STORE_SIZE(); i++) {
-                pd->ps.pkts[i].pkt = malloc(MAX_PKT_SIZE());
-                if (pd->ps.pkts[i].pkt == NULL) {
-			printf("Unable to allocate memory initializing hash table. Please, check num_pkt_cache_size value in opennop.conf\n");
-			abort();
+        for (i = 0; i < size; i++) {
+                ps->pkts[i].pkt = malloc(MAX_PKT_SIZE());
+                if (ps->pkts[i].pkt == NULL) {
+			while (i-- > 0) free(ps->pkts[i].pkt);
+			free(ps->pkts);
+			return -1;
 		}
+		ps->pkts[i].len = 0;
+		ps->pkts[i].acked = 0;
+		ps->pkts[i].refused = 0;
+		ps->pkts[i].hash = 0;
+		ps->pkts[i].pktId = 0;
         }
-        pd->fps = malloc(FP_STORE_SIZE()*sizeof(FPEntry));
-        if (pd->fps == NULL) {
-		printf("Unable to allocate memory initializing hash table. Please, check num_pkt_cache_size value in opennop.conf\n");
-		abort();
+	return 0;
+}
+
+static void freePktStore(PktStore *ps) {
+
+	int i;
+
+	for (i = 0; i < ps->size; i++) free(ps->pkts[i].pkt);
+	free(ps->pkts);
+}
+
+// FP store allocation, returns NULL (nothing left allocated) if there is not enough memory
+static FPStore tryAllocFPStore(unsigned int size) {
+
+	int i, j;
+	FPStore fps;
+	FPEntryB *fpes;
+
+	fps = malloc(sizeof(FPTable));
+	if (fps == NULL) return NULL;
+	fps->size = size;
+	fps->old = NULL;
+	fps->migrated = 0;
+        fps->fpes = malloc(size*sizeof(FPEntry));
+	// Entries of all buckets in one block, so a large store is allocated quickly (see applyResize)
+	fpes = malloc((size_t) size*PKTS_PER_FP*sizeof(FPEntryB));
+        if ((fps->fpes == NULL) || (fpes == NULL)) {
+		free(fpes);
+		free(fps->fpes);
+		free(fps);
+		return NULL;
 	}
 
         // Initialize FPStore
-        for (i=0; i<FP_STORE_SIZE(); i++) {
-                pd->fps[i].pkts = malloc(PKTS_PER_FP*sizeof(FPEntryB));
-                if (pd->fps[i].pkts == NULL) {
-			printf("Unable to allocate memory initializing hash table. Please, check num_pkt_cache_size value in opennop.conf\n");
-			abort();
-		}
+        for (i=0; i<size; i++) {
+                fps->fpes[i].pkts = fpes + (size_t) i*PKTS_PER_FP;
                 for (j=0; j<PKTS_PER_FP; j++) {
-			pd->fps[i].pkts[j].pktId = 0;
-			pd->fps[i].pkts[j].fp = UINT64_MAX;
+			fps->fpes[i].pkts[j].pktId = 0;
+			fps->fpes[i].pkts[j].fp = UINT64_MAX;
                 }
         }
+	return fps;
+}
+
+static void freeFPStore(FPStore fps) {
+
+	free(fps->fpes[0].pkts);
+	free(fps->fpes);
+	free(fps);
+}
 
+// Initialization tasks
+static void publishResizeStatus(pDeduplicator pd);
+
+// Returns NULL (nothing left allocated) if there is not enough memory
+static pDeduplicator tryAllocDeduplicator(unsigned int pktStoreSize, unsigned int fpStoreSize) {
+
+	pDeduplicator pd;
+	
+	if (posix_memalign((void **) &pd, 64, sizeof(Deduplicator)) != 0) return NULL;
+	if (tryInitPktStore(&pd->ps, pktStoreSize) != 0) {
+		free(pd);
+		return NULL;
+	}
+	pd->fps = tryAllocFPStore(fpStoreSize);
+	if (pd->fps == NULL) {
+		freePktStore(&pd->ps);
+		free(pd);
+		return NULL;
+	}
+
+	pd->locked = 0;
 	pthread_mutex_init(&pd->cerrojo, NULL);
+	pthread_mutex_init(&pd->statsLock, NULL);
+	pd->shm = NULL;
+	pd->hub = NULL;
+	pd->indexed = 0;
+	pd->resemblance = NULL;
+	pd->helpers = NULL;
+	pd->ackedRefs = 0;
+	pd->refusedRefs = 0;
+
+	// Initialize maintenance state
+	pd->sweepCursor = 0;
+	pd->sweepPassLive = 0;
+	pd->sweepPassStart = 0;
+	pd->sweepBuckets = 0;
+	pd->sweepInterval = 0;
+	pd->sweepNext = 0;
+	pd->sweepTick = 0;
+	memset((void *) &pd->maintStats, 0, sizeof(pd->maintStats));
+
+	// Initialize resize state
+	pd->epoch = 0;
+	pd->resizeState = DICT_STABLE;
+	pd->fpsPerStep = 0;
+	pd->pktsSinceResize = 0;
+	pd->pendingPs = NULL;
+	pd->pendingFps = NULL;
+	pd->pendingEpoch = -1;
+	pd->peerEpoch = -1;
 
 	// Initialize statistics
+	pd->compSeq = pd->decompSeq = pd->statusSeq = 0;
 	memset((void *) &pd->compStats, 0, sizeof(pd->compStats));
+	memset((void *) &pd->decompStats, 0, sizeof(pd->decompStats));
+	memset((void *) &pd->compBase, 0, sizeof(pd->compBase));
+	memset((void *) &pd->decompBase, 0, sizeof(pd->decompBase));
+	publishResizeStatus(pd);
 	return pd;
 
 }
 
-void getStatistics(pDeduplicator pd, Statistics *cs) {
+static pDeduplicator allocDeduplicator(pDeduplicator pd) {
+
+	if (pd == NULL) {
+		printf("Unable to allocate memory initializing hash table. Please, check num_pkt_cache_size value in opennop.conf\n");
+		abort();
+	}
+	return pd;
+}
+
+pDeduplicator newDeduplicator(void) {
+	return allocDeduplicator(tryAllocDeduplicator(PKT_STORE_SIZE(), FP_STORE_SIZE()));
+}
+
+pDeduplicator newDeduplicatorOfSize(unsigned int pktStoreSize) {
+	return allocDeduplicator(tryNewDeduplicatorOfSize(pktStoreSize));
+}
+
+pDeduplicator tryNewDeduplicatorOfSize(unsigned int pktStoreSize) {
+	return tryAllocDeduplicator(pktStoreSize, FP_PER_PKT()*pktStoreSize*FPS_FACTOR());
+}
+
+pDeduplicator newIndexDeduplicatorOfSize(unsigned int pktStoreSize) {
+	return allocDeduplicator(tryNewIndexDeduplicatorOfSize(pktStoreSize));
+}
+
+pDeduplicator tryNewIndexDeduplicatorOfSize(unsigned int pktStoreSize) {
+
+	pDeduplicator pd;
+
+	pd = tryAllocDeduplicator(pktStoreSize, 1); // Never holds entries, only kept so the FPStore code needs no checks
+	if (pd != NULL) pd->indexed = 1;
+	return pd;
+}
+
+pDeduplicator newUnifiedDeduplicator(void) {
+	return newUnifiedDeduplicatorOfSize(PKT_STORE_SIZE());
+}
+
+pDeduplicator newUnifiedDeduplicatorOfSize(unsigned int pktStoreSize) {
+	return allocDeduplicator(tryNewUnifiedDeduplicatorOfSize(pktStoreSize));
+}
+
+pDeduplicator tryNewUnifiedDeduplicatorOfSize(unsigned int pktStoreSize) {
+
+	pDeduplicator pd;
+	unsigned int laneSize = pktStoreSize / 2;
+
+	if (laneSize == 0) laneSize = 1;
+	pd = tryAllocDeduplicator(laneSize, FP_PER_PKT()*pktStoreSize*FPS_FACTOR());
+	if (pd == NULL) return NULL;
+	pd->ps.peer = malloc(sizeof(PktStore));
+	if ((pd->ps.peer == NULL) || (tryInitPktStore(pd->ps.peer, laneSize) != 0)) {
+		free(pd->ps.peer);
+		pd->ps.peer = NULL;
+		freeDeduplicator(pd);
+		return NULL;
+	}
+	pd->locked = 1; // Used by the compressor and decompressor threads
+	return pd;
+}
+
+// Lock free readers of the statistics, see STATS_BEGIN
+static uint32_t statsReadBegin(uint32_t *seq) {
+	uint32_t s;
+
+	while ((s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+	return s;
+}
+
+static int statsReadRetry(uint32_t *seq, uint32_t s) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
+
+// Packet store partitioning
+static void initPartitions(PktStore *ps, unsigned int num, unsigned int *quotaPercent, int borrow) {
+
+	PktPartitions *pp;
+	unsigned int i, assigned = 0;
+
+	pp = malloc(sizeof(PktPartitions));
+	if (pp == NULL) {
+		printf("Unable to allocate memory");
+		abort();
+	}
+	pp->next = malloc(ps->size*sizeof(int));
+	if (pp->next == NULL) {
+		printf("Unable to allocate memory");
+		abort();
+	}
+	pp->num = (num > MAX_PARTITIONS) ? MAX_PARTITIONS : num;
+	pp->borrow = borrow;
+	pp->seq = 0;
+	for (i = 0; i < pp->num; i++) {
+		pp->used[i] = 0;
+		pp->evictions[i] = 0;
+		pp->head[i] = pp->tail[i] = -1;
+		if (i == 0) continue;
+		pp->quota[i] = (uint64_t) ps->size * quotaPercent[i] / 100;
+		if (pp->quota[i] == 0) pp->quota[i] = 1;
+		assigned += pp->quota[i];
+	}
+	pp->quota[0] = (assigned < ps->size) ? ps->size - assigned : 1;
+
+	// All slots free
+	for (i = 0; i < ps->size; i++) pp->next[i] = i+1;
+	pp->next[ps->size-1] = -1;
+	pp->freeHead = 0;
+	__atomic_store_n(&ps->parts, pp, __ATOMIC_RELEASE); // Read by getPartitionStats with no lock
+}
+
+void setPartitions(pDeduplicator pd, unsigned int num, unsigned int *quotaPercent, int borrow) {
+
+	if (num == 0) return;
 	pthread_mutex_lock(&pd->cerrojo);
-	*cs = pd->compStats;
+	initPartitions(&pd->ps, num, quotaPercent, borrow);
+	if (pd->ps.peer != NULL) initPartitions(pd->ps.peer, num, quotaPercent, borrow);
 	pthread_mutex_unlock(&pd->cerrojo);
 }
+
+unsigned int getPartitionStats(pDeduplicator pd, int peerLane, unsigned int *quota, unsigned int *used, uint64_t *evictions) {
+
+	PktPartitions *pp;
+	unsigned int i, num = 0;
+	uint32_t s;
+
+	pp = peerLane ? ((pd->ps.peer != NULL) ? __atomic_load_n(&pd->ps.peer->parts, __ATOMIC_ACQUIRE) : NULL) :
+			__atomic_load_n(&pd->ps.parts, __ATOMIC_ACQUIRE);
+	if (pp == NULL) return 0;
+	num = pp->num;
+	do {
+		s = statsReadBegin(&pp->seq);
+		for (i = 0; i < num; i++) {
+			quota[i] = pp->quota[i];
+			used[i] = pp->used[i];
+			evictions[i] = pp->evictions[i];
+		}
+	} while (statsReadRetry(&pp->seq, s));
+	return num;
+}
+
+static void readStatistics(uint32_t *seq, Statistics *from, Statistics *to) {
+	uint32_t s;
+
+	do {
+		s = statsReadBegin(seq);
+		*to = *from;
+	} while (statsReadRetry(seq, s));
+}
+
+// All fields are uint64_t counters, lastPktId is not reset
+static void subtractStatistics(Statistics *st, Statistics *base) {
+	uint64_t *v = (uint64_t *) st, *b = (uint64_t *) base;
+	uint64_t lastPktId = st->lastPktId;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(Statistics) / sizeof(uint64_t); i++) v[i] -= b[i];
+	st->lastPktId = lastPktId;
+}
+
+void getStatistics(pDeduplicator pd, Statistics *cs) {
+	pthread_mutex_lock(&pd->statsLock);
+	readStatistics(&pd->compSeq, &pd->compStats, cs);
+	subtractStatistics(cs, &pd->compBase);
+	pthread_mutex_unlock(&pd->statsLock);
+}
 void resetStatistics(pDeduplicator pd) {
+	pthread_mutex_lock(&pd->statsLock);
+	readStatistics(&pd->compSeq, &pd->compStats, &pd->compBase);
+	pthread_mutex_unlock(&pd->statsLock);
+}
+void getDecompStatistics(pDeduplicator pd, Statistics *ds) {
+	pthread_mutex_lock(&pd->statsLock);
+	readStatistics(&pd->decompSeq, &pd->decompStats, ds);
+	subtractStatistics(ds, &pd->decompBase);
+	pthread_mutex_unlock(&pd->statsLock);
+}
+void resetDecompStatistics(pDeduplicator pd) {
+	pthread_mutex_lock(&pd->statsLock);
+	readStatistics(&pd->decompSeq, &pd->decompStats, &pd->decompBase);
+	pthread_mutex_unlock(&pd->statsLock);
+}
+
+// Online dictionary resize
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Makes (ps, fps) the current stores. The current ones are kept as old until their contents are migrated.
+static void switchStores(pDeduplicator pd, PktStore *ps, FPStore fps) {
+
+	PktStore *oldps;
+	int64_t lowest;
+
+	oldps = malloc(sizeof(PktStore));
+	if (oldps == NULL) {
+		printf("Unable to allocate memory");
+		abort();
+	}
+	*oldps = pd->ps;
+
+	// pktIds go on from the previous store, so FP entries need no translation
+	lowest = oldps->pktId - oldps->size;
+	if (lowest < oldps->minPktId) lowest = oldps->minPktId;
+	ps->pktId = oldps->pktId;
+	ps->minPktId = lowest;
+	ps->migrated = lowest;
+	ps->old = oldps;
+	pd->ps = *ps;
+	free(ps);
+
+	// Both stores are migrated at the same pace
+	pd->fpsPerStep = (pd->fps->size / oldps->size) * RESIZE_PKTS_PER_STEP;
+	if (pd->fpsPerStep == 0) pd->fpsPerStep = 1;
+	fps->old = pd->fps;
+	fps->migrated = 0;
+	pd->fps = fps;
+
+	pd->resizeState = DICT_MIGRATING;
+	pd->pktsSinceResize = 0;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Moves a still valid FP entry of the previous FPStore. Newer entries for the same FP are kept.
+static void migrateFP(pDeduplicator pd, FPEntryB *fpe) {
+
+	FPEntry *fpp;
+	int fpidx;
+	int emptyPos = PKTS_PER_FP;
+
+	fpp = &pd->fps->fpes[hashFPStore(pd->fps, fpe->fp)];
+	for (fpidx = 0; fpidx < PKTS_PER_FP; fpidx++) {
+		if (getPkt(&pd->ps, fpp->pkts[fpidx].pktId) == NULL) emptyPos = fpidx;
+		else if ((fpp->pkts[fpidx].fp == fpe->fp) && ((fpp->pkts[fpidx].pktId < 0) == (fpe->pktId < 0))) return;
+	}
+	if (emptyPos < PKTS_PER_FP) fpp->pkts[emptyPos] = *fpe;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Makes the resize state visible to getResizeStatus
+static void publishResizeStatus(pDeduplicator pd) {
+
+	ResizeStatus *rs = &pd->resizeStatus;
+
+	STATS_BEGIN(pd->statusSeq);
+	rs->epoch = pd->epoch;
+	rs->state = pd->resizeState;
+	rs->pktStoreSize = pd->ps.size;
+	rs->fpStoreSize = pd->fps->size;
+	rs->pktsMigrated = rs->pktsToMigrate = 0;
+	if (pd->ps.old != NULL) {
+		rs->pktsToMigrate = pd->ps.old->pktId - pd->ps.minPktId;
+		rs->pktsMigrated = pd->ps.migrated - pd->ps.minPktId;
+	}
+	rs->bucketsMigrated = rs->bucketsToMigrate = 0;
+	if (pd->fps->old != NULL) {
+		rs->bucketsToMigrate = pd->fps->old->size;
+		rs->bucketsMigrated = pd->fps->migrated;
+	}
+	rs->announce = (pd->epoch != 0);
+	STATS_END(pd->statusSeq);
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Moves the next entries of the previous stores
+static void migrateStep(pDeduplicator pd) {
+
+	PktStore *oldps;
+	FPStore oldfps;
+	PktEntry tmp, *from, *to;
+	int i, j;
+
+	oldps = pd->ps.old;
+	if (oldps != NULL) {
+		// Packets already out of the new store window are not moved
+		if (pd->ps.migrated < pd->ps.pktId - pd->ps.size) pd->ps.migrated = pd->ps.pktId - pd->ps.size;
+		// Packet buffers are swapped, not copied
+		for (i = 0; (i < RESIZE_PKTS_PER_STEP) && (pd->ps.migrated < oldps->pktId); i++, pd->ps.migrated++) {
+			from = &oldps->pkts[pd->ps.migrated % oldps->size];
+			to = &pd->ps.pkts[pd->ps.migrated % pd->ps.size];
+			tmp = *to;
+			*to = *from;
+			*from = tmp;
+		}
+		if (pd->ps.migrated >= oldps->pktId) {
+			pd->ps.old = NULL;
+			freePktStore(oldps);
+			free(oldps);
+		}
+	}
+
+	oldfps = pd->fps->old;
+	if (oldfps != NULL) {
+		for (i = 0; (i < pd->fpsPerStep) && (pd->fps->migrated < oldfps->size); i++, pd->fps->migrated++) {
+			for (j = 0; j < PKTS_PER_FP; j++) {
+				if (getPkt(&pd->ps, oldfps->fpes[pd->fps->migrated].pkts[j].pktId) != NULL)
+					migrateFP(pd, &oldfps->fpes[pd->fps->migrated].pkts[j]);
+			}
+		}
+		if (pd->fps->migrated >= oldfps->size) {
+			pd->fps->old = NULL;
+			freeFPStore(oldfps);
+		}
+	}
+
+	// The state may already be DICT_ALLOCATING for the next resize of the peer (see applyResize)
+	if ((pd->ps.old == NULL) && (pd->fps->old == NULL))
+		__sync_bool_compare_and_swap(&pd->resizeState, DICT_MIGRATING, DICT_STABLE);
+}
+
+void resizeStep(pDeduplicator pd) {
+
+	// New stores are published by resizeAllocator with no lock held by the owner
+	if ((__atomic_load_n(&pd->resizeState, __ATOMIC_ACQUIRE) == DICT_PENDING) && (pd->pendingPs == NULL)) {
+		// Allocation failed
+		pd->resizeState = ((pd->ps.old != NULL) || (pd->fps->old != NULL)) ? DICT_MIGRATING : DICT_STABLE;
+	} else if (pd->resizeState == DICT_PENDING) {
+		// A previous migration not over yet (resize of the peer) is finished first, as the peer did
+		while ((pd->ps.old != NULL) || (pd->fps->old != NULL)) migrateStep(pd);
+		switchStores(pd, pd->pendingPs, pd->pendingFps);
+		pd->pendingPs = NULL;
+		pd->pendingFps = NULL;
+		if (pd->pendingEpoch < 0) pd->epoch++;
+		else pd->epoch = pd->pendingEpoch;
+	}
+	pd->pktsSinceResize++;
+	if ((pd->ps.old != NULL) || (pd->fps->old != NULL)) migrateStep(pd);
+	if ((pd->resizeState != DICT_STABLE) || (pd->resizeStatus.state != DICT_STABLE)) publishResizeStatus(pd);
+}
+
+typedef struct {
+	pDeduplicator pd;
+	unsigned int pktStoreSize;
+	unsigned int fpStoreSize;
+	int epoch;		// Epoch of the peer (see applyResize), -1 if resized by requestResize
+} ResizeRequest;
+
+// Background allocation of the new stores
+static void *resizeAllocator(void *arg) {
+
+	ResizeRequest *rr = arg;
+	PktStore *ps;
+	FPStore fps;
+
+	ps = malloc(sizeof(PktStore));
+	if ((ps != NULL) && (tryInitPktStore(ps, rr->pktStoreSize) != 0)) {
+		free(ps);
+		ps = NULL;
+	}
+	fps = (ps != NULL) ? tryAllocFPStore(rr->fpStoreSize) : NULL;
+	if (fps == NULL) { // Not enough memory, the owner keeps the dictionary as it is (see resizeStep)
+		printf("Unable to allocate memory for a dictionary of %u packets\n", rr->pktStoreSize);
+		if (ps != NULL) {
+			freePktStore(ps);
+			free(ps);
+			ps = NULL;
+		}
+	}
+
+	rr->pd->pendingPs = ps;
+	rr->pd->pendingFps = fps;
+	rr->pd->pendingEpoch = rr->epoch;
+	__atomic_store_n(&rr->pd->resizeState, DICT_PENDING, __ATOMIC_RELEASE);
+	free(rr);
+	return NULL;
+}
+
+// Starts the background allocation, the state must already be DICT_ALLOCATING
+static int startResizeAllocator(ResizeRequest *rr) {
+
+	pthread_t t;
+	pthread_attr_t attr;
+	int result;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	result = pthread_create(&t, &attr, resizeAllocator, rr);
+	pthread_attr_destroy(&attr);
+	return result;
+}
+
+int requestResize(pDeduplicator pd, unsigned int pktStoreSize, unsigned int fpsFactor) {
+
+	ResizeRequest *rr;
+
+	if ((pktStoreSize == 0) || (fpsFactor == 0) || (fpsFactor > MAX_FPS_FACTOR)) return -1;
+	rr = malloc(sizeof(ResizeRequest));
+	if (rr == NULL) return -1;
+	rr->pd = pd;
+	rr->pktStoreSize = pktStoreSize;
+	rr->fpStoreSize = FP_PER_PKT()*pktStoreSize*fpsFactor;
+	rr->epoch = -1;
+
+	// The owner only changes the state once it is DICT_PENDING
+	if ((pd->ps.peer != NULL) || (pd->ps.parts != NULL) || (pd->shm != NULL) || (pd->hub != NULL) ||
+			!__sync_bool_compare_and_swap(&pd->resizeState, DICT_STABLE, DICT_ALLOCATING)) {
+		free(rr);
+		return -1;
+	}
+
+	if (startResizeAllocator(rr) != 0) {
+		__atomic_store_n(&pd->resizeState, DICT_STABLE, __ATOMIC_RELEASE);
+		free(rr);
+		return -1;
+	}
+	return 0;
+}
+
+int applyResize(pDeduplicator pd, uint8_t epoch, unsigned int pktStoreSize, unsigned int fpsFactor, unsigned int maxPktStoreSize) {
+
+	ResizeRequest *rr;
+	int state;
+
+	if (epoch == pd->peerEpoch) return 1; // Already started or refused
+	state = __atomic_load_n(&pd->resizeState, __ATOMIC_ACQUIRE);
+	if ((state == DICT_ALLOCATING) || (state == DICT_PENDING)) return 1; // Tried again once switched
+	pd->peerEpoch = epoch;
+	// Unified, partitioned, hub and shared dictionaries are never resized
+	if ((pd->ps.peer != NULL) || (pd->ps.parts != NULL) || (pd->hub != NULL) || (pd->shm != NULL)) return -1;
+	if ((pktStoreSize == 0) || (pktStoreSize & (pktStoreSize - 1)) || (pktStoreSize > maxPktStoreSize) ||
+			(fpsFactor == 0) || (fpsFactor > MAX_FPS_FACTOR) || (pktStoreSize > UINT_MAX / (FP_PER_PKT()*fpsFactor)))
+		return -1;
+	rr = malloc(sizeof(ResizeRequest));
+	if (rr == NULL) return -1;
+	rr->pd = pd;
+	rr->pktStoreSize = pktStoreSize;
+	rr->fpStoreSize = pd->indexed ? 1 : FP_PER_PKT()*pktStoreSize*fpsFactor;
+	rr->epoch = epoch;
+
+	// A migration still in progress goes on while allocating (see resizeStep)
+	pd->resizeState = DICT_ALLOCATING;
+	if (startResizeAllocator(rr) != 0) {
+		pd->resizeState = ((pd->ps.old != NULL) || (pd->fps->old != NULL)) ? DICT_MIGRATING : DICT_STABLE;
+		free(rr);
+		return -1;
+	}
+	return 0;
+}
+
+// Returns the status last published by the owner, only the state may be newer
+void getResizeStatus(pDeduplicator pd, ResizeStatus *rs) {
+
+	uint32_t s;
+
+	do {
+		s = statsReadBegin(&pd->statusSeq);
+		*rs = pd->resizeStatus;
+	} while (statsReadRetry(&pd->statusSeq, s));
+	if (rs->state == DICT_STABLE) rs->state = __atomic_load_n(&pd->resizeState, __ATOMIC_ACQUIRE);
+}
+
+// Hub mode
+
+// UNSAFE FUNCTION, must be called inside code with locks
+int hubKnows(HubState *hub, PktStore *pktStore, int peer, int64_t pktId) {
+	uint32_t *known;
+
+	if ((peer < 0) || (pktId <= 0)) return 0;
+	known = &hub->known[(pktId % pktStore->size) * hub->words];
+	return (known[peer >> 5] >> (peer & 31)) & 1;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Called for every packet stored by a hub, just after putPkt: the slot now holds a packet no peer knows yet.
+// If the packet was sent to a peer, the packet the peer drops to hold it is no longer known.
+void hubSent(HubState *hub, PktStore *pktStore, int peer, int64_t pktId) {
+	HubPeer *hp;
+	int64_t *oldest;
+	uint32_t *known, bits;
+	unsigned int w;
+
+	// The packet evicted from the slot is no longer known by the peers it was sent to
+	known = &hub->known[(pktId % pktStore->size) * hub->words];
+	for (w = 0; w < hub->words; w++) {
+		for (bits = known[w]; bits != 0; bits &= bits - 1) hub->peers[w * 32 + __builtin_ctz(bits)].known--;
+		known[w] = 0;
+	}
+	hub->peerPktIds[pktId % pktStore->size] = 0;
+	if ((peer < 0) || (peer >= hub->maxPeers) || (hub->peers[peer].window == 0)) return;
+	hp = &hub->peers[peer];
+	oldest = &hp->sent[hp->count % hp->window];
+	if ((*oldest != 0) && (getPkt(pktStore, *oldest) != NULL) && hubKnows(hub, pktStore, peer, *oldest)) {
+		hub->known[(*oldest % pktStore->size) * hub->words + (peer >> 5)] &= ~(1U << (peer & 31));
+		hp->known--;
+	}
+	*oldest = pktId;
+	hp->count++;
+	known[peer >> 5] |= 1U << (peer & 31);
+	hp->known++;
+	hub->peerPktIds[pktId % pktStore->size] = hp->count; // The peer stores them from 1 on, as it does after a flush
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+int64_t hubPeerPktId(HubState *hub, PktStore *pktStore, int64_t pktId) {
+	return hub->peerPktIds[pktId % pktStore->size];
+}
+
+int setHub(pDeduplicator pd, unsigned int maxPeers) {
+
+	HubState *hub;
+
+	if ((maxPeers == 0) || (maxPeers > MAX_HUB_PEERS)) return -1;
+	pthread_mutex_lock(&pd->cerrojo);
+	if ((pd->ps.peer != NULL) || (pd->ps.parts != NULL) || (pd->shm != NULL) || (pd->hub != NULL) || (pd->resizeState != DICT_STABLE)) {
+		pthread_mutex_unlock(&pd->cerrojo);
+		return -1;
+	}
+	hub = malloc(sizeof(HubState));
+	if (hub == NULL) {
+		printf("Unable to allocate memory");
+		abort();
+	}
+	hub->maxPeers = maxPeers;
+	hub->words = (maxPeers + 31) / 32;
+	hub->filtered = 0;
+	hub->known = calloc((size_t) pd->ps.size * hub->words, sizeof(uint32_t));
+	hub->peerPktIds = calloc(pd->ps.size, sizeof(int64_t));
+	hub->peers = calloc(maxPeers, sizeof(HubPeer));
+	if ((hub->known == NULL) || (hub->peerPktIds == NULL) || (hub->peers == NULL)) {
+		printf("Unable to allocate memory");
+		abort();
+	}
+	pd->hub = hub;
+	pthread_mutex_unlock(&pd->cerrojo);
+	return 0;
+}
+
+int setHubPeer(pDeduplicator pd, unsigned int peer, unsigned int window) {
+
+	int64_t *sent;
+
+	if ((pd->hub == NULL) || (peer >= pd->hub->maxPeers) || (window == 0)) return 0;
+	sent = calloc(window, sizeof(int64_t));
+	if (sent == NULL) return -1;
+	pthread_mutex_lock(&pd->cerrojo);
+	if (pd->hub->peers[peer].window == 0) {
+		pd->hub->peers[peer].sent = sent;
+		pd->hub->peers[peer].window = window;
+		pd->hub->peers[peer].count = 0;
+		pd->hub->peers[peer].known = 0;
+		pd->hub->peers[peer].references = 0;
+		sent = NULL;
+	}
+	pthread_mutex_unlock(&pd->cerrojo);
+	free(sent);
+	return 0;
+}
+
+unsigned int getHubPeerStats(pDeduplicator pd, unsigned int peer, uint64_t *references) {
+
+	HubPeer *hp;
+	uint64_t known;
+	uint32_t s;
+
+	*references = 0;
+	if ((pd->hub == NULL) || (peer >= pd->hub->maxPeers)) return 0;
+	hp = &pd->hub->peers[peer];
+	do {
+		s = statsReadBegin(&pd->compSeq);
+		known = hp->known;
+		*references = hp->references;
+	} while (statsReadRetry(&pd->compSeq, s));
+	return known;
+}
+
+// Delta encoding
+
+int setResemblance(pDeduplicator pd) {
+
+	ResemblanceIndex *ri;
+	unsigned int size = 1;
+
+	if (pd->shm != NULL) return -1;
+	// About one entry per super fingerprint of each stored packet
+	while (size < pd->ps.size * RESEMBLANCE_SF) size <<= 1;
+	ri = malloc(sizeof(ResemblanceIndex));
+	if (ri == NULL) {
+		printf("Unable to allocate memory");
+		abort();
+	}
+	ri->size = size;
+	ri->entries = calloc(size, sizeof(ResemblanceEntry));
+	ri->delta = malloc(MAX_PKT_SIZE());
+	if ((ri->entries == NULL) || (ri->delta == NULL)) {
+		printf("Unable to allocate memory");
+		abort();
+	}
 	pthread_mutex_lock(&pd->cerrojo);
-	memset(&pd->compStats,0,sizeof(pd->compStats));
+	if (pd->resemblance != NULL) {
+		pthread_mutex_unlock(&pd->cerrojo);
+		free(ri->entries);
+		free(ri->delta);
+		free(ri);
+		return -1;
+	}
+	pd->resemblance = ri;
 	pthread_mutex_unlock(&pd->cerrojo);
+	return 0;
+}
+
+// Acknowledged and refused references
+
+int setAckedReferences(pDeduplicator pd, int acked) {
+	if (pd->hub != NULL) return -1;
+	DEDUP_LOCK(pd);
+	pd->ackedRefs = acked;
+	DEDUP_UNLOCK(pd);
+	return 0;
+}
+
+// Each pktId is checked, the range may hold packets already replaced
+void ackPackets(pDeduplicator pd, int64_t first, int64_t last) {
+	PktEntry *pktE;
+	int64_t pktId;
+
+	if ((first <= 0) || (last < first)) return;
+	if (last - first >= pd->ps.size) first = last - pd->ps.size + 1;
+	DEDUP_LOCK(pd);
+	for (pktId = first; pktId <= last; pktId++) {
+		pktE = getPkt(&pd->ps, pktId);
+		if ((pktE != NULL) && (pktE->pktId == pktId)) pktE->acked = 1;
+	}
+	DEDUP_UNLOCK(pd);
+}
+
+int refuseReference(pDeduplicator pd, int format, uint64_t ref, uint32_t hash, unsigned char *packet, uint16_t *pktlen) {
+	PktEntry *pktE = NULL;
+	FPEntryB *fpe;
+	int64_t pktId;
+	unsigned int i;
+
+	if (pd->hub != NULL) return 0;
+	DEDUP_LOCK(pd);
+	if (format == DEDUP_FORMAT_INDEX) {
+		pktId = (int64_t) ref;
+		if (pktId > 0) pktE = getPkt(&pd->ps, pktId);
+		if ((pktE != NULL) && (pktE->pktId != pktId)) pktE = NULL;
+	} else {
+		fpe = (pd->indexed) ? NULL : getFPhash(pd->fps, &pd->ps, ref, hash);
+		if (fpe != NULL) pktE = getPkt(&pd->ps, fpe->pktId);
+		else { // Whole packet reference, or the FP entry was replaced: the whole store is looked at, not only
+			// the last packets as by getPktHash, as the packet may have been referenced by its pktId (see extendMatch)
+			for (i = 0; i < pd->ps.size; i++) {
+				if ((pd->ps.pkts[i].hash == hash) && (pd->ps.pkts[i].pktId > 0) &&
+						((pktE == NULL) || (pd->ps.pkts[i].pktId > pktE->pktId)) &&
+						(getPkt(&pd->ps, pd->ps.pkts[i].pktId) == &pd->ps.pkts[i])) pktE = &pd->ps.pkts[i];
+			}
+		}
+	}
+	if (pktE != NULL) {
+		pktE->refused = 1;
+		pd->refusedRefs = 1;
+		if ((packet != NULL) && (pktE->len <= *pktlen)) memcpy(packet, pktE->pkt, pktE->len);
+		if (packet != NULL) *pktlen = (pktE->len <= *pktlen) ? pktE->len : 0;
+		STATS_BEGIN(pd->compSeq);
+		pd->compStats.refusedPackets++;
+		STATS_END(pd->compSeq);
+	}
+	DEDUP_UNLOCK(pd);
+	return pktE != NULL;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Packets received from the peer (peer lane of a unified dictionary) are held by it
+int pktReferable(pDeduplicator pd, int64_t pktId) {
+	PktEntry *pktE;
+
+	if (pktId < 0) return 1;
+	pktE = getPkt(&pd->ps, pktId);
+	if ((pktE == NULL) || (pktE->pktId != pktId) || pktE->refused) return 0;
+	return !pd->ackedRefs || pktE->acked;
+}
+
+// Dictionary flush
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Empties a lane. Partitions start again with all slots free, as those of the new dictionary of the peer.
+static void flushPktStore(PktStore *ps) {
+	PktPartitions *pp = ps->parts;
+	unsigned int i;
+
+	for (i = 0; i < ps->size; i++) {
+		ps->pkts[i].len = 0;
+		ps->pkts[i].acked = 0;
+		ps->pkts[i].refused = 0;
+		ps->pkts[i].hash = 0;
+		ps->pkts[i].pktId = 0;
+	}
+	ps->minPktId = ps->pktId;
+	if (pp == NULL) return;
+	STATS_BEGIN(pp->seq);
+	for (i = 0; i < pp->num; i++) {
+		pp->used[i] = 0;
+		pp->head[i] = pp->tail[i] = -1;
+	}
+	STATS_END(pp->seq);
+	for (i = 0; i < ps->size; i++) pp->next[i] = i+1;
+	pp->next[ps->size-1] = -1;
+	pp->freeHead = 0;
+}
+
+int flushDictionary(pDeduplicator pd) {
+	unsigned int i;
+	int j;
+
+	DEDUP_LOCK(pd);
+	if ((pd->resizeState != DICT_STABLE) || (pd->ps.old != NULL) || (pd->fps->old != NULL)) {
+		DEDUP_UNLOCK(pd);
+		return -1;
+	}
+	flushPktStore(&pd->ps);
+	if (pd->ps.peer != NULL) flushPktStore(pd->ps.peer);
+	// The peer gives pktIds from 1 again
+	if (pd->indexed) pd->ps.pktId = pd->ps.minPktId = 1;
+	for (i = 0; i < pd->fps->size; i++) {
+		for (j = 0; j < PKTS_PER_FP; j++) {
+			pd->fps->fpes[i].pkts[j].pktId = 0;
+			pd->fps->fpes[i].pkts[j].fp = UINT64_MAX;
+		}
+	}
+	if (pd->resemblance != NULL) memset(pd->resemblance->entries, 0, pd->resemblance->size * sizeof(ResemblanceEntry));
+	if (pd->hub != NULL) {
+		memset(pd->hub->known, 0, (size_t) pd->ps.size * pd->hub->words * sizeof(uint32_t));
+		STATS_BEGIN(pd->compSeq);
+		for (i = 0; i < pd->hub->maxPeers; i++) {
+			if (pd->hub->peers[i].window == 0) continue;
+			memset(pd->hub->peers[i].sent, 0, pd->hub->peers[i].window * sizeof(int64_t));
+			pd->hub->peers[i].count = 0;
+			pd->hub->peers[i].known = 0;
+		}
+		STATS_END(pd->compSeq);
+	}
+	pd->refusedRefs = 0;
+	DEDUP_UNLOCK(pd);
+	return 0;
+}
+
+void resetHubPeer(pDeduplicator pd, unsigned int peer) {
+	HubPeer *hp;
+	unsigned int i;
+
+	if ((pd->hub == NULL) || (peer >= pd->hub->maxPeers)) return;
+	pthread_mutex_lock(&pd->cerrojo);
+	for (i = 0; i < pd->ps.size; i++) pd->hub->known[i * pd->hub->words + (peer >> 5)] &= ~(1U << (peer & 31));
+	hp = &pd->hub->peers[peer];
+	if (hp->window != 0) memset(hp->sent, 0, hp->window * sizeof(int64_t));
+	hp->count = 0;
+	STATS_BEGIN(pd->compSeq);
+	hp->known = 0;
+	STATS_END(pd->compSeq);
+	pthread_mutex_unlock(&pd->cerrojo);
+}
+
+// Dictionary maintenance
+
+static uint64_t now_usec(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Empties the stale entries of the next numBuckets buckets of the FPStore and keeps occupancy statistics.
+// Only stale entries are touched: live ones keep their position, as lookups and putFP depend on it in both peers.
+static void sweepFPStore(pDeduplicator pd, unsigned int numBuckets) {
+
+	FPStore fps = pd->fps;
+	FPEntryB *fpe;
+	unsigned int i;
+	int j;
+	uint64_t now, elapsed;
+
+	STATS_BEGIN(pd->statusSeq);
+	if (pd->sweepCursor >= fps->size) pd->sweepCursor = 0; // Store resized
+	if (pd->sweepCursor == 0) {
+		pd->sweepPassLive = 0;
+		pd->sweepPassStart = now_usec();
+	}
+	for (i = 0; (i < numBuckets) && (pd->sweepCursor < fps->size); i++, pd->sweepCursor++) {
+		for (j = 0; j < PKTS_PER_FP; j++) {
+			fpe = &fps->fpes[pd->sweepCursor].pkts[j];
+			if (fpe->pktId == 0) continue;
+			if (getPkt(&pd->ps, fpe->pktId) == NULL) {
+				fpe->pktId = 0;
+				pd->maintStats.reclaimedEntries++;
+			} else pd->sweepPassLive++;
+		}
+	}
+	pd->maintStats.sweptBuckets += i;
+
+	if (pd->sweepCursor >= fps->size) { // Pass completed
+		now = now_usec();
+		elapsed = now - pd->sweepPassStart;
+		pd->maintStats.completedSweeps++;
+		pd->maintStats.liveEntries = pd->sweepPassLive;
+		pd->maintStats.fpEntries = (uint64_t) fps->size * PKTS_PER_FP;
+		pd->maintStats.sweepRate = (elapsed > 0) ? (uint64_t) fps->size * 1000000 / elapsed : 0;
+		pd->sweepCursor = 0;
+	}
+	STATS_END(pd->statusSeq);
+}
+
+// Packets between clock checks of the owner sweeps
+#define MAINTENANCE_TICK 64
+
+void maintenanceStep(pDeduplicator pd) {
+
+	uint64_t now;
+
+	if ((pd->sweepBuckets == 0) || ((++pd->sweepTick % MAINTENANCE_TICK) != 0)) return;
+	now = now_usec();
+	if (now < pd->sweepNext) return;
+	sweepFPStore(pd, pd->sweepBuckets);
+	pd->sweepNext = now + pd->sweepInterval;
+}
+
+typedef struct {
+	pDeduplicator pd;
+	unsigned int numBuckets;
+	unsigned int intervalMs;
+} MaintenanceTask;
+
+static void *maintenanceThread(void *arg) {
+
+	MaintenanceTask *mt = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&mt->pd->cerrojo);
+		sweepFPStore(mt->pd, mt->numBuckets);
+		pthread_mutex_unlock(&mt->pd->cerrojo);
+		usleep(mt->intervalMs * 1000);
+	}
+	return NULL;
+}
+
+int startMaintenance(pDeduplicator pd, unsigned int numBuckets, unsigned int intervalMs) {
+
+	MaintenanceTask *mt;
+	pthread_t t;
+	pthread_attr_t attr;
+	int result;
+
+	if (numBuckets == 0) return -1;
+	if (!pd->locked) { // Swept by the owner, see maintenanceStep
+		pd->sweepInterval = (uint64_t) intervalMs * 1000;
+		pd->sweepBuckets = numBuckets;
+		return 0;
+	}
+	mt = malloc(sizeof(MaintenanceTask));
+	if (mt == NULL) return -1;
+	mt->pd = pd;
+	mt->numBuckets = numBuckets;
+	mt->intervalMs = intervalMs;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	result = pthread_create(&t, &attr, maintenanceThread, mt);
+	pthread_attr_destroy(&attr);
+	if (result != 0) {
+		free(mt);
+		return -1;
+	}
+	return 0;
+}
+
+void getMaintenanceStats(pDeduplicator pd, MaintenanceStats *ms) {
+
+	uint32_t s;
+
+	do {
+		s = statsReadBegin(&pd->statusSeq);
+		*ms = pd->maintStats;
+	} while (statsReadRetry(&pd->statusSeq, s));
+}
+
+// Shared memory dictionaries
+
+#define SHM_DICT_MAGIC 0x534f4c57	// "SOLW"
+#define SHM_DICT_VERSION 5		// Must be increased whenever the segment layout or the dictionary structures change
+#define SHM_TAKEOVER_WAIT 100		// Tenths of second waited for the previous process to release the dictionary and exit
+#define SHM_ALIGN(x) (((x) + 63) & ~((size_t) 63))
+
+// magic, version, owner and lastOwner keep their place in all versions, so any older process can be asked to release
+struct ShmDictHeader {
+	uint32_t magic;
+	uint32_t version;
+	volatile pid_t owner;		// Process using the dictionary, 0 once released
+	volatile pid_t lastOwner;
+	uint32_t dictSize;		// sizeof(Deduplicator), catches builds with different structures
+	uint32_t pktStoreSize;		// Of each lane if unified
+	uint32_t fpStoreSize;
+	uint32_t maxPktSize;
+	uint32_t fpPerPkt;
+	uint32_t unified;
+	uint64_t segmentSize;
+	char *base;			// Address the segment was mapped at by its last owner
+};
+
+// Segment layout: header, Deduplicator, FPTable, peer lane PktStore, packet entries, packet buffers, FP buckets, FP entries
+typedef struct {
+	size_t dict, fpTable, peer, pktEntries, pktData, fpBuckets, fpEntries, size;
+} ShmLayout;
+
+static void shmLayout(ShmLayout *l, unsigned int pktStoreSize, unsigned int fpStoreSize, int unified) {
+
+	size_t lanes = unified ? 2 : 1;
+
+	l->dict = SHM_ALIGN(sizeof(struct ShmDictHeader));
+	l->fpTable = l->dict + SHM_ALIGN(sizeof(Deduplicator));
+	l->peer = l->fpTable + SHM_ALIGN(sizeof(FPTable));
+	l->pktEntries = l->peer + SHM_ALIGN(sizeof(PktStore));
+	l->pktData = l->pktEntries + SHM_ALIGN(lanes*pktStoreSize*sizeof(PktEntry));
+	l->fpBuckets = l->pktData + SHM_ALIGN(lanes*pktStoreSize*MAX_PKT_SIZE());
+	l->fpEntries = l->fpBuckets + SHM_ALIGN((size_t) fpStoreSize*sizeof(FPEntry));
+	l->size = l->fpEntries + SHM_ALIGN((size_t) fpStoreSize*PKTS_PER_FP*sizeof(FPEntryB));
+}
+
+static void initSharedMutex(pthread_mutex_t *m) {
+
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(m, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void initSharedPktStore(PktStore *ps, unsigned int size, PktEntry *pkts, unsigned char *data) {
+
+	unsigned int i;
+
+	ps->pktId = 1; // 0 means empty FPEntry
+	ps->size = size;
+	ps->peer = NULL;
+	ps->minPktId = 1;
+	ps->old = NULL;
+	ps->migrated = 0;
+	ps->parts = NULL;
+	ps->pkts = pkts;
+	for (i = 0; i < size; i++) {
+		ps->pkts[i].pkt = data + (size_t) i*MAX_PKT_SIZE();
+		ps->pkts[i].len = 0;
+		ps->pkts[i].acked = 0;
+		ps->pkts[i].refused = 0;
+		ps->pkts[i].hash = 0;
+		ps->pkts[i].pktId = 0;
+	}
+}
+
+// Builds a new dictionary in the segment
+static pDeduplicator initSharedDeduplicator(char *base, ShmLayout *l, unsigned int pktStoreSize, unsigned int fpStoreSize, int unified) {
+
+	struct ShmDictHeader *h = (struct ShmDictHeader *) base;
+	pDeduplicator pd = (pDeduplicator) (base + l->dict);
+	PktEntry *pkts = (PktEntry *) (base + l->pktEntries);
+	unsigned char *data = (unsigned char *) (base + l->pktData);
+	FPEntryB *fpes = (FPEntryB *) (base + l->fpEntries);
+	unsigned int i, j;
+
+	memset(pd, 0, sizeof(Deduplicator));
+	pd->locked = 1; // Released to the next process by another thread (see releaseSharedDeduplicator)
+	initSharedMutex(&pd->cerrojo);
+	initSharedMutex(&pd->statsLock);
+	pd->resizeState = DICT_STABLE;
+	pd->pendingEpoch = -1;
+	pd->peerEpoch = -1;
+	pd->shm = h;
+
+	initSharedPktStore(&pd->ps, pktStoreSize, pkts, data);
+	if (unified) {
+		pd->ps.peer = (PktStore *) (base + l->peer);
+		initSharedPktStore(pd->ps.peer, pktStoreSize, pkts + pktStoreSize, data + (size_t) pktStoreSize*MAX_PKT_SIZE());
+	}
+
+	pd->fps = (FPStore) (base + l->fpTable);
+	pd->fps->size = fpStoreSize;
+	pd->fps->old = NULL;
+	pd->fps->migrated = 0;
+	pd->fps->fpes = (FPEntry *) (base + l->fpBuckets);
+	for (i = 0; i < fpStoreSize; i++) {
+		pd->fps->fpes[i].pkts = fpes + (size_t) i*PKTS_PER_FP;
+		for (j = 0; j < PKTS_PER_FP; j++) {
+			pd->fps->fpes[i].pkts[j].pktId = 0;
+			pd->fps->fpes[i].pkts[j].fp = UINT64_MAX;
+		}
+	}
+
+	publishResizeStatus(pd);
+
+	h->magic = SHM_DICT_MAGIC;
+	h->version = SHM_DICT_VERSION;
+	h->dictSize = sizeof(Deduplicator);
+	h->pktStoreSize = pktStoreSize;
+	h->fpStoreSize = fpStoreSize;
+	h->maxPktSize = MAX_PKT_SIZE();
+	h->fpPerPkt = FP_PER_PKT();
+	h->unified = unified;
+	h->segmentSize = l->size;
+	return pd;
+}
+
+#define SHM_RELOCATE(p, delta) ((p) = (void *) ((char *) (p) + (delta)))
+
+static void relocatePktStore(PktStore *ps, ptrdiff_t delta) {
+
+	unsigned int i;
+
+	SHM_RELOCATE(ps->pkts, delta);
+	for (i = 0; i < ps->size; i++) SHM_RELOCATE(ps->pkts[i].pkt, delta);
+}
+
+// Takes over the dictionary left in the segment, which may have been mapped at another address
+static pDeduplicator attachSharedDeduplicator(char *base, ShmLayout *l) {
+
+	struct ShmDictHeader *h = (struct ShmDictHeader *) base;
+	pDeduplicator pd = (pDeduplicator) (base + l->dict);
+	ptrdiff_t delta = base - h->base;
+	unsigned int i;
+
+	// The previous owner is gone, nobody else uses the locks, nor was updating statistics
+	initSharedMutex(&pd->cerrojo);
+	initSharedMutex(&pd->statsLock);
+	pd->compSeq &= ~1;
+	pd->decompSeq &= ~1;
+	pd->statusSeq &= ~1;
+	pd->shm = h;
+	pd->helpers = NULL; // Threads of the previous owner
+	pd->ackedRefs = 0; // Set again by the new owner, as the acknowledgements of the previous one are lost
+	pd->refusedRefs = 0;
+	if (delta != 0) {
+		SHM_RELOCATE(pd->fps, delta);
+		SHM_RELOCATE(pd->fps->fpes, delta);
+		for (i = 0; i < pd->fps->size; i++) SHM_RELOCATE(pd->fps->fpes[i].pkts, delta);
+		relocatePktStore(&pd->ps, delta);
+		if (pd->ps.peer != NULL) {
+			SHM_RELOCATE(pd->ps.peer, delta);
+			relocatePktStore(pd->ps.peer, delta);
+		}
+	}
+	return pd;
+}
+
+static int validSharedDeduplicator(struct ShmDictHeader *h, ShmLayout *l, unsigned int pktStoreSize, unsigned int fpStoreSize, int unified) {
+	return (h->magic == SHM_DICT_MAGIC) && (h->version == SHM_DICT_VERSION) && (h->dictSize == sizeof(Deduplicator)) &&
+		(h->pktStoreSize == pktStoreSize) && (h->fpStoreSize == fpStoreSize) && (h->maxPktSize == MAX_PKT_SIZE()) &&
+		(h->fpPerPkt == FP_PER_PKT()) && (h->unified == unified) && (h->segmentSize == l->size);
+}
+
+static int otherProcessAlive(pid_t pid) {
+	return (pid > 0) && (pid != getpid()) && (kill(pid, 0) == 0);
+}
+
+// Asks the previous owner to release the dictionary and waits until it has exited.
+// Returns 0 if released, 1 if there are no contents to keep, -1 if still in use.
+static int takeoverSharedDeduplicator(struct ShmDictHeader *h) {
+
+	unsigned char message[LOGSZ];
+	pid_t owner = h->owner;
+	int i;
+
+	if (h->magic != SHM_DICT_MAGIC) return 1;
+	if (otherProcessAlive(owner)) {
+		sprintf(message, "[SHM DICT]: asking process %d to release the dictionary\n", owner);
+		logger(LOG_INFO, message);
+		kill(owner, SIGTERM);
+		for (i = 0; (i < SHM_TAKEOVER_WAIT) && (h->owner != 0); i++) usleep(100000);
+	}
+	owner = (h->owner != 0) ? h->owner : h->lastOwner;
+	// The lock of a released dictionary is kept by its owner, which must be gone before the lock is initialized again
+	for (i = 0; (i < SHM_TAKEOVER_WAIT) && otherProcessAlive(owner); i++) usleep(100000);
+	if (otherProcessAlive(owner)) return -1;
+	return (h->owner == 0) ? 0 : 1; // Not released: the previous process died while using it
+}
+
+pDeduplicator newSharedDeduplicator(const char *name, unsigned int size, int unified, int *attached) {
+
+	unsigned char message[LOGSZ];
+	char path[128];
+	unsigned int pktStoreSize, fpStoreSize;
+	ShmLayout l;
+	struct stat st;
+	struct ShmDictHeader *h;
+	pDeduplicator pd;
+	char *base;
+	int fd, released = 1;
+
+	pktStoreSize = unified ? size / 2 : size;
+	if (pktStoreSize == 0) pktStoreSize = 1;
+	fpStoreSize = FP_PER_PKT()*size*FPS_FACTOR();
+	shmLayout(&l, pktStoreSize, fpStoreSize, unified);
+	*attached = 0;
+
+	snprintf(path, sizeof(path), "/dev/shm/%s", name);
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if ((fd < 0) || (fstat(fd, &st) < 0)) {
+		sprintf(message, "[SHM DICT]: cannot open %s: %s\n", path, strerror(errno));
+		logger(LOG_INFO, message);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+
+	// The previous owner must be gone before the segment is resized or initialized
+	if (st.st_size >= sizeof(struct ShmDictHeader)) {
+		h = mmap(NULL, sizeof(struct ShmDictHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (h != MAP_FAILED) {
+			released = takeoverSharedDeduplicator(h);
+			munmap(h, sizeof(struct ShmDictHeader));
+		}
+		if ((h == MAP_FAILED) || (released < 0)) {
+			sprintf(message, "[SHM DICT]: %s still in use\n", path);
+			logger(LOG_INFO, message);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	if ((st.st_size != l.size) && ((ftruncate(fd, 0) < 0) || (posix_fallocate(fd, 0, l.size) != 0))) {
+		sprintf(message, "[SHM DICT]: cannot allocate %zu bytes for %s\n", l.size, path);
+		logger(LOG_INFO, message);
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, l.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		sprintf(message, "[SHM DICT]: cannot map %s: %s\n", path, strerror(errno));
+		logger(LOG_INFO, message);
+		return NULL;
+	}
+	h = (struct ShmDictHeader *) base;
+
+	if ((released == 0) && validSharedDeduplicator(h, &l, pktStoreSize, fpStoreSize, unified)) {
+		pd = attachSharedDeduplicator(base, &l);
+		*attached = 1;
+	} else {
+		pd = initSharedDeduplicator(base, &l, pktStoreSize, fpStoreSize, unified);
+	}
+	h->base = base;
+	h->lastOwner = h->owner = getpid();
+	return pd;
+}
+
+void releaseSharedDeduplicator(pDeduplicator pd) {
+
+	struct ShmDictHeader *h = pd->shm;
+	ShmLayout l;
+
+	if (h == NULL) return;
+	shmLayout(&l, h->pktStoreSize, h->fpStoreSize, h->unified);
+	// Never unlocked: no other operation runs until the process exits
+	pthread_mutex_lock(&pd->cerrojo);
+	// A dictionary resized by the peer no longer lives in the segment
+	if ((pd->resizeState != DICT_STABLE) || (pd->fps != (FPStore) ((char *) h + l.fpTable)) ||
+			(pd->ps.pkts != (PktEntry *) ((char *) h + l.pktEntries)) || (pd->ps.parts != NULL) || (pd->hub != NULL)) return;
+	h->owner = 0;
+}
+
+void freeDeduplicator(pDeduplicator pd) {
+
+	struct ShmDictHeader *h = pd->shm;
+	ShmLayout l;
+
+	if (h != NULL) {
+		shmLayout(&l, h->pktStoreSize, h->fpStoreSize, h->unified);
+		h->owner = 0; // Taken over by the next opennopd
+		munmap(h->base, l.size);
+		return;
+	}
+	if (pd->ps.peer != NULL) {
+		freePktStore(pd->ps.peer);
+		free(pd->ps.peer);
+	}
+	freePktStore(&pd->ps);
+	freeFPStore(pd->fps);
+	pthread_mutex_destroy(&pd->cerrojo);
+	pthread_mutex_destroy(&pd->statsLock);
+	free(pd);
 }
@@ -0,0 +1,117 @@
+/*
+
+  matchlen.h
+
+  This file is part of OpenNOP-SoloWAN distribution.
+
+  Copyright (C) 2014 Center for Open Middleware (COM) 
+                     Universidad Politecnica de Madrid, SPAIN
+
+    OpenNOP-SoloWAN is an enhanced version of the Open Network Optimization 
+    Platform (OpenNOP) developed to add it deduplication capabilities using
+    a modern dictionary based compression algorithm. 
+
+    SoloWAN is a project of the Center for Open Middleware (COM) of Universidad 
+    Politecnica de Madrid which aims to experiment with open-source based WAN 
+    optimization solutions.
+
+  References:
+
+    SoloWAN: solowan@centeropenmiddleware.com
+             https://github.com/centeropenmiddleware/solowan/wiki
+    OpenNOP: http://www.opennop.org
+    Center for Open Middleware (COM): http://www.centeropenmiddleware.com
+    Universidad Politecnica de Madrid (UPM): http://www.upm.es   
+
+  License:
+
+    OpenNOP-SoloWAN is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    OpenNOP-SoloWAN is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef MATCHLEN_H_
+#define MATCHLEN_H_
+
+// Match length of two byte strings, used to extend FP matches and to check FP contents.
+// Bytes are compared 16 at a time with SSE2 (8 at a time otherwise), the first mismatch
+// is found counting zeros of the comparison mask.
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define WORD_FIRST_DIFF(x) (__builtin_clzll(x) >> 3)	// Lowest address byte is the most significant
+#define WORD_LAST_DIFF(x) (__builtin_ctzll(x) >> 3)
+#else
+#define WORD_FIRST_DIFF(x) (__builtin_ctzll(x) >> 3)
+#define WORD_LAST_DIFF(x) (__builtin_clzll(x) >> 3)
+#endif
+
+// Returns how many bytes are equal at the start of a and b, at most len
+static inline int matchForward(const unsigned char *a, const unsigned char *b, int len) {
+
+	int n = 0;
+	uint64_t wa, wb;
+
+#ifdef __SSE2__
+	unsigned int mask;
+
+	for (; n + 16 <= len; n += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + n)),
+				_mm_loadu_si128((const __m128i *) (b + n)))) ^ 0xffff;
+		if (mask != 0) return n + __builtin_ctz(mask);
+	}
+#endif
+	for (; n + 8 <= len; n += 8) {
+		memcpy(&wa, a + n, 8);
+		memcpy(&wb, b + n, 8);
+		if (wa != wb) return n + WORD_FIRST_DIFF(wa ^ wb);
+	}
+	while ((n < len) && (a[n] == b[n])) n++;
+	return n;
+}
+
+// Returns how many bytes are equal just before a and b (a[-1] == b[-1] and so on), at most len
+static inline int matchBackward(const unsigned char *a, const unsigned char *b, int len) {
+
+	int n = 0;
+	uint64_t wa, wb;
+
+#ifdef __SSE2__
+	unsigned int mask;
+
+	for (; n + 16 <= len; n += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a - n - 16)),
+				_mm_loadu_si128((const __m128i *) (b - n - 16)))) ^ 0xffff;
+		if (mask != 0) return n + __builtin_clz(mask) - 16;
+	}
+#endif
+	for (; n + 8 <= len; n += 8) {
+		memcpy(&wa, a - n - 8, 8);
+		memcpy(&wb, b - n - 8, 8);
+		if (wa != wb) return n + WORD_LAST_DIFF(wa ^ wb);
+	}
+	while ((n < len) && (a[-n-1] == b[-n-1])) n++;
+	return n;
+}
+
+// Returns true if the len bytes of a and b are equal
+static inline int sameBytes(const unsigned char *a, const unsigned char *b, int len) {
+	return matchForward(a, b, len) == len;
+}
+
+#endif /* MATCHLEN_H_ */
@@ -52,86 +52,560 @@
 #include <stdbool.h>
 #include <sys/time.h>
 #include "solowan_rolling.h"
+#include "matchlen.h"
 #include "MurmurHash3.h"
 #include "logger.h"
 #include "debugd.h"
 
-inline static void cacheAndCompressIfNeeded(pDeduplicator pd, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen, unsigned int compress) {
+// A string of the packet being compressed found in a stored packet:
+// len bytes from ofs in the packet are the same as len bytes from refOfs in packet pktId
+// A string going on across stored packets (see extendMatch) takes a match for each one: span is set in the matches
+// following the first, which start at offset 0 of the packet stored after the previous one, where it ended.
+// In a self reference pktId is the one of the packet itself, and refOfs is below ofs.
+typedef struct {
+	uint16_t ofs;
+	uint16_t len;
+	uint16_t refOfs;
+	int64_t pktId;
+	uint64_t fp;
+	uint32_t refHash;
+	int span;
+} DedupMatch;
+
+// Length of a FP descriptor (DEDUP_FORMAT_FP), the least a match must replace to save anything
+#define FP_DESC_LEN (sizeof(uint64_t) + sizeof(uint32_t) + 3*sizeof(uint16_t))
+
+// Compressed packet format (DEDUP_FORMAT_FP):
+//     32 bit int (network order) original packet hash
+//     Short int (network order) offset from end of this header to first FP descriptor
+// Compressed data: byte sequence of uncompressed chunks (variable length) and interleaved FP descriptors
+// FP descriptors pointed by the header, fixed format and length:
+//     64 bit FP (network order)
+//     32 bit packet hash (network order)
+//     16 bit left limit (network order)
+//     16 bit right limit (network order)
+//     16 bit offset from end of this header to next FP descriptor (if all ones, no more descriptors)
+static uint16_t writeFPFormat(unsigned char *optpkt, unsigned char *packet, uint16_t pktlen, uint32_t pktHash, DedupMatch *matches, int numMatches) {
+
+	int i, orig, dest;
+	unsigned char *poffsetFPD;
+
+	hton32(optpkt, pktHash);
+	poffsetFPD = optpkt + sizeof(uint32_t);
+	orig = 0;
+	dest = sizeof(uint32_t) + sizeof(uint16_t);
+	for (i = 0; i < numMatches; i++) {
+		// Uncompressed chunk before matching bytes
+		memcpy(optpkt+dest, packet+orig, matches[i].ofs-orig);
+		hton16(poffsetFPD, matches[i].ofs-orig);
+		dest += matches[i].ofs-orig;
+
+		hton64(optpkt+dest, matches[i].fp);
+		dest += sizeof(uint64_t);
+		hton32(optpkt+dest, matches[i].refHash);
+		dest += sizeof(uint32_t);
+		hton16(optpkt+dest, matches[i].refOfs);
+		dest += sizeof(uint16_t);
+		assert(matches[i].refOfs+matches[i].len-1 < MAX_PKT_SIZE());
+		hton16(optpkt+dest, matches[i].refOfs+matches[i].len-1);
+		dest += sizeof(uint16_t);
+		poffsetFPD = optpkt+dest;
+		hton16(poffsetFPD, 0xffff);
+		dest += sizeof(uint16_t);
+		orig = matches[i].ofs+matches[i].len;
+	}
+	memcpy(optpkt+dest, packet+orig, pktlen-orig);
+	assert(ntoh16(optpkt+ sizeof(uint32_t)) < MAX_PKT_SIZE());
+	return dest+pktlen-orig;
+}
+
+// pktId a stored packet has at the peer: the same one but in hub dictionaries (see Hub mode)
+static int64_t peerPktId(pDeduplicator pd, int64_t pktId) {
+	return (pd->hub != NULL) ? hubPeerPktId(pd->hub, &pd->ps, pktId) : pktId;
+}
+
+// Compressed packet format (DEDUP_FORMAT_INDEX), all integers but the hash are varints (see putVarint):
+//     32 bit int (network order) original packet hash
+//     pktId of this packet
+// Then, until the end of the packet, uncompressed chunks, each one followed by a reference unless it is the last one:
+//     Chunk length, chunk bytes
+//     Reference: pktId of this packet minus the pktId of the referenced one, offset in that packet, length minus BETA
+// A reference longer than the rest of the referenced packet goes on from the start of the following ones, so a
+// string spanning several stored packets takes a single reference.
+// Each reference replaces at least BETA bytes with at most 3*MAX_VARINT_LEN, so the result is never longer than pktlen.
+static uint16_t writeIndexFormat(pDeduplicator pd, unsigned char *optpkt, unsigned char *packet, uint16_t pktlen, uint32_t pktHash, int64_t pktId, DedupMatch *matches, int numMatches) {
+
+	int i, j, len, orig, dest;
+
+	hton32(optpkt, pktHash);
+	dest = sizeof(uint32_t);
+	dest += putVarint(optpkt+dest, peerPktId(pd, pktId));
+	orig = 0;
+	for (i = 0; i < numMatches; i = j) {
+		len = matches[i].len;
+		for (j = i+1; (j < numMatches) && matches[j].span; j++) len += matches[j].len;
+		dest += putVarint(optpkt+dest, matches[i].ofs-orig);
+		memcpy(optpkt+dest, packet+orig, matches[i].ofs-orig);
+		dest += matches[i].ofs-orig;
+		dest += putVarint(optpkt+dest, peerPktId(pd, pktId)-peerPktId(pd, matches[i].pktId));
+		dest += putVarint(optpkt+dest, matches[i].refOfs);
+		dest += putVarint(optpkt+dest, len-BETA);
+		orig = matches[i].ofs+len;
+	}
+	if (orig < pktlen) {
+		dest += putVarint(optpkt+dest, pktlen-orig);
+		memcpy(optpkt+dest, packet+orig, pktlen-orig);
+		dest += pktlen-orig;
+	}
+	return dest;
+}
 
-	FPEntryB pktFps[MAX_FP_PER_PKT];
-	int i;
+// FPs and hash of a packet. FPs are calculated with no lock held if the dictionary is locked, otherwise only
+// once the packet is known not to be stored already (see findStoredPacket). So are the super fingerprints,
+// if the dictionary has a resemblance index.
+typedef struct {
+	FPEntryB fps[MAX_FP_PER_PKT];
+	unsigned int fpNum;
+	int fingerprinted;
+	uint32_t hash;
+	uint32_t sfs[RESEMBLANCE_SF];
+} PktPrint;
+
+static void fingerprintPacket(pDeduplicator pd, unsigned char *packet, uint16_t pktlen, PktPrint *pp) {
+	if (!pp->fingerprinted) {
+		pp->fpNum = calculateRelevantFPs(pp->fps, packet, pktlen);
+		if (pd->resemblance != NULL) calculateSuperFPs(pp->sfs, packet, pktlen);
+		pp->fingerprinted = 1;
+	}
+}
+
+static void printPacket(pDeduplicator pd, unsigned char *packet, uint16_t pktlen, PktPrint *pp) {
+	pp->fpNum = 0;
+	pp->fingerprinted = 0;
+	pp->hash = 0;
+	if (pktlen >= BETA) {
+		MurmurHash3_x86_32  (packet, pktlen, SEED, (void *) &pp->hash );
+		if (pd->locked) fingerprintPacket(pd, packet, pktlen, pp);
+	}
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// pktId of a stored packet equal to the given one, 0 if none (see PKT_FP)
+static int64_t findStoredPacket(pDeduplicator pd, int peer, unsigned char *packet, uint16_t pktlen, uint32_t hash) {
 	FPEntryB *fpp;
+	PktEntry *storedPacket;
+
+	fpp = getFPhash(pd->fps, &pd->ps, PKT_FP(hash, pktlen), hash);
+	if ((fpp == NULL) || (fpp->offset != 0)) return 0;
+	storedPacket = getPkt(&pd->ps, fpp->pktId);
+	if ((storedPacket == NULL) || (storedPacket->len != pktlen) || memcmp(storedPacket->pkt, packet, pktlen)) return 0;
+	if (pd->hub != NULL) {
+		if (!hubKnows(pd->hub, &pd->ps, peer, fpp->pktId)) {
+			pd->hub->filtered++;
+			return 0;
+		}
+		pd->hub->peers[peer].references++;
+	}
+	if (REFS_CHECKED(pd) && !pktReferable(pd, fpp->pktId)) {
+		pd->compStats.unackedMatches++;
+		return 0;
+	}
+	return fpp->pktId;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Set if a reference to the whole stored packet pktId (see PKT_FP) is solved by the peer as this very packet.
+// Outside DEDUP_FORMAT_INDEX it is looked up by packet hash, and the FPStore may hold another packet with the same
+// hash and length, or none if the entry was overwritten.
+static int pktFPRefersTo(pDeduplicator pd, int format, int64_t pktId, PktEntry *storedPacket) {
+	FPEntryB *fpp;
+
+	if (format == DEDUP_FORMAT_INDEX) return 1;
+	fpp = getFPhash(pd->fps, &pd->ps, PKT_FP(storedPacket->hash, storedPacket->len), storedPacket->hash);
+	return (fpp != NULL) && (fpp->offset == 0) && (fpp->pktId == pktId);
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Matches the packet from its start with the continuation of the stored packets its flow was repeating (see DedupStream).
+// Returns the number of matches, orig is set to the end of the last one. References are solved by the peer as
+// any other: by packet hash (see PKT_FP) in DEDUP_FORMAT_FP, by pktId in DEDUP_FORMAT_INDEX. The prediction stops
+// at a stored packet the peer would not find by its hash.
+static int predictMatches(pDeduplicator pd, int peer, int format, int64_t currPktId, unsigned char *packet, uint16_t pktlen, DedupStream *stream, DedupMatch *matches, int *orig) {
+	int numMatches = 0;
+	int len;
+	int64_t pktId = stream->pktId;
+	unsigned int offset = stream->offset;
+	PktEntry *storedPacket;
+
+	*orig = 0;
+	// pktIds of partitioned stores are not consecutive
+	if ((pktId == 0) || (pd->ps.parts != NULL)) return 0;
+	while ((*orig < pktlen) && (numMatches < MAX_FP_PER_PKT)) {
+		if (pktId == currPktId) break; // Stored already, must not reference itself
+		storedPacket = getPkt(&pd->ps, pktId);
+		if (storedPacket == NULL) break;
+		if ((pd->hub != NULL) && !hubKnows(pd->hub, &pd->ps, peer, pktId)) break;
+		if (REFS_CHECKED(pd) && !pktReferable(pd, pktId)) break;
+		if (!pktFPRefersTo(pd, format, pktId, storedPacket)) break;
+		if (offset < storedPacket->len) {
+			len = (pktlen - *orig < storedPacket->len - offset) ? pktlen - *orig : storedPacket->len - offset;
+			len = matchForward(packet + *orig, storedPacket->pkt + offset, len);
+			if (len < BETA) break;
+			matches[numMatches].ofs = *orig;
+			matches[numMatches].len = len;
+			matches[numMatches].refOfs = offset;
+			matches[numMatches].pktId = pktId;
+			matches[numMatches].fp = PKT_FP(storedPacket->hash, storedPacket->len);
+			matches[numMatches].refHash = storedPacket->hash;
+			matches[numMatches].span = (numMatches > 0);
+			numMatches++;
+			*orig += len;
+			if (offset + len < storedPacket->len) break; // Mismatch, or the packet is over
+		}
+		// Next packet stored (peer lane pktIds of unified dictionaries are negative)
+		pktId = (pktId < 0) ? pktId - 1 : pktId + 1;
+		offset = 0;
+	}
+	pd->compStats.predictedMatches += numMatches;
+	return numMatches;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Packet stored just after (step 1) or before (step -1) pktId in the same lane, NULL if not held, if it is the packet
+// being compressed, if the peer does not hold it (or has not acknowledged it) or would not find it by its hash
+// (see pktFPRefersTo). Partitioned stores have no such order.
+static PktEntry *adjacentPacket(pDeduplicator pd, int peer, int format, int64_t currPktId, int64_t *pktId, int step) {
+	PktEntry *storedPacket;
+
+	if (pd->ps.parts != NULL) return NULL;
+	// Peer lane pktIds of unified dictionaries are negative
+	*pktId = (*pktId < 0) ? *pktId - step : *pktId + step;
+	if ((*pktId == 0) || (*pktId == currPktId)) return NULL;
+	storedPacket = getPkt(&pd->ps, *pktId);
+	if ((storedPacket == NULL) || ((pd->hub != NULL) && !hubKnows(pd->hub, &pd->ps, peer, *pktId))) return NULL;
+	if (REFS_CHECKED(pd) && !pktReferable(pd, *pktId)) return NULL;
+	if (!pktFPRefersTo(pd, format, *pktId, storedPacket)) return NULL;
+	return storedPacket;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Packets sent again are seldom segmented as they were first, so a string found in a stored packet often goes on in the
+// packets stored before and after it. The last match is extended leftwards down to orig, into the previous stored packets,
+// and rightwards into the following ones, taking a match for each packet (see DedupMatch). Matches shorter than minLen
+// are not taken. Returns the number of matches, now ending with the extended string.
+static int extendMatch(pDeduplicator pd, int peer, int format, int64_t currPktId, unsigned char *packet, uint16_t pktlen, int orig, DedupMatch *matches, int numMatches, int minLen) {
+	DedupMatch left[MAX_FP_PER_PKT];
+	DedupMatch *m;
+	PktEntry *storedPacket;
+	int64_t pktId;
+	int i, len, end, numLeft = 0;
+
+	// Leftwards, while the string reaches the start of a stored packet
+	m = &matches[numMatches-1];
+	pktId = m->pktId;
+	end = m->ofs;
+	if (m->refOfs == 0) {
+		while ((end > orig) && (numMatches + numLeft < MAX_FP_PER_PKT)) {
+			if ((storedPacket = adjacentPacket(pd, peer, format, currPktId, &pktId, -1)) == NULL) break;
+			len = (end - orig < storedPacket->len) ? end - orig : storedPacket->len;
+			len = matchBackward(packet + end, storedPacket->pkt + storedPacket->len, len);
+			if (len < minLen) break;
+			end -= len;
+			left[numLeft].ofs = end;
+			left[numLeft].len = len;
+			left[numLeft].refOfs = storedPacket->len - len;
+			left[numLeft].pktId = pktId;
+			left[numLeft].fp = PKT_FP(storedPacket->hash, storedPacket->len);
+			left[numLeft].refHash = storedPacket->hash;
+			pd->compStats.extendedBytes += len;
+			numLeft++;
+			if (len < storedPacket->len) break;
+		}
+	}
+	if (numLeft > 0) {
+		matches[numMatches-1+numLeft] = *m;
+		matches[numMatches-1+numLeft].span = 1;
+		for (i = 0; i < numLeft; i++) {
+			matches[numMatches-1+i] = left[numLeft-1-i];
+			matches[numMatches-1+i].span = (i > 0);
+		}
+		numMatches += numLeft;
+	}
+
+	// Rightwards, while the string reaches the end of a stored packet
+	m = &matches[numMatches-1];
+	pktId = m->pktId;
+	end = m->ofs + m->len;
+	storedPacket = getPkt(&pd->ps, pktId);
+	if (m->refOfs + m->len < storedPacket->len) return numMatches;
+	while ((end < pktlen) && (numMatches < MAX_FP_PER_PKT)) {
+		if ((storedPacket = adjacentPacket(pd, peer, format, currPktId, &pktId, 1)) == NULL) break;
+		len = (pktlen - end < storedPacket->len) ? pktlen - end : storedPacket->len;
+		len = matchForward(packet + end, storedPacket->pkt, len);
+		if (len < minLen) break;
+		matches[numMatches].ofs = end;
+		matches[numMatches].len = len;
+		matches[numMatches].refOfs = 0;
+		matches[numMatches].pktId = pktId;
+		matches[numMatches].fp = PKT_FP(storedPacket->hash, storedPacket->len);
+		matches[numMatches].refHash = storedPacket->hash;
+		matches[numMatches].span = 1;
+		pd->compStats.extendedBytes += len;
+		numMatches++;
+		end += len;
+		if (len < storedPacket->len) break;
+	}
+	return numMatches;
+}
+
+// Slot of the resemblance index for super fingerprint j, each one is spread differently
+#define RESEMBLANCE_SLOT(ri, sf, j) ((((sf) ^ ((j) * 0x9E3779B9U)) * 0x85EBCA6BU) & ((ri)->size - 1))
+
+// UNSAFE FUNCTION, must be called inside code with locks
+static void putResemblance(ResemblanceIndex *ri, uint32_t *sfs, int64_t pktId) {
+	int j;
+	ResemblanceEntry *re;
+
+	for (j = 0; j < RESEMBLANCE_SF; j++) {
+		re = &ri->entries[RESEMBLANCE_SLOT(ri, sfs[j], j)];
+		re->sf = sfs[j];
+		re->pktId = pktId;
+	}
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+// Stored packet sharing the most super fingerprints with the packet, the latest one if several share as many.
+// NULL if none shares any, or if the peer does not hold it (or has not acknowledged it).
+static PktEntry *findSimilarPacket(pDeduplicator pd, int peer, PktPrint *pp) {
+	ResemblanceIndex *ri = pd->resemblance;
+	ResemblanceEntry *re;
+	int64_t candidates[RESEMBLANCE_SF];
+	int votes[RESEMBLANCE_SF];
+	int i, j, num = 0, best = -1;
+
+	for (j = 0; j < RESEMBLANCE_SF; j++) {
+		re = &ri->entries[RESEMBLANCE_SLOT(ri, pp->sfs[j], j)];
+		if ((re->pktId == 0) || (re->sf != pp->sfs[j])) continue;
+		for (i = 0; (i < num) && (candidates[i] != re->pktId); i++);
+		if (i == num) {
+			candidates[num] = re->pktId;
+			votes[num++] = 0;
+		}
+		votes[i]++;
+	}
+	for (i = 0; i < num; i++) {
+		if (getPkt(&pd->ps, candidates[i]) == NULL) continue;
+		if ((pd->hub != NULL) && !hubKnows(pd->hub, &pd->ps, peer, candidates[i])) continue;
+		if (REFS_CHECKED(pd) && !pktReferable(pd, candidates[i])) continue;
+		if ((best < 0) || (votes[i] > votes[best]) || ((votes[i] == votes[best]) && (candidates[i] > candidates[best]))) best = i;
+	}
+	return (best < 0) ? NULL : getPkt(&pd->ps, candidates[best]);
+}
+
+// Delta packet format (DEDUP_FORMAT_DELTA):
+//     32 bit int (network order) original packet hash
+//     Short int (network order) DELTA_MARK
+//     32 bit int (network order) hash of the stored packet referenced, short int (network order) its length
+// Then, until the end of the packet, inserted strings, each one followed by a copy unless it is the last one:
+//     Varint length, inserted bytes
+//     Copy: varint offset in the stored packet, varint length minus DELTA_MIN_COPY
+// Strings of DELTA_MIN_COPY bytes of the stored packet are found with a small hash table. Where the last copy ended
+// is tried first, as edits usually keep the length of what they change.
+// Returns the length of the delta, or limit if it would not be shorter than limit.
+#define DELTA_HASH_BITS 10
+#define DELTA_HASH(w) (((w) * 0x9E3779B1U) >> (32 - DELTA_HASH_BITS))
+#define DELTA_HEADER_LEN (2*sizeof(uint32_t) + 2*sizeof(uint16_t))
+static int writeDeltaFormat(unsigned char *optpkt, int limit, unsigned char *packet, uint16_t pktlen, uint32_t pktHash, PktEntry *ref) {
+
+	uint16_t head[1 << DELTA_HASH_BITS];
+	uint32_t w;
+	int i, len, back, cand, dest;
+	int pos = 0, ins = 0, refNext = 0;
+
+	if ((pktlen >= DELTA_MARK) || (ref->len < DELTA_MIN_COPY) || (limit <= DELTA_HEADER_LEN)) return limit;
+	memset(head, 0xff, sizeof(head));
+	for (i = 0; i + DELTA_MIN_COPY <= ref->len; i++) {
+		memcpy(&w, ref->pkt + i, sizeof(uint32_t));
+		head[DELTA_HASH(w)] = i;
+	}
+
+	hton32(optpkt, pktHash);
+	hton16(optpkt+sizeof(uint32_t), DELTA_MARK);
+	hton32(optpkt+sizeof(uint32_t)+sizeof(uint16_t), ref->hash);
+	hton16(optpkt+2*sizeof(uint32_t)+sizeof(uint16_t), ref->len);
+	dest = DELTA_HEADER_LEN;
+	while (pos + DELTA_MIN_COPY <= pktlen) {
+		len = 0;
+		cand = refNext + pos - ins;
+		if (cand + DELTA_MIN_COPY <= ref->len)
+			len = matchForward(packet + pos, ref->pkt + cand, (pktlen - pos < ref->len - cand) ? pktlen - pos : ref->len - cand);
+		if (len < DELTA_MIN_COPY) {
+			memcpy(&w, packet + pos, sizeof(uint32_t));
+			cand = head[DELTA_HASH(w)];
+			if (cand != 0xffff)
+				len = matchForward(packet + pos, ref->pkt + cand, (pktlen - pos < ref->len - cand) ? pktlen - pos : ref->len - cand);
+		}
+		if (len < DELTA_MIN_COPY) {
+			pos++;
+			continue;
+		}
+		back = matchBackward(packet + pos, ref->pkt + cand, (pos - ins < cand) ? pos - ins : cand);
+		pos -= back;
+		cand -= back;
+		len += back;
+		if (dest + pos - ins + 3*MAX_VARINT_LEN >= limit) return limit;
+		dest += putVarint(optpkt+dest, pos - ins);
+		memcpy(optpkt+dest, packet + ins, pos - ins);
+		dest += pos - ins;
+		dest += putVarint(optpkt+dest, cand);
+		dest += putVarint(optpkt+dest, len - DELTA_MIN_COPY);
+		pos += len;
+		ins = pos;
+		refNext = cand + len;
+	}
+	if (ins < pktlen) {
+		if (dest + pktlen - ins + MAX_VARINT_LEN >= limit) return limit;
+		dest += putVarint(optpkt+dest, pktlen - ins);
+		memcpy(optpkt+dest, packet + ins, pktlen - ins);
+		dest += pktlen - ins;
+	}
+	return dest;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks, between STATS_BEGIN(pd->compSeq) and STATS_END(pd->compSeq)
+// Returns the pktId the packet is stored with (the one it has at the peer, for a hub), 0 if not stored
+static int64_t cacheAndCompress(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen, PktPrint *pp, unsigned char *optpkt, uint16_t *optlen, unsigned int compress, int format, DedupStream *stream) {
+
+	DedupMatch matches[MAX_FP_PER_PKT];
+	int i, j, numMatches;
+	FPEntryB *fpp;
+	int64_t refPktId;
 	unsigned char message[LOGSZ];
 	struct timeval tiempo;
-	uint32_t computedPacketHash;
-	int orig, dest;
-	void *poffsetFPD, *pliml, *plimr;
-	void *poffsetFP, *poffsetPktHash;
-	uint16_t firstoffs;
+	int orig;
 	int ofs1 = 0;
 	int ofs2 = 0;
-	unsigned int fpNum;
-	  
-	// Calculate FPs and packet hash
-	// These functions may be placed outside locks, as they don't involve access to any shared state	
-	if (pktlen >= BETA) {
-		fpNum = calculateRelevantFPs(pktFps, packet, pktlen);
-		MurmurHash3_x86_32  (packet, pktlen, SEED, (void *) &computedPacketHash );
-	}	
-	pthread_mutex_lock(&pd->cerrojo);
+	// Whole packet, self and spanning references only if the peer uncompresses them
+	int extended = format & DEDUP_EXTENDED;
+	format &= ~DEDUP_EXTENDED;
+	// A match in an adjacent packet takes a FP descriptor of its own, but only makes a reference longer in DEDUP_FORMAT_INDEX
+	int minLen = (format == DEDUP_FORMAT_INDEX) ? sizeof(uint32_t) : FP_DESC_LEN + 1;
+
 	pd->compStats.processedPackets++;
 	pd->compStats.inputBytes += pktlen;
 
 	if (debugword & DEDUP_MASK) {
 		gettimeofday(&tiempo,NULL);
-		sprintf(message,"DEDUP processing at %d.%d hash %x len %d\n",tiempo.tv_sec,tiempo.tv_usec, computedPacketHash, pktlen);
+		sprintf(message,"DEDUP processing at %d.%d hash %x len %d\n",tiempo.tv_sec,tiempo.tv_usec, pp->hash, pktlen);
 		logger(LOG_INFO, message);
 	}
 
 	// Default return values, no changes
 	if (compress) *optlen = pktlen;
+	// pktIds are only kept alike by the peer in split, not partitioned dictionaries
+	if ((format == DEDUP_FORMAT_INDEX) && ((pd->ps.peer != NULL) || (pd->ps.parts != NULL))) compress = 0;
+	// A hub references packets by their pktIds at the peer, which must be set (see Hub mode)
+	if ((pd->hub != NULL) && ((format != DEDUP_FORMAT_INDEX) || (peer < 0) || (peer >= pd->hub->maxPeers) ||
+			(pd->hub->peers[peer].window == 0))) compress = 0;
+
+	// Only packets compressed keep the flow stream, the others break the sequence
+	if ((stream != NULL) && (!compress || !extended)) stream->pktId = 0;
 
 	// Do not optimize packets shorter than length of fingerprinted strings
 	if (pktlen < BETA) {
 		pd->compStats.numberOfShortPkts++;
 		pd->compStats.outputBytes += pktlen;
-		pthread_mutex_unlock(&pd->cerrojo);
 		if (debugword & DEDUP_MASK) {
 			sprintf(message,"DEDUP returning, short %d\n", pktlen);
 			logger(LOG_INFO, message);
 		}
-		return;
+		return 0;
 	}
 
+	// Exact repeat of a stored packet: nothing is stored, and the peer stores nothing either
+	if (compress && extended && ((refPktId = findStoredPacket(pd, peer, packet, pktlen, pp->hash)) != 0)) {
+		hton32(optpkt, pp->hash);
+		if (format == DEDUP_FORMAT_INDEX) {
+			*optlen = sizeof(uint32_t);
+			*optlen += putVarint(optpkt+*optlen, 0);
+			*optlen += putVarint(optpkt+*optlen, peerPktId(pd, refPktId));
+		} else {
+			hton16(optpkt+sizeof(uint32_t), pktlen);
+			*optlen = PKT_REF_LEN;
+		}
+		pd->compStats.packetReferences++;
+		pd->compStats.compressedPackets++;
+		pd->compStats.outputBytes += *optlen;
+		if (stream != NULL) {
+			stream->pktId = refPktId;
+			stream->offset = pktlen;
+		}
+		return 0;
+	}
+	fingerprintPacket(pd, packet, pktlen, pp);
+
+	// Pending resize and contents migration, the peer does the same for each packet it stores
+	resizeStep(pd);
+	maintenanceStep(pd);
+
+	// The most similar packet is looked up before this one is indexed
+	PktEntry *similarPacket = NULL;
+	if (compress && (format == DEDUP_FORMAT_DELTA) && (pd->resemblance != NULL)) similarPacket = findSimilarPacket(pd, peer, pp);
+
 	// Store packet in PS
 	int64_t currPktId;
-	currPktId = putPkt(&pd->ps, packet, pktlen, computedPacketHash);
+	currPktId = putPkt(&pd->ps, partition, packet, pktlen, pp->hash);
+	if (pd->hub != NULL) hubSent(pd->hub, &pd->ps, peer, currPktId);
 
 	if (compress) {
-	  	// Compressed packet format:
-	  	//     32 bit int (network order) original packet hash
-	  	//     Short int (network order) offset from end of this header to first FP descriptor
-	  	// Compressed data: byte sequence of uncompressed chunks (variable length) and interleaved FP descriptors
-	  	// FP descriptors pointed by the header, fixed format and length:
-	  	//     64 bit FP (network order)
-	  	//     32 bit packet hash (network order)
-	  	//     16 bit left limit (network order)
-	  	//     16 bit right limit (network order)
-	  	//     16 bit offset from end of this header to next FP descriptor (if all ones, no more descriptors)
-	  	// Check fingerprints in FPStore
-	  
-	  	poffsetFPD = (void *) optpkt+ sizeof(uint32_t);
-	  	orig = dest= 0;
-	  	for (i=0; i<fpNum; i++) {
-	  		ofs1 = pktFps[i].offset;
-			fpp = getFPcontent(pd->fps,&pd->ps,pktFps[i].fp,packet+ofs1);
+	  	// Continuation of the flow first, then fingerprints in FPStore for the rest, the longest string around each one is taken
+	  	orig = 0;
+	  	numMatches = (stream != NULL) ? predictMatches(pd, peer, format, currPktId, packet, pktlen, stream, matches, &orig) : 0;
+	  	for (i=0; (i<pp->fpNum) && (numMatches<MAX_FP_PER_PKT) && (orig + BETA <= pktlen); i++) {
+	  		ofs1 = pp->fps[i].offset;
+	  		// If already covered, skip
+	  		if (orig > ofs1) continue;
+			fpp = getFPcontent(pd->fps,&pd->ps,pp->fps[i].fp,packet+ofs1);
+			// A hub only references packets the peer holds
+			if ((fpp != NULL) && (pd->hub != NULL)) {
+				if (hubKnows(pd->hub, &pd->ps, peer, fpp->pktId)) pd->hub->peers[peer].references++;
+				else {
+					pd->hub->filtered++;
+					fpp = NULL;
+				}
+			}
+			// Nor packets the peer may not have received yet, if so asked
+			if ((fpp != NULL) && REFS_CHECKED(pd) && !pktReferable(pd, fpp->pktId)) {
+				pd->compStats.unackedMatches++;
+				fpp = NULL;
+			}
+			// Otherwise, an earlier occurrence in the packet itself
+			if ((fpp == NULL) && extended) {
+				for (j = 0; j < pp->fpNum; j++) {
+					ofs2 = pp->fps[j].offset;
+					if ((ofs2 < ofs1) && (pp->fps[j].fp == pp->fps[i].fp) && sameBytes(packet+ofs2, packet+ofs1, BETA)) break;
+				}
+				if (j < pp->fpNum) {
+					// The string found may overlap this one, the peer copies it byte by byte
+					int liml = (ofs1-orig < ofs2) ? ofs1-orig : ofs2;
+					int deltal = matchBackward(packet+ofs1, packet+ofs2, liml);
+					int deltar = matchForward(packet+ofs1+BETA, packet+ofs2+BETA, pktlen-ofs1-BETA);
+
+					matches[numMatches].ofs = ofs1-deltal;
+					matches[numMatches].len = deltal+BETA+deltar;
+					matches[numMatches].refOfs = ofs2-deltal;
+					matches[numMatches].pktId = currPktId;
+					matches[numMatches].fp = SELF_FP(pp->hash);
+					matches[numMatches].refHash = pp->hash;
+					matches[numMatches].span = 0;
+					numMatches++;
+					orig = ofs1+deltar+BETA;
+					pd->compStats.selfReferences++;
+					continue;
+				}
+			}
 	  		if (fpp != NULL)  {
 	  
-	  			// If already covered, skip
-	  			if (orig > ofs1) {
-	  				continue;
-	  			}
-
 	  			// Contents match, dedup content
 	  			// Explore full matching string
 				PktEntry *storedPacket;
@@ -139,70 +613,48 @@ inline static void cacheAndCompressIfNeeded(pDeduplicator pd, unsigned char *pac
 				ofs2 = fpp->offset;
 
 	  			int liml = (ofs1-orig < ofs2) ? ofs1-orig : ofs2;
-	  			int deltal = 1;
-	  			while ((deltal <= liml) && (packet[ofs1-deltal] == storedPacket->pkt[ofs2-deltal])) deltal++;
-	  			deltal--;
+	  			int deltal = matchBackward(packet+ofs1, storedPacket->pkt+ofs2, liml);
 				assert (deltal >= 0);
 	  			int limr = (pktlen - ofs1 < storedPacket->len - ofs2) ? pktlen - ofs1 - BETA : storedPacket->len - ofs2 - BETA;
-	  			int deltar = 0;
-	  			while ((deltar < limr) && (packet[ofs1+deltar+BETA] == storedPacket->pkt[ofs2+deltar+BETA])) deltar++;
+	  			int deltar = matchForward(packet+ofs1+BETA, storedPacket->pkt+ofs2+BETA, limr);
 				assert (deltar >= 0);
-
-	  
-	  			// Copy uncompressed chunk before matching bytes
 	  			assert (ofs1 >= deltal+orig);
-				if (dest == 0) {
-					hton32((void *) optpkt, computedPacketHash);
-					dest = sizeof(uint32_t) + sizeof(uint16_t);
-					firstoffs = ofs1-deltal-orig;
-				}
-	  			memcpy(optpkt+dest,packet+orig,ofs1-deltal-orig);
-
-	  			hton16(poffsetFPD,ofs1-deltal-orig);
-	  			dest += ofs1-deltal-orig;
 
-	  			poffsetFP = (void *) optpkt+dest;
-	  			hton64(poffsetFP, fpp->fp);
-	  			dest += sizeof(uint64_t);
-	  
-	  			poffsetPktHash = (void *) optpkt+dest;
-	  			hton32(poffsetPktHash, storedPacket->hash);
-	  			dest += sizeof(uint32_t);
-	  
-	  			pliml = (void *) optpkt+dest;
-	  			hton16(pliml,ofs2-deltal);
-	  			dest += sizeof(uint16_t);
-	  
-	  			plimr = (void *) optpkt+dest;
-	  			assert(ofs2+deltar+BETA-1 < MAX_PKT_SIZE());
-	  			hton16(plimr,ofs2+deltar+BETA-1);
-	  			dest += sizeof(uint16_t);
-
-	  			poffsetFPD = (void *) optpkt+dest;
-	  			hton16(poffsetFPD,0xffff);
-	  			orig = ofs1+deltar+BETA;
-	  			dest += sizeof(uint16_t);
-	  			*optlen = dest;
-	  
-				if (pktlen == orig) break;
-	  			else if (orig + BETA > pktlen) {
-	  				memcpy(optpkt+dest,packet+orig,pktlen-orig);
-	  				*optlen += pktlen-orig;
-	  				orig = pktlen;
-	  				break;
-	  			}
-	  
+				matches[numMatches].ofs = ofs1-deltal;
+				matches[numMatches].len = deltal+BETA+deltar;
+				matches[numMatches].refOfs = ofs2-deltal;
+				matches[numMatches].pktId = fpp->pktId;
+				matches[numMatches].fp = fpp->fp;
+				matches[numMatches].refHash = storedPacket->hash;
+				matches[numMatches].span = 0;
+				numMatches++;
+				if (extended) numMatches = extendMatch(pd, peer, format, currPktId, packet, pktlen, orig, matches, numMatches, minLen);
+				orig = matches[numMatches-1].ofs + matches[numMatches-1].len;
 	  		}
 	  	}
-	  
-	  	if (orig < pktlen) {
-	  		memcpy(optpkt+dest,packet+orig,pktlen-orig);
-			*optlen = dest+pktlen-orig;
-	  	} 
 
-		if (*optlen < pktlen) {
-			assert(ntoh16(optpkt+ sizeof(uint32_t)) == firstoffs);
-			assert(ntoh16(optpkt+ sizeof(uint32_t)) < MAX_PKT_SIZE());
+		// The flow goes on where its last match ends, if that is the end of the packet and not the packet itself
+		if (stream != NULL) {
+			if ((numMatches > 0) && (matches[numMatches-1].ofs + matches[numMatches-1].len == pktlen) &&
+					(matches[numMatches-1].pktId != currPktId)) {
+				stream->pktId = matches[numMatches-1].pktId;
+				stream->offset = matches[numMatches-1].refOfs + matches[numMatches-1].len;
+			} else stream->pktId = 0;
+		}
+
+		if (numMatches > 0) {
+			if (format == DEDUP_FORMAT_INDEX) *optlen = writeIndexFormat(pd, optpkt, packet, pktlen, pp->hash, currPktId, matches, numMatches);
+			else *optlen = writeFPFormat(optpkt, packet, pktlen, pp->hash, matches, numMatches);
+		}
+
+		// A delta against the most similar packet, if shorter
+		if (similarPacket != NULL) {
+			int deltaLen = writeDeltaFormat(pd->resemblance->delta, *optlen, packet, pktlen, pp->hash, similarPacket);
+			if (deltaLen < *optlen) {
+				memcpy(optpkt, pd->resemblance->delta, deltaLen);
+				*optlen = deltaLen;
+				pd->compStats.deltaPackets++;
+			}
 		}
 	  
 	  	if (debugword & DEDUP_MASK) {
@@ -212,33 +664,279 @@ inline static void cacheAndCompressIfNeeded(pDeduplicator pd, unsigned char *pac
 	  	}
 	}
 
-	for (i=fpNum-1; i >=0; i--) {
-		putFP(pd->fps, &pd->ps, pktFps[i].fp, currPktId, pktFps[i].offset, &pd->compStats);
+	for (i=pp->fpNum-1; i >=0; i--) {
+		putFP(pd->fps, &pd->ps, pp->fps[i].fp, currPktId, pp->fps[i].offset, &pd->compStats);
 		if (debugword & DEDUP_MASK) {
-			sprintf(message,"[DEDUP] storing (empty) FP %" PRIx64 " for hash %x\n",pktFps[i].fp,computedPacketHash);
+			sprintf(message,"[DEDUP] storing (empty) FP %" PRIx64 " for hash %x\n",pp->fps[i].fp,pp->hash);
 			logger(LOG_INFO, message);
 		}
 	}
+	putFP(pd->fps, &pd->ps, PKT_FP(pp->hash, pktlen), currPktId, 0, &pd->compStats);
+	if (pd->resemblance != NULL) putResemblance(pd->resemblance, pp->sfs, currPktId);
 	pd->compStats.lastPktId = currPktId;
-	if (compress) {
+	if (optlen != NULL) {
 		pd->compStats.outputBytes += *optlen;
 		if (*optlen < pktlen) pd->compStats.compressedPackets++;
 		assert (*optlen <= MAX_PKT_SIZE());
-		assert (orig <= MAX_PKT_SIZE());
 	}
-	pthread_mutex_unlock(&pd->cerrojo);
+	return peerPktId(pd, currPktId);
+}
+
+inline static void cacheAndCompressIfNeeded(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen, unsigned int compress, int format) {
+
+	PktPrint pp;
+
+	// Calculate FPs and packet hash
+	// These functions may be placed outside locks, as they don't involve access to any shared state	
+	printPacket(pd, packet, pktlen, &pp);
+	DEDUP_LOCK(pd);
+	STATS_BEGIN(pd->compSeq);
+	cacheAndCompress(pd, peer, partition, packet, pktlen, &pp, optpkt, optlen, compress, format, NULL);
+	STATS_END(pd->compSeq);
+	DEDUP_UNLOCK(pd);
+}
+
+// Lookahead of a batch packet (see DictProbe): its whole packet FP, the stored packet its flow goes on with and its FPs.
+// A packet not fingerprinted yet is probably a repeat: only its whole packet FP is probed.
+static void startBatchProbe(DedupBatchEntry *entry, PktPrint *pp, DictProbe *probe) {
+	unsigned int i;
+
+	probe->stage = 0;
+	probe->num = 0;
+	if (entry->pktlen < BETA) {
+		probe->stage = PROBE_DONE;
+		return;
+	}
+	if ((entry->optpkt != NULL) && (entry->format & DEDUP_EXTENDED)) addProbeRef(probe, PKT_FP(pp->hash, entry->pktlen), 0, 0);
+	if ((entry->format & DEDUP_EXTENDED) && (entry->stream != NULL) && (entry->stream->pktId != 0))
+		addProbeRef(probe, 0, entry->stream->pktId, entry->stream->offset);
+	for (i = 0; i < pp->fpNum; i++) addProbeRef(probe, pp->fps[i].fp, 0, 0);
+}
 
+// UNSAFE FUNCTION, must be called inside code with locks
+// Next lookahead step of a batch packet. Once a packet not fingerprinted is found not to be a repeat, it is
+// fingerprinted and its FPs are probed. A repeat is looked up again once its turn comes, so a wrong guess costs
+// no compression.
+static int stepBatchProbe(pDeduplicator pd, DedupBatchEntry *entry, PktPrint *pp, DictProbe *probe) {
+	if (advanceProbe(pd->fps, &pd->ps, probe) < PROBE_DONE) return 0;
+	if (pp->fingerprinted || (entry->pktlen < BETA)) return 1;
+	if ((entry->optpkt != NULL) && (entry->format & DEDUP_EXTENDED) &&
+			(getFPhash(pd->fps, &pd->ps, PKT_FP(pp->hash, entry->pktlen), pp->hash) != NULL)) return 1;
+	fingerprintPacket(pd, entry->packet, entry->pktlen, pp);
+	startBatchProbe(entry, pp, probe);
+	return 0;
+}
+
+// Fingerprint helpers (see newFingerprintHelpers). The packets of a batch are taken one at a time by whichever
+// thread is free, the caller included; job tells the helpers a new batch is waiting.
+struct FPHelpers {
+	unsigned int num;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	uint64_t job;
+	pDeduplicator pd;
+	DedupBatchEntry *batch;
+	PktPrint *prints;
+	unsigned int n;
+	unsigned int next;	// Next packet to fingerprint
+	unsigned int left;	// Packets not fingerprinted yet
+};
+
+// Must be called with the helpers lock held, which is held again on return
+static void fingerprintBatchPackets(FPHelpers *h) {
+	unsigned int i;
+
+	while (h->next < h->n) {
+		i = h->next++;
+		pthread_mutex_unlock(&h->lock);
+		printPacket(h->pd, h->batch[i].packet, h->batch[i].pktlen, &h->prints[i]);
+		if (h->batch[i].pktlen >= BETA) fingerprintPacket(h->pd, h->batch[i].packet, h->batch[i].pktlen, &h->prints[i]);
+		pthread_mutex_lock(&h->lock);
+		if (--h->left == 0) pthread_cond_signal(&h->done);
+	}
+}
+
+static void *fingerprintHelper(void *arg) {
+	FPHelpers *h = arg;
+	uint64_t job = 0;
+
+	pthread_mutex_lock(&h->lock);
+	for (;;) {
+		while (h->job == job) pthread_cond_wait(&h->work, &h->lock);
+		job = h->job;
+		fingerprintBatchPackets(h);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+
+FPHelpers *newFingerprintHelpers(unsigned int num) {
+
+	FPHelpers *h;
+	pthread_t t;
+	pthread_attr_t attr;
+	unsigned int i;
+
+	if ((num == 0) || (num > MAX_FP_HELPERS)) return NULL;
+	h = calloc(1, sizeof(FPHelpers));
+	if (h == NULL) {
+		printf("Unable to allocate memory");
+		abort();
+	}
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->work, NULL);
+	pthread_cond_init(&h->done, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < num; i++) {
+		if (pthread_create(&t, &attr, fingerprintHelper, h) != 0) break;
+		h->num++;
+	}
+	pthread_attr_destroy(&attr);
+	// A pool with fewer helpers than asked for is still used
+	if (h->num == 0) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+int setFingerprintHelpers(pDeduplicator pd, FPHelpers *helpers) {
+	if ((helpers == NULL) || (pd->helpers != NULL)) return -1;
+	pd->helpers = helpers;
+	return 0;
+}
+
+// Hashes and FPs of the packets of a batch, calculated along with the helpers for large batches.
+// Packets are then fingerprinted in advance, even if they may be repeats (see stepBatchProbe).
+static void printBatch(pDeduplicator pd, DedupBatchEntry *batch, PktPrint *prints, unsigned int n) {
+	FPHelpers *h = pd->helpers;
+	unsigned int i;
+
+	if ((h == NULL) || (n < FP_HELPERS_MIN_BATCH)) {
+		for (i = 0; i < n; i++) printPacket(pd, batch[i].packet, batch[i].pktlen, &prints[i]);
+		return;
+	}
+	pthread_mutex_lock(&h->lock);
+	h->pd = pd;
+	h->batch = batch;
+	h->prints = prints;
+	h->n = n;
+	h->next = 0;
+	h->left = n;
+	h->job++;
+	pthread_cond_broadcast(&h->work);
+	fingerprintBatchPackets(h);
+	while (h->left > 0) pthread_cond_wait(&h->done, &h->lock);
+	pthread_mutex_unlock(&h->lock);
+}
+
+// Packets are in flight as state machines: each round every packet in the window advances its lookahead one
+// level, so the misses of up to DEDUP_WINDOW packets overlap. They are still compressed and stored in order,
+// the oldest one as soon as its lookahead is done, so a packet may reference any previous one.
+void dedup_batch(pDeduplicator pd, DedupBatchEntry *batch, unsigned int num) {
+
+	PktPrint prints[MAX_DEDUP_BATCH];
+	DictProbe probes[DEDUP_WINDOW];
+	int ready[MAX_DEDUP_BATCH];
+	unsigned int i, n, done, next, committed;
+
+	for (done = 0; done < num; done += n) {
+		n = (num - done < MAX_DEDUP_BATCH) ? num - done : MAX_DEDUP_BATCH;
+		printBatch(pd, &batch[done], prints, n);
+
+		DEDUP_LOCK(pd);
+		STATS_BEGIN(pd->compSeq);
+		for (next = 0, committed = 0; committed < n; ) {
+			while ((next < n) && (next < committed + DEDUP_WINDOW)) {
+				startBatchProbe(&batch[done+next], &prints[next], &probes[next % DEDUP_WINDOW]);
+				ready[next] = 0;
+				next++;
+			}
+			for (i = committed; i < next; i++) {
+				if (!ready[i]) ready[i] = stepBatchProbe(pd, &batch[done+i], &prints[i], &probes[i % DEDUP_WINDOW]);
+			}
+			for (; (committed < next) && ready[committed]; committed++) {
+				i = committed;
+				batch[done+i].pktId = cacheAndCompress(pd, batch[done+i].peer, batch[done+i].partition, batch[done+i].packet, batch[done+i].pktlen, &prints[i],
+						batch[done+i].optpkt, (batch[done+i].optpkt != NULL) ? &batch[done+i].optlen : NULL,
+						batch[done+i].optpkt != NULL, batch[done+i].format, batch[done+i].stream);
+				batch[done+i].epoch = pd->epoch;
+			}
+		}
+		STATS_END(pd->compSeq);
+		DEDUP_UNLOCK(pd);
+	}
 }
 
 // dedup takes an incoming packet (packet, pktlen), processes it and, if some compression is possible,
 // outputs the compressed packet (optpkt -- must be allocated by the caller, optlen). If no compression is possible, 
 // optlen is the same as pktlen
-void dedup(pDeduplicator pd, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen) {
-	cacheAndCompressIfNeeded(pd, packet, pktlen, optpkt, optlen, 1);
+void dedup(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen) {
+	cacheAndCompressIfNeeded(pd, HUB_NO_PEER, partition, packet, pktlen, optpkt, optlen, 1, DEDUP_FORMAT_FP);
+}
+
+void dedupToPeer(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen) {
+	cacheAndCompressIfNeeded(pd, peer, partition, packet, pktlen, optpkt, optlen, 1, DEDUP_FORMAT_FP);
+}
+
+void dedupIndexed(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen) {
+	cacheAndCompressIfNeeded(pd, HUB_NO_PEER, partition, packet, pktlen, optpkt, optlen, 1, DEDUP_FORMAT_INDEX);
+}
+
+void dedupIndexedToPeer(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen) {
+	cacheAndCompressIfNeeded(pd, peer, partition, packet, pktlen, optpkt, optlen, 1, DEDUP_FORMAT_INDEX);
 }
 
-void put_in_cache(pDeduplicator pd, unsigned char *packet, uint16_t pktlen) {
-	cacheAndCompressIfNeeded(pd, packet, pktlen, NULL, NULL, 0);
+void dedupDelta(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen) {
+	cacheAndCompressIfNeeded(pd, HUB_NO_PEER, partition, packet, pktlen, optpkt, optlen, 1, DEDUP_FORMAT_DELTA);
+}
+
+void put_in_cache(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen) {
+	cacheAndCompressIfNeeded(pd, HUB_NO_PEER, partition, packet, pktlen, NULL, NULL, 0, DEDUP_FORMAT_FP);
+}
+
+void put_in_cache_to_peer(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen) {
+	cacheAndCompressIfNeeded(pd, peer, partition, packet, pktlen, NULL, NULL, 0, DEDUP_FORMAT_FP);
+}
+
+// The references are checked as the peer solves them (see uncomp and uncompIndexed). A dictionary switch to a new
+// epoch moves the stored packets, so a packet compressed before it is not sent again.
+int checkResend(pDeduplicator pd, unsigned char *optpkt, uint16_t optlen, int format, uint8_t epoch) {
+
+	RefCursor c;
+	uint64_t fp;
+	uint32_t hash;
+	int64_t pktId;
+	uint16_t offset;
+	PktEntry *storedPkt;
+	FPEntryB *fpe;
+	int ok, n;
+
+	DEDUP_LOCK(pd);
+	ok = (pd->hub == NULL) && (epoch == pd->epoch);
+	format &= ~DEDUP_EXTENDED;
+	if (ok) firstReference(&c, optpkt, optlen, (format == DEDUP_FORMAT_INDEX) ? DEDUP_FORMAT_INDEX : DEDUP_FORMAT_FP);
+	while (ok && ((n = nextReference(&c, &fp, &hash, &pktId, &offset)) != 0)) {
+		if (n < 0) ok = 0;
+		else if (fp == 0) {
+			storedPkt = getPkt(&pd->ps, pktId);
+			ok = (storedPkt != NULL) && (storedPkt->pktId == pktId) && !storedPkt->refused;
+		} else {
+			fpe = getFPhash(pd->fps, &pd->ps, fp, hash);
+			storedPkt = (fpe != NULL) ? getPkt(&pd->ps, fpe->pktId) : getPktHash(&pd->ps, hash);
+			ok = (storedPkt != NULL) && (getPkt(&pd->ps, storedPkt->pktId) == storedPkt) && !storedPkt->refused;
+		}
+	}
+	if (ok) {
+		STATS_BEGIN(pd->compSeq);
+		pd->compStats.resentPackets++;
+		STATS_END(pd->compSeq);
+	}
+	DEDUP_UNLOCK(pd);
+	return ok;
 }
 
 
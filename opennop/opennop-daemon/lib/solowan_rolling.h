@@ -119,7 +119,15 @@ typedef struct {
 // Type definition for the fingerprint store
 // The host machine should have enough RAM
 // AND SWAP SHOULD BE DISABLED 
-typedef FPEntry *FPStore;
+// size is a power of 2. While an online resize is in progress (see requestResize), old holds the
+// previous table: its buckets below migrated have already been moved to this one, the rest are still looked up there.
+typedef struct FPTable {
+	FPEntry *fpes;
+	unsigned int size;
+	struct FPTable *old;
+	unsigned int migrated;
+} FPTable;
+typedef FPTable *FPStore;
 
 // Type definition for a data packet
 typedef unsigned char *Pkt;
@@ -130,15 +138,55 @@ typedef struct {
 	Pkt pkt;
 	// Actual packet length
         uint16_t len;
+	// Set once the peer acknowledged the packet (see setAckedReferences)
+	uint8_t acked;
+	// Set once the peer could not find the packet (see refuseReference)
+	uint8_t refused;
 	// Packet hash
         uint32_t hash;
+	// pktId of the packet held, checked by partitioned stores and index-addressed lookups (see uncompIndexed)
+	int64_t pktId;
 } PktEntry;
 
+// Partitioned packet store (see setPartitions)
+// Slots are shared by all partitions, each partition keeps its packets in FIFO order.
+// A partition under its quota takes a free slot or, if there is none, evicts the oldest packet of the
+// partition most over its quota. A partition at its quota evicts its own oldest packet.
+// Without borrowing a partition never goes over its quota.
+// Eviction only depends on the sequence of stored packets, so two peers storing the same packets evict the same ones.
+#define MAX_PARTITIONS 16
+typedef struct {
+	unsigned int num;
+	int borrow;
+	unsigned int quota[MAX_PARTITIONS];
+	// Statistics, written by the owner between STATS_BEGIN(seq) and STATS_END(seq) (see getPartitionStats)
+	uint32_t seq;
+	unsigned int used[MAX_PARTITIONS];
+	uint64_t evictions[MAX_PARTITIONS];
+	int head[MAX_PARTITIONS];	// Oldest slot
+	int tail[MAX_PARTITIONS];	// Newest slot
+	int *next;			// Next (newer) slot in the same partition, or in the free list
+	int freeHead;
+} PktPartitions;
+
 
 // Packet store
-typedef struct {
+// A unified dictionary (see newUnifiedDeduplicator) keeps two lanes: the local one holds the packets
+// sent by this side and the peer one the packets received from the other side.
+// Each lane is a FIFO of its own, so the local lane here evicts exactly like the peer lane at the other end.
+// Peer lane packets are given negative pktIds, so the same FPStore can index both lanes.
+// While an online resize is in progress, old holds the previous store: its packets from migrated on have not
+// been moved here yet. minPktId is the lowest pktId this store may hold.
+// In a partitioned store (parts not NULL) pktIds are not consecutive: pktId % size is the slot holding the packet.
+typedef struct PktStore {
 	PktEntry *pkts;
 	int64_t pktId;
+	unsigned int size;
+	struct PktStore *peer;
+	int64_t minPktId;
+	struct PktStore *old;
+	int64_t migrated;
+	PktPartitions *parts;
 } PktStore;
 
 typedef struct {
@@ -161,6 +209,16 @@ typedef struct {
 	uint64_t errorsMissingPacket;
 	uint64_t errorsPacketFormat;
 	uint64_t errorsPacketHash;
+	uint64_t packetReferences;	// Whole packet references sent (compressor) or solved (decompressor)
+	uint64_t predictedMatches;	// Matches found by continuation (see DedupStream)
+	uint64_t extendedBytes;		// Bytes matched in stored packets adjacent to the one a FP was found in
+	uint64_t deltaPackets;		// Packets sent (compressor) or solved (decompressor) as a delta (see dedupDelta)
+	uint64_t selfReferences;	// Self references sent (compressor) or solved (decompressor)
+	uint64_t resentPackets;		// Retransmissions sent (compressor) or uncompressed (decompressor) as first compressed
+	uint64_t unackedMatches;	// Matches not used because the peer has not acknowledged the packet (see setAckedReferences) or refused it
+	uint64_t refusedPackets;	// Packets the peer could not find, no longer referenced (see refuseReference)
+	uint64_t reorderedPackets;	// Packets stored with the pktId given by the peer after a later one (decompressor)
+	uint64_t aheadPackets;		// Packets not stored, their pktId given by the peer too far ahead (see PKT_AHEAD, decompressor)
 } Statistics;
 
 
@@ -168,6 +226,11 @@ typedef struct {
 #define MAX_ITER 4
 unsigned int calculateRelevantFPs(FPEntryB *pktFps, unsigned char *packet, uint16_t pktlen);
 
+// Resemblance (see dedupDelta): RESEMBLANCE_SF super fingerprints of a packet, each the minimum of a different hash of
+// the 8 byte strings sampled from it. Two packets share each one with a probability close to their resemblance.
+#define RESEMBLANCE_SF 4
+void calculateSuperFPs(uint32_t *sfs, unsigned char *packet, uint16_t pktlen);
+
 // Read and write bytes from/to network
 void hton16(unsigned char *p, uint16_t n) ;
 void hton32(unsigned char *p, uint32_t n) ;
@@ -175,6 +238,11 @@ void hton64(unsigned char *p, uint64_t n) ;
 uint16_t ntoh16(unsigned char *p) ;
 uint32_t ntoh32(unsigned char *p) ;
 uint64_t ntoh64(unsigned char *p) ;
+// Variable length integers (LEB128, 7 bits per byte, least significant first)
+// putVarint returns the bytes written (at most MAX_VARINT_LEN), getVarint the bytes read or 0 if truncated or too long
+#define MAX_VARINT_LEN 10
+int putVarint(unsigned char *p, uint64_t n) ;
+int getVarint(unsigned char *p, unsigned int avail, uint64_t *n) ;
 
 
 inline unsigned int MAX_PKT_SIZE(void);
@@ -188,35 +256,343 @@ inline unsigned int FPS_FACTOR(void);
 // Dictionary (PacketStore and FPStore) API
 // UNSAFE FUNCTIONS, must be called inside code with locks
 
+inline uint32_t hashFPStore(FPStore fpStore, uint64_t fp);
 inline FPEntryB *getFPhash(FPStore fpStore, PktStore *pktStore, uint64_t fp, uint32_t pktHash);
 inline FPEntryB *getFPcontent(FPStore fpStore, PktStore *pktStore, uint64_t fp, unsigned char *chunk);
 inline PktEntry *getPkt(PktStore *pktStore, int64_t pktId);
 inline PktEntry *getPktHash(PktStore *pktStore, uint32_t pktHash);
-inline int64_t putPkt(PktStore *pktStore, unsigned char *pkt, uint16_t pktlen, uint32_t pktHash);
+inline int64_t putPkt(PktStore *pktStore, unsigned int partition, unsigned char *pkt, uint16_t pktlen, uint32_t pktHash);
+int64_t putPktAt(PktStore *pktStore, int64_t pktId, unsigned char *pkt, uint16_t pktlen, uint32_t pktHash);
+// A pktId given by the peer a whole store or more ahead of the last one stored is not taken: it would move the store
+// past every packet held, and a wrong one would leave it ahead of the peer
+#define PKT_AHEAD(pktStore, pktId) ((pktId) - (pktStore)->pktId >= (int64_t) (pktStore)->size)
 inline void putFP(FPStore fpStore, PktStore *pktStore, uint64_t fp, int64_t pktId, uint16_t offset, Statistics *st);
 
+// Staged dictionary lookahead (AMAC). The FPStore bucket, its entries, the PktStore entry and the packet bytes are
+// dependent misses: each advanceProbe call prefetches one level for every reference of a probe and returns, so the
+// caller runs the probes of several packets round robin and their misses overlap. A probe only reads the dictionary
+// and its results are hints: the dictionary may change before the packet is processed.
+// A reference is a FP (pktId and offset found in its bucket) or, if fp is 0, a pktId and offset already known.
+#define PROBE_REFS (MAX_FP_PER_PKT + 2)
+#define PROBE_DONE 4
+typedef struct {
+	int stage;
+	unsigned int num;
+	uint64_t fp[PROBE_REFS];
+	int64_t pktId[PROBE_REFS];
+	uint16_t offset[PROBE_REFS];
+} DictProbe;
+PktEntry *getPktSlot(PktStore *pktStore, int64_t pktId);
+void addProbeRef(DictProbe *probe, uint64_t fp, int64_t pktId, uint16_t offset);
+int advanceProbe(FPStore fpStore, PktStore *pktStore, DictProbe *probe);
+
 // Common API functions 
 
 // Statistics handling
 // Deduplicator object definition
 // It can hold state for both compresion and decompression
+// compStats is updated by dedup() and put_in_cache(), decompStats by uncomp() and update_caches()
+// Dictionary maintenance statistics (see startMaintenance)
+typedef struct {
+	uint64_t sweptBuckets;		// FPStore buckets swept
+	uint64_t reclaimedEntries;	// Stale FP entries emptied
+	uint64_t completedSweeps;	// Full passes over the FPStore
+	uint64_t sweepRate;		// Buckets per second in the last full pass
+	uint64_t liveEntries;		// FP entries pointing to stored packets in the last full pass
+	uint64_t fpEntries;		// Total FP entries (buckets * PKTS_PER_FP)
+} MaintenanceStats;
+
+// Hub mode (see setHub)
+// One dictionary compresses the traffic sent to many peers. A packet may only be referenced when compressing for a peer
+// if it was sent to that peer and is still in its dictionary, that is, among the last window packets sent to it.
+// Each peer stores the packets sent to it with consecutive pktIds of its own, which the hub keeps for each slot and
+// references them by (DEDUP_FORMAT_INDEX), so no reference depends on the FPs the smaller FPStore of the peer dropped.
+#define MAX_HUB_PEERS 256
+#define HUB_NO_PEER (-1)
+typedef struct {
+	int64_t *sent;			// pktIds of the last window packets sent to the peer (ring)
+	unsigned int window;		// Packets in the peer dictionary, 0 if the peer is not set
+	uint64_t count;			// Packets sent to the peer
+	// Statistics, written by the owner between STATS_BEGIN(pd->compSeq) and STATS_END(pd->compSeq)
+	uint64_t known;			// Packets the peer still holds (slots with its known bit set)
+	uint64_t references;		// References to packets known by the peer
+} HubPeer;
+typedef struct {
+	unsigned int maxPeers;
+	unsigned int words;		// 32 bit words of the peer bitset of each slot
+	uint32_t *known;		// Peers holding the packet in each slot of the packet store
+	int64_t *peerPktIds;		// pktId of the packet in each slot at the peer it was sent to (see hubSent)
+	HubPeer *peers;
+	uint64_t filtered;		// Matches not used because the peer does not hold the packet
+} HubState;
+
+// Resemblance index (see setResemblance): super fingerprints of the stored packets, direct mapped.
+// Entries are not removed, the packet of an entry may have been evicted or replaced.
+typedef struct {
+	uint32_t sf;
+	int64_t pktId;
+} ResemblanceEntry;
 typedef struct {
+	ResemblanceEntry *entries;
+	unsigned int size;		// Power of 2
+	unsigned char *delta;		// Scratch buffer for a delta, MAX_PKT_SIZE() bytes
+} ResemblanceIndex;
+
+// Online resize states
+#define DICT_STABLE	0
+#define DICT_ALLOCATING	1	// New stores being allocated in background
+#define DICT_PENDING	2	// New stores ready, switched to at the next packet
+#define DICT_MIGRATING	3	// Contents being moved from the previous stores
+
+typedef struct {
+	uint8_t epoch;
+	int state;
+	unsigned int pktStoreSize;
+	unsigned int fpStoreSize;
+	uint64_t pktsMigrated;
+	uint64_t pktsToMigrate;
+	unsigned int bucketsMigrated;
+	unsigned int bucketsToMigrate;
+	int announce;		// Peer should be told the current epoch
+} ResizeStatus;
+
+// Statistics and status are written by a single thread and read by others with no lock: the writer makes the
+// sequence number odd while updating them, readers retry if it was odd or has changed.
+#define STATS_BEGIN(seq) do { __atomic_store_n(&(seq), (seq) + 1, __ATOMIC_RELAXED); __atomic_thread_fence(__ATOMIC_RELEASE); } while (0)
+#define STATS_END(seq) __atomic_store_n(&(seq), (seq) + 1, __ATOMIC_RELEASE)
+
+// A dictionary is owned by one thread, which takes no lock, unless locked is set (see Deduplicator)
+#define DEDUP_LOCK(pd) do { if ((pd)->locked) pthread_mutex_lock(&(pd)->cerrojo); } while (0)
+#define DEDUP_UNLOCK(pd) do { if ((pd)->locked) pthread_mutex_unlock(&(pd)->cerrojo); } while (0)
+
+typedef struct {
+  // Set if more than one thread uses the dictionary (unified and shared memory dictionaries), which is then
+  // protected by cerrojo. Otherwise only the owner thread calls dedup/put_in_cache or uncomp/update_caches.
+  int locked;
   pthread_mutex_t cerrojo;
+  pthread_mutex_t statsLock;	// Serializes statistics readers, never taken by the owner
+  // Each set of statistics has its own cache line, written by the compressor and decompressor threads
+  uint32_t compSeq __attribute__((aligned(64)));
   Statistics compStats;
+  uint32_t decompSeq __attribute__((aligned(64)));
+  Statistics decompStats;
+  // Maintenance and resize status, written with the dictionary locked if locked, by the owner otherwise
+  uint32_t statusSeq __attribute__((aligned(64)));
+  MaintenanceStats maintStats;
+  ResizeStatus resizeStatus;
+  // Values at the last reset, subtracted by readers
+  Statistics compBase __attribute__((aligned(64)));
+  Statistics decompBase;
   FPStore fps;
   PktStore ps;
+  // Maintenance task state (see startMaintenance)
+  unsigned int sweepCursor;
+  uint64_t sweepPassLive;
+  uint64_t sweepPassStart;
+  unsigned int sweepBuckets;	// Swept by the owner if not locked, 0 if no maintenance or done by a thread
+  uint64_t sweepInterval;	// usec
+  uint64_t sweepNext;
+  unsigned int sweepTick;
+  // Online resize state (see requestResize)
+  uint8_t epoch;
+  int resizeState;
+  unsigned int fpsPerStep;
+  uint64_t pktsSinceResize;
+  PktStore *pendingPs;
+  FPStore pendingFps;
+  int pendingEpoch;		// Epoch of the peer the pending stores are for, -1 if resized by requestResize
+  int peerEpoch;		// Last epoch of the peer handled by applyResize, -1 if none
+  // Shared memory segment holding the dictionary, NULL if private (see newSharedDeduplicator)
+  struct ShmDictHeader *shm;
+  // Hub mode state, NULL if not a hub (see setHub)
+  HubState *hub;
+  // Set if the FPStore is not kept (see newIndexDeduplicatorOfSize)
+  int indexed;
+  // Resemblance index, NULL if packets are not delta encoded (see setResemblance)
+  ResemblanceIndex *resemblance;
+  // Threads fingerprinting batches along with the owner, NULL if none (see setFingerprintHelpers)
+  struct FPHelpers *helpers;
+  // Set if only packets acknowledged by the peer are referenced (see setAckedReferences)
+  int ackedRefs;
+  // Set once the peer refused a packet (see refuseReference)
+  int refusedRefs;
 } Deduplicator, *pDeduplicator;
 
 void getStatistics(pDeduplicator pd, Statistics *cs);
 void resetStatistics(pDeduplicator pd);
+void getDecompStatistics(pDeduplicator pd, Statistics *ds);
+void resetDecompStatistics(pDeduplicator pd);
 
 // Common initialization function
 extern void init_common(unsigned int pktStoreSize, unsigned int pktSize, unsigned int maxFpPerPkt, unsigned int fpsFactor);
 
 // Deduplicator object creation
 extern pDeduplicator newDeduplicator(void);
+// Same, with a packet store of pktStoreSize packets instead of the configured one
+extern pDeduplicator newDeduplicatorOfSize(unsigned int pktStoreSize);
+// Unified Deduplicator object creation: one dictionary fed by both the compressor and the decompressor
+// of a worker, so content received from the peer can be used to compress data sent back to it.
+// Each lane is half the configured packet store, the FPStore is shared.
+extern pDeduplicator newUnifiedDeduplicator(void);
+extern pDeduplicator newUnifiedDeduplicatorOfSize(unsigned int pktStoreSize);
+// Decompressor for index-addressed packets only (see uncompIndexed): no FPs are calculated nor stored for
+// received packets. Packets in the original format are still uncompressed, found by their packet hash.
+extern pDeduplicator newIndexDeduplicatorOfSize(unsigned int pktStoreSize);
+// Same as the *OfSize functions, but NULL is returned instead of aborting if there is not enough memory
+extern pDeduplicator tryNewDeduplicatorOfSize(unsigned int pktStoreSize);
+extern pDeduplicator tryNewUnifiedDeduplicatorOfSize(unsigned int pktStoreSize);
+extern pDeduplicator tryNewIndexDeduplicatorOfSize(unsigned int pktStoreSize);
+// Frees a dictionary just created, not set up nor used yet. A shared one is left to be taken over.
+extern void freeDeduplicator(pDeduplicator pd);
+
+// Shared memory dictionaries, for restarts without losing the dictionary contents
+// The whole dictionary (Deduplicator, stores and lock) lives in the segment /dev/shm/<name>, with a versioned layout.
+// If the segment holds a dictionary of the same version and sizes, it is taken over: if the process using it is still
+// running, it is sent SIGTERM and must call releaseSharedDeduplicator before exiting. Otherwise a new dictionary is created.
+// size is the number of packets of the packet store (split between both lanes if unified).
+// *attached is set if the previous contents are kept. Returns NULL if the segment cannot be used.
+// Shared dictionaries cannot be resized (requestResize, applyResize) nor partitioned.
+extern pDeduplicator newSharedDeduplicator(const char *name, unsigned int size, int unified, int *attached);
+// Waits for the operation in progress and leaves the dictionary ready to be taken over. The dictionary cannot be used
+// any more by this process, which should exit. Does nothing with private dictionaries.
+extern void releaseSharedDeduplicator(pDeduplicator pd);
+
+// Hub mode
+// Turns a new compressor dictionary into a hub one for up to maxPeers peers (at most MAX_HUB_PEERS).
+// Packets are compressed with dedupToPeer and cached with put_in_cache_to_peer, peers are numbered from 0.
+// Only split, not partitioned dictionaries may be hubs; they cannot be resized nor shared. Returns 0 if done.
+extern int setHub(pDeduplicator pd, unsigned int maxPeers);
+// Sets the packets held by the dictionary of a peer. Must be called before any packet is sent to it.
+// Returns 0 if done, -1 if there is not enough memory.
+extern int setHubPeer(pDeduplicator pd, unsigned int peer, unsigned int window);
+// Returns the packets sent to the peer that it still holds, and the references to them
+extern unsigned int getHubPeerStats(pDeduplicator pd, unsigned int peer, uint64_t *references);
+int hubKnows(HubState *hub, PktStore *pktStore, int peer, int64_t pktId);
+void hubSent(HubState *hub, PktStore *pktStore, int peer, int64_t pktId);
+// pktId a packet known by a peer (see hubKnows) has at that peer
+int64_t hubPeerPktId(HubState *hub, PktStore *pktStore, int64_t pktId);
+
+// Delta encoding
+// Keeps the super fingerprints of the packets stored by a new compressor dictionary, so dedupDelta finds the most similar
+// stored packet. Not available for shared dictionaries. Returns 0 if done.
+extern int setResemblance(pDeduplicator pd);
+
+// Acknowledged and refused references
+// A packet lost on its way to the peer, or still on its way, is not in the peer dictionary yet, and the packets
+// referencing it cannot be uncompressed. With acked set, a compressor dictionary only references the packets the peer
+// acknowledged (see ackPackets), and those received from it (peer lane of a unified dictionary). Not available for
+// hub dictionaries, which already reference only the packets sent to each peer. Returns 0 if done.
+extern int setAckedReferences(pDeduplicator pd, int acked);
+// The peer holds the packets first to last, consecutive pktIds given by dedup_batch (see DedupBatchEntry)
+extern void ackPackets(pDeduplicator pd, int64_t first, int64_t last);
+// The peer could not uncompress a packet because it does not hold the one referenced by ref: a pktId (DEDUP_FORMAT_INDEX)
+// or a FP and the hash of the packet it belongs to (DEDUP_FORMAT_FP), as given by uncomp in UncompReturnStatus.
+// That packet is no longer referenced. Returns 1 if it was found. Unless packet is NULL, its data is copied to packet,
+// of *pktlen bytes, so the peer can be sent it, and *pktlen set to its length, 0 if it does not fit.
+// Not available for hub dictionaries.
+extern int refuseReference(pDeduplicator pd, int format, uint64_t ref, uint32_t hash, unsigned char *packet, uint16_t *pktlen);
+// References are checked with pktReferable only if set
+#define REFS_CHECKED(pd) ((pd)->ackedRefs || (pd)->refusedRefs)
+int pktReferable(pDeduplicator pd, int64_t pktId);
+
+// Dictionary flush
+// The peer restarted with an empty dictionary: no packet stored so far is referenced or found again, by pktId, FP or
+// packet hash. Compressor pktIds go on from the last one, so those the caller still holds (see ackPackets) never name
+// a new packet; an indexed decompressor (see newIndexDeduplicatorOfSize) takes them from 1 again, as the new dictionary
+// of the peer gives them. Both lanes of a unified dictionary are flushed. Returns 0 if done, -1 if a resize is in
+// progress (to be tried again later).
+extern int flushDictionary(pDeduplicator pd);
+// Same for one peer of a hub dictionary: only the packets it knew are no longer referenced when sending to it
+extern void resetHubPeer(pDeduplicator pd, unsigned int peer);
+
+// Dictionary maintenance
+// Sweeps numBuckets buckets of the FPStore every intervalMs milliseconds, emptying stale entries (those pointing
+// to packets no longer in the packet store). Returns 0 if started.
+// Locked dictionaries are swept by a new thread; otherwise the owner sweeps while processing packets (see maintenanceStep).
+extern int startMaintenance(pDeduplicator pd, unsigned int numBuckets, unsigned int intervalMs);
+extern void getMaintenanceStats(pDeduplicator pd, MaintenanceStats *ms);
+// UNSAFE FUNCTION, must be called inside code with locks. Called once per stored packet.
+extern void maintenanceStep(pDeduplicator pd);
+
+// Dictionary partitioning
+// Must be called before any packet is processed, with the same values in both peers.
+// quotaPercent holds the share of the packet store of each partition, partition 0 gets whatever is not assigned.
+// Both lanes of a unified dictionary are partitioned.
+extern void setPartitions(pDeduplicator pd, unsigned int num, unsigned int *quotaPercent, int borrow);
+// Returns the number of partitions (0 if not partitioned) and fills quota, used and evictions of the local lane,
+// or of the peer lane of a unified dictionary if peerLane is set
+extern unsigned int getPartitionStats(pDeduplicator pd, int peerLane, unsigned int *quota, unsigned int *used, uint64_t *evictions);
+
+// Online dictionary resize
+// The compressor side calls requestResize: the new stores are allocated in background and switched to at the next
+// dedup() or put_in_cache() call, which increments the dictionary epoch. The peer must be told the new epoch and sizes
+// (the daemon uses a TCP option on every packet while the epoch is not 0) and call applyResize, which allocates
+// in background too and switches at the next stored packet once done. Packets of the new epoch handled before
+// are looked up in the previous stores, so a few of them may not be decoded.
+// In both sides the previous contents are moved to the new stores a few entries per packet, so both stay equal.
+// Unified and partitioned dictionaries cannot be resized.
+#define RESIZE_PKTS_PER_STEP 4
+
+// Returns 0 if the resize was started, -1 if not possible (already resizing, unified or partitioned dictionary)
+extern int requestResize(pDeduplicator pd, unsigned int pktStoreSize, unsigned int fpsFactor);
+// Switches to stores of the given size for a new epoch of the peer. Sizes over maxPktStoreSize packets are refused.
+// Returns 0 if the allocation was started, 1 if the epoch was already handled or an allocation is in progress
+// (the call is repeated with the next packet), -1 if refused. Called by the owner.
+extern int applyResize(pDeduplicator pd, uint8_t epoch, unsigned int pktStoreSize, unsigned int fpsFactor, unsigned int maxPktStoreSize);
+extern void getResizeStatus(pDeduplicator pd, ResizeStatus *rs);
+// UNSAFE FUNCTION, must be called inside code with locks. Called once per stored packet, before putPkt.
+extern void resizeStep(pDeduplicator pd);
 // Deduplication API 
 
+// Compressed packet formats, told to the peer out of band (the daemon uses the value of the compression TCP option)
+#define DEDUP_FORMAT_FP		1	// FP descriptors (dedup/uncomp)
+#define DEDUP_FORMAT_INDEX	2	// pktId, offset and length references (dedupIndexed/uncompIndexed)
+#define DEDUP_FORMAT_DELTA	3	// FP descriptors or, when shorter, a delta against a similar stored packet (dedupDelta/uncomp)
+
+// Whole packet references: a packet equal to a stored one is sent as a reference to it, and neither side stores it again.
+// Every stored packet is also indexed in the FPStore under PKT_FP(hash, len), at offset 0, so the compressor finds
+// exact repeats by packet hash before any FP is calculated. In DEDUP_FORMAT_FP the reference is the packet hash and
+// length (PKT_REF_LEN bytes, shorter than any other compressed packet), looked up the same way by the peer.
+// In DEDUP_FORMAT_INDEX it is the packet hash, a 0 pktId and the pktId referenced.
+#define PKT_FP(hash, len) (((((uint64_t) (len) << 32) | (uint32_t) (hash)) << GAMMA) | 1)
+#define PKT_REF_LEN 6
+
+// Self references: a string repeated inside a packet references its first occurrence. In DEDUP_FORMAT_FP the FP of the
+// descriptor is SELF_FP and its packet hash is the hash of the packet itself (no stored packet is 0 bytes long),
+// in DEDUP_FORMAT_INDEX the pktId difference is 0. The string referenced may overlap the one it replaces, it is
+// copied byte by byte as it is uncompressed, so a run of a repeated byte takes a single reference.
+#define SELF_FP(hash) PKT_FP(hash, 0)
+
+// Whole packet references, self references and the references of match continuation and extension (see DedupStream)
+// are only sent if DEDUP_EXTENDED is or'ed to the format given to dedup_batch, when the peer uncompresses them.
+// dedup and the other single packet functions never send them.
+#define DEDUP_EXTENDED 0x10
+
+// Delta packets (DEDUP_FORMAT_DELTA): packets with small edits spread all over them share no FP with the stored ones.
+// If a stored packet has super fingerprints in common with the packet (see calculateSuperFPs), the packet is also
+// encoded as copies of strings of that packet and inserted bytes, and sent that way if shorter than with FP descriptors.
+// The packet hash is followed by DELTA_MARK where FP descriptor packets hold the offset of the first one, so uncomp
+// tells both apart. The packet referenced is found by its hash and length, as whole packet references.
+#define DELTA_MARK 0xfffe
+#define DELTA_MIN_COPY 8
+
+// References of a compressed packet (DEDUP_FORMAT_FP, delta or DEDUP_FORMAT_INDEX), read with nextReference
+// after firstReference. Only the references are parsed, the packet is not uncompressed.
+typedef struct {
+	unsigned char *optpkt;
+	unsigned int optlen;
+	unsigned int pos;
+	int format;
+	int single;		// Set if the packet is a single reference (whole packet or delta), in fp or pktId
+	uint64_t fp;
+	uint32_t hash;		// Packet hash, or hash of the packet referenced if single
+	uint64_t pktId;		// pktId of the packet (DEDUP_FORMAT_INDEX), or the one referenced if single
+} RefCursor;
+extern void firstReference(RefCursor *c, unsigned char *optpkt, uint16_t optlen, int format);
+// Next reference: a FP and the packet hash it is looked up with (pktId 0), or a pktId (fp 0) and the offset of the bytes
+// referenced. Self references are skipped. Returns 1 if found, 0 at the end of the packet, -1 if the packet is malformed.
+extern int nextReference(RefCursor *c, uint64_t *fp, uint32_t *hash, int64_t *pktId, uint16_t *offset);
+
 // Uncompression return
 #define	UNCOMP_OK			0
 #define	UNCOMP_FP_NOT_FOUND		1
@@ -231,26 +607,94 @@ typedef struct {
 } UncompReturnStatus;
 
 // De-duplication function
+// Input parameter: partition (dictionary partition of the packet, ignored if the dictionary is not partitioned)
 // Input parameter: packet (pointer to an array of unsigned char holding the packet to be optimized)
 // Input parameter: pktlen (actual length of packet -- 16 bit unsigned integer)
 // Output parameter: optpkt (pointer to an array of unsigned char where the optimized packet contents are copied). VERY IMPORTANT: THE CALLER MUST ALLOCATE THIS ARRAY.
 // Output parameter: optlen (actual length of optimized packet -- pointer to a 16 bit unsigned integer). 
 // VERY IMPORTANT: IF OPTLEN IS THE SAME AS PKTLEN, NO OPTIMIZATION IS POSSIBLE AND OPTPKT HAS NO VALID CONTENTS
-extern void dedup(pDeduplicator pd, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen);
+extern void dedup(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen);
+// Same, for a packet sent to a peer of a hub dictionary (HUB_NO_PEER if not known). Same as dedup if pd is not a hub.
+// Hub dictionaries only compress in DEDUP_FORMAT_INDEX (see Hub mode), so this one only caches the packet.
+extern void dedupToPeer(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen);
+// Same, output in DEDUP_FORMAT_INDEX. Stored packets are referenced by their pktId, so the peer must store every packet
+// with the same pktId: only split, not partitioned dictionaries may use it (otherwise no compression is done).
+// Hub dictionaries use the pktIds of the peer the packet is sent to.
+extern void dedupIndexed(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen);
+extern void dedupIndexedToPeer(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen);
+
+// Same, output in DEDUP_FORMAT_DELTA if the dictionary has a resemblance index (see setResemblance), same as dedup otherwise.
+// The peer uncompresses it with uncomp.
+extern void dedupDelta(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, unsigned char *optpkt, uint16_t *optlen);
+
+// Batch de-duplication: num packets are fingerprinted with no lock held, then compressed (or only cached, if optpkt is NULL)
+// in order under a single lock, so a packet may reference any previous one in the same batch. Up to DEDUP_WINDOW packets
+// are in flight: their dictionary lookups are probed round robin (see DictProbe), and the oldest one is compressed as soon
+// as its probe is done. optlen is set as in dedup for each entry with an optpkt.
+#define MAX_DEDUP_BATCH 32
+#define DEDUP_WINDOW 8
+// Match continuation: when a packet of a flow matched a stored packet up to its end, the next packet of the flow is
+// first compared with the rest of that stored packet and the packets stored after it, with no FP lookup. The FPs are
+// only looked up for the bytes the prediction does not cover. The stream of the flow is kept by the caller, zeroed.
+typedef struct {
+	int64_t pktId;		// Stored packet the flow was repeating, 0 if none
+	uint16_t offset;	// Offset in that packet following the last matching byte
+} DedupStream;
+typedef struct {
+	unsigned char *packet;
+	uint16_t pktlen;
+	unsigned int partition;
+	int peer; // HUB_NO_PEER if not a hub dictionary
+	int format; // DEDUP_FORMAT_FP, DEDUP_FORMAT_INDEX or DEDUP_FORMAT_DELTA, and DEDUP_EXTENDED
+	unsigned char *optpkt; // NULL to only cache the packet
+	DedupStream *stream; // Flow of the packet, NULL if none
+	uint16_t optlen;
+	uint8_t epoch; // Dictionary epoch the packet was stored in (see Online dictionary resize)
+	int64_t pktId; // pktId the packet was stored with (at the peer, for a hub), 0 if not stored (short packets and whole packet references)
+} DedupBatchEntry;
+extern void dedup_batch(pDeduplicator pd, DedupBatchEntry *batch, unsigned int num);
+
+// Fingerprint helpers: threads that calculate the hashes and FPs of the packets of a batch along with the caller of
+// dedup_batch. That is the stateless part of the work: the dictionary is still looked up and updated only by the
+// caller, in order, so the output does not change. Batches under FP_HELPERS_MIN_BATCH packets, which are the usual
+// ones unless a flow keeps the worker busy, are fingerprinted by the caller alone.
+// A pool may serve several dictionaries, as long as they are all used by the same thread.
+#define FP_HELPERS_MIN_BATCH 4
+#define MAX_FP_HELPERS 16
+typedef struct FPHelpers FPHelpers;
+// Starts num helper threads, returns NULL if they could not be started
+extern FPHelpers *newFingerprintHelpers(unsigned int num);
+// Must be called before any packet is processed. Returns 0 if done.
+extern int setFingerprintHelpers(pDeduplicator pd, FPHelpers *helpers);
 
 // update cache in compressor function
+// Input parameter: partition (dictionary partition of the packet, ignored if the dictionary is not partitioned)
 // Input parameter: packet (pointer to an array of unsigned char holding the packet to be optimized)
 // Input parameter: pktlen (actual length of packet -- 16 bit unsigned integer)
-extern void put_in_cache(pDeduplicator pd, unsigned char *packet, uint16_t pktlen);
+extern void put_in_cache(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen);
+extern void put_in_cache_to_peer(pDeduplicator pd, int peer, unsigned int partition, unsigned char *packet, uint16_t pktlen);
+
+// Retransmissions: a packet sent again may be sent as it was compressed the first time (optpkt and optlen, as output by
+// dedup or dedup_batch in format and epoch), as long as every packet it references is still in the dictionary, so the
+// peer still holds it, and was not refused by the peer (see refuseReference). Returns 1 if so, 0 if the packet must be handled as a new one. Nothing is stored.
+// Not available in hub dictionaries (0), which only know the packets held by each peer as they are sent.
+extern int checkResend(pDeduplicator pd, unsigned char *optpkt, uint16_t optlen, int format, uint8_t epoch);
 
 // Uncompression API (implemented in uncomp.c)
 
 // Update uncompressor packet cache
+// Input parameter: partition (dictionary partition of the packet, ignored if the dictionary is not partitioned)
 // Input parameter: packet (pointer to an array of unsigned char holding an uncompressed received packet)
 // Input parameter: pktlen (actual length of packt -- 16 bit unsigned integer)
-extern void update_caches(pDeduplicator pd, unsigned char *packet, uint16_t pktlen);
+extern void update_caches(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen);
+// Same for a packet the peer stored and sent as it is, given the 32 low bits of the pktId it took (see DedupBatchEntry).
+// It is stored with the closest pktId, as uncompIndexed stores the packets it uncompresses, so the packet store mirrors
+// the peer one whatever the order packets arrive in: a packet arriving late takes its slot unless it was reused since.
+// Partitioned and unified dictionaries store it as update_caches does.
+extern void update_caches_at(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, uint32_t pktIdLow);
 
 // Uncompress received optimized packet
+// Input parameter: partition (dictionary partition of the packet, ignored if the dictionary is not partitioned)
 // Input parameter: optpkt (pointer to an array of unsigned char holding an optimized packet). 
 // Input parameter: optlen (actual length of optimized packet -- 16 bit unsigned integer). 
 // Output parameter: packet (pointer to an array of unsigned char holding the uncompressed packet). VERY IMPORTANT: THE CALLER MUST ALLOCATE THIS ARRAY
@@ -263,7 +707,30 @@ extern void update_caches(pDeduplicator pd, unsigned char *packet, uint16_t pktl
 //		status.code == UNCOMP_BAD_PACKET_HASH	packet cannot be uncompressed because packet hash validation failed
 //		status.code == UNCOMP_BAD_PACKET_FORMAT	packet cannot be uncompressed because of erroneous format
 // This function also calls update_caches when the packet is successfully uncompressed, no need to call update_caches externally
-extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status);
+// Packets in DEDUP_FORMAT_DELTA are also uncompressed by this function
+extern void uncomp(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status);
+
+// Uncompress a packet in DEDUP_FORMAT_INDEX, same parameters as uncomp
+// The packet is stored with the pktId given by the peer, so both packet stores are kept aligned even if some packets were lost.
+// A reference may go on across consecutive stored packets (see writeIndexFormat in solowan_rolling.c).
+// If a referenced packet is not held, status.code is UNCOMP_FP_NOT_FOUND and status.fp holds its pktId.
+// Not available in unified nor partitioned dictionaries (UNCOMP_BAD_PACKET_FORMAT).
+extern void uncompIndexed(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status);
+
+// Uncompress a packet sent again as it was compressed the first time (see checkResend), in uncomp or uncompIndexed
+// format (DEDUP_FORMAT_FP or DEDUP_FORMAT_INDEX), same parameters as uncomp. The packet is only stored if it is not
+// held already, so both dictionaries store it once whether its first copy was lost or not.
+extern void uncompResent(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, int format, UncompReturnStatus *status);
+
+// Batch lookahead for the uncompressor: the dictionary entries referenced by num received packets (uncomp or
+// uncompIndexed format, given by format) are probed round robin (see DictProbe) under a single lock, so their misses
+// overlap. Nothing is uncompressed: the packets are uncompressed afterwards, in order, as usual.
+typedef struct {
+	unsigned char *optpkt;
+	uint16_t optlen;
+	int format; // DEDUP_FORMAT_FP or DEDUP_FORMAT_INDEX
+} UncompBatchEntry;
+extern void uncomp_prefetch(pDeduplicator pd, UncompBatchEntry *batch, unsigned int num);
 
 #endif
 
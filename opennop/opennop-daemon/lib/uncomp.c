@@ -48,21 +48,32 @@
 #include "logger.h"
 #include "debugd.h"
 
-inline static void local_update_caches(pDeduplicator pd, unsigned char *packet, uint16_t pktlen, uint32_t computedPacketHash) {
+// pktId is the one given by the peer (see uncompIndexed), 0 if the packet takes the next one
+inline static void local_update_caches(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, uint32_t computedPacketHash, int64_t pktId) {
 
 	FPEntryB pktFps[MAX_FP_PER_PKT];
 	int i;
 	unsigned char message[LOGSZ];
 	struct timeval tiempo;
-	unsigned int fpNum;
+	unsigned int fpNum = 0;
 
 	if (pktlen < BETA) return; // Short packets are never optimized
-	fpNum = calculateRelevantFPs(pktFps, packet, pktlen);
-	pthread_mutex_lock(&pd->cerrojo);
+	if (!pd->indexed) fpNum = calculateRelevantFPs(pktFps, packet, pktlen);
+	DEDUP_LOCK(pd);
+	STATS_BEGIN(pd->decompSeq);
 
-	// Store packet in PS
+	// Contents migration if resizing, as done by the peer for this packet
+	resizeStep(pd);
+	maintenanceStep(pd);
+
+	// Store packet in PS (peer lane if the dictionary is unified)
 	int64_t currPktId;
-	currPktId = putPkt(&pd->ps,packet,pktlen,computedPacketHash);
+	if ((pktId != 0) && (pktId < pd->ps.pktId - 1)) pd->decompStats.reorderedPackets++;
+	if ((pktId != 0) && PKT_AHEAD(&pd->ps, pktId)) pd->decompStats.aheadPackets++;
+	if (pktId != 0) currPktId = putPktAt(&pd->ps,pktId,packet,pktlen,computedPacketHash);
+	else if (pd->ps.peer != NULL) currPktId = -putPkt(pd->ps.peer,partition,packet,pktlen,computedPacketHash);
+	else currPktId = putPkt(&pd->ps,partition,packet,pktlen,computedPacketHash);
+	if (currPktId == 0) fpNum = 0; // Too old, not stored
 
 	if (debugword & LOCAL_UPDATE_CACHE_MASK) {
 		gettimeofday(&tiempo,NULL);
@@ -71,20 +82,22 @@ inline static void local_update_caches(pDeduplicator pd, unsigned char *packet,
 	}
 
 	for (i=fpNum-1; i >= 0; i--) {
-		putFP(pd->fps, &pd->ps, pktFps[i].fp, currPktId, pktFps[i].offset, &pd->compStats);
+		putFP(pd->fps, &pd->ps, pktFps[i].fp, currPktId, pktFps[i].offset, &pd->decompStats);
 		if (debugword & LOCAL_UPDATE_CACHE_MASK) {
 				sprintf(message, "[LOCAL UPDATE CACHE]: store FP %" PRIx64 " for hash %x pktId %" PRIu64 "\n",pktFps[i].fp, computedPacketHash, currPktId);
 				logger(LOG_INFO, message);
 		}
 	}
-	pthread_mutex_unlock(&pd->cerrojo);
+	// Whole packet references are looked up by packet hash (see PKT_FP)
+	if ((currPktId != 0) && !pd->indexed) putFP(pd->fps, &pd->ps, PKT_FP(computedPacketHash, pktlen), currPktId, 0, &pd->decompStats);
+	STATS_END(pd->decompSeq);
+	DEDUP_UNLOCK(pd);
 }
 
 // update_caches takes an incoming uncompressed packet (packet, pktlen) and updates fingerprint pointers and packet cache
 // PENDING: behaviour when a compressed packet includes uncached fingerprints
-// PENDING: think of handling the same cache on both sides (merge with dedup.c)
 
-void update_caches(pDeduplicator pd, unsigned char *packet, uint16_t pktlen) {
+static void updateCaches(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, int64_t pktId) {
 
 	unsigned char message[LOGSZ];
 	struct timeval tiempo;
@@ -98,10 +111,12 @@ void update_caches(pDeduplicator pd, unsigned char *packet, uint16_t pktlen) {
 		logger(LOG_INFO, message);
 	}
         MurmurHash3_x86_32  (packet, pktlen, SEED, (void *) &computedPacketHash);
-	local_update_caches(pd, packet, pktlen, computedPacketHash);
-	pd->compStats.inputBytes += pktlen;
-	pd->compStats.outputBytes += pktlen;
-	pd->compStats.processedPackets++;
+	local_update_caches(pd, partition, packet, pktlen, computedPacketHash, pktId);
+	STATS_BEGIN(pd->decompSeq);
+	pd->decompStats.inputBytes += pktlen;
+	pd->decompStats.outputBytes += pktlen;
+	pd->decompStats.processedPackets++;
+	STATS_END(pd->decompSeq);
 	if (debugword & UPDATE_CACHE_MASK) {
 		gettimeofday(&tiempo,NULL);
 		sprintf(message, "[UPDATE CACHE]: exiting at %d.%d\n", tiempo.tv_sec, tiempo.tv_usec);
@@ -109,6 +124,126 @@ void update_caches(pDeduplicator pd, unsigned char *packet, uint16_t pktlen) {
 	}
 }
 
+void update_caches(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen) {
+	updateCaches(pd, partition, packet, pktlen, 0);
+}
+
+void update_caches_at(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t pktlen, uint32_t pktIdLow) {
+	int64_t last, pktId;
+
+	if ((pd->ps.parts != NULL) || (pd->ps.peer != NULL)) {
+		updateCaches(pd, partition, packet, pktlen, 0);
+		return;
+	}
+	// Only the owner stores packets, no lock needed to read the last pktId
+	last = pd->ps.pktId;
+	pktId = (last & ~(int64_t) 0xffffffff) | pktIdLow;
+	if (pktId > last + 0x80000000LL) pktId -= 0x100000000LL;
+	else if (pktId < last - 0x80000000LL) pktId += 0x100000000LL;
+	if (pktId <= 0) return; // Long gone
+	updateCaches(pd, partition, packet, pktlen, pktId);
+}
+
+// Whether a packet sent again (see uncompResent) is held already: by the pktId given by the peer, if any,
+// otherwise as a whole packet reference would find it
+static int holdsPacket(pDeduplicator pd, uint32_t hash, uint16_t pktlen, int64_t pktId) {
+	PktEntry *storedPkt;
+	int held;
+
+	DEDUP_LOCK(pd);
+	if (pktId != 0) {
+		storedPkt = getPkt(&pd->ps, pktId);
+		held = (storedPkt != NULL) && (storedPkt->pktId == pktId) && (storedPkt->hash == hash);
+	} else held = getFPhash(pd->fps, &pd->ps, PKT_FP(hash, pktlen), hash) != NULL;
+	DEDUP_UNLOCK(pd);
+	return held;
+}
+
+// Self reference (see SELF_FP): the string may overlap the bytes it is copied to, so it is copied byte by byte
+inline static void copySelf(unsigned char *packet, unsigned int orig, unsigned int left, unsigned int len) {
+	unsigned int i;
+
+	for (i = 0; i < len; i++) packet[orig+i] = packet[left+i];
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks, between STATS_BEGIN(pd->decompSeq) and STATS_END(pd->decompSeq)
+// Solves the delta after the packet hash and DELTA_MARK (see writeDeltaFormat in solowan_rolling.c).
+// Returns 1 if done, otherwise 0 with *pktlen set to 0 and status set.
+static int uncompDelta(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status) {
+
+	FPEntryB *fpp;
+	PktEntry *storedPkt;
+	uint32_t refHash;
+	uint16_t refLen;
+	uint64_t chunk, left, len;
+	unsigned int pos, orig = 0;
+	int n;
+
+	*pktlen = 0;
+	if (optlen < sizeof(uint32_t) + sizeof(uint16_t)) {
+		pd->decompStats.errorsPacketFormat++;
+		status->code = UNCOMP_BAD_PACKET_FORMAT;
+		return 0;
+	}
+	refHash = ntoh32(optpkt);
+	refLen = ntoh16(optpkt+sizeof(uint32_t));
+	pos = sizeof(uint32_t) + sizeof(uint16_t);
+
+	// Found as whole packet references are
+	fpp = getFPhash(pd->fps,&pd->ps,PKT_FP(refHash,refLen),refHash);
+	storedPkt = (fpp != NULL) ? getPkt(&pd->ps,fpp->pktId) : NULL;
+	if (storedPkt == NULL) {
+		storedPkt = getPktHash(&pd->ps,refHash);
+		if ((storedPkt != NULL) && (getPkt(&pd->ps,storedPkt->pktId) != storedPkt)) storedPkt = NULL;
+	}
+	if ((storedPkt == NULL) || (storedPkt->len != refLen)) {
+		pd->decompStats.errorsMissingPacket++;
+		status->code = UNCOMP_FP_NOT_FOUND;
+		status->fp = PKT_FP(refHash,refLen);
+		status->hash = refHash;
+		return 0;
+	}
+
+	status->code = UNCOMP_OK;
+	while (pos < optlen) {
+		// Inserted string
+		n = getVarint(optpkt+pos, optlen-pos, &chunk);
+		pos += n;
+		if ((n == 0) || (chunk > optlen-pos) || (orig+chunk > MAX_PKT_SIZE())) {
+			status->code = UNCOMP_BAD_PACKET_FORMAT;
+			break;
+		}
+		memcpy(packet+orig, optpkt+pos, chunk);
+		orig += chunk;
+		pos += chunk;
+		if (pos == optlen) break;
+
+		// Copy
+		n = getVarint(optpkt+pos, optlen-pos, &left);
+		pos += n;
+		if (n > 0) {
+			n = getVarint(optpkt+pos, optlen-pos, &len);
+			pos += n;
+		}
+		// Compared without overflow, the copy must lie inside the stored packet
+		if ((n == 0) || (left > refLen) || (len > refLen) || (len+DELTA_MIN_COPY > refLen-left) ||
+				(orig+len+DELTA_MIN_COPY > MAX_PKT_SIZE())) {
+			status->code = UNCOMP_BAD_PACKET_FORMAT;
+			break;
+		}
+		len += DELTA_MIN_COPY;
+		memcpy(packet+orig, storedPkt->pkt+left, len);
+		orig += len;
+	}
+	if (status->code != UNCOMP_OK) {
+		pd->decompStats.errorsPacketFormat++;
+		return 0;
+	}
+	*pktlen = orig;
+	pd->decompStats.deltaPackets++;
+	return 1;
+}
+
 // Uncompress received optimized packet
 // Input parameter: optpkt (pointer to an array of unsigned char holding an optimized packet).
 // Input parameter: optlen (actual length of optimized packet -- 16 bit unsigned integer).
@@ -121,7 +256,8 @@ void update_caches(pDeduplicator pd, unsigned char *packet, uint16_t pktlen) {
 //                                                              status.fp and status.hash hold the missed values
 // This function also calls update_caches when the packet is successfully uncompressed, no need to call update_caches externally
 
-extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status) {
+// resent is set for a packet sent again (see uncompResent)
+static void uncompPacket(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status, int resent) {
 
 
 	uint64_t tentativeFP;
@@ -130,23 +266,25 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 	uint16_t offset;
 	uint16_t orig = 0;
 	FPEntryB *fpp;
+	PktEntry *storedPkt;
 	uint16_t left, right;
 	unsigned char curr;
 	uint16_t orig_optlen;
 	unsigned char *orig_pkt;
         unsigned char message[LOGSZ];
 
-	int failed;
+	int failed, self;
 
 	orig_optlen = optlen;
 	orig_pkt = optpkt;
 
-	pthread_mutex_lock(&pd->cerrojo);
+	DEDUP_LOCK(pd);
+	STATS_BEGIN(pd->decompSeq);
 
 		optlen = orig_optlen;
 		optpkt = orig_pkt;
-		pd->compStats.inputBytes += optlen;
-		pd->compStats.processedPackets++;
+		pd->decompStats.inputBytes += optlen;
+		pd->decompStats.processedPackets++;
 
 		*pktlen=0;
 
@@ -162,6 +300,34 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 		//     16 bit offset from end of this header to next FP descriptor (if all ones, no more descriptors)
 		// Check fingerprints in FPStore
 
+		// Whole packet reference: packet hash and length of a stored packet, the packet is not stored again
+		if (optlen == PKT_REF_LEN) {
+			sentPktHash = ntoh32(optpkt);
+			*pktlen = ntoh16(optpkt+sizeof(uint32_t));
+			fpp = getFPhash(pd->fps,&pd->ps,PKT_FP(sentPktHash,*pktlen),sentPktHash);
+			storedPkt = (fpp != NULL) ? getPkt(&pd->ps,fpp->pktId) : NULL;
+			if (storedPkt == NULL) {
+				storedPkt = getPktHash(&pd->ps,sentPktHash);
+				if ((storedPkt != NULL) && (getPkt(&pd->ps,storedPkt->pktId) != storedPkt)) storedPkt = NULL;
+			}
+			if ((storedPkt == NULL) || (storedPkt->len != *pktlen)) {
+				*pktlen = 0;
+				status->code = UNCOMP_FP_NOT_FOUND;
+				pd->decompStats.errorsMissingPacket++;
+				status->fp = PKT_FP(sentPktHash,ntoh16(optpkt+sizeof(uint32_t)));
+				status->hash = sentPktHash;
+			} else {
+				memcpy(packet,storedPkt->pkt,*pktlen);
+				pd->decompStats.packetReferences++;
+				pd->decompStats.uncompressedPackets++;
+				pd->decompStats.outputBytes += *pktlen;
+				status->code = UNCOMP_OK;
+			}
+			STATS_END(pd->decompSeq);
+			DEDUP_UNLOCK(pd);
+			return;
+		}
+
 		sentPktHash = ntoh32(optpkt);
 		optpkt += sizeof(uint32_t);
 		optlen -= sizeof(uint32_t);
@@ -169,12 +335,21 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 		offset = ntoh16(optpkt);
 		optpkt += sizeof(uint16_t);
 		optlen -= sizeof(uint16_t);
-		if (offset > 0) {
+		if (offset == DELTA_MARK) {
+			// Delta against a similar stored packet, no FP descriptors follow
+			if (!uncompDelta(pd, packet, pktlen, optpkt, optlen, status)) {
+				STATS_END(pd->decompSeq);
+				DEDUP_UNLOCK(pd);
+				return;
+			}
+			optlen = 0;
+		} else if (offset > 0) {
         		if (offset > MAX_PKT_SIZE()) {
-				pd->compStats.errorsPacketFormat++;
+				pd->decompStats.errorsPacketFormat++;
                         *pktlen = 0;
                         status->code = UNCOMP_BAD_PACKET_FORMAT;
-                        pthread_mutex_unlock(&pd->cerrojo);
+                        STATS_END(pd->decompSeq);
+                        DEDUP_UNLOCK(pd);
                         return;
         		}
 			memcpy(packet+orig,optpkt,offset);
@@ -195,23 +370,33 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 			optpkt += sizeof(uint32_t);
 			optlen -= sizeof(uint32_t);
 
+			// Self reference: the string is in the bytes already uncompressed
+			self = (tentativeFP == SELF_FP(sentPktHash)) && (tentativePktHash == sentPktHash);
+			if (!self) {
+				fpp = getFPhash(pd->fps,&pd->ps,tentativeFP,tentativePktHash);
+				storedPkt = (fpp != NULL) ? getPkt(&pd->ps,fpp->pktId) : NULL;
+				// The FP may have been dropped here but not at the peer (e.g. a peer with a larger FP store),
+				// the packet is still found by its hash. The hash of the whole packet is checked below.
+				if (storedPkt == NULL) {
+					storedPkt = getPktHash(&pd->ps,tentativePktHash);
+					if ((storedPkt != NULL) && (getPkt(&pd->ps,storedPkt->pktId) != storedPkt)) storedPkt = NULL;
+				}
 
-			fpp = getFPhash(pd->fps,&pd->ps,tentativeFP,tentativePktHash);
-
-			if (fpp == NULL) {
-				if (debugword & UNCOMP_MASK) {
-					sprintf(message, "[UNCOMP]: cannot find FP/PktHash pair tentativeFP %" PRIx64 " tentativePktHash %x\n",tentativeFP,tentativePktHash);
-					logger(LOG_INFO, message);
+				if (storedPkt == NULL) {
+					if (debugword & UNCOMP_MASK) {
+						sprintf(message, "[UNCOMP]: cannot find FP/PktHash pair tentativeFP %" PRIx64 " tentativePktHash %x\n",tentativeFP,tentativePktHash);
+						logger(LOG_INFO, message);
+					}
+					// *pktlen = 0;
+					// status->code = UNCOMP_FP_NOT_FOUND;
+					// decompStats.errorsMissingFP++;				
+					// status->fp = tentativeFP;
+					// status->hash = tentativePktHash;
+					// pthread_mutex_unlock(&cerrojo);
+					// return;
+					failed = 1;
+					break;
 				}
-				// *pktlen = 0;
-				// status->code = UNCOMP_FP_NOT_FOUND;
-				// decompStats.errorsMissingFP++;				
-				// status->fp = tentativeFP;
-				// status->hash = tentativePktHash;
-				// pthread_mutex_unlock(&cerrojo);
-				// return;
-				failed = 1;
-				break;
 			}
 
 			left = ntoh16(optpkt);
@@ -222,16 +407,18 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 			optpkt += sizeof(uint16_t);
 			optlen -= sizeof(uint16_t);
 
-			PktEntry *storedPkt;
-			storedPkt = getPkt(&pd->ps,fpp->pktId);
-			if ((left > right) || (right >= storedPkt->len) || (orig+right-left> MAX_PKT_SIZE())) {
-				pd->compStats.errorsPacketFormat++;
+			if ((left > right) || (self ? (left >= orig) : (right >= storedPkt->len)) || (orig+right-left> MAX_PKT_SIZE())) {
+				pd->decompStats.errorsPacketFormat++;
 				*pktlen = 0;
 				status->code = UNCOMP_BAD_PACKET_FORMAT;
-				pthread_mutex_unlock(&pd->cerrojo);
+				STATS_END(pd->decompSeq);
+				DEDUP_UNLOCK(pd);
 				return;
 			}
-			memcpy(packet+orig,storedPkt->pkt+left,right-left+1);
+			if (self) {
+				copySelf(packet, orig, left, right-left+1);
+				pd->decompStats.selfReferences++;
+			} else memcpy(packet+orig,storedPkt->pkt+left,right-left+1);
 			orig += right-left+1;
 			*pktlen += right-left+1;
 
@@ -240,10 +427,11 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 			optlen -= sizeof(uint16_t);
 			if (offset == 0xffff) {
 				if (orig+optlen> MAX_PKT_SIZE()) {
-					pd->compStats.errorsPacketFormat++;
+					pd->decompStats.errorsPacketFormat++;
 					*pktlen = 0;
 					status->code = UNCOMP_BAD_PACKET_FORMAT;
-					pthread_mutex_unlock(&pd->cerrojo);
+					STATS_END(pd->decompSeq);
+					DEDUP_UNLOCK(pd);
 					return;
 				}
 				memcpy(packet+orig,optpkt,optlen);
@@ -252,10 +440,11 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 				optlen = 0;
 			} else {
 				if (orig+offset> MAX_PKT_SIZE()) {
-					pd->compStats.errorsPacketFormat++;				
+					pd->decompStats.errorsPacketFormat++;				
 					*pktlen = 0;
 					status->code = UNCOMP_BAD_PACKET_FORMAT;
-					pthread_mutex_unlock(&pd->cerrojo);
+					STATS_END(pd->decompSeq);
+					DEDUP_UNLOCK(pd);
 					return;
 				}
 				memcpy(packet+orig,optpkt,offset);
@@ -269,27 +458,225 @@ extern void uncomp(pDeduplicator pd, unsigned char *packet, uint16_t *pktlen, un
 	if (failed) {
 		*pktlen = 0;
 		status->code = UNCOMP_FP_NOT_FOUND;
-		pd->compStats.errorsMissingFP++;				
+		pd->decompStats.errorsMissingFP++;				
 		status->fp = tentativeFP;
 		status->hash = tentativePktHash;
-		pthread_mutex_unlock(&pd->cerrojo);
+		STATS_END(pd->decompSeq);
+		DEDUP_UNLOCK(pd);
 		return;
 	}
 
 	assert(*pktlen <= MAX_PKT_SIZE());
 	assert(orig <= MAX_PKT_SIZE());
-	if (*pktlen > orig_optlen) pd->compStats.uncompressedPackets++;
-	pthread_mutex_unlock(&pd->cerrojo);
+	if (*pktlen > orig_optlen) pd->decompStats.uncompressedPackets++;
+	STATS_END(pd->decompSeq);
+	DEDUP_UNLOCK(pd);
         MurmurHash3_x86_32  (packet, *pktlen, SEED, (void *) &computedPacketHash);
+	// Only this thread updates decompStats, no lock needed
+	STATS_BEGIN(pd->decompSeq);
+	if (computedPacketHash == sentPktHash) pd->decompStats.outputBytes += *pktlen;
+	else pd->decompStats.errorsPacketHash++;
+	STATS_END(pd->decompSeq);
 	if (computedPacketHash == sentPktHash) {
-		pd->compStats.outputBytes += *pktlen;
-		local_update_caches(pd,packet,*pktlen, computedPacketHash); 
+		if (!resent || !holdsPacket(pd, computedPacketHash, *pktlen, 0))
+			local_update_caches(pd,partition,packet,*pktlen, computedPacketHash, 0);
 		status->code = UNCOMP_OK;
 	} else {
-		pd->compStats.errorsPacketHash++;				
 		*pktlen = 0;
 		status->code = UNCOMP_BAD_PACKET_HASH;
 	}
 
 }
 
+extern void uncomp(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status) {
+	uncompPacket(pd, partition, packet, pktlen, optpkt, optlen, status, 0);
+}
+
+// Uncompress received packet in DEDUP_FORMAT_INDEX (see writeIndexFormat in solowan_rolling.c)
+// Same parameters as uncompPacket. No FP is looked up: references are solved by pktId, checking the stored packet is the one referenced.
+
+static void uncompIndexedPacket(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status, int resent) {
+
+	uint32_t computedPacketHash, sentPktHash;
+	uint64_t pktId, chunk, delta, left, len, part;
+	int64_t refId;
+	PktEntry *storedPkt;
+	unsigned int pos, orig = 0;
+	int n;
+	unsigned char message[LOGSZ];
+
+	DEDUP_LOCK(pd);
+	STATS_BEGIN(pd->decompSeq);
+	pd->decompStats.inputBytes += optlen;
+	pd->decompStats.processedPackets++;
+	*pktlen = 0;
+	status->code = UNCOMP_OK;
+
+	n = 0;
+	if ((pd->ps.peer == NULL) && (pd->ps.parts == NULL) && (optlen > sizeof(uint32_t))) {
+		sentPktHash = ntoh32(optpkt);
+		n = getVarint(optpkt+sizeof(uint32_t), optlen-sizeof(uint32_t), &pktId);
+	}
+	pos = sizeof(uint32_t) + n;
+	// Whole packet reference: 0 and the pktId of a stored packet, the packet is not stored again
+	if ((n > 0) && (pktId == 0)) {
+		n = getVarint(optpkt+pos, optlen-pos, &pktId);
+		refId = pktId;
+		storedPkt = ((n > 0) && (pos+n == optlen) && (pktId <= MAX_PKT_ID)) ? getPkt(&pd->ps, refId) : NULL;
+		if ((n == 0) || (pos+n != optlen) || (pktId == 0) || (pktId > MAX_PKT_ID)) {
+			pd->decompStats.errorsPacketFormat++;
+			status->code = UNCOMP_BAD_PACKET_FORMAT;
+		} else if ((storedPkt == NULL) || (storedPkt->pktId != refId) || (storedPkt->hash != sentPktHash)) {
+			pd->decompStats.errorsMissingPacket++;
+			status->code = UNCOMP_FP_NOT_FOUND;
+			status->fp = refId;
+			status->hash = sentPktHash;
+		} else {
+			memcpy(packet, storedPkt->pkt, storedPkt->len);
+			*pktlen = storedPkt->len;
+			pd->decompStats.packetReferences++;
+			pd->decompStats.uncompressedPackets++;
+			pd->decompStats.outputBytes += *pktlen;
+		}
+		STATS_END(pd->decompSeq);
+		DEDUP_UNLOCK(pd);
+		return;
+	}
+	if ((n == 0) || (pktId == 0) || (pktId > MAX_PKT_ID)) status->code = UNCOMP_BAD_PACKET_FORMAT;
+
+	while ((status->code == UNCOMP_OK) && (pos < optlen)) {
+		// Uncompressed chunk
+		n = getVarint(optpkt+pos, optlen-pos, &chunk);
+		pos += n;
+		if ((n == 0) || (chunk > optlen-pos) || (orig+chunk > MAX_PKT_SIZE())) {
+			status->code = UNCOMP_BAD_PACKET_FORMAT;
+			break;
+		}
+		memcpy(packet+orig, optpkt+pos, chunk);
+		orig += chunk;
+		pos += chunk;
+		if (pos == optlen) break;
+
+		// Reference
+		n = getVarint(optpkt+pos, optlen-pos, &delta);
+		pos += n;
+		if (n > 0) {
+			n = getVarint(optpkt+pos, optlen-pos, &left);
+			pos += n;
+		}
+		if (n > 0) {
+			n = getVarint(optpkt+pos, optlen-pos, &len);
+			pos += n;
+		}
+		if ((n == 0) || (delta >= pktId) || (len > MAX_PKT_SIZE())) {
+			status->code = UNCOMP_BAD_PACKET_FORMAT;
+			break;
+		}
+		len += BETA;
+		if ((orig+len > MAX_PKT_SIZE()) || ((delta == 0) && (left >= orig))) {
+			status->code = UNCOMP_BAD_PACKET_FORMAT;
+			break;
+		}
+		// Self reference, the string is in the bytes already uncompressed
+		if (delta == 0) {
+			copySelf(packet, orig, left, len);
+			orig += len;
+			pd->decompStats.selfReferences++;
+			continue;
+		}
+		// A reference longer than the rest of the packet goes on in the packets stored after it
+		for (refId = pktId - delta; len > 0; refId++, left = 0) {
+			storedPkt = (refId < (int64_t) pktId) ? getPkt(&pd->ps, refId) : NULL;
+			if ((storedPkt == NULL) || (storedPkt->pktId != refId)) {
+				if (debugword & UNCOMP_MASK) {
+					sprintf(message, "[UNCOMP]: cannot find pktId %" PRId64 " referenced by %" PRIu64 "\n", refId, pktId);
+					logger(LOG_INFO, message);
+				}
+				status->code = (refId < (int64_t) pktId) ? UNCOMP_FP_NOT_FOUND : UNCOMP_BAD_PACKET_FORMAT;
+				status->fp = refId;
+				status->hash = 0;
+				break;
+			}
+			if (left >= storedPkt->len) {
+				status->code = UNCOMP_BAD_PACKET_FORMAT;
+				break;
+			}
+			part = (len < storedPkt->len - left) ? len : storedPkt->len - left;
+			memcpy(packet+orig, storedPkt->pkt+left, part);
+			orig += part;
+			len -= part;
+		}
+	}
+
+	if (status->code != UNCOMP_OK) {
+		if (status->code == UNCOMP_FP_NOT_FOUND) pd->decompStats.errorsMissingPacket++;
+		else pd->decompStats.errorsPacketFormat++;
+		STATS_END(pd->decompSeq);
+		DEDUP_UNLOCK(pd);
+		return;
+	}
+
+	*pktlen = orig;
+	if (*pktlen > optlen) pd->decompStats.uncompressedPackets++;
+	STATS_END(pd->decompSeq);
+	DEDUP_UNLOCK(pd);
+	MurmurHash3_x86_32  (packet, *pktlen, SEED, (void *) &computedPacketHash);
+	STATS_BEGIN(pd->decompSeq);
+	if (computedPacketHash == sentPktHash) pd->decompStats.outputBytes += *pktlen;
+	else pd->decompStats.errorsPacketHash++;
+	STATS_END(pd->decompSeq);
+	if (computedPacketHash == sentPktHash) {
+		if (!resent || !holdsPacket(pd, computedPacketHash, *pktlen, pktId))
+			local_update_caches(pd,partition,packet,*pktlen, computedPacketHash, pktId);
+	} else {
+		*pktlen = 0;
+		status->code = UNCOMP_BAD_PACKET_HASH;
+	}
+}
+
+extern void uncompIndexed(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, UncompReturnStatus *status) {
+	uncompIndexedPacket(pd, partition, packet, pktlen, optpkt, optlen, status, 0);
+}
+
+// The first copy of the packet may have been lost or not: either way, the packet is stored once
+extern void uncompResent(pDeduplicator pd, unsigned int partition, unsigned char *packet, uint16_t *pktlen, unsigned char *optpkt, uint16_t optlen, int format, UncompReturnStatus *status) {
+	if (format == DEDUP_FORMAT_INDEX) uncompIndexedPacket(pd, partition, packet, pktlen, optpkt, optlen, status, 1);
+	else uncompPacket(pd, partition, packet, pktlen, optpkt, optlen, status, 1);
+	if (status->code == UNCOMP_OK) {
+		STATS_BEGIN(pd->decompSeq);
+		pd->decompStats.resentPackets++;
+		STATS_END(pd->decompSeq);
+	}
+}
+
+// References of a received packet to probe (see uncomp_prefetch), as far as the packet can be parsed
+static void startUncompProbe(pDeduplicator pd, UncompBatchEntry *entry, DictProbe *probe) {
+	RefCursor c;
+	uint64_t fp;
+	uint32_t hash;
+	int64_t pktId;
+	uint16_t offset;
+
+	probe->stage = 0;
+	probe->num = 0;
+	if ((entry->format == DEDUP_FORMAT_INDEX) && ((pd->ps.peer != NULL) || (pd->ps.parts != NULL))) return;
+	firstReference(&c, entry->optpkt, entry->optlen, entry->format);
+	while (nextReference(&c, &fp, &hash, &pktId, &offset) > 0) addProbeRef(probe, fp, pktId, offset);
+}
+
+void uncomp_prefetch(pDeduplicator pd, UncompBatchEntry *batch, unsigned int num) {
+
+	DictProbe probes[DEDUP_WINDOW];
+	unsigned int i, n, done;
+	int stage;
+
+	DEDUP_LOCK(pd);
+	for (done = 0; done < num; done += n) {
+		n = (num - done < DEDUP_WINDOW) ? num - done : DEDUP_WINDOW;
+		for (i = 0; i < n; i++) startUncompProbe(pd, &batch[done+i], &probes[i]);
+		for (stage = 0; stage < PROBE_DONE; stage++) {
+			for (i = 0; i < n; i++) advanceProbe(pd->fps, &pd->ps, &probes[i]);
+		}
+	}
+	DEDUP_UNLOCK(pd);
+}
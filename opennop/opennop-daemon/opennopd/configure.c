@@ -100,11 +100,208 @@ int configure(char *path, __u32 *localID, __u32 *packet_number, __u32 *packet_si
 						}
 						deduplication_enable();
 						compression_disable();
+						residue_compression_disable();
+					}else if(strcmp(token, "combined") == 0){
+						if(DEBUG_CONFIGURATION == true){
+							sprintf(message, "deduplication and compression enabled \n");
+							logger(LOG_INFO, message);
+						}
+						deduplication_enable();
+						compression_disable();
+						residue_compression_enable();
 					}else {
 						compression_disable();
 						deduplication_disable();
 					}
 				}
+				else if (strcmp(token, "dictionary") == 0){ // Set dictionary layout
+					token = strtok( NULL, "\t =\n\r" );
+					if(token != NULL && strcmp(token, "unified") == 0){
+						if(DEBUG_CONFIGURATION == true){
+							sprintf(message, "unified dictionary \n");
+							logger(LOG_INFO, message);
+						}
+						unified_dictionary_enable();
+					}else {
+						unified_dictionary_disable();
+					}
+				}
+				else if (strcmp(token, "dictionary_partition") == 0){ // Set dictionary partitioning
+					token = strtok( NULL, "\t =\n\r" );
+					if(token != NULL){
+						if(dictionary_partition_set(token) != 0){
+							sprintf(message, "Initialization: wrong dictionary partitioning %s, not partitioned\n", token);
+							logger(LOG_INFO, message);
+						}else if(DEBUG_CONFIGURATION == true){
+							sprintf(message, "%s\n", token);
+							logger(LOG_INFO, message);
+						}
+					}
+				}
+				else if (strcmp(token, "partition_class") == 0){
+					unsigned int quota = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &quota);
+					token = strtok( NULL, "\t =\n\r");
+					if((token == NULL) || (partition_class_add(quota, token) != 0)){
+						sprintf(message, "Initialization: wrong partition class, quotas must add up to less than 100\n");
+						logger(LOG_INFO, message);
+					}else if(DEBUG_CONFIGURATION == true){
+						sprintf(message, "quota %u ports %s\n", quota, token);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "dictionary_per_peer") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token != NULL) && (strcmp(token, "yes") == 0)){
+						peer_dictionaries_enable();
+					}else {
+						peer_dictionaries_disable();
+					}
+				}
+				else if (strcmp(token, "dictionary_hub") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token != NULL) && (strcmp(token, "yes") == 0)){
+						dictionary_hub_enable();
+					}else {
+						dictionary_hub_disable();
+					}
+				}
+				else if (strcmp(token, "dedup_format") == 0){
+					unsigned int format = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &format);
+					if(dedup_format_set(format) != 0){
+						sprintf(message, "Initialization: wrong packet format: %u\n", format);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "codec_selection") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token != NULL) && (strcmp(token, "yes") == 0)){
+						codec_selection_enable();
+					}else {
+						codec_selection_disable();
+					}
+				}
+				else if (strcmp(token, "delta_encoding") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token != NULL) && (strcmp(token, "yes") == 0)){
+						delta_encoding_enable();
+					}else {
+						delta_encoding_disable();
+					}
+				}
+				else if (strcmp(token, "retransmission_cache") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token != NULL) && (strcmp(token, "yes") == 0)){
+						retransmission_cache_enable();
+					}else {
+						retransmission_cache_disable();
+					}
+				}
+				else if (strcmp(token, "acked_references") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token != NULL) && (strcmp(token, "yes") == 0)){
+						acked_references_enable();
+					}else {
+						acked_references_disable();
+					}
+				}
+				else if (strcmp(token, "recovery_port") == 0){
+					unsigned int port = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &port);
+					if(recovery_port_set(port) != 0){
+						sprintf(message, "Initialization: wrong recovery port: %u\n", port);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "dedup_batch") == 0){
+					unsigned int size = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &size);
+					if(dedup_batch_size_set(size) != 0){
+						sprintf(message, "Initialization: wrong deduplication batch size: %u\n", size);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "dedup_helpers") == 0){
+					unsigned int helpers = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &helpers);
+					if(dedup_helpers_set(helpers) != 0){
+						sprintf(message, "Initialization: wrong number of fingerprint helpers: %u\n", helpers);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "peer_dictionaries_max") == 0){
+					unsigned int peers = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &peers);
+					if(peer_dictionaries_max_set(peers) != 0){
+						sprintf(message, "Initialization: wrong number of peer dictionaries: %u\n", peers);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "peer_dictionaries_total") == 0){
+					unsigned int size = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &size);
+					if(peer_dictionaries_total_set(size) != 0){
+						sprintf(message, "Initialization: wrong total size of peer dictionaries: %u\n", size);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "peer_dictionary_size") == 0){
+					unsigned int size = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &size);
+					token = strtok( NULL, "\t =\n\r");
+					if(peer_dictionary_size_set(size, token) != 0){
+						sprintf(message, "Initialization: wrong peer dictionary size\n");
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "dictionary_shm") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token == NULL) || (dictionary_shm_set(token) != 0)){
+						sprintf(message, "Initialization: wrong shared memory name for dictionaries\n");
+						logger(LOG_INFO, message);
+					}else if(DEBUG_CONFIGURATION == true){
+						sprintf(message, "shared dictionaries %s\n", token);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "dictionary_resize_max") == 0){
+					unsigned int size = 0;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &size);
+					if(dictionary_resize_max_set(size) != 0){
+						sprintf(message, "Initialization: wrong dictionary resize limit: %u\n", size);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "dictionary_sweep") == 0){
+					unsigned int buckets = 0, interval = 10;
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &buckets);
+					token = strtok( NULL, "\t =\n\r");
+					if(token != NULL) sscanf(token, "%u", &interval);
+					dictionary_sweep_set(buckets, interval);
+					if(DEBUG_CONFIGURATION == true){
+						sprintf(message, "sweep %u buckets every %u ms\n", buckets, interval);
+						logger(LOG_INFO, message);
+					}
+				}
+				else if (strcmp(token, "partition_borrow") == 0){
+					token = strtok( NULL, "\t =\n\r");
+					if((token != NULL) && (strcmp(token, "no") == 0)){
+						partition_borrow_set(false);
+					}else {
+						partition_borrow_set(true);
+					}
+				}
 /*				else if (strcmp(token, "deduplication") == 0){ // Set dedulpication
 					token = strtok( NULL, "\t =\n\r" ) ;
 					if(strcmp(token, "enable") == 0){
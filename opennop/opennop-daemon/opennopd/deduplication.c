@@ -45,10 +45,13 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <netinet/ip.h> // for tcpmagic and TCP options
 #include <netinet/tcp.h> // for tcpmagic and TCP options
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <endian.h>
 #include "deduplication.h"
 #include "solowan_rolling.h"
 #include "tcpoptions.h"
@@ -56,6 +59,10 @@
 #include "climanager.h"
 #include "debugd.h"
 #include "worker.h"
+#include "configure.h"
+#include "opennopd.h"
+#include "sessionmanager.h"
+#include "recovery.h"
 
 //#ifndef BASIC
 //#define BASIC
@@ -74,6 +81,36 @@
 #endif
 
 int deduplication = true; // Determines if opennop should deduplicate tcp data.
+int unified_dictionary = false; // Determines if each worker shares one dictionary for both directions.
+int dictionary_partition = PARTITION_NONE; // Determines how the dictionary of each worker is partitioned.
+struct partition_class partition_classes[MAX_PARTITIONS]; // Class 0 is the default one, it gets the quota not assigned.
+unsigned int partition_classes_num = 1;
+int partition_borrow = true; // Determines if partitions can use the unused quota of others.
+int peer_dictionaries = false; // Determines if each worker keeps dictionaries per remote accelerator.
+unsigned int peer_dictionaries_max = 64; // Remote accelerators with their own dictionaries, per worker.
+unsigned int peer_dictionary_default = 0; // Packets of each peer dictionary, 0 for num_pkt_cache_size.
+unsigned int peer_dictionaries_total = 0; // Packets of all peer dictionaries of a worker, 0 for 8 times num_pkt_cache_size.
+struct peer_dictionary_size peer_dictionary_sizes[MAX_PEER_SIZES];
+unsigned int peer_dictionary_sizes_num = 0;
+int dictionary_hub = false; // Determines if each worker compresses for every remote accelerator with one dictionary.
+int dedup_format = DEDUP_FORMAT_FP; // Highest compressed packet format used, if the peer accelerator also supports it.
+int residue_compression = false; // Determines if deduplicated packets are also compressed with QuickLZ.
+int codec_selection = false; // Determines if the codecs run on each packet are chosen by their recent yield on its flow.
+int delta_encoding = false; // Determines if packets are delta encoded against similar cached ones when shorter.
+int retransmission_cache = false; // Determines if retransmissions are sent as their first copy was optimized, when still valid.
+int acked_references = false; // Determines if packets only reference cached ones the peer acknowledged.
+unsigned int dedup_batch_size = 16; // Packets taken from the queue and deduplicated together by the optimization thread.
+unsigned int dedup_helpers = 0; // Threads of each worker fingerprinting large batches along with it, 0 for none.
+char dictionary_shm[64] = ""; // Shared memory segment name prefix of the dictionaries, empty for private memory.
+static unsigned int dictionaries_created = 0; // Worker dictionaries created empty, and taken over from shared memory.
+static unsigned int dictionaries_taken_over = 0;
+static __u16 dictionary_generation = 0; // Changes whenever this accelerator starts with empty dictionaries.
+static struct dictionary_peer dictionary_peers[MAX_DICTIONARY_PEERS];
+static unsigned int dictionary_peers_num = 0;
+static pthread_mutex_t dictionary_peers_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned int dictionary_resize_max = 0; // Largest dictionary the peer may resize ours to, 0 for 4 times num_pkt_cache_size.
+unsigned int sweep_buckets = 0; // FP buckets swept by the maintenance task each time, 0 disables it.
+unsigned int sweep_interval = 10; // Milliseconds between maintenance sweeps.
 int DEBUG_DEDUPLICATION = false;
 int DEBUG_DEDUPLICATION1 = false;
 
@@ -85,7 +122,15 @@ int cli_reset_stats_in_dedup(int client_fd, char **parameters, int numparameters
         sprintf(msg,"-------------------------------------------------------------------------------\n");
         cli_send_feedback(client_fd, msg);
 	int si;
-	for (si=0;si<get_workers();si++) resetStatistics(get_worker_compressor(si));
+	unsigned int p;
+	struct peer_dictionary *thispeer;
+	for (si=0;si<get_workers();si++) {
+		resetStatistics(get_worker_compressor(si));
+		for (p = 0; p < get_worker_peers(si); p++) {
+			thispeer = get_worker_peer(si, p);
+			if ((thispeer != NULL) && (thispeer->compressor != get_worker_compressor(si))) resetStatistics(thispeer->compressor);
+		}
+	}
 	sprintf(msg,"Compressor statistics reset\n");
         cli_send_feedback(client_fd, msg);
 	sprintf(msg,"-------------------------------------------------------------------------------\n");
@@ -98,7 +143,15 @@ int cli_reset_stats_in_dedup_thread(int client_fd, char **parameters, int numpar
         sprintf(msg,"-------------------------------------------------------------------------------\n");
         cli_send_feedback(client_fd, msg);
 	int si;
-	for (si=0;si<get_workers();si++) resetStatistics(get_worker_compressor(si));
+	unsigned int p;
+	struct peer_dictionary *thispeer;
+	for (si=0;si<get_workers();si++) {
+		resetStatistics(get_worker_compressor(si));
+		for (p = 0; p < get_worker_peers(si); p++) {
+			thispeer = get_worker_peer(si, p);
+			if ((thispeer != NULL) && (thispeer->compressor != get_worker_compressor(si))) resetStatistics(thispeer->compressor);
+		}
+	}
 	sprintf(msg,"Compressor statistics reset\n");
         cli_send_feedback(client_fd, msg);
 	sprintf(msg,"-------------------------------------------------------------------------------\n");
@@ -114,8 +167,12 @@ int cli_show_stats_in_dedup(int client_fd, char **parameters, int numparameters)
 	Statistics cs, csAggregate;
 	int si;
 	memset(&csAggregate,0,sizeof(csAggregate));
-	for (si = 0; si < get_workers(); si++) {
-		getStatistics(get_worker_compressor(si),&cs);
+	unsigned int p;
+	struct peer_dictionary *thispeer;
+	for (si = 0; si < get_workers(); si++) for (p = 0; p <= get_worker_peers(si); p++) {
+		thispeer = (p > 0) ? get_worker_peer(si, p-1) : NULL;
+		if ((p > 0) && ((thispeer == NULL) || (thispeer->compressor == get_worker_compressor(si)))) continue; // Not ready, or hub (already counted)
+		getStatistics((p == 0) ? get_worker_compressor(si) : thispeer->compressor,&cs);
 		csAggregate.inputBytes += cs.inputBytes;		
 		csAggregate.outputBytes += cs.outputBytes;		
 		csAggregate.processedPackets += cs.processedPackets;		
@@ -130,6 +187,14 @@ int cli_show_stats_in_dedup(int client_fd, char **parameters, int numparameters)
 		csAggregate.numberOfRMObsoleteOrBadFP += cs.numberOfRMObsoleteOrBadFP;		
 		csAggregate.numberOfRMLinearSearches += cs.numberOfRMLinearSearches;		
 		csAggregate.numberOfRMCannotFind += cs.numberOfRMCannotFind;		
+		csAggregate.packetReferences += cs.packetReferences;
+		csAggregate.predictedMatches += cs.predictedMatches;
+		csAggregate.extendedBytes += cs.extendedBytes;
+		csAggregate.deltaPackets += cs.deltaPackets;
+		csAggregate.selfReferences += cs.selfReferences;
+		csAggregate.resentPackets += cs.resentPackets;
+		csAggregate.unackedMatches += cs.unackedMatches;
+		csAggregate.refusedPackets += cs.refusedPackets;
 	}
 	memset(msg, 0, MAX_BUFFER_SIZE);
 	sprintf(msg,"Compressor statistics\n");
@@ -162,6 +227,22 @@ int cli_show_stats_in_dedup(int client_fd, char **parameters, int numparameters)
 	cli_send_feedback(client_fd, msg);
 	sprintf(msg,"RM_requests_not_found.value %" PRIu64 "\n", csAggregate.numberOfRMCannotFind);
 	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"packet_references.value %" PRIu64 "\n", csAggregate.packetReferences);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"predicted_matches.value %" PRIu64 "\n", csAggregate.predictedMatches);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"extended_bytes.value %" PRIu64 "\n", csAggregate.extendedBytes);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"delta_packets.value %" PRIu64 "\n", csAggregate.deltaPackets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"self_references.value %" PRIu64 "\n", csAggregate.selfReferences);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"resent_packets.value %" PRIu64 "\n", csAggregate.resentPackets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"unacked_matches.value %" PRIu64 "\n", csAggregate.unackedMatches);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"refused_packets.value %" PRIu64 "\n", csAggregate.refusedPackets);
+	cli_send_feedback(client_fd, msg);
 	sprintf	(msg,"------------------------------------------------------------------\n");
 	cli_send_feedback(client_fd, msg);
 /*
@@ -263,7 +344,15 @@ int cli_reset_stats_out_dedup(int client_fd, char **parameters, int numparameter
         sprintf(msg,"-------------------------------------------------------------------------------\n");
         cli_send_feedback(client_fd, msg);
 	int si;
-	for (si=0;si<get_workers();si++) resetStatistics(get_worker_decompressor(si));
+	unsigned int p;
+	struct peer_dictionary *thispeer;
+	for (si=0;si<get_workers();si++) {
+		resetDecompStatistics(get_worker_decompressor(si));
+		for (p = 0; p < get_worker_peers(si); p++) {
+			thispeer = get_worker_peer(si, p);
+			if ((thispeer != NULL) && (thispeer->decompressor != get_worker_decompressor(si))) resetDecompStatistics(thispeer->decompressor);
+		}
+	}
 	sprintf(msg,"Decompressor statistics reset\n");
         cli_send_feedback(client_fd, msg);
 	sprintf(msg,"-------------------------------------------------------------------------------\n");
@@ -276,7 +365,15 @@ int cli_reset_stats_out_dedup_thread(int client_fd, char **parameters, int numpa
         sprintf(msg,"-------------------------------------------------------------------------------\n");
         cli_send_feedback(client_fd, msg);
 	int si;
-	for (si=0;si<get_workers();si++) resetStatistics(get_worker_decompressor(si));
+	unsigned int p;
+	struct peer_dictionary *thispeer;
+	for (si=0;si<get_workers();si++) {
+		resetDecompStatistics(get_worker_decompressor(si));
+		for (p = 0; p < get_worker_peers(si); p++) {
+			thispeer = get_worker_peer(si, p);
+			if ((thispeer != NULL) && (thispeer->decompressor != get_worker_decompressor(si))) resetDecompStatistics(thispeer->decompressor);
+		}
+	}
 	sprintf(msg,"Decompressor statistics reset\n");
         cli_send_feedback(client_fd, msg);
 	sprintf(msg,"-------------------------------------------------------------------------------\n");
@@ -290,9 +387,13 @@ int cli_show_stats_out_dedup(int client_fd, char **parameters, int numparameters
         cli_send_feedback(client_fd, msg);
 	Statistics ds, dsAggregate;
         int si;
+	unsigned int p;
+	struct peer_dictionary *thispeer;
         memset(&dsAggregate,0,sizeof(dsAggregate));
-        for (si=0;si<get_workers(); si++) {
-		getStatistics(get_worker_decompressor(si),&ds);
+        for (si=0;si<get_workers(); si++) for (p = 0; p <= get_worker_peers(si); p++) {
+		thispeer = (p > 0) ? get_worker_peer(si, p-1) : NULL;
+		if ((p > 0) && ((thispeer == NULL) || (thispeer->decompressor == get_worker_decompressor(si)))) continue; // Not ready, or already counted
+		getDecompStatistics((p == 0) ? get_worker_decompressor(si) : thispeer->decompressor,&ds);
 		dsAggregate.inputBytes += ds.inputBytes;
 		dsAggregate.outputBytes += ds.outputBytes;
 		dsAggregate.processedPackets += ds.processedPackets;
@@ -301,6 +402,12 @@ int cli_show_stats_out_dedup(int client_fd, char **parameters, int numparameters
 		dsAggregate.errorsMissingPacket += ds.errorsMissingPacket;
 		dsAggregate.errorsPacketFormat += ds.errorsPacketFormat;
 		dsAggregate.errorsPacketHash += ds.errorsPacketHash;
+		dsAggregate.packetReferences += ds.packetReferences;
+		dsAggregate.deltaPackets += ds.deltaPackets;
+		dsAggregate.selfReferences += ds.selfReferences;
+		dsAggregate.resentPackets += ds.resentPackets;
+		dsAggregate.reorderedPackets += ds.reorderedPackets;
+		dsAggregate.aheadPackets += ds.aheadPackets;
          }
 	memset(msg, 0, MAX_BUFFER_SIZE);
 	sprintf(msg,"Decompressor statistics\n");
@@ -321,6 +428,18 @@ int cli_show_stats_out_dedup(int client_fd, char **parameters, int numparameters
 	cli_send_feedback(client_fd, msg);
 	sprintf(msg,"bad_packet_hash.value %" PRIu64 "\n", dsAggregate.errorsPacketHash);
 	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"packet_references.value %" PRIu64 "\n", dsAggregate.packetReferences);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"delta_packets.value %" PRIu64 "\n", dsAggregate.deltaPackets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"self_references.value %" PRIu64 "\n", dsAggregate.selfReferences);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"resent_packets.value %" PRIu64 "\n", dsAggregate.resentPackets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"reordered_packets.value %" PRIu64 "\n", dsAggregate.reorderedPackets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"ahead_packets.value %" PRIu64 "\n", dsAggregate.aheadPackets);
+	cli_send_feedback(client_fd, msg);
 	sprintf(msg,"------------------------------------------------------------------\n");
 	cli_send_feedback(client_fd, msg);
 /***
@@ -331,7 +450,7 @@ int cli_show_stats_out_dedup(int client_fd, char **parameters, int numparameters
                         Statistics ds;
 			int si;
 			for (si=0;si<get_workers();si++) {
-	                        getStatistics(get_worker_decompressor(si),&ds);
+	                        getDecompStatistics(get_worker_decompressor(si),&ds);
 	                        memset(msg, 0, MAX_BUFFER_SIZE);
 	                        sprintf(msg,"Decompressor statistics (thread %d)\n",si);
 	                        cli_send_feedback(client_fd, msg);
@@ -365,7 +484,7 @@ int cli_show_stats_out_dedup_thread(int client_fd, char **parameters, int numpar
                         Statistics ds;
 			int si;
 			for (si=0;si<get_workers();si++) {
-	                        getStatistics(get_worker_decompressor(si),&ds);
+	                        getDecompStatistics(get_worker_decompressor(si),&ds);
 	                        memset(msg, 0, MAX_BUFFER_SIZE);
 	                        sprintf(msg,"Decompressor statistics (thread %d)\n",si);
 	                        cli_send_feedback(client_fd, msg);
@@ -403,6 +522,74 @@ int cli_show_deduplication(int client_fd, char **parameters, int numparameters)
 	}
 	cli_send_feedback(client_fd, msg);
 
+	if (unified_dictionary == true) {
+		sprintf(msg, "Dictionary: unified\n");
+	} else {
+		sprintf(msg, "Dictionary: split\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (dictionary_hub == true) {
+		sprintf(msg, "Dictionary: hub\n");
+		cli_send_feedback(client_fd, msg);
+	}
+
+	if (dedup_format == DEDUP_FORMAT_INDEX) {
+		sprintf(msg, "Packet format: indexed (v2) with peers supporting it\n");
+	} else {
+		sprintf(msg, "Packet format: FP descriptors (v1)\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (delta_encoding == true) {
+		sprintf(msg, "Delta encoding: enabled with peers supporting it\n");
+	} else {
+		sprintf(msg, "Delta encoding: disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (retransmission_cache == true) {
+		sprintf(msg, "Retransmission cache: enabled with peers supporting it\n");
+	} else {
+		sprintf(msg, "Retransmission cache: disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (acked_references == true) {
+		sprintf(msg, "Acknowledged references: enabled\n");
+	} else {
+		sprintf(msg, "Acknowledged references: disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (dedup_helpers > 0) {
+		sprintf(msg, "Fingerprint helpers: %u per worker\n", dedup_helpers);
+	} else {
+		sprintf(msg, "Fingerprint helpers: none\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (residue_compression == true) {
+		sprintf(msg, "Second stage compression: enabled\n");
+	} else {
+		sprintf(msg, "Second stage compression: disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (codec_selection == true) {
+		sprintf(msg, "Codec selection: per flow\n");
+	} else {
+		sprintf(msg, "Codec selection: disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	if (dictionary_shm[0] != '\0') {
+		sprintf(msg, "Dictionary memory: shared (%s)\n", dictionary_shm);
+	} else {
+		sprintf(msg, "Dictionary memory: private\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
         sprintf(msg,"------------------------------------------------------------------\n");
         cli_send_feedback(client_fd, msg);
 
@@ -445,133 +632,1575 @@ int deduplication_disable(){
 	return 0;
 }
 
+int unified_dictionary_enable(){
+	unified_dictionary = true;
+	return 0;
+}
+
+int unified_dictionary_disable(){
+	unified_dictionary = false;
+	return 0;
+}
+
+int dictionary_partition_set(char *mode){
+	if (strcmp(mode, "class") == 0) {
+		dictionary_partition = PARTITION_CLASS;
+	} else {
+		dictionary_partition = PARTITION_NONE;
+		if (strcmp(mode, "none") != 0) return -1;
+	}
+	return 0;
+}
+
 /*
- * Optimize the TCP data of an SKB.
+ * Adds a session class: quota in percent of the packet store and comma separated list of TCP ports.
  */
-unsigned int tcp_optimize(pDeduplicator pd, __u8 *ippacket, __u8 *buffered_packet) {
+int partition_class_add(unsigned int quota, char *ports){
+	struct partition_class *pc;
+	char *port, *saveptr;
+	unsigned int total = 0, i;
+
+	for (i = 1; i < partition_classes_num; i++) total += partition_classes[i].quota;
+	if ((partition_classes_num >= MAX_PARTITIONS) || (quota == 0) || (total + quota >= 100)) return -1;
+	pc = &partition_classes[partition_classes_num];
+	pc->quota = quota;
+	pc->numports = 0;
+	for (port = strtok_r(ports, ",", &saveptr); (port != NULL) && (pc->numports < MAX_CLASS_PORTS); port = strtok_r(NULL, ",", &saveptr)) {
+		pc->ports[pc->numports++] = (__u16) atoi(port);
+	}
+	partition_classes_num++;
+	return 0;
+}
 
-	struct iphdr *iph = NULL;
-	struct tcphdr *tcph = NULL;
-	__u16 oldsize = 0, newsize = 0; /* Store old, and new size of the TCP data. */
-	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
+int partition_borrow_set(int borrow){
+	partition_borrow = borrow;
+	return 0;
+}
+
+int dictionary_shm_set(char *name){
+	if (strchr(name, '/') != NULL) return -1;
+	snprintf(dictionary_shm, sizeof(dictionary_shm), "%s", name);
+	return 0;
+}
+
+int peer_dictionaries_enable(){
+	peer_dictionaries = true;
+	return 0;
+}
+
+int peer_dictionaries_disable(){
+	peer_dictionaries = false;
+	return 0;
+}
+
+int dictionary_hub_enable(){
+	dictionary_hub = true;
+	return 0;
+}
+
+int dictionary_hub_disable(){
+	dictionary_hub = false;
+	return 0;
+}
+
+/*
+ * Turns the compressor of a worker into a hub one (see setHub), for up to peer_dictionaries_max peers.
+ * Hub mode is disabled if the dictionaries are unified or partitioned.
+ */
+void setup_dictionary_hub(pDeduplicator pd){
 	char message[LOGSZ];
-	int compressed;
 
-	if (DEBUG_DEDUPLICATION == true) {
-		sprintf(message, "[DEDUP]: Entering into TCP OPTIMIZATION \n");
+	if (dictionary_hub == false) return;
+	if (peer_dictionaries_max > MAX_HUB_PEERS) peer_dictionaries_max = MAX_HUB_PEERS;
+	if (setHub(pd, peer_dictionaries_max) != 0) {
+		sprintf(message, "[DEDUP]: Hub mode needs split, not partitioned dictionaries, disabled\n");
 		logger(LOG_INFO, message);
+		dictionary_hub = false;
 	}
+}
 
-	// If the skb or state_compress is NULL abort compression.
-	if ((ippacket != NULL) && (deduplication == true)) {
-		iph = (struct iphdr *) ippacket; // Access ip header.
+int residue_compression_enable(){
+	residue_compression = true;
+	return 0;
+}
 
-		if ((iph->protocol == IPPROTO_TCP)) { // If this is not a TCP segment abort deduplication.
-			tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
-			oldsize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
-			tcpdata = (__u8 *) tcph + tcph->doff * 4; // Find starting location of the TCP data.
+int residue_compression_disable(){
+	residue_compression = false;
+	return 0;
+}
 
-			if (oldsize > 0) { // Only compress if there is any data.
+int codec_selection_enable(){
+	codec_selection = true;
+	return 0;
+}
 
-				if (DEBUG_DEDUPLICATION == true) {
-					sprintf(message,
-							"[DEDUP]: IP packet ID: %u\n", ntohs(iph->id));
-					logger(LOG_INFO, message);
-				}
+int codec_selection_disable(){
+	codec_selection = false;
+	return 0;
+}
 
-				newsize = (oldsize * 2);
+int delta_encoding_enable(){
+	delta_encoding = true;
+	return 0;
+}
 
-				if (DEBUG_DEDUPLICATION1  == true) {
-					sprintf(message, "[DEDUP]: Begin deduplication.\n");
-					logger(LOG_INFO, message);
-				}
+int delta_encoding_disable(){
+	delta_encoding = false;
+	return 0;
+}
 
-#ifdef BASIC
-				optimize(tcpdata, oldsize, buffered_packet, &newsize);
-#endif
+int retransmission_cache_enable(){
+	retransmission_cache = true;
+	return 0;
+}
 
-#ifdef ROLLING
-				dedup(pd, tcpdata, oldsize, buffered_packet, &newsize);
-#endif
-				compressed = newsize < oldsize;
+int retransmission_cache_disable(){
+	retransmission_cache = false;
+	return 0;
+}
 
-				if (DEBUG_DEDUPLICATION == true) {
-					sprintf(message,
-							"[DEDUP]: OLD SIZE: %u \t NEW SIZE: %u\n", oldsize, newsize);
-					logger(LOG_INFO, message);
-				}
+int acked_references_enable(){
+	acked_references = true;
+	return 0;
+}
 
-				if(compressed){
-
-					if (DEBUG_DEDUPLICATION == true) {
-						sprintf(message,
-								"[DEDUP]: IP packet %u COMPRESSED\n", ntohs(iph->id));
-						logger(LOG_INFO, message);
-					}
-
-					memmove(tcpdata, buffered_packet, newsize);// Move compressed data to packet.
-					// Set the ip packet and the TCP options
-					iph->tot_len = htons(ntohs(iph->tot_len) - (oldsize - newsize));// Fix packet length.
-					__set_tcp_option((__u8 *) iph, 31, 3, 1); // Set compression flag.
-                    /* Bellido: change from increasing seq number to changing most significant bit
-					tcph->seq = htonl(ntohl(tcph->seq) + 8000); // Increase SEQ number.
-                    */
-					tcph->seq = htonl(ntohl(tcph->seq) ^ 1 << 31 ); // Change most significant bit
-				}
+int acked_references_disable(){
+	acked_references = false;
+	return 0;
+}
 
-				if (DEBUG_DEDUPLICATION == true) {
-					sprintf(message, "[DEDUP]: Leaving TCP OPTIMIZATION \n");
-					logger(LOG_INFO, message);
-				}
-			}
-		}
+/*
+ * Lets a compressor dictionary delta encode packets (see setResemblance), if configured.
+ */
+void setup_dictionary_resemblance(pDeduplicator pd){
+	char message[LOGSZ];
+
+	if (delta_encoding == false) return;
+	if (setResemblance(pd) != 0) {
+		sprintf(message, "[DEDUP]: Shared dictionaries cannot delta encode packets, disabled\n");
+		logger(LOG_INFO, message);
+		delta_encoding = false;
 	}
-	return OK;
 }
 
 /*
- * Deoptimize the TCP data of an SKB.
+ * Makes a compressor dictionary only reference packets the peer acknowledged (see setAckedReferences), if configured.
  */
-unsigned int tcp_deoptimize(pDeduplicator pd, __u8 *ippacket, __u8 *regenerated_packet) {
+void setup_dictionary_acked(pDeduplicator pd){
+	char message[LOGSZ];
 
-	struct iphdr *iph = NULL;
-	struct tcphdr *tcph = NULL;
-	__u16 oldsize = 0, newsize = 0; /* Store old, and new size of the TCP data. */
-	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
+	if (acked_references == false) return;
+	if (setAckedReferences(pd, 1) != 0) {
+		sprintf(message, "[DEDUP]: Hub dictionaries cannot track acknowledged packets, acknowledged references disabled\n");
+		logger(LOG_INFO, message);
+		acked_references = false;
+	}
+}
+
+int dedup_batch_size_set(unsigned int size){
+	if ((size == 0) || (size > MAX_DEDUP_BATCH)) return -1;
+	dedup_batch_size = size;
+	return 0;
+}
+
+int dedup_helpers_set(unsigned int helpers){
+	if (helpers > MAX_FP_HELPERS) return -1;
+	dedup_helpers = helpers;
+	return 0;
+}
+
+/*
+ * Starts the fingerprint helpers of a worker (see newFingerprintHelpers), if configured.
+ */
+FPHelpers *new_dedup_helpers(int i){
+	FPHelpers *helpers;
 	char message[LOGSZ];
-	UncompReturnStatus status;
-	
 
-	if (DEBUG_DEDUPLICATION1 == true) {
-		sprintf(message, "[SDEDUP]: Entering into TCP DEOPTIMIZATION \n");
+	if (dedup_helpers == 0) return NULL;
+	helpers = newFingerprintHelpers(dedup_helpers);
+	if (helpers == NULL) {
+		sprintf(message, "[DEDUP]: Worker %d couldn't start fingerprint helpers\n", i);
 		logger(LOG_INFO, message);
 	}
+	return helpers;
+}
 
-	if ((ippacket != NULL)) { // If the skb or state_decompress is NULL abort compression.
-		iph = (struct iphdr *) ippacket; // Access ip header.
+/*
+ * Lets a compressor dictionary fingerprint large batches with the helpers of its worker.
+ */
+void setup_dictionary_helpers(pDeduplicator pd, FPHelpers *helpers){
+	if (helpers != NULL) setFingerprintHelpers(pd, helpers);
+}
 
-		if ((iph->protocol == IPPROTO_TCP)) { // If this is not a TCP segment abort compression.
+int dedup_format_set(unsigned int format){
+	if ((format != DEDUP_FORMAT_FP) && (format != DEDUP_FORMAT_INDEX)) return -1;
+	dedup_format = format;
+	return 0;
+}
 
-			if (DEBUG_DEDUPLICATION == true) {
-				sprintf(message, "[SDEDUP]: IP Packet ID %u\n", ntohs(iph->id));
-				logger(LOG_INFO, message);
-			}
+/*
+ * The indexed format needs the peer to store every packet with the same pktId,
+ * so it is not used with unified, partitioned or hub dictionaries.
+ */
+void check_dedup_format(){
+	char message[LOGSZ];
 
-			tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl); // Access tcp header.
-			oldsize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff* 4;
-			tcpdata = (__u8 *) tcph + tcph->doff * 4; // Find starting location of the TCP data.
+	if ((dedup_format == DEDUP_FORMAT_INDEX) &&
+			((unified_dictionary == true) || (dictionary_partition != PARTITION_NONE))) {
+		sprintf(message, "[DEDUP]: Indexed packet format needs split, not partitioned dictionaries, using FP descriptors\n");
+		logger(LOG_INFO, message);
+		dedup_format = DEDUP_FORMAT_FP;
+	}
+	if ((dedup_format != DEDUP_FORMAT_INDEX) && (dictionary_hub == true) &&
+			(unified_dictionary == false) && (dictionary_partition == PARTITION_NONE)) {
+		sprintf(message, "[DEDUP]: Hub mode references packets by their number at each peer, using indexed packet format\n");
+		logger(LOG_INFO, message);
+		dedup_format = DEDUP_FORMAT_INDEX;
+	}
+}
 
-			if ((oldsize > 0) && (regenerated_packet != NULL)) {
+/*
+ * Packet format option: added with the Accelerator ID to SYN and SYN/ACK packets,
+ * it tells the peer the highest compressed packet format this accelerator uncompresses,
+ * and that it uncompresses second stage compression (DEDUP_FLAG_LZ), delta packets (DEDUP_FLAG_DELTA)
+ * and retransmissions sent as first optimized (DEDUP_FLAG_RESENT).
+ * Data (1 byte): format | flags. An accelerator not sending it only uses DEDUP_FORMAT_FP.
+ */
+/*
+ * Packet formats we uncompress: the highest deduplicated format and the flags of the ones we always accept.
+ * Told to the remote accelerator at connection setup and saved as our side of the session.
+ */
+__u8 get_local_dedup_format(void){
+	return dedup_format | DEDUP_FLAG_EXTENDED | DEDUP_FLAG_RESENT | DEDUP_FLAG_DELTA | DEDUP_FLAG_LZ;
+}
 
-#ifdef BASIC
-				if(deoptimize(tcpdata, oldsize, regenerated_packet, &newsize) == 2)
-					return HASH_NOT_FOUND;
-#endif
+void set_dedup_format_option(__u8 *ippacket){
+	__set_tcp_option(ippacket, TCPOPT_DEDUP_FORMAT, 3, get_local_dedup_format());
+}
 
-#ifdef ROLLING
-				uncomp(pd,regenerated_packet, &newsize, tcpdata, oldsize, &status);
-				if(status.code == UNCOMP_FP_NOT_FOUND)
-					return HASH_NOT_FOUND;
+__u8 get_dedup_format_option(__u8 *ippacket){
+	__u64 format = __get_tcp_option(ippacket, TCPOPT_DEDUP_FORMAT);
+	if ((format & DEDUP_FORMAT_MASK) != DEDUP_FORMAT_INDEX)
+		return (format & (DEDUP_FLAG_EXTENDED | DEDUP_FLAG_RESENT | DEDUP_FLAG_DELTA | DEDUP_FLAG_LZ)) | DEDUP_FORMAT_FP;
+	return format & (DEDUP_FORMAT_MASK | DEDUP_FLAG_EXTENDED | DEDUP_FLAG_RESENT | DEDUP_FLAG_DELTA | DEDUP_FLAG_LZ);
+}
+
+/*
+ * Format of the packets sent in a session: indexed packets if both accelerators
+ * support them, otherwise delta packets if enabled and supported by both,
+ * second stage compression and the retransmission cache if enabled and supported by both,
+ * and extended references if supported by both.
+ */
+int get_session_dedup_format(struct session *thissession){
+	int format = DEDUP_FORMAT_FP;
+
+	if (((thissession->largerIPFormat & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_INDEX) &&
+			((thissession->smallerIPFormat & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_INDEX))
+		format = DEDUP_FORMAT_INDEX;
+	else if ((delta_encoding == true) && (thissession->largerIPFormat & DEDUP_FLAG_DELTA) &&
+			(thissession->smallerIPFormat & DEDUP_FLAG_DELTA))
+		format |= DEDUP_FLAG_DELTA;
+	if ((residue_compression == true) && (thissession->largerIPFormat & DEDUP_FLAG_LZ) &&
+			(thissession->smallerIPFormat & DEDUP_FLAG_LZ))
+		format |= DEDUP_FLAG_LZ;
+	if ((retransmission_cache == true) && (thissession->largerIPFormat & DEDUP_FLAG_RESENT) &&
+			(thissession->smallerIPFormat & DEDUP_FLAG_RESENT))
+		format |= DEDUP_FLAG_RESENT;
+	if ((thissession->largerIPFormat & DEDUP_FLAG_EXTENDED) && (thissession->smallerIPFormat & DEDUP_FLAG_EXTENDED))
+		format |= DEDUP_FLAG_EXTENDED;
+	return format;
+}
+
+int peer_dictionaries_max_set(unsigned int peers){
+	if (peers == 0) return -1;
+	peer_dictionaries_max = peers;
+	return 0;
+}
+
+int peer_dictionaries_total_set(unsigned int size){
+	if (size == 0) return -1;
+	peer_dictionaries_total = size;
+	return 0;
+}
+
+/*
+ * Sets the packets of the dictionaries used with one peer (peer in dotted notation),
+ * or with any peer not configured (peer NULL).
+ */
+int peer_dictionary_size_set(unsigned int size, char *peer){
+	__u32 peerID;
+
+	if (size == 0) return -1;
+	size = round_down_to_power_of_2(size);
+	if (peer == NULL) {
+		peer_dictionary_default = size;
+		return 0;
+	}
+	if ((inet_pton(AF_INET, peer, &peerID) != 1) || (peer_dictionary_sizes_num >= MAX_PEER_SIZES)) return -1;
+	peer_dictionary_sizes[peer_dictionary_sizes_num].peerID = peerID;
+	peer_dictionary_sizes[peer_dictionary_sizes_num].size = size;
+	peer_dictionary_sizes_num++;
+	return 0;
+}
+
+/*
+ * Returns the packets of a dictionary, both peers must use the same size.
+ */
+unsigned int get_dictionary_size(__u32 peerID){
+	unsigned int i;
+
+	if (peerID == 0) return PKT_STORE_SIZE();
+	for (i = 0; i < peer_dictionary_sizes_num; i++) {
+		if (peer_dictionary_sizes[i].peerID == peerID) return peer_dictionary_sizes[i].size;
+	}
+	return (peer_dictionary_default != 0) ? peer_dictionary_default : PKT_STORE_SIZE();
+}
+
+/*
+ * Returns the packets all dictionaries a worker keeps for remote accelerators may hold.
+ */
+unsigned int get_peer_dictionaries_total(void){
+	return (peer_dictionaries_total != 0) ? peer_dictionaries_total : 8 * PKT_STORE_SIZE();
+}
+
+/*
+ * Set if a remote accelerator told us at connection setup that it uncompresses indexed packets,
+ * so it sends no format 1 packets to a decompressor used only with it.
+ */
+static int dictionary_peer_indexed(__u32 peerID){
+	unsigned int i, num = __atomic_load_n(&dictionary_peers_num, __ATOMIC_ACQUIRE);
+
+	if ((peerID == 0) || (dedup_format != DEDUP_FORMAT_INDEX)) return false;
+	for (i = 0; i < num; i++) {
+		if (dictionary_peers[i].peerID == peerID)
+			return (__atomic_load_n(&dictionary_peers[i].format, __ATOMIC_ACQUIRE) & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_INDEX;
+	}
+	return false;
+}
+
+/*
+ * Creates a dictionary of a worker, the default one (peerID 0) or the one used with a remote accelerator.
+ * With dictionary_shm it lives in the shared memory segment <dictionary_shm>-<worker>-<role>[-<peerID>],
+ * and is taken over from a previous opennopd if possible.
+ * Returns NULL if there is not enough memory for the dictionary of a remote accelerator.
+ */
+pDeduplicator new_dictionary(int worker, __u32 peerID, const char *role, int unified){
+	char message[LOGSZ];
+	char name[128];
+	pDeduplicator pd = NULL;
+	unsigned int size = get_dictionary_size(peerID);
+	int indexed = (strcmp(role, "d") == 0) && dictionary_peer_indexed(peerID);
+	int attached;
+
+	if ((dictionary_shm[0] != '\0') && (dictionary_partition != PARTITION_NONE)) {
+		sprintf(message, "[DEDUP]: Partitioned dictionaries cannot be shared, using private memory\n");
+		logger(LOG_INFO, message);
+	} else if ((dictionary_shm[0] != '\0') && (dictionary_hub == true) && (strcmp(role, "c") == 0)) {
+		sprintf(message, "[DEDUP]: Hub dictionaries cannot be shared, using private memory\n");
+		logger(LOG_INFO, message);
+	} else if ((dictionary_shm[0] != '\0') && (indexed == true)) {
+		sprintf(message, "[DEDUP]: Indexed decompressor dictionaries cannot be shared, using private memory\n");
+		logger(LOG_INFO, message);
+	} else if (dictionary_shm[0] != '\0') {
+		if (peerID == 0) {
+			sprintf(name, "%s-%d-%s", dictionary_shm, worker, role);
+		} else {
+			sprintf(name, "%s-%d-%s-%08x", dictionary_shm, worker, role, ntohl(peerID));
+		}
+		pd = newSharedDeduplicator(name, size, unified, &attached);
+		if (pd != NULL) {
+			if (peerID == 0) {
+				if (attached) dictionaries_taken_over++;
+				else dictionaries_created++;
+			}
+			sprintf(message, "[DEDUP]: %s dictionary %s\n", attached ? "Took over" : "Created", name);
+			logger(LOG_INFO, message);
+			return pd;
+		}
+		sprintf(message, "[DEDUP]: Cannot share dictionary %s, using private memory\n", name);
+		logger(LOG_INFO, message);
+	}
+	if (peerID == 0) {
+		dictionaries_created++;
+		if (unified) return newUnifiedDeduplicatorOfSize(size);
+		return newDeduplicatorOfSize(size);
+	}
+	if (unified) return tryNewUnifiedDeduplicatorOfSize(size);
+	// No FPs are needed to uncompress indexed packets; the worker decompressor also serves accelerators sending format 1 ones
+	if (indexed == true) return tryNewIndexDeduplicatorOfSize(size);
+	return tryNewDeduplicatorOfSize(size);
+}
+
+int cli_show_dictionary_peers(int client_fd, char **parameters, int numparameters) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	char strIP[INET_ADDRSTRLEN];
+	struct peer_dictionary *thispeer;
+	Statistics cs, ds;
+	unsigned int p, numpeers, known;
+	uint64_t references;
+	int si;
+
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	if ((peer_dictionaries == false) && (dictionary_hub == false)) {
+		sprintf(msg,"Dictionaries are not per peer\n");
+		cli_send_feedback(client_fd, msg);
+	}
+	for (si=0;((peer_dictionaries == true) || (dictionary_hub == true)) && (si<get_workers());si++) {
+		numpeers = get_worker_peers(si);
+		sprintf(msg,"Thread %d: %u peers (max %u)\n", si, numpeers, peer_dictionaries_max);
+		cli_send_feedback(client_fd, msg);
+		for (p = 0; p < numpeers; p++) {
+			thispeer = get_worker_peer(si, p);
+			if (thispeer == NULL) continue; // Being created, or not enough memory
+			getStatistics(thispeer->compressor, &cs);
+			getDecompStatistics(thispeer->decompressor, &ds);
+			inet_ntop(AF_INET, &thispeer->peerID, strIP, INET_ADDRSTRLEN);
+			if (dictionary_hub == true) {
+				known = getHubPeerStats(thispeer->compressor, p, &references);
+				sprintf(msg,"    %s: %u packets, %u known by the peer, %" PRIu64 " references, uncompressed %" PRIu64 "/%" PRIu64 "\n",
+						strIP, get_dictionary_size(thispeer->peerID), known, references,
+						ds.uncompressedPackets, ds.processedPackets);
+				cli_send_feedback(client_fd, msg);
+				continue;
+			}
+			sprintf(msg,"    %s: %u packets, compressed %" PRIu64 "/%" PRIu64 ", uncompressed %" PRIu64 "/%" PRIu64 ", bytes %" PRIu64 " -> %" PRIu64 "\n",
+					strIP, get_dictionary_size(thispeer->peerID), cs.compressedPackets, cs.processedPackets,
+					ds.uncompressedPackets, ds.processedPackets, cs.inputBytes, cs.outputBytes);
+			cli_send_feedback(client_fd, msg);
+		}
+	}
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	return CLI_SUCCESS;
+}
+
+int dictionary_resize_max_set(unsigned int size){
+	if (size == 0) return -1;
+	dictionary_resize_max = round_down_to_power_of_2(size);
+	return 0;
+}
+
+int dictionary_sweep_set(unsigned int buckets, unsigned int interval){
+	sweep_buckets = buckets;
+	sweep_interval = interval;
+	return 0;
+}
+
+/*
+ * Starts the maintenance task of a dictionary, which empties stale FP entries in the background.
+ */
+void start_dictionary_maintenance(pDeduplicator pd){
+	char message[LOGSZ];
+
+	if (sweep_buckets == 0) return;
+	if (startMaintenance(pd, sweep_buckets, sweep_interval) != 0) {
+		sprintf(message, "[DEDUP]: Cannot start dictionary maintenance task\n");
+		logger(LOG_INFO, message);
+	}
+}
+
+static void show_maintenance_stats(int client_fd, const char *name, int si, pDeduplicator pd) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	MaintenanceStats ms;
+
+	getMaintenanceStats(pd, &ms);
+	sprintf(msg,"%s (thread %d)\n", name, si);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"    swept_buckets.value %" PRIu64 "\n", ms.sweptBuckets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"    reclaimed_entries.value %" PRIu64 "\n", ms.reclaimedEntries);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"    completed_sweeps.value %" PRIu64 "\n", ms.completedSweeps);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"    sweep_rate.value %" PRIu64 " buckets/s\n", ms.sweepRate);
+	cli_send_feedback(client_fd, msg);
+	if (ms.fpEntries > 0) {
+		sprintf(msg,"    occupancy.value %" PRIu64 "/%" PRIu64 " (%" PRIu64 "%%)\n", ms.liveEntries, ms.fpEntries,
+				ms.liveEntries * 100 / ms.fpEntries);
+		cli_send_feedback(client_fd, msg);
+	}
+}
+
+int cli_show_dictionary_maintenance(int client_fd, char **parameters, int numparameters) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	int si;
+
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	if (sweep_buckets == 0) {
+		sprintf(msg,"Dictionary maintenance disabled\n");
+		cli_send_feedback(client_fd, msg);
+	} else {
+		sprintf(msg,"Dictionary maintenance: %u buckets every %u ms\n", sweep_buckets, sweep_interval);
+		cli_send_feedback(client_fd, msg);
+		for (si=0;si<get_workers();si++) {
+			show_maintenance_stats(client_fd, "Compressor", si, get_worker_compressor(si));
+			if (get_worker_decompressor(si) != get_worker_compressor(si))
+				show_maintenance_stats(client_fd, "Decompressor", si, get_worker_decompressor(si));
+		}
+	}
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	return CLI_SUCCESS;
+}
+
+/*
+ * Partitions a new dictionary as configured. Must be called before it processes any packet.
+ */
+void setup_dictionary_partitions(pDeduplicator pd){
+	unsigned int quota[MAX_PARTITIONS];
+	unsigned int i;
+
+	if (dictionary_partition == PARTITION_CLASS) {
+		for (i = 0; i < partition_classes_num; i++) quota[i] = partition_classes[i].quota;
+		setPartitions(pd, partition_classes_num, quota, partition_borrow);
+	}
+}
+
+/*
+ * Returns the dictionary partition of a packet. Both peers must get the same partition:
+ * classes are matched against both TCP ports.
+ */
+unsigned int get_dictionary_partition(struct iphdr *iph, struct tcphdr *tcph){
+	unsigned int i, j;
+
+	if (dictionary_partition == PARTITION_CLASS) {
+		for (i = 1; i < partition_classes_num; i++) {
+			for (j = 0; j < partition_classes[i].numports; j++) {
+				if ((ntohs(tcph->source) == partition_classes[i].ports[j]) ||
+						(ntohs(tcph->dest) == partition_classes[i].ports[j])) return i;
+			}
+		}
+	}
+	return 0;
+}
+
+int cli_show_dictionary_partitions(int client_fd, char **parameters, int numparameters) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	unsigned int quota[MAX_PARTITIONS], used[MAX_PARTITIONS];
+	uint64_t evictions[MAX_PARTITIONS];
+	unsigned int num, i;
+	int si, lane;
+	pDeduplicator pd;
+
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	if (dictionary_partition == PARTITION_NONE) {
+		sprintf(msg,"Dictionary not partitioned\n");
+		cli_send_feedback(client_fd, msg);
+	}
+	for (si=0;(dictionary_partition != PARTITION_NONE) && (si<get_workers());si++) {
+		for (lane = 0; lane < 2; lane++) {
+			// Split dictionaries: compressor and decompressor. Unified: local and peer lanes.
+			pd = (lane == 0) ? get_worker_compressor(si) : get_worker_decompressor(si);
+			num = getPartitionStats(pd, (unified_dictionary == true) && (lane == 1), quota, used, evictions);
+			sprintf(msg,"%s (thread %d)\n", (lane == 0) ? "Compressor" : "Decompressor", si);
+			cli_send_feedback(client_fd, msg);
+			for (i = 0; i < num; i++) {
+				sprintf(msg,"    partition %u: quota %u used %u evictions %" PRIu64 "\n", i, quota[i], used[i], evictions[i]);
+				cli_send_feedback(client_fd, msg);
+			}
+		}
+	}
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	return CLI_SUCCESS;
+}
+
+static const char *resize_state_name(int state) {
+	switch (state) {
+		case DICT_ALLOCATING: return "allocating";
+		case DICT_PENDING: return "pending";
+		case DICT_MIGRATING: return "migrating";
+		default: return "stable";
+	}
+}
+
+static unsigned int log2_of(unsigned int x) {
+	unsigned int l = 0;
+	while (x >>= 1) l++;
+	return l;
+}
+
+int cli_dictionary_resize(int client_fd, char **parameters, int numparameters) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	unsigned int num_pkts = 0, fps_factor = FPS_FACTOR();
+	int si;
+
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	if ((numparameters < 1) || (numparameters > 2) || (sscanf(parameters[0], "%u", &num_pkts) != 1) || (num_pkts == 0) ||
+			((numparameters == 2) && ((sscanf(parameters[1], "%u", &fps_factor) != 1) || (fps_factor == 0) || (fps_factor > MAX_FPS_FACTOR)))) {
+		sprintf(msg,"Usage: dictionary resize <num_pkt_cache_size> [fps_factor]. fps_factor between 1 and %d.\n", MAX_FPS_FACTOR);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"------------------------------------------------------------------\n");
+		cli_send_feedback(client_fd, msg);
+		return CLI_ERR_CMD;
+	}
+	num_pkts = round_down_to_power_of_2(num_pkts);
+	fps_factor = round_down_to_power_of_2(fps_factor);
+
+	for (si=0;si<get_workers();si++) {
+		if (requestResize(get_worker_compressor(si), num_pkts, fps_factor) == 0) {
+			sprintf(msg,"Thread %d: resizing to %u packets, fps_factor %u\n", si, num_pkts, fps_factor);
+		} else {
+			sprintf(msg,"Thread %d: cannot resize (resize in progress, unified, partitioned or shared dictionary)\n", si);
+		}
+		cli_send_feedback(client_fd, msg);
+	}
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	return CLI_SUCCESS;
+}
+
+static void show_resize_status(int client_fd, const char *name, int si, pDeduplicator pd) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	ResizeStatus rs;
+
+	getResizeStatus(pd, &rs);
+	sprintf(msg,"%s (thread %d): epoch %u, %s, %u packets, %u FP buckets\n", name, si, rs.epoch,
+			resize_state_name(rs.state), rs.pktStoreSize, rs.fpStoreSize);
+	cli_send_feedback(client_fd, msg);
+	if (rs.state == DICT_MIGRATING) {
+		sprintf(msg,"    packets migrated %" PRIu64 "/%" PRIu64 ", FP buckets migrated %u/%u\n",
+				rs.pktsMigrated, rs.pktsToMigrate, rs.bucketsMigrated, rs.bucketsToMigrate);
+		cli_send_feedback(client_fd, msg);
+	}
+}
+
+int cli_show_dictionary_resize(int client_fd, char **parameters, int numparameters) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	int si;
+
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	for (si=0;si<get_workers();si++) {
+		show_resize_status(client_fd, "Compressor", si, get_worker_compressor(si));
+		if (get_worker_decompressor(si) != get_worker_compressor(si))
+			show_resize_status(client_fd, "Decompressor", si, get_worker_decompressor(si));
+	}
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	return CLI_SUCCESS;
+}
+
+/*
+ * Dictionary control option: once resized the compressor tells the peer its epoch and store sizes on every packet,
+ * so a peer that missed the first ones, or refused to resize, still learns them.
+ * Data (4 bytes): epoch, log2(num_pkt_cache_size), log2(fps_factor), reserved.
+ */
+static void set_dictionary_option(pDeduplicator pd, __u8 *ippacket, int epoch) {
+	ResizeStatus rs;
+	__u32 control;
+
+	getResizeStatus(pd, &rs);
+	// A packet of a batch stored before the switch to the current epoch must not announce it (epoch -1 if not batched)
+	if (rs.announce && ((epoch < 0) || (epoch == rs.epoch))) {
+		control = ((__u32) rs.epoch << 24) | (log2_of(rs.pktStoreSize) << 16) |
+				(log2_of(rs.fpStoreSize / rs.pktStoreSize / FP_PER_PKT()) << 8);
+		__set_tcp_option(ippacket, TCPOPT_DICTIONARY, 6, control);
+	}
+}
+
+/*
+ * Caches a packet received as it is, in the place the peer stored it if it says so (see set_pktid_option).
+ */
+static void cache_received(pDeduplicator pd, unsigned int partition, __u8 *ippacket, __u8 *data, __u16 datasize) {
+	__u32 pktIdLow;
+
+	pktIdLow = (__u32) __get_tcp_option(ippacket, TCPOPT_PKTID);
+	if (pktIdLow != 0) update_caches_at(pd, partition, data, datasize, pktIdLow);
+	else update_caches(pd, partition, data, datasize);
+}
+
+static void check_dictionary_option(pDeduplicator pd, __u8 *ippacket) {
+	char message[LOGSZ];
+	ResizeStatus rs;
+	__u32 control;
+	__u8 epoch, diff;
+	unsigned int pktsLog2, factorLog2, size, factor, limit;
+
+	control = (__u32) __get_tcp_option(ippacket, TCPOPT_DICTIONARY);
+	if (control == 0) return;
+	epoch = control >> 24;
+	pktsLog2 = (control >> 16) & 0xff;
+	factorLog2 = (control >> 8) & 0xff;
+
+	getResizeStatus(pd, &rs);
+	diff = epoch - rs.epoch;
+	if ((diff == 0) || (diff >= 128)) return; // Current or older epoch
+	// Bad sizes are passed as 0 so applyResize refuses them, and the epoch is only logged once
+	size = (pktsLog2 <= 30) ? 1U << pktsLog2 : 0;
+	factor = (factorLog2 <= log2_of(MAX_FPS_FACTOR)) ? 1U << factorLog2 : 0;
+	limit = (dictionary_resize_max != 0) ? dictionary_resize_max : 4 * PKT_STORE_SIZE();
+	switch (applyResize(pd, epoch, size, factor, limit)) {
+	case 0:
+		sprintf(message, "[DEDUP]: Peer dictionary epoch %u, resizing to %u packets, fps_factor %u\n", epoch, size, factor);
+		logger(LOG_INFO, message);
+		break;
+	case -1:
+		sprintf(message, "[DEDUP]: Refusing peer dictionary epoch %u (log2 of sizes %u and %u, dictionary_resize_max %u)\n",
+				epoch, pktsLog2, factorLog2, limit);
+		logger(LOG_INFO, message);
+		break;
+	}
+}
+
+/*
+ * A remote accelerator that restarted comes back with its configured sizes at epoch 0: a decompressor used only
+ * with it, that it had resized (see check_dictionary_option), is resized back to them. The peer tells its epoch
+ * again if it resizes once more.
+ */
+void reset_dictionary_resize(pDeduplicator pd, __u32 peerID){
+	char message[LOGSZ];
+	char strIP[INET_ADDRSTRLEN];
+	ResizeStatus rs;
+	unsigned int size = get_dictionary_size(peerID);
+
+	getResizeStatus(pd, &rs);
+	if (rs.epoch == 0) return;
+	if (applyResize(pd, 0, size, FPS_FACTOR(), size) == 0) {
+		inet_ntop(AF_INET, &peerID, strIP, INET_ADDRSTRLEN);
+		sprintf(message, "[DEDUP]: Accelerator %s restarted, resizing its decompressor dictionary back to %u packets, fps_factor %u\n",
+				strIP, size, FPS_FACTOR());
+		logger(LOG_INFO, message);
+	}
+}
+
+/*
+ * Dictionary generation: drawn when the workers start with empty dictionaries. If they were all taken over
+ * from shared memory the previous one is kept, in the file <dictionary_shm>-generation next to them.
+ */
+void setup_dictionary_generation(){
+	char message[LOGSZ];
+	char path[128];
+	struct timeval tv;
+	unsigned int generation = 0;
+	FILE *f;
+
+	if (dictionary_shm[0] != '\0') {
+		snprintf(path, sizeof(path), "/dev/shm/%s-generation", dictionary_shm);
+		if ((dictionaries_created == 0) && (dictionaries_taken_over > 0) && ((f = fopen(path, "r")) != NULL)) {
+			if (fscanf(f, "%u", &generation) != 1) generation = 0;
+			fclose(f);
+		}
+	}
+	if ((generation == 0) || (generation > 0xffff)) {
+		gettimeofday(&tv, NULL);
+		generation = ((tv.tv_sec ^ tv.tv_usec ^ (getpid() << 16)) * 2654435761U) >> 16;
+		if (generation == 0) generation = 1;
+	}
+	dictionary_generation = generation;
+	if ((dictionary_shm[0] != '\0') && ((f = fopen(path, "w")) != NULL)) {
+		fprintf(f, "%u\n", generation);
+		fclose(f);
+	}
+	sprintf(message, "[DEDUP]: Dictionary generation %u\n", generation);
+	logger(LOG_INFO, message);
+}
+
+/*
+ * Current sizes of the compressor or decompressor dictionary a worker uses with a remote accelerator, as told
+ * in the dictionary hello option: log2 of its packets (0 if not known: in a SYN if dictionaries are per peer,
+ * it is then told in the SYN/ACK) and of its fps_factor (HELLO_NO_FPS for a decompressor keeping no FPs).
+ * Dictionaries not created yet will have the configured sizes.
+ */
+#define HELLO_NO_FPS 7
+static void hello_dictionary_sizes(__u32 peerID, int worker, int compressor, unsigned int *pktsLog2, unsigned int *factorLog2){
+	pDeduplicator pd;
+	ResizeStatus rs;
+
+	*pktsLog2 = 0;
+	*factorLog2 = log2_of(FPS_FACTOR());
+	if ((peer_dictionaries == false) && (dictionary_hub == false)) peerID = 0;
+	else if (peerID == 0) return;
+	// The hub compressor, and its decompressor if shared, serve all the peers and are never resized
+	pd = ((dictionary_hub == true) && ((compressor == true) || (peer_dictionaries == false))) ? NULL :
+			find_worker_peer_dictionary(worker, peerID, compressor);
+	if (pd == NULL) {
+		*pktsLog2 = log2_of(get_dictionary_size(peerID));
+		return;
+	}
+	getResizeStatus(pd, &rs);
+	*pktsLog2 = log2_of(rs.pktStoreSize);
+	if (rs.fpStoreSize < rs.pktStoreSize * FP_PER_PKT()) *factorLog2 = HELLO_NO_FPS;
+	else *factorLog2 = log2_of(rs.fpStoreSize / rs.pktStoreSize / FP_PER_PKT());
+}
+
+/*
+ * Digest of the parameters both accelerators must share besides the dictionary sizes: pkt_size, fp_per_pkt,
+ * unified_dictionary and dictionary_partition.
+ */
+static __u8 hello_params_digest(){
+	__u32 params = (__u32) MAX_PKT_SIZE() << 8 | FP_PER_PKT() | (__u32) (unified_dictionary == true) << 28 |
+			(__u32) dictionary_partition << 29;
+	return (params * 2654435761U) >> 24;
+}
+
+/*
+ * Dictionary hello option: added with the Accelerator ID to SYN and SYN/ACK packets. A peer seeing a new generation
+ * knows this accelerator lost its dictionaries and flushes the ones it uses with it (see dictionary_peer_restarts);
+ * if the sizes do not match those of its compressor it does not deduplicate the packets it sends to it
+ * (see dictionary_peer_mismatch). The current sizes of the decompressor used with the peer are told, so they follow
+ * the dictionary resizes of the peer (see check_dictionary_option).
+ * Data (4 bytes): generation (16 bits), log2(packets of the decompressor used with the peer, 0 if not known) (5 bits),
+ * log2(its fps_factor) (3 bits), digest of pkt_size, fp_per_pkt and the dictionary mode (8 bits).
+ * worker is the one of the session.
+ */
+void set_dictionary_hello_option(__u8 *ippacket, __u32 peerID, int worker){
+	unsigned int pktsLog2, factorLog2;
+	__u32 hello;
+
+	if (dictionary_generation == 0) return;
+	hello_dictionary_sizes(peerID, worker, false, &pktsLog2, &factorLog2);
+	hello = ((__u32) dictionary_generation << 16) | (pktsLog2 << 11) | (factorLog2 << 8) | hello_params_digest();
+	__set_tcp_option(ippacket, TCPOPT_DICTIONARY_HELLO, 6, hello);
+}
+
+static int hello_mismatch(__u32 hello, __u32 remoteID, int worker, int previous){
+	unsigned int pktsLog2, factorLog2;
+	int mismatch = 0;
+
+	hello_dictionary_sizes(remoteID, worker, true, &pktsLog2, &factorLog2);
+	if (((hello >> 11) & 0x1f) == 0) mismatch |= previous & DICT_MISMATCH_SIZE; // Not told
+	else if ((pktsLog2 != 0) && (((hello >> 11) & 0x1f) != pktsLog2)) mismatch |= DICT_MISMATCH_SIZE;
+	// Indexed packets need no FPs in the decompressor
+	if ((((hello >> 8) & 0x7) != HELLO_NO_FPS) && (((hello >> 8) & 0x7) != factorLog2)) mismatch |= DICT_MISMATCH_FPS;
+	if ((hello & 0xff) != hello_params_digest()) mismatch |= DICT_MISMATCH_PARAMS;
+	return mismatch;
+}
+
+/*
+ * Keeps the dictionary hello option of a remote accelerator, returns its entry plus one (0 if none) for the session.
+ * Only called by the fetcher, workers read the entries with no lock.
+ */
+__u16 get_dictionary_hello_option(__u8 *ippacket, __u32 remoteID, int worker){
+	struct dictionary_peer *thispeer = NULL;
+	__u32 hello = (__u32) __get_tcp_option(ippacket, TCPOPT_DICTIONARY_HELLO);
+	char message[LOGSZ];
+	char strIP[INET_ADDRSTRLEN];
+	unsigned int i;
+	int mismatch;
+
+	if ((hello == 0) || (remoteID == 0)) return 0;
+	inet_ntop(AF_INET, &remoteID, strIP, INET_ADDRSTRLEN);
+	pthread_mutex_lock(&dictionary_peers_lock);
+	for (i = 0; i < dictionary_peers_num; i++) {
+		if (dictionary_peers[i].peerID == remoteID) {
+			thispeer = &dictionary_peers[i];
+			break;
+		}
+	}
+	if ((thispeer == NULL) && (dictionary_peers_num < MAX_DICTIONARY_PEERS)) {
+		thispeer = &dictionary_peers[dictionary_peers_num];
+		thispeer->peerID = remoteID;
+		thispeer->hello = hello;
+		thispeer->restarts = 0;
+		thispeer->flushes = 0;
+		thispeer->format = DEDUP_FORMAT_FP;
+		thispeer->mismatch = 0;
+		__atomic_store_n(&dictionary_peers_num, dictionary_peers_num + 1, __ATOMIC_RELEASE);
+	} else if (thispeer == NULL) {
+		pthread_mutex_unlock(&dictionary_peers_lock);
+		return 0;
+	} else if ((hello >> 16) != (thispeer->hello >> 16)) {
+		__atomic_store_n(&thispeer->restarts, thispeer->restarts + 1, __ATOMIC_RELEASE);
+		sprintf(message, "[DEDUP]: Accelerator %s restarted (dictionary generation %u), flushing the dictionaries used with it\n",
+				strIP, hello >> 16);
+		logger(LOG_INFO, message);
+	}
+	thispeer->hello = hello;
+	__atomic_store_n(&thispeer->format, get_dedup_format_option(ippacket), __ATOMIC_RELEASE);
+	mismatch = hello_mismatch(hello, remoteID, worker, thispeer->mismatch);
+	if (mismatch != thispeer->mismatch) {
+		__atomic_store_n(&thispeer->mismatch, mismatch, __ATOMIC_RELEASE);
+		if (mismatch != 0) {
+			sprintf(message, "[DEDUP]: Dictionaries of accelerator %s do not match (%s%s%s), packets sent to it are not deduplicated\n",
+					strIP, (mismatch & DICT_MISMATCH_SIZE) ? " num_pkt_cache_size" : "",
+					(mismatch & DICT_MISMATCH_FPS) ? " fps_factor" : "", (mismatch & DICT_MISMATCH_PARAMS) ? " pkt_size/fp_per_pkt/dictionary mode" : "");
+		} else {
+			sprintf(message, "[DEDUP]: Dictionaries of accelerator %s match again\n", strIP);
+		}
+		logger(LOG_INFO, message);
+	}
+	i = thispeer - dictionary_peers;
+	pthread_mutex_unlock(&dictionary_peers_lock);
+	return i + 1;
+}
+
+/*
+ * Restarts of the remote accelerator of a dictionary handshake entry: a worker flushes a dictionary used with it
+ * when they change.
+ */
+__u32 dictionary_peer_restarts(__u16 hello){
+	if ((hello == 0) || (hello > MAX_DICTIONARY_PEERS)) return 0;
+	return __atomic_load_n(&dictionary_peers[hello - 1].restarts, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Set if the dictionaries of the remote accelerator of a dictionary handshake entry do not match ours.
+ */
+int dictionary_peer_mismatch(__u16 hello){
+	if ((hello == 0) || (hello > MAX_DICTIONARY_PEERS)) return 0;
+	return __atomic_load_n(&dictionary_peers[hello - 1].mismatch, __ATOMIC_ACQUIRE);
+}
+
+void dictionary_peer_flushed(__u16 hello){
+	if ((hello == 0) || (hello > MAX_DICTIONARY_PEERS)) return;
+	__sync_fetch_and_add(&dictionary_peers[hello - 1].flushes, 1);
+}
+
+int cli_show_dictionary_handshake(int client_fd, char **parameters, int numparameters) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	char strIP[INET_ADDRSTRLEN];
+	struct dictionary_peer *thispeer;
+	unsigned int i, num;
+	int mismatch;
+
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg,"Dictionary generation %u, %u packets, fps_factor %u, pkt_size %u, fp_per_pkt %u\n",
+			dictionary_generation, PKT_STORE_SIZE(), FPS_FACTOR(), MAX_PKT_SIZE(), FP_PER_PKT());
+	cli_send_feedback(client_fd, msg);
+	num = __atomic_load_n(&dictionary_peers_num, __ATOMIC_ACQUIRE);
+	for (i = 0; i < num; i++) {
+		thispeer = &dictionary_peers[i];
+		inet_ntop(AF_INET, &thispeer->peerID, strIP, INET_ADDRSTRLEN);
+		mismatch = dictionary_peer_mismatch(i + 1);
+		sprintf(msg,"    %s: generation %u, restarts %u, dictionaries flushed %u, %s%s%s%s\n",
+				strIP, thispeer->hello >> 16, dictionary_peer_restarts(i + 1), thispeer->flushes,
+				(mismatch != 0) ? "mismatch:" : "match", (mismatch & DICT_MISMATCH_SIZE) ? " num_pkt_cache_size" : "",
+				(mismatch & DICT_MISMATCH_FPS) ? " fps_factor" : "", (mismatch & DICT_MISMATCH_PARAMS) ? " pkt_size/fp_per_pkt/dictionary mode" : "");
+		cli_send_feedback(client_fd, msg);
+	}
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	return CLI_SUCCESS;
+}
+
+/*
+ * Codec selection: the yield of a codec on a flow is averaged over its last packets.
+ */
+static void codec_feedback(__u16 *yield, unsigned int in, unsigned int out) {
+	unsigned int sample = (out < in) ? ((in - out) << 8) / in : 0;
+
+	*yield = (7 * (unsigned int) *yield + sample) / 8;
+}
+
+/*
+ * Quick entropy estimate: compressed or encrypted data shows almost as many different byte values in a sample
+ * as random data does (about 57 in 64 bytes), text or structured data far fewer.
+ */
+#define CODEC_SAMPLE 64
+#define CODEC_RANDOM_BYTES 48
+static int looks_random(__u8 *data, __u16 datasize) {
+	__u32 seen[8] = { 0 };
+	unsigned int i, step, distinct = 0;
+
+	if (datasize < CODEC_SAMPLE) return false;
+	step = datasize / CODEC_SAMPLE;
+	for (i = 0; i < CODEC_SAMPLE; i++) {
+		__u8 b = data[i * step];
+		if (!(seen[b >> 5] & (1u << (b & 31)))) {
+			seen[b >> 5] |= 1u << (b & 31);
+			distinct++;
+		}
+	}
+	return distinct >= CODEC_RANDOM_BYTES;
+}
+
+/*
+ * Codecs run on a packet of a flow: those which recently saved bytes on it, and every one now and then,
+ * so a flow whose contents change is noticed. Second stage compression is also skipped for data which looks random.
+ */
+static int choose_codec(struct codec_model *model, __u8 *data, __u16 datasize, int format) {
+	int codec = 0, explore;
+
+	if (codec_selection == false) return CODEC_DEDUP | ((format & DEDUP_FLAG_LZ) ? CODEC_LZ : 0);
+	explore = (++model->packets % CODEC_EXPLORE) == 0;
+	if (explore || (model->dedupYield >= CODEC_MIN_YIELD)) codec |= CODEC_DEDUP;
+	if ((format & DEDUP_FLAG_LZ) &&
+			(explore || ((model->lzYield >= CODEC_MIN_YIELD) && !looks_random(data, datasize)))) codec |= CODEC_LZ;
+	return codec;
+}
+
+/*
+ * Second half of the optimization: takes the deduplicated data (newsize bytes in buffered_packet,
+ * not deduplicated if newsize is not shorter than the TCP data), compresses it with QuickLZ if asked,
+ * and puts the result and the TCP options in the packet. The yield of QuickLZ is fed to model, if any.
+ */
+static void tcp_optimized(pDeduplicator pd, int format, __u8 *ippacket, __u8 *buffered_packet, __u16 newsize,
+		__u8 *lzbuffer, qlz_state_compress *state_compress, int epoch, struct codec_model *model) {
+
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	__u16 oldsize = 0, lzsize = 0; /* Store old size of the TCP data. */
+	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
+	__u8 *newdata = NULL;
+	char message[LOGSZ];
+	int compressed;
+	__u8 flag;
+
+	iph = (struct iphdr *) ippacket; // Access ip header.
+	tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
+	oldsize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
+	tcpdata = (__u8 *) tcph + tcph->doff * 4; // Find starting location of the TCP data.
+
+	compressed = newsize < oldsize;
+	flag = compressed ? (format & DEDUP_FORMAT_MASK) : 0;
+	newdata = buffered_packet;
+
+	/*
+	 * Second stage: the literal bytes left (or the whole packet if nothing
+	 * was deduplicated) are compressed, if that makes the packet shorter.
+	 */
+	if ((format & DEDUP_FLAG_LZ) && (lzbuffer != NULL) && (state_compress != NULL)) {
+		if (!compressed) newsize = oldsize;
+		lzsize = qlz_compress(compressed ? buffered_packet : tcpdata, (char *) lzbuffer, newsize, state_compress);
+		if (model != NULL) codec_feedback(&model->lzYield, newsize, lzsize);
+		if (lzsize < newsize) {
+			newsize = lzsize;
+			newdata = lzbuffer;
+			flag |= DEDUP_FLAG_LZ;
+			compressed = 1;
+		}
+	}
+
+	if (DEBUG_DEDUPLICATION == true) {
+		sprintf(message,
+				"[DEDUP]: OLD SIZE: %u \t NEW SIZE: %u\n", oldsize, newsize);
+		logger(LOG_INFO, message);
+	}
+
+	if(compressed){
+
+		if (DEBUG_DEDUPLICATION == true) {
+			sprintf(message,
+					"[DEDUP]: IP packet %u COMPRESSED\n", ntohs(iph->id));
+			logger(LOG_INFO, message);
+		}
+
+		memmove(tcpdata, newdata, newsize);// Move compressed data to packet.
+		// Set the ip packet and the TCP options
+		iph->tot_len = htons(ntohs(iph->tot_len) - (oldsize - newsize));// Fix packet length.
+		__set_tcp_option((__u8 *) iph, 31, 3, flag); // Set compression flag, its value is the packet format.
+        /* Bellido: change from increasing seq number to changing most significant bit
+		tcph->seq = htonl(ntohl(tcph->seq) + 8000); // Increase SEQ number.
+        */
+		tcph->seq = htonl(ntohl(tcph->seq) ^ 1 << 31 ); // Change most significant bit
+	}
+	// Options are set once the TCP data is in place
+	set_dictionary_option(pd, ippacket, epoch);
+}
+
+/*
+ * Optimize the TCP data of an SKB.
+ */
+unsigned int tcp_optimize(pDeduplicator pd, unsigned int partition, int peer, int format, __u8 *ippacket, __u8 *buffered_packet,
+		__u8 *lzbuffer, qlz_state_compress *state_compress) {
+
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	__u16 oldsize = 0, newsize = 0; /* Store old, and new size of the TCP data. */
+	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
+	char message[LOGSZ];
+
+	if (DEBUG_DEDUPLICATION == true) {
+		sprintf(message, "[DEDUP]: Entering into TCP OPTIMIZATION \n");
+		logger(LOG_INFO, message);
+	}
+
+	// If the skb or state_compress is NULL abort compression.
+	if ((ippacket != NULL) && (deduplication == true)) {
+		iph = (struct iphdr *) ippacket; // Access ip header.
+
+		if ((iph->protocol == IPPROTO_TCP)) { // If this is not a TCP segment abort deduplication.
+			tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
+			oldsize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
+			tcpdata = (__u8 *) tcph + tcph->doff * 4; // Find starting location of the TCP data.
+
+			if (oldsize > 0) { // Only compress if there is any data.
+
+				if (DEBUG_DEDUPLICATION == true) {
+					sprintf(message,
+							"[DEDUP]: IP packet ID: %u\n", ntohs(iph->id));
+					logger(LOG_INFO, message);
+				}
+
+				newsize = (oldsize * 2);
+
+				if (DEBUG_DEDUPLICATION1  == true) {
+					sprintf(message, "[DEDUP]: Begin deduplication.\n");
+					logger(LOG_INFO, message);
+				}
+
+#ifdef BASIC
+				optimize(tcpdata, oldsize, buffered_packet, &newsize);
+#endif
+
+#ifdef ROLLING
+				if ((format & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_INDEX) dedupIndexedToPeer(pd, peer, partition, tcpdata, oldsize, buffered_packet, &newsize);
+				else if ((format & DEDUP_FLAG_DELTA) && (peer == HUB_NO_PEER)) dedupDelta(pd, partition, tcpdata, oldsize, buffered_packet, &newsize);
+				else dedupToPeer(pd, peer, partition, tcpdata, oldsize, buffered_packet, &newsize);
+#endif
+				tcp_optimized(pd, format, ippacket, buffered_packet, newsize, lzbuffer, state_compress, -1, NULL);
+
+				if (DEBUG_DEDUPLICATION == true) {
+					sprintf(message, "[DEDUP]: Leaving TCP OPTIMIZATION \n");
+					logger(LOG_INFO, message);
+				}
+			}
+		}
+	}
+	return OK;
+}
+
+/*
+ * Batched optimization: packets are staged with tcp_optimize_batched and tcp_cache_optim_batched,
+ * and deduplicated together, in order, by dedup_batch_run (see dedup_batch in solowan_rolling.h).
+ * The packets must not be sent before dedup_batch_run returns.
+ */
+int dedup_batch_init(struct dedup_batch *batch) {
+	unsigned int i;
+
+	batch->num = 0;
+	for (i = 0; i < MAX_DEDUP_BATCH; i++) {
+		batch->buffers[i] = calloc(1, 2*BUFSIZE + 400);
+		if (batch->buffers[i] == NULL) return ERROR;
+	}
+	batch->streams = calloc(DEDUP_STREAMS, sizeof(struct dedup_stream));
+	if (batch->streams == NULL) return ERROR;
+	batch->resend = NULL;
+	if (retransmission_cache == true) {
+		batch->resend = calloc(RESEND_SLOTS, sizeof(struct resend_entry));
+		if (batch->resend == NULL) return ERROR;
+		for (i = 0; i < RESEND_SLOTS; i++) {
+			batch->resend[i].buffer = malloc(BUFFER_SIZE);
+			if (batch->resend[i].buffer == NULL) return ERROR;
+		}
+	}
+	return OK;
+}
+
+void dedup_batch_free(struct dedup_batch *batch) {
+	unsigned int i;
+
+	for (i = 0; i < MAX_DEDUP_BATCH; i++) {
+		free(batch->buffers[i]);
+		batch->buffers[i] = NULL;
+	}
+	free(batch->streams);
+	batch->streams = NULL;
+	if (batch->resend != NULL) {
+		for (i = 0; i < RESEND_SLOTS; i++) free(batch->resend[i].buffer);
+		free(batch->resend);
+		batch->resend = NULL;
+	}
+	batch->num = 0;
+}
+
+/*
+ * Match continuation and codec yields of the flow of a packet. A flow taking the slot of another one starts
+ * with no continuation, and tries every codec. The packets of the flow it replaces not yet acknowledged stay so.
+ */
+static struct dedup_stream *get_dedup_stream(struct dedup_batch *batch, pDeduplicator pd, struct iphdr *iph, struct tcphdr *tcph) {
+	struct dedup_stream *thisstream;
+	__u32 hash;
+
+	hash = (iph->saddr ^ iph->daddr ^ (((__u32) tcph->source << 16) | tcph->dest)) * 2654435761u;
+	thisstream = &batch->streams[(hash >> 16) % DEDUP_STREAMS];
+	if ((thisstream->pd != pd) || (thisstream->saddr != iph->saddr) || (thisstream->daddr != iph->daddr) ||
+			(thisstream->source != tcph->source) || (thisstream->dest != tcph->dest)) {
+		thisstream->pd = pd;
+		thisstream->saddr = iph->saddr;
+		thisstream->daddr = iph->daddr;
+		thisstream->source = tcph->source;
+		thisstream->dest = tcph->dest;
+		thisstream->stream.pktId = 0;
+		thisstream->model.dedupYield = CODEC_YIELD_INIT;
+		thisstream->model.lzYield = CODEC_YIELD_INIT;
+		thisstream->model.packets = 0;
+		thisstream->runHead = 0;
+		thisstream->runNum = 0;
+	}
+	return thisstream;
+}
+
+/*
+ * Retransmission cache slot of a segment, by connection and sequence number (all in network byte order).
+ */
+static struct resend_entry *get_resend_entry(struct dedup_batch *batch, __u32 saddr, __u32 daddr, __u16 source, __u16 dest, __u32 seq) {
+	__u32 hash;
+
+	hash = (saddr ^ daddr ^ (((__u32) source << 16) | dest) ^ seq) * 2654435761u;
+	return &batch->resend[(hash >> 16) % RESEND_SLOTS];
+}
+
+/*
+ * Keeps the deduplicated data of a packet of the batch, before it is sent, in case it is retransmitted.
+ */
+static void resend_save(struct dedup_batch *batch, unsigned int i, int format) {
+	struct iphdr *iph = (struct iphdr *) batch->ippacket[i];
+	struct tcphdr *tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
+	DedupBatchEntry *entry = &batch->entries[i];
+	struct resend_entry *saved;
+
+	if ((batch->resend == NULL) || !(format & DEDUP_FLAG_RESENT) || (entry->peer != HUB_NO_PEER) ||
+			(entry->optlen >= entry->pktlen) || (entry->optlen > BUFFER_SIZE)) return;
+	saved = get_resend_entry(batch, iph->saddr, iph->daddr, tcph->source, tcph->dest, tcph->seq);
+	saved->pd = batch->pd[i];
+	saved->saddr = iph->saddr;
+	saved->daddr = iph->daddr;
+	saved->source = tcph->source;
+	saved->dest = tcph->dest;
+	saved->seq = ntohl(tcph->seq);
+	saved->datasize = entry->pktlen;
+	saved->optlen = entry->optlen;
+	saved->format = format;
+	saved->dedupformat = entry->format;
+	saved->epoch = entry->epoch;
+	memcpy(saved->buffer, entry->optpkt, entry->optlen);
+}
+
+/*
+ * Records the pktId a packet of the batch was cached with, until the far host acknowledges its data.
+ * If there are too many runs the oldest one is dropped: its packets are never referenced.
+ */
+static void ack_run_save(struct dedup_batch *batch, unsigned int i) {
+	struct iphdr *iph = (struct iphdr *) batch->ippacket[i];
+	struct tcphdr *tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
+	struct dedup_stream *thisstream = batch->flow[i];
+	DedupBatchEntry *entry = &batch->entries[i];
+	struct ack_run *run;
+	__u32 seqEnd;
+
+	if ((acked_references == false) || (entry->pktId == 0)) return;
+	// The slot may have been taken by another flow since the packet was staged
+	if ((thisstream->saddr != iph->saddr) || (thisstream->daddr != iph->daddr) ||
+			(thisstream->source != tcph->source) || (thisstream->dest != tcph->dest)) return;
+	seqEnd = ntohl(tcph->seq) + entry->pktlen;
+	if (thisstream->runNum > 0) {
+		run = &thisstream->runs[(thisstream->runHead + thisstream->runNum - 1) % ACK_RUNS];
+		if ((entry->pktId == run->last + 1) && !SEQ_BEFORE(seqEnd, run->seqEnd)) {
+			run->last = entry->pktId;
+			run->seqEnd = seqEnd;
+			return;
+		}
+	}
+	if (thisstream->runNum == ACK_RUNS) {
+		thisstream->runHead = (thisstream->runHead + 1) % ACK_RUNS;
+		thisstream->runNum--;
+	}
+	run = &thisstream->runs[(thisstream->runHead + thisstream->runNum) % ACK_RUNS];
+	run->seqEnd = seqEnd;
+	run->first = entry->pktId;
+	run->last = entry->pktId;
+	thisstream->runNum++;
+}
+
+static void dedup_batch_add(struct dedup_batch *batch, pDeduplicator pd, unsigned int partition, int peer, int format,
+		__u8 *ippacket, int optimize, __u8 *lzbuffer, qlz_state_compress *state_compress) {
+
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	__u16 datasize = 0;
+	DedupBatchEntry *entry;
+	struct dedup_stream *thisstream;
+	int codec = -1;
+
+	if (ippacket == NULL) return;
+	iph = (struct iphdr *) ippacket; // Access ip header.
+	if (iph->protocol != IPPROTO_TCP) return; // If this is not a TCP segment abort deduplication.
+	tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
+	datasize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
+	if (datasize == 0) return;
+
+	if (batch->num == MAX_DEDUP_BATCH) dedup_batch_run(batch, lzbuffer, state_compress);
+
+	entry = &batch->entries[batch->num];
+	entry->packet = (__u8 *) tcph + tcph->doff * 4;
+	entry->pktlen = datasize;
+	thisstream = get_dedup_stream(batch, pd, iph, tcph);
+	if (optimize) codec = choose_codec(&thisstream->model, entry->packet, datasize, format);
+	entry->partition = partition;
+	entry->peer = peer;
+	if ((format & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_INDEX) entry->format = DEDUP_FORMAT_INDEX;
+	else if (format & DEDUP_FLAG_DELTA) entry->format = DEDUP_FORMAT_DELTA;
+	else entry->format = DEDUP_FORMAT_FP;
+	if (format & DEDUP_FLAG_EXTENDED) entry->format |= DEDUP_EXTENDED;
+	// A packet not looked up is still cached, as the peer caches it
+	entry->optpkt = ((codec >= 0) && (codec & CODEC_DEDUP)) ? batch->buffers[batch->num] : NULL;
+	entry->stream = &thisstream->stream;
+	batch->pd[batch->num] = pd;
+	batch->ippacket[batch->num] = ippacket;
+	batch->format[batch->num] = format;
+	batch->codec[batch->num] = codec;
+	batch->flow[batch->num] = thisstream;
+	batch->num++;
+}
+
+void tcp_optimize_batched(struct dedup_batch *batch, pDeduplicator pd, unsigned int partition, int peer, int format, __u8 *ippacket,
+		__u8 *lzbuffer, qlz_state_compress *state_compress) {
+	if (deduplication == true) dedup_batch_add(batch, pd, partition, peer, format, ippacket, true, lzbuffer, state_compress);
+}
+
+void tcp_cache_optim_batched(struct dedup_batch *batch, pDeduplicator pd, unsigned int partition, int peer, int format, __u8 *ippacket,
+		__u8 *lzbuffer, qlz_state_compress *state_compress) {
+	dedup_batch_add(batch, pd, partition, peer, format, ippacket, false, lzbuffer, state_compress);
+}
+
+/*
+ * Tells the peer the pktId a packet of the batch sent as it is, or only compressed with QuickLZ, was stored with,
+ * so it stores it in the same place whatever the order it arrives in (see update_caches_at). Only needed for
+ * DEDUP_FORMAT_INDEX, whose references are pktIds, and deduplicated packets carry theirs already.
+ */
+static void set_pktid_option(struct dedup_batch *batch, unsigned int i, int deduplicated) {
+	DedupBatchEntry *entry = &batch->entries[i];
+
+	if (deduplicated || (entry->pktId <= 0) || ((batch->format[i] & DEDUP_FORMAT_MASK) != DEDUP_FORMAT_INDEX)) return;
+	if ((__u32) entry->pktId == 0) return; // Would read as no option, the peer stores it as the next one
+	__set_tcp_option(batch->ippacket[i], TCPOPT_PKTID, 6, (__u32) entry->pktId);
+}
+
+void dedup_batch_run(struct dedup_batch *batch, __u8 *lzbuffer, qlz_state_compress *state_compress) {
+	DedupBatchEntry *entry;
+	unsigned int i, first;
+	int codec, format;
+
+	// Consecutive packets of the same dictionary are deduplicated with one call
+	for (first = 0, i = 1; i <= batch->num; i++) {
+		if ((i == batch->num) || (batch->pd[i] != batch->pd[first])) {
+			dedup_batch(batch->pd[first], &batch->entries[first], i - first);
+			first = i;
+		}
+	}
+	for (i = 0; i < batch->num; i++) {
+		entry = &batch->entries[i];
+		codec = batch->codec[i];
+		ack_run_save(batch, i); // Before the sequence number is changed
+		if (codec < 0) {
+			set_dictionary_option(batch->pd[i], batch->ippacket[i], entry->epoch);
+			set_pktid_option(batch, i, false);
+			continue;
+		}
+		// Packets too short to be deduplicated tell nothing about the flow
+		if ((codec & CODEC_DEDUP) && (entry->pktlen >= BETA)) codec_feedback(&batch->flow[i]->model.dedupYield, entry->pktlen, entry->optlen);
+		format = (codec & CODEC_LZ) ? batch->format[i] : batch->format[i] & ~DEDUP_FLAG_LZ;
+		if (codec & CODEC_DEDUP) resend_save(batch, i, format);
+		// Not looked up: sent as it is, unless second stage compression makes it shorter
+		tcp_optimized(batch->pd[i], format, batch->ippacket[i], batch->buffers[i],
+				(codec & CODEC_DEDUP) ? entry->optlen : entry->pktlen,
+				lzbuffer, state_compress, entry->epoch, &batch->flow[i]->model);
+		set_pktid_option(batch, i, (codec & CODEC_DEDUP) && (entry->optlen < entry->pktlen));
+	}
+	batch->num = 0;
+}
+
+/*
+ * Retransmission of a segment (see checkseqnumber): if the same segment was deduplicated when first sent, and
+ * every packet its deduplicated data references is still cached, it is sent again that way, with DEDUP_FLAG_RESENT,
+ * and not cached again. The peer caches it only if it does not hold it, that is, if the first copy was lost.
+ * Otherwise, ERROR is returned and the packet is handled as any other retransmission.
+ * A retransmission covering other bytes than a segment sent (repacketized) is not found.
+ */
+unsigned int tcp_resend_batched(struct dedup_batch *batch, pDeduplicator pd, int format, __u8 *ippacket,
+		__u8 *lzbuffer, qlz_state_compress *state_compress) {
+
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	__u16 datasize = 0;
+	struct resend_entry *saved;
+	char message[LOGSZ];
+
+	if ((deduplication == false) || (batch->resend == NULL) || !(format & DEDUP_FLAG_RESENT) || (ippacket == NULL)) return ERROR;
+	iph = (struct iphdr *) ippacket; // Access ip header.
+	if (iph->protocol != IPPROTO_TCP) return ERROR;
+	tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
+	datasize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
+	saved = get_resend_entry(batch, iph->saddr, iph->daddr, tcph->source, tcph->dest, tcph->seq);
+	if ((saved->optlen == 0) || (saved->pd != pd) || (saved->saddr != iph->saddr) || (saved->daddr != iph->daddr) ||
+			(saved->source != tcph->source) || (saved->dest != tcph->dest) ||
+			(saved->seq != ntohl(tcph->seq)) || (saved->datasize != datasize)) return ERROR;
+	// Packets staged before this one are sent first, so they may evict what it references
+	if (batch->num > 0) dedup_batch_run(batch, lzbuffer, state_compress);
+	if (!checkResend(pd, saved->buffer, saved->optlen, saved->dedupformat, saved->epoch)) {
+		saved->optlen = 0;
+		return ERROR;
+	}
+	if (DEBUG_DEDUPLICATION == true) {
+		sprintf(message, "[DEDUP]: Retransmission of %u bytes sent in %u\n", datasize, saved->optlen);
+		logger(LOG_INFO, message);
+	}
+	tcp_optimized(pd, saved->format, ippacket, saved->buffer, saved->optlen, lzbuffer, state_compress, saved->epoch, NULL);
+	__set_tcp_option(ippacket, 31, 3, __get_tcp_option(ippacket, 31) | DEDUP_FLAG_RESENT);
+	return OK;
+}
+
+/*
+ * Decode miss reported by the peer accelerator (see recovery_nack): the packet it does not hold is no longer
+ * referenced, and the segment is not sent deduplicated again when retransmitted. Returns 1 if the packet was found,
+ * its data copied to chunk, of *chunklen bytes, to be sent to the peer (see recovery_answer), and *chunklen set to its length.
+ */
+int tcp_refuse_batched(struct dedup_batch *batch, pDeduplicator pd, struct recovery_nack *nack, __u8 *chunk, __u16 *chunklen) {
+	struct resend_entry *saved;
+	char message[LOGSZ];
+	int refused;
+
+	if (deduplication == false) return 0;
+	refused = refuseReference(pd, (nack->format == DEDUP_FORMAT_INDEX) ? DEDUP_FORMAT_INDEX : DEDUP_FORMAT_FP,
+			be64toh(nack->ref), ntohl(nack->hash), chunk, chunklen);
+	if (batch->resend != NULL) {
+		saved = get_resend_entry(batch, nack->saddr, nack->daddr, nack->source, nack->dest, nack->seq);
+		if ((saved->pd == pd) && (saved->saddr == nack->saddr) && (saved->daddr == nack->daddr) &&
+				(saved->source == nack->source) && (saved->dest == nack->dest) && (saved->seq == ntohl(nack->seq)))
+			saved->optlen = 0;
+	}
+	if (DEBUG_DEDUPLICATION == true) {
+		sprintf(message, "[DEDUP]: Peer could not uncompress a segment, missing packet %s\n", refused ? "refused" : "not found");
+		logger(LOG_INFO, message);
+	}
+	return refused;
+}
+
+/*
+ * Acknowledgement of the data of a flow by the far host (see saveacknumber), acked as kept by the session: the
+ * packets the peer accelerator cached with it can be referenced (see setAckedReferences). It is only looked at
+ * when the flow sends again.
+ */
+void tcp_acked_batched(struct dedup_batch *batch, pDeduplicator pd, __u8 *ippacket, __u64 acked) {
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	struct dedup_stream *thisstream;
+	struct ack_run *run;
+
+	if ((deduplication == false) || (acked_references == false) || (ippacket == NULL) || (acked == 0)) return;
+	iph = (struct iphdr *) ippacket; // Access ip header.
+	if (iph->protocol != IPPROTO_TCP) return;
+	tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
+	thisstream = get_dedup_stream(batch, pd, iph, tcph);
+	while (thisstream->runNum > 0) {
+		run = &thisstream->runs[thisstream->runHead];
+		if (SEQ_BEFORE((__u32) acked, run->seqEnd)) break;
+		ackPackets(pd, run->first, run->last);
+		thisstream->runHead = (thisstream->runHead + 1) % ACK_RUNS;
+		thisstream->runNum--;
+	}
+}
+
+/*
+ * Batched deoptimization: the dictionary entries referenced by the deduplicated packets of a batch are
+ * prefetched together (see uncomp_prefetch in solowan_rolling.h), before the packets are deoptimized
+ * one by one, in order. pd[i] is the decompressor of ippacket[i], NULL to skip it.
+ */
+void tcp_deoptimize_prefetch(pDeduplicator *pd, __u8 **ippacket, unsigned int num) {
+	UncompBatchEntry entries[MAX_DEDUP_BATCH];
+	pDeduplicator batchpd[MAX_DEDUP_BATCH];
+	struct iphdr *iph;
+	struct tcphdr *tcph;
+	unsigned int i, n, first;
+	__u16 datasize;
+	__u8 flag;
+
+	for (i = 0, n = 0; (i < num) && (n < MAX_DEDUP_BATCH); i++) {
+		if (pd[i] == NULL) continue;
+		iph = (struct iphdr *) ippacket[i];
+		if (iph->protocol != IPPROTO_TCP) continue;
+		tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
+		datasize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
+		flag = __get_tcp_option(ippacket[i], 31);
+		// Second stage compressed data cannot be parsed before it is undone
+		if ((datasize == 0) || (flag & DEDUP_FLAG_LZ)) continue;
+		if (((flag & DEDUP_FORMAT_MASK) != DEDUP_FORMAT_FP) && ((flag & DEDUP_FORMAT_MASK) != DEDUP_FORMAT_INDEX)) continue;
+		entries[n].optpkt = (__u8 *) tcph + tcph->doff * 4;
+		entries[n].optlen = datasize;
+		entries[n].format = flag & DEDUP_FORMAT_MASK;
+		batchpd[n++] = pd[i];
+	}
+	// Consecutive packets of the same dictionary are prefetched with one call
+	for (first = 0, i = 1; i <= n; i++) {
+		if ((i == n) || (batchpd[i] != batchpd[first])) {
+			uncomp_prefetch(batchpd[first], &entries[first], i - first);
+			first = i;
+		}
+	}
+}
+
+/*
+ * Deoptimize the TCP data of an SKB.
+ */
+unsigned int tcp_deoptimize(pDeduplicator pd, unsigned int partition, __u8 *ippacket, __u8 *regenerated_packet,
+		__u8 *lzbuffer, qlz_state_decompress *state_decompress) {
+
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	__u16 oldsize = 0, newsize = 0, datasize = 0; /* Store old, and new size of the TCP data. */
+	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
+	__u8 *data = NULL;
+	char message[LOGSZ];
+	UncompReturnStatus status;
+	__u8 flag;
+	
+
+	if (DEBUG_DEDUPLICATION1 == true) {
+		sprintf(message, "[SDEDUP]: Entering into TCP DEOPTIMIZATION \n");
+		logger(LOG_INFO, message);
+	}
+
+	if ((ippacket != NULL)) { // If the skb or state_decompress is NULL abort compression.
+		iph = (struct iphdr *) ippacket; // Access ip header.
+
+		if ((iph->protocol == IPPROTO_TCP)) { // If this is not a TCP segment abort compression.
+
+			if (DEBUG_DEDUPLICATION == true) {
+				sprintf(message, "[SDEDUP]: IP Packet ID %u\n", ntohs(iph->id));
+				logger(LOG_INFO, message);
+			}
+
+			tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl); // Access tcp header.
+			oldsize = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff* 4;
+			tcpdata = (__u8 *) tcph + tcph->doff * 4; // Find starting location of the TCP data.
+
+			if ((oldsize > 0) && (regenerated_packet != NULL)) {
+
+#ifdef BASIC
+				if(deoptimize(tcpdata, oldsize, regenerated_packet, &newsize) == 2)
+					return HASH_NOT_FOUND;
+#endif
+
+#ifdef ROLLING
+				check_dictionary_option(pd, ippacket);
+				flag = __get_tcp_option(ippacket, 31);
+				data = tcpdata;
+				datasize = oldsize;
+				if (flag & DEDUP_FLAG_LZ) { // Second stage compression is undone first
+					if ((lzbuffer == NULL) || (state_decompress == NULL) || (oldsize < 3) ||
+							(((tcpdata[0] & 2) == 2) && (oldsize < 9)) ||
+							(qlz_size_compressed((char *) tcpdata) != oldsize) ||
+							(qlz_size_decompressed((char *) tcpdata) > BUFFER_SIZE))
+						return ERROR;
+					datasize = qlz_decompress((char *) tcpdata, lzbuffer, state_decompress);
+					data = lzbuffer;
+				}
+				status.code = UNCOMP_OK;
+				if ((flag & DEDUP_FLAG_RESENT) && (((flag & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_INDEX) ||
+						((flag & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_FP))) {
+					uncompResent(pd, partition, regenerated_packet, &newsize, data, datasize, flag & DEDUP_FORMAT_MASK, &status);
+				} else if ((flag & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_INDEX) {
+					uncompIndexed(pd, partition, regenerated_packet, &newsize, data, datasize, &status);
+				} else if ((flag & DEDUP_FORMAT_MASK) == DEDUP_FORMAT_FP) {
+					uncomp(pd, partition, regenerated_packet, &newsize, data, datasize, &status);
+				} else { // Only compressed, cached as any packet not deduplicated
+					cache_received(pd, partition, ippacket, data, datasize);
+					memcpy(regenerated_packet, data, datasize);
+					newsize = datasize;
+				}
+				if(status.code == UNCOMP_FP_NOT_FOUND) {
+					recovery_nack(ippacket, flag & DEDUP_FORMAT_MASK, status.fp, status.hash);
+					return HASH_NOT_FOUND;
+				}
+				if(status.code != UNCOMP_OK)
+					return ERROR;
 #endif
 
 				memmove(tcpdata, regenerated_packet, newsize); // Move decompressed data to packet.
@@ -604,7 +2233,7 @@ unsigned int tcp_deoptimize(pDeduplicator pd, __u8 *ippacket, __u8 *regenerated_
 /*
  * Cache the TCP data of an SKB.
  */
-unsigned int tcp_cache_deoptim(pDeduplicator pd, __u8 *ippacket) {
+unsigned int tcp_cache_deoptim(pDeduplicator pd, unsigned int partition, __u8 *ippacket) {
 	struct iphdr *iph = NULL;
 	struct tcphdr *tcph = NULL;
 	__u16 datasize = 0; /* Store the size of the TCP data. */
@@ -636,7 +2265,8 @@ unsigned int tcp_cache_deoptim(pDeduplicator pd, __u8 *ippacket) {
 #endif
 
 #ifdef ROLLING
-				update_caches(pd, tcpdata, datasize);
+				check_dictionary_option(pd, ippacket);
+				cache_received(pd, partition, ippacket, tcpdata, datasize);
 #endif
 
 
@@ -652,7 +2282,7 @@ unsigned int tcp_cache_deoptim(pDeduplicator pd, __u8 *ippacket) {
 }
 
 
-unsigned int tcp_cache_optim(pDeduplicator pd, __u8 *ippacket) {
+unsigned int tcp_cache_optim(pDeduplicator pd, unsigned int partition, int peer, __u8 *ippacket) {
 	struct iphdr *iph = NULL;
 	struct tcphdr *tcph = NULL;
 	__u16 datasize = 0; /* Store the size of the TCP data. */
@@ -684,7 +2314,8 @@ unsigned int tcp_cache_optim(pDeduplicator pd, __u8 *ippacket) {
 #endif
 
 #ifdef ROLLING
-				put_in_cache(pd, tcpdata, datasize);
+				put_in_cache_to_peer(pd, peer, partition, tcpdata, datasize);
+				set_dictionary_option(pd, ippacket, -1);
 #endif
 
 
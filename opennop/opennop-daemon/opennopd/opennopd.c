@@ -82,6 +82,7 @@
 #include "version.h"
 
 #include "deduplication.h"
+#include "recovery.h"
 #include "configure.h"
 #include "01dedup.h"
 #include "solowan_rolling.h"
@@ -293,6 +294,7 @@ int main(int argc, char *argv[]) {
  	for (i = 0; i < get_workers(); i++) {
 		create_worker(i);
 	}
+	setup_dictionary_generation();
 
 #ifdef BASIC
 	create_hashmap(&ht); // Create hash table
@@ -306,6 +308,7 @@ int main(int argc, char *argv[]) {
 	 * IP packets from the Netfilter Queue.
 	 */
 	create_fetcher();
+	create_recovery();
 	pthread_create(&t_cleanup, NULL, cleanup_function, (void *) NULL);
 	pthread_create(&t_healthagent, NULL, healthagent_function, (void *) NULL);
 	pthread_create(&t_cli, NULL, cli_manager_init, (void *) NULL);
@@ -345,6 +348,13 @@ int main(int argc, char *argv[]) {
 	register_command("compression disable", cli_compression_disable, false, false);
 	register_command("deduplication enable", cli_deduplication_enable, false, false);
 	register_command("deduplication disable", cli_deduplication_disable, false, false);
+	register_command("dictionary resize", cli_dictionary_resize, true, false);
+	register_command("show dictionary resize", cli_show_dictionary_resize, false, false);
+	register_command("show dictionary partitions", cli_show_dictionary_partitions, false, false);
+	register_command("show dictionary maintenance", cli_show_dictionary_maintenance, false, false);
+	register_command("show dictionary peers", cli_show_dictionary_peers, false, false);
+	register_command("show dictionary handshake", cli_show_dictionary_handshake, false, false);
+	register_command("show recovery", cli_show_recovery, false, false);
 
 	/*
 	 * Rejoin all threads before we exit!
@@ -108,6 +108,34 @@ struct packet *dequeue_packet(struct packet_head *queue, int signal) {
 	return thispacket;
 }
 
+/*
+ * Gets up to max packets from a queue under a single lock, in queue order.
+ * Sleeps if the queue is empty. Returns how many were taken, 0 if woken with no packets.
+ */
+u_int32_t dequeue_packets(struct packet_head *queue, struct packet **packets, u_int32_t max) {
+	struct packet *thispacket;
+	u_int32_t num = 0;
+
+	pthread_mutex_lock(&queue->lock); // Grab lock on the queue.
+
+	if (queue->qlen == 0) { // If there is no work wait for some.
+		pthread_cond_wait(&queue->signal, &queue->lock);
+	}
+
+	while ((num < max) && (queue->next != NULL)) {
+		thispacket = queue->next; // Get the next packet in the queue.
+		queue->next = thispacket->next; // Move the next packet forward in the queue.
+		queue->qlen -= 1; // Need to decrease the packet count on this queue.
+		thispacket->next = NULL;
+		thispacket->prev = NULL;
+		packets[num++] = thispacket;
+	}
+
+	pthread_mutex_unlock(&queue->lock); // Lose lock on the queue.
+
+	return num;
+}
+
 /*
  * This function moves all packet buffers from one queue to another.
  * Returns how many were moved.
@@ -563,6 +563,67 @@ int saveacceleratorid(__u32 largerIP, __u32 acceleratorID, struct iphdr *iph, st
 	return -1;// Had a problem.
 }
 
+int savededupformat(__u32 largerIP, __u8 format, struct iphdr *iph, struct session *thissession) {
+
+	if ((largerIP != 0) && (iph != NULL) && (thissession != NULL)){
+
+		if (iph->saddr == largerIP)
+		{ // Set the packet format for this source.
+			thissession->largerIPFormat = format;
+		}
+		else
+		{
+			thissession->smallerIPFormat = format;
+		}
+		return 0;// Everything  OK.
+	}
+	return -1;// Had a problem.
+}
+
+int savedictionaryhello(__u32 largerIP, __u16 hello, struct iphdr *iph, struct session *thissession) {
+
+	if ((largerIP != 0) && (iph != NULL) && (thissession != NULL)){
+
+		if (iph->saddr == largerIP)
+		{ // Set the dictionary handshake entry for this source.
+			thissession->largerIPHello = hello;
+		}
+		else
+		{
+			thissession->smallerIPHello = hello;
+		}
+		return 0;// Everything  OK.
+	}
+	return -1;// Had a problem.
+}
+
+/*
+ * Keeps the highest ACK of a packet for the data of the other side. It is read by the optimization thread
+ * (see tcp_acked_batched), so it is written at once.
+ */
+int saveacknumber(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph, struct session *thissession) {
+	__u64 *acked;
+	__u64 last;
+
+	if ((largerIP != 0) && (iph != NULL) && (tcph != NULL) && (thissession != NULL) && (tcph->ack == 1)) {
+
+		if (iph->saddr == largerIP)
+		{ // It acknowledges the data of the smallerIP.
+			acked = &thissession->smallerIPAcked;
+		}
+		else
+		{
+			acked = &thissession->largerIPAcked;
+		}
+		last = *acked;
+		if ((last == 0) || !SEQ_BEFORE(ntohl(tcph->ack_seq), (__u32) last)) {
+			*(volatile __u64 *) acked = (1ULL << 32) | ntohl(tcph->ack_seq);
+		}
+		return 0;// Everything  OK.
+	}
+	return -1;// Had a problem.
+}
+
 int updateseqnumber(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph, struct session *thissession){
 	char message[LOGSZ];
 
@@ -600,10 +661,7 @@ int checkseqnumber(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph, struc
 	if ((largerIP != 0) && (iph != NULL) && (tcph != NULL) && (thissession != NULL)) {
 
 		if (iph->saddr == largerIP) { // See what IP this is coming from.
-//			if (((ntohl(tcph->seq) - thissession->largerIPseq) % TCP_SEQ_NUMBERS) < HALF_TCP_SEQ_NUMBER) {
-			/*ToDo Change this condition: it will not work if the sequence
-			 * number restarts from	the beginning inside the same connection*/
-			if(ntohl(tcph->seq) < thissession->largerIPseq){
+			if (SEQ_BEFORE(ntohl(tcph->seq), thissession->largerIPseq)) {
 				if (DEBUG_SESSIONMANAGER_CHECK == true) {
 					sprintf(message, "[SESSION MANAGER] Out of order - LargerIPseq: Rcv %u Stored %u\n", ntohl(tcph->seq), thissession->largerIPseq);
 					logger(LOG_INFO, message);
@@ -612,8 +670,7 @@ int checkseqnumber(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph, struc
 			}
 			return 1;
 		} else {
-//			if (((ntohl(tcph->seq) - thissession->smallerIPseq) % TCP_SEQ_NUMBERS) < HALF_TCP_SEQ_NUMBER ) {
-			if(ntohl(tcph->seq) < thissession->smallerIPseq ){
+			if (SEQ_BEFORE(ntohl(tcph->seq), thissession->smallerIPseq)) {
 				if (DEBUG_SESSIONMANAGER_CHECK == true) {
 					sprintf(message, "[SESSION MANAGER] SmallerIPseq: Received Seq %u Stored Seq%u\n", ntohl(tcph->seq), thissession->smallerIPseq);
 					logger(LOG_INFO, message);
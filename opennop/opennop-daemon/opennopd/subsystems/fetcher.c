@@ -75,6 +75,7 @@
 #include "memorymanager.h"
 #include "counters.h"
 #include "climanager.h"
+#include "deduplication.h"
 
 #include <errno.h> //For error results
 
@@ -176,12 +177,15 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
 						{
 							__set_tcp_option((__u8 *)originalpacket,2,4,mms - 60); // Reduce the MSS.
 							__set_tcp_option((__u8 *)originalpacket,32,6,localID); // Add the Accelerator ID to this packet.
+							set_dedup_format_option((__u8 *)originalpacket); // Add the packet formats we uncompress.
+							set_dictionary_hello_option((__u8 *)originalpacket, 0, thissession->queue); // Add our dictionary generation and sizes.
 							/*
 							 * TCP Window Scale option seemed to break Win7 & Win8 Internet access.
 							 */
 							//__set_tcp_option((__u8 *)originalpacket,3,3,G_SCALEWINDOW); // Enable window scale.
 
 							saveacceleratorid(largerIP, localID, iph, thissession);
+							savededupformat(largerIP, get_local_dedup_format(), iph, thissession);
 
 							/*
 							 * Changing anything requires the IP and TCP
@@ -194,6 +198,8 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
 					{ // Accelerator ID was found.
 
 						saveacceleratorid(largerIP, remoteID, iph, thissession);
+						savededupformat(largerIP, get_dedup_format_option((__u8 *)originalpacket), iph, thissession);
+						savedictionaryhello(largerIP, get_dictionary_hello_option((__u8 *)originalpacket, remoteID, thissession->queue), iph, thissession);
 
 					}
 
@@ -233,12 +239,16 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
 							{
 								__set_tcp_option((__u8 *)originalpacket,2,4,mms - 60); // Reduce the MSS.
 								__set_tcp_option((__u8 *)originalpacket,32,6,localID); // Add the Accelerator ID to this packet.
+								set_dedup_format_option((__u8 *)originalpacket); // Add the packet formats we uncompress.
+								set_dictionary_hello_option((__u8 *)originalpacket, (iph->saddr == largerIP) ?
+										thissession->smallerIPAccelerator : thissession->largerIPAccelerator, thissession->queue); // Add our dictionary generation and sizes.
 								/*
 								 * TCP Window Scale option seemed to break Win7 & Win8 Internet access.
 								 */
 								//__set_tcp_option((__u8 *)originalpacket,3,3,G_SCALEWINDOW); // Enable window scale.
 
 								saveacceleratorid(largerIP, localID, iph, thissession);
+								savededupformat(largerIP, get_local_dedup_format(), iph, thissession);
 
 							}
 						}
@@ -246,6 +256,8 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
 						{ // Accelerator ID was found.
 
 							saveacceleratorid(largerIP, remoteID, iph, thissession);
+							savededupformat(largerIP, get_dedup_format_option((__u8 *)originalpacket), iph, thissession);
+							savedictionaryhello(largerIP, get_dictionary_hello_option((__u8 *)originalpacket, remoteID, thissession->queue), iph, thissession);
 
 						}
 						thissession->state = TCP_ESTABLISHED;
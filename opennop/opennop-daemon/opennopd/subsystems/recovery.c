@@ -0,0 +1,456 @@
+/*
+
+  recovery.c
+
+  This file is part of OpenNOP-SoloWAN distribution.
+
+  Copyright (C) 2014 Center for Open Middleware (COM)
+                     Universidad Politecnica de Madrid, SPAIN
+
+    OpenNOP-SoloWAN is an enhanced version of the Open Network Optimization
+    Platform (OpenNOP) developed to add it deduplication capabilities using
+    a modern dictionary based compression algorithm.
+
+    SoloWAN is a project of the Center for Open Middleware (COM) of Universidad
+    Politecnica de Madrid which aims to experiment with open-source based WAN
+    optimization solutions.
+
+  References:
+
+    SoloWAN: solowan@centeropenmiddleware.com
+             https://github.com/centeropenmiddleware/solowan/wiki
+    OpenNOP: http://www.opennop.org
+    Center for Open Middleware (COM): http://www.centeropenmiddleware.com
+    Universidad Politecnica de Madrid (UPM): http://www.upm.es
+
+  License:
+
+    OpenNOP-SoloWAN is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    OpenNOP-SoloWAN is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <endian.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h> // for tcpmagic and TCP options
+#include <netinet/tcp.h> // for tcpmagic and TCP options
+#include <arpa/inet.h>
+
+#include <linux/types.h>
+
+#include "recovery.h"
+#include "sessionmanager.h"
+#include "opennopd.h"
+#include "tcpoptions.h"
+#include "logger.h"
+#include "climanager.h"
+#include "worker.h"
+
+/* NACKs received for the sessions of each worker, taken by its optimization thread,
+ * and answers, taken by its deoptimization thread. */
+struct recovery_inbox {
+	pthread_mutex_t lock;
+	unsigned int head;
+	unsigned int num;
+	struct recovery_nack nacks[RECOVERY_INBOX];
+	unsigned int chunkhead;
+	unsigned int chunknum;
+	struct recovery_chunk chunks[RECOVERY_CHUNKS];
+	unsigned int held; // Packets held by the deoptimization thread, woken up while there are any
+};
+
+unsigned int recovery_port = 0; // UDP port of the decode miss recovery channel, 0 disables it.
+int DEBUG_RECOVERY = false;
+
+static int recoverysock = -1;
+static pthread_t t_recovery;
+static struct recovery_inbox inboxes[MAXWORKERS];
+static __u64 nacks_sent = 0;
+static __u64 nacks_received = 0;
+static __u64 nacks_ignored = 0; // Not sent by the accelerator of the session, or its worker had too many waiting.
+static __u64 packets_refused = 0;
+static __u64 chunks_sent = 0;
+static __u64 chunks_received = 0;
+static __u64 chunks_ignored = 0; // Not sent by the accelerator of the session, or its worker had too many waiting.
+static __u64 packets_held = 0;
+static __u64 packets_recovered = 0;
+static __u64 packets_dropped = 0;
+
+int recovery_port_set(unsigned int port){
+	if (port > 65535) return -1;
+	recovery_port = port;
+	return 0;
+}
+
+/*
+ * Opens the recovery channel and starts the thread receiving the NACKs of remote accelerators, if configured.
+ */
+void create_recovery() {
+	struct sockaddr_in sin;
+	struct timeval timeout;
+	char message[LOGSZ];
+	int i;
+
+	if (recovery_port == 0) return;
+	for (i = 0; i < MAXWORKERS; i++) {
+		pthread_mutex_init(&inboxes[i].lock, NULL);
+		inboxes[i].head = 0;
+		inboxes[i].num = 0;
+		inboxes[i].chunkhead = 0;
+		inboxes[i].chunknum = 0;
+		inboxes[i].held = 0;
+	}
+	recoverysock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (recoverysock < 0) {
+		sprintf(message, "Initialization: Error opening recovery socket, decode misses are not reported.\n");
+		logger(LOG_INFO, message);
+		return;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = localID; // NACKs are sent from our accelerator ID, as the remote ones check
+	sin.sin_port = htons(recovery_port);
+	timeout.tv_sec = 1; // So the thread sees the service stopping
+	timeout.tv_usec = 0;
+	if ((bind(recoverysock, (struct sockaddr *) &sin, sizeof(sin)) < 0) ||
+			(setsockopt(recoverysock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)) {
+		sprintf(message, "Initialization: Error binding recovery socket to port %u, decode misses are not reported.\n", recovery_port);
+		logger(LOG_INFO, message);
+		close(recoverysock);
+		recoverysock = -1;
+		return;
+	}
+	pthread_create(&t_recovery, NULL, recovery_function, (void *) NULL);
+}
+
+/*
+ * Whether decode misses are reported, so packets missing a reference are held for the answer.
+ */
+int recovery_active(void) {
+	return recoverysock >= 0;
+}
+
+/*
+ * Reports a packet that could not be uncompressed (see tcp_deoptimize) to the accelerator that sent it,
+ * before it is held or dropped. ref and hash are those of the packet missing, as given by uncomp.
+ */
+void recovery_nack(__u8 *ippacket, int format, uint64_t ref, uint32_t hash) {
+	struct iphdr *iph;
+	struct tcphdr *tcph;
+	struct recovery_nack nack;
+	struct sockaddr_in din;
+	__u32 remoteID;
+	char message[LOGSZ];
+
+	if ((recoverysock < 0) || (ippacket == NULL)) return;
+	iph = (struct iphdr *) ippacket;
+	if (iph->protocol != IPPROTO_TCP) return;
+	tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
+	remoteID = (__u32) __get_tcp_option(ippacket, 32);
+	if (remoteID == 0) return;
+
+	memset(&nack, 0, sizeof(nack));
+	nack.magic = htonl(RECOVERY_MAGIC);
+	nack.accelerator = localID;
+	nack.saddr = iph->saddr;
+	nack.daddr = iph->daddr;
+	nack.source = tcph->source;
+	nack.dest = tcph->dest;
+	nack.seq = htonl(ntohl(tcph->seq) ^ 1 << 31); // Sent with the most significant bit changed (see tcp_optimized)
+	nack.hash = htonl(hash);
+	nack.ref = htobe64(ref);
+	nack.format = format;
+
+	memset(&din, 0, sizeof(din));
+	din.sin_family = AF_INET;
+	din.sin_addr.s_addr = remoteID;
+	din.sin_port = htons(recovery_port);
+	if (sendto(recoverysock, &nack, sizeof(nack), 0, (struct sockaddr *) &din, sizeof(din)) < 0) return;
+	__sync_fetch_and_add(&nacks_sent, 1);
+
+	if (DEBUG_RECOVERY == true) {
+		sprintf(message, "[RECOVERY]: NACK sent for a packet of %u bytes\n", ntohs(iph->tot_len));
+		logger(LOG_INFO, message);
+	}
+}
+
+/*
+ * Answers a NACK with the data of the packet missing (len bytes of chunk), as refused by the compressor
+ * of the session (see tcp_refuse_batched).
+ */
+void recovery_answer(struct recovery_nack *nack, __u8 *chunk, __u16 len) {
+	struct recovery_chunk answer;
+	struct sockaddr_in din;
+	char message[LOGSZ];
+
+	if ((recoverysock < 0) || (len == 0) || (len > RECOVERY_CHUNK_SIZE)) return;
+	answer.nack = *nack;
+	answer.nack.magic = htonl(RECOVERY_CHUNK_MAGIC);
+	answer.nack.accelerator = localID;
+	answer.len = htons(len);
+	memset(answer.pad, 0, sizeof(answer.pad));
+	memcpy(answer.data, chunk, len);
+
+	memset(&din, 0, sizeof(din));
+	din.sin_family = AF_INET;
+	din.sin_addr.s_addr = nack->accelerator;
+	din.sin_port = htons(recovery_port);
+	if (sendto(recoverysock, &answer, offsetof(struct recovery_chunk, data) + len, 0,
+			(struct sockaddr *) &din, sizeof(din)) < 0) return;
+	__sync_fetch_and_add(&chunks_sent, 1);
+
+	if (DEBUG_RECOVERY == true) {
+		sprintf(message, "[RECOVERY]: Answered a NACK with a packet of %u bytes\n", len);
+		logger(LOG_INFO, message);
+	}
+}
+
+/*
+ * Session of the flow of a NACK or answer, if its segments are sent from accelerator from to accelerator to.
+ */
+static struct session *recovery_session(struct recovery_nack *nack, __u32 from, __u32 to) {
+	struct session *thissession;
+	__u32 largerIP, smallerIP, sourceAccelerator, destAccelerator;
+	__u16 largerIPPort, smallerIPPort;
+
+	sort_sockets(&largerIP, &largerIPPort, &smallerIP, &smallerIPPort,
+			nack->saddr, nack->source, nack->daddr, nack->dest);
+	thissession = getsession(largerIP, largerIPPort, smallerIP, smallerIPPort);
+	if (thissession == NULL) return NULL;
+	if (nack->saddr == largerIP) {
+		sourceAccelerator = thissession->largerIPAccelerator;
+		destAccelerator = thissession->smallerIPAccelerator;
+	} else {
+		sourceAccelerator = thissession->smallerIPAccelerator;
+		destAccelerator = thissession->largerIPAccelerator;
+	}
+	if ((sourceAccelerator != from) || (destAccelerator != to)) return NULL;
+	return thissession;
+}
+
+/*
+ * Queues a NACK for the worker of its session, if it comes from the accelerator the segment was sent to.
+ */
+static void recovery_receive(struct recovery_nack *nack) {
+	struct session *thissession;
+	struct recovery_inbox *inbox;
+
+	thissession = recovery_session(nack, localID, nack->accelerator);
+	if (thissession == NULL) {
+		nacks_ignored++;
+		return;
+	}
+
+	inbox = &inboxes[thissession->queue];
+	pthread_mutex_lock(&inbox->lock);
+	if (inbox->num < RECOVERY_INBOX) {
+		inbox->nacks[(inbox->head + inbox->num) % RECOVERY_INBOX] = *nack;
+		inbox->num++;
+	} else {
+		nacks_ignored++;
+	}
+	pthread_mutex_unlock(&inbox->lock);
+}
+
+/*
+ * Queues an answer for the worker of its session, if it comes from the accelerator that sent the segment,
+ * and wakes up its deoptimization thread.
+ */
+static void recovery_receive_chunk(struct recovery_chunk *chunk) {
+	struct session *thissession;
+	struct recovery_inbox *inbox;
+	int queued = false;
+
+	thissession = recovery_session(&chunk->nack, chunk->nack.accelerator, localID);
+	if (thissession == NULL) {
+		chunks_ignored++;
+		return;
+	}
+
+	inbox = &inboxes[thissession->queue];
+	pthread_mutex_lock(&inbox->lock);
+	if (inbox->chunknum < RECOVERY_CHUNKS) {
+		inbox->chunks[(inbox->chunkhead + inbox->chunknum) % RECOVERY_CHUNKS] = *chunk;
+		inbox->chunknum++;
+		queued = true;
+	} else {
+		chunks_ignored++;
+	}
+	pthread_mutex_unlock(&inbox->lock);
+	if (queued) wake_deoptimization(thissession->queue);
+}
+
+void *recovery_function(void *data) {
+	struct recovery_chunk message;
+	struct sockaddr_in src;
+	socklen_t srclen;
+	ssize_t len;
+	int i;
+
+	while (servicestate >= STOPPING) {
+		srclen = sizeof(src);
+		len = recvfrom(recoverysock, &message, sizeof(message), 0, (struct sockaddr *) &src, &srclen);
+		if (len < 0) { // Timeout, packets held are looked at again so those not answered are dropped
+			for (i = 0; i < get_workers(); i++) {
+				if (inboxes[i].held > 0) wake_deoptimization(i);
+			}
+			continue;
+		}
+		if ((len >= sizeof(message.nack)) && (ntohl(message.nack.magic) == RECOVERY_CHUNK_MAGIC)) {
+			chunks_received++;
+			if ((len < offsetof(struct recovery_chunk, data)) || (ntohs(message.len) > RECOVERY_CHUNK_SIZE) ||
+					(len != offsetof(struct recovery_chunk, data) + ntohs(message.len)) ||
+					(srclen < sizeof(src)) || (src.sin_family != AF_INET) || (src.sin_addr.s_addr != message.nack.accelerator)) {
+				chunks_ignored++;
+				continue;
+			}
+			recovery_receive_chunk(&message);
+			continue;
+		}
+		nacks_received++;
+		if ((len != sizeof(message.nack)) || (ntohl(message.nack.magic) != RECOVERY_MAGIC)) {
+			nacks_ignored++;
+			continue;
+		}
+		// The accelerator ID is the address the remote accelerator sends from
+		if ((srclen < sizeof(src)) || (src.sin_family != AF_INET) || (src.sin_addr.s_addr != message.nack.accelerator)) {
+			nacks_ignored++;
+			continue;
+		}
+		recovery_receive(&message.nack);
+	}
+	close(recoverysock);
+	recoverysock = -1;
+	return NULL;
+}
+
+/*
+ * Takes up to max NACKs queued for a worker, called by its optimization thread.
+ */
+unsigned int recovery_take(int worker, struct recovery_nack *nacks, unsigned int max) {
+	struct recovery_inbox *inbox;
+	unsigned int num = 0;
+
+	if (recovery_port == 0) return 0;
+	inbox = &inboxes[worker];
+	if (inbox->num == 0) return 0; // Checked again with the lock
+	pthread_mutex_lock(&inbox->lock);
+	while ((num < max) && (inbox->num > 0)) {
+		nacks[num++] = inbox->nacks[inbox->head];
+		inbox->head = (inbox->head + 1) % RECOVERY_INBOX;
+		inbox->num--;
+	}
+	pthread_mutex_unlock(&inbox->lock);
+	return num;
+}
+
+/*
+ * Takes the oldest answer queued for a worker, called by its deoptimization thread. Returns 1 if there was one.
+ */
+int recovery_take_chunk(int worker, struct recovery_chunk *chunk) {
+	struct recovery_inbox *inbox;
+	int taken = 0;
+
+	if (recovery_port == 0) return 0;
+	inbox = &inboxes[worker];
+	if (inbox->chunknum == 0) return 0; // Checked again with the lock
+	pthread_mutex_lock(&inbox->lock);
+	if (inbox->chunknum > 0) {
+		*chunk = inbox->chunks[inbox->chunkhead];
+		inbox->chunkhead = (inbox->chunkhead + 1) % RECOVERY_CHUNKS;
+		inbox->chunknum--;
+		taken = 1;
+	}
+	pthread_mutex_unlock(&inbox->lock);
+	return taken;
+}
+
+/*
+ * Counts a NACK taken by a worker whose missing packet was found and is no longer referenced.
+ */
+void recovery_refused(int refused) {
+	if (refused) __sync_fetch_and_add(&packets_refused, 1);
+}
+
+/*
+ * Counts a packet held by the deoptimization thread of a worker, or one held no longer (see worker.c),
+ * which then holds held packets. The thread is woken up every second while it holds some.
+ */
+void recovery_held(int worker, unsigned int held, int event) {
+	struct recovery_inbox *inbox;
+
+	if (recovery_port == 0) return;
+	inbox = &inboxes[worker];
+	pthread_mutex_lock(&inbox->lock);
+	inbox->held = held;
+	pthread_mutex_unlock(&inbox->lock);
+	switch (event) {
+	case RECOVERY_PACKET_HELD:
+		__sync_fetch_and_add(&packets_held, 1);
+		break;
+	case RECOVERY_PACKET_RECOVERED:
+		__sync_fetch_and_add(&packets_recovered, 1);
+		break;
+	case RECOVERY_PACKET_DROPPED:
+		__sync_fetch_and_add(&packets_dropped, 1);
+		break;
+	}
+}
+
+int cli_show_recovery(int client_fd, char **parameters, int numparameters) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	if (recovery_port == 0) {
+		sprintf(msg, "Decode miss recovery: disabled\n");
+		cli_send_feedback(client_fd, msg);
+	} else {
+		sprintf(msg, "Decode miss recovery: UDP port %u%s\n", recovery_port, (recoverysock < 0) ? " (not open)" : "");
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"nacks_sent.value %" PRIu64 "\n", (uint64_t) nacks_sent);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"nacks_received.value %" PRIu64 "\n", (uint64_t) nacks_received);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"nacks_ignored.value %" PRIu64 "\n", (uint64_t) nacks_ignored);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"packets_refused.value %" PRIu64 "\n", (uint64_t) packets_refused);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"chunks_sent.value %" PRIu64 "\n", (uint64_t) chunks_sent);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"chunks_received.value %" PRIu64 "\n", (uint64_t) chunks_received);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"chunks_ignored.value %" PRIu64 "\n", (uint64_t) chunks_ignored);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"packets_held.value %" PRIu64 "\n", (uint64_t) packets_held);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"packets_recovered.value %" PRIu64 "\n", (uint64_t) packets_recovered);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg,"packets_dropped.value %" PRIu64 "\n", (uint64_t) packets_dropped);
+		cli_send_feedback(client_fd, msg);
+	}
+	sprintf(msg,"------------------------------------------------------------------\n");
+	cli_send_feedback(client_fd, msg);
+	return CLI_SUCCESS;
+}
@@ -51,10 +51,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <endian.h>
 #include <pthread.h> // for multi-threading
+#include <sys/time.h>
 #include <netinet/ip.h> // for tcpmagic and TCP options
 #include <netinet/tcp.h> // for tcpmagic and TCP options
+#include <arpa/inet.h>
 #include <linux/types.h>
 #include <linux/netfilter.h> // for NF_ACCEPT
 #include <libnetfilter_queue/libnetfilter_queue.h> // for access to Netfilter Queue
@@ -73,6 +77,7 @@
 #include "climanager.h"
 
 #include "deduplication.h"
+#include "recovery.h"
 
 struct worker workers[MAXWORKERS]; // setup slots for the max number of workers.
 unsigned char numworkers = 0; // sets number of worker threads. 0 = auto detect.
@@ -81,14 +86,81 @@ int DEBUG_WORKER = false;
 int DEBUG_WORKER_CLI = false;
 int DEBUG_WORKER_COUNTERS = false;
 
+/*
+ * Applies the decode misses reported by remote accelerators (see recovery.c) to the compressor dictionaries,
+ * and answers them with the packets missing. Called with no packets staged in the batch.
+ */
+static void apply_recovery_nacks(struct worker *me, struct dedup_batch *batch) {
+	struct recovery_nack nacks[RECOVERY_INBOX];
+	struct peer_dictionary *thispeer;
+	pDeduplicator compressor;
+	__u8 chunk[RECOVERY_CHUNK_SIZE];
+	__u16 chunklen;
+	unsigned int num, i;
+	int refused;
+
+	num = recovery_take(me->workernum, nacks, RECOVERY_INBOX);
+	for (i = 0; i < num; i++) {
+		thispeer = get_peer_dictionary(me, nacks[i].accelerator);
+		compressor = (thispeer != NULL) ? thispeer->compressor : me->compressor;
+		chunklen = RECOVERY_CHUNK_SIZE;
+		refused = tcp_refuse_batched(batch, compressor, &nacks[i], chunk, &chunklen);
+		recovery_refused(refused);
+		if (refused) recovery_answer(&nacks[i], chunk, chunklen); // The peer holds the packet waiting for it
+	}
+}
+
+/*
+ * Flushes a dictionary used with a remote accelerator once after each restart of that accelerator
+ * (see dictionary_peer_restarts), its dictionary handshake entry given by the session (hello).
+ * In hub mode only the packets known by that peer are forgotten. A dictionary only used with that accelerator
+ * and sized by it (peersized, see reset_dictionary_resize) goes back to its configured sizes, flushed or not (flush).
+ */
+static void flush_restarted(struct worker *me, struct dictionary_flush *flushed, pDeduplicator pd, int hubpeer,
+		__u32 peerID, __u16 hello, const char *role, int flush, int peersized) {
+	__u32 restarts;
+	char message[LOGSZ];
+	char strIP[INET_ADDRSTRLEN];
+
+	if (hello == 0) return;
+	restarts = dictionary_peer_restarts(hello);
+	if (flushed->peerID != peerID) { // First used with this accelerator
+		flushed->peerID = peerID;
+		flushed->restarts = restarts;
+		return;
+	}
+	if (flushed->restarts == restarts) return;
+	if (hubpeer != HUB_NO_PEER) {
+		resetHubPeer(pd, hubpeer);
+	} else if (flush && (flushDictionary(pd) != 0)) {
+		return; // Resizing, flushed with a later packet
+	}
+	flushed->restarts = restarts;
+	if (peersized) reset_dictionary_resize(pd, peerID);
+	if (!flush && (hubpeer == HUB_NO_PEER)) return;
+	dictionary_peer_flushed(hello);
+	inet_ntop(AF_INET, &peerID, strIP, INET_ADDRSTRLEN);
+	sprintf(message, "Worker %d: flushed the %s dictionary used with accelerator %s\n", me->workernum, role, strIP);
+	logger(LOG_INFO, message);
+}
+
 void *optimization_thread(void *dummyPtr) {
 	struct worker *me = NULL;
 	struct packet *thispacket = NULL;
 	struct session *thissession = NULL;
 	struct iphdr *iph = NULL;
 	struct tcphdr *tcph = NULL;
-	__u32 largerIP, smallerIP, remoteID;
-	__u16 largerIPPort, smallerIPPort;
+	__u32 largerIP, smallerIP, remoteID, peerID;
+	struct peer_dictionary *thispeer;
+	int hubpeer;
+	int format;
+	__u16 largerIPPort, smallerIPPort, hello;
+	unsigned int partition;
+	pDeduplicator compressor;
+	struct packet *packets[MAX_DEDUP_BATCH];
+	int changed[MAX_DEDUP_BATCH];
+	struct dedup_batch batch;
+	u_int32_t num, i;
 	char message[LOGSZ];
 	qlz_state_compress *state_compress = (qlz_state_compress *) malloc(sizeof(qlz_state_compress));
 	me = dummyPtr;
@@ -109,6 +181,12 @@ void *optimization_thread(void *dummyPtr) {
 		exit(1);
 	}
 
+	if (dedup_batch_init(&batch) != OK) {
+		sprintf(message, "Worker optimization: Couldn't allocate buffers dedup batch");
+		logger(LOG_INFO, message);
+		exit(1);
+	}
+
 	/*
 	 * Register the worker threads metrics so they get updated.
 	 */
@@ -119,152 +197,189 @@ void *optimization_thread(void *dummyPtr) {
 
 		while (me->state >= STOPPING) {
 
-			thispacket = dequeue_packet(&me->optimization.queue, true);
+			num = dequeue_packets(&me->optimization.queue, packets, dedup_batch_size);
+			apply_recovery_nacks(me, &batch);
 
-			if(compression == true || deduplication == true){
+			for (i = 0; i < num; i++) {
+				thispacket = packets[i];
+				changed[i] = false;
 
-				if (thispacket != NULL) { // If a packet was taken from the queue.
-					iph = (struct iphdr *) thispacket->data;
-					tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
-
-					if (DEBUG_WORKER == true) {
-						sprintf(message, "Worker: IP Packet length is: %u\n",
-								ntohs(iph->tot_len));
-						logger(LOG_INFO, message);
-					}
-					me->optimization.metrics.bytesin += ntohs(iph->tot_len);
-					remoteID = (__u32) __get_tcp_option((__u8 *)iph,32);/* Check what IP address is larger. */
-					sort_sockets(&largerIP, &largerIPPort, &smallerIP, &smallerIPPort,
-							iph->saddr,tcph->source,iph->daddr,tcph->dest);
+				if(compression == true || deduplication == true){
 
-					if (DEBUG_WORKER == true)
-					{
-						sprintf(message, "Worker: Searching for session.\n");
-						logger(LOG_INFO, message);
-					}
-
-					thissession = getsession(largerIP, largerIPPort, smallerIP,smallerIPPort);
+					if (thispacket != NULL) { // If a packet was taken from the queue.
+						iph = (struct iphdr *) thispacket->data;
+						tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
 
-					if (thissession != NULL)
-					{
+						if (DEBUG_WORKER == true) {
+							sprintf(message, "Worker: IP Packet length is: %u\n",
+									ntohs(iph->tot_len));
+							logger(LOG_INFO, message);
+						}
+						me->optimization.metrics.bytesin += ntohs(iph->tot_len);
+						remoteID = (__u32) __get_tcp_option((__u8 *)iph,32);/* Check what IP address is larger. */
+						sort_sockets(&largerIP, &largerIPPort, &smallerIP, &smallerIPPort,
+								iph->saddr,tcph->source,iph->daddr,tcph->dest);
 
 						if (DEBUG_WORKER == true)
 						{
-							sprintf(message, "Worker: Found a session.\n");
+							sprintf(message, "Worker: Searching for session.\n");
 							logger(LOG_INFO, message);
 						}
 
-						if ((tcph->syn == 0) && (tcph->ack == 1) && (tcph->fin == 0))
-						{
-
-							if (remoteID == 0)
-							{ // Accelerator ID was not found.
+						thissession = getsession(largerIP, largerIPPort, smallerIP,smallerIPPort);
 
-								saveacceleratorid(largerIP, localID, iph, thissession);
+						if (thissession != NULL)
+						{
 
-								__set_tcp_option((__u8 *)iph,32,6,localID); // Add the Accelerator ID to this packet.
+							if (DEBUG_WORKER == true)
+							{
+								sprintf(message, "Worker: Found a session.\n");
+								logger(LOG_INFO, message);
+							}
 
-								if ((((iph->saddr == largerIP) &&
-										(thissession->largerIPAccelerator == localID) &&
-										(thissession->smallerIPAccelerator != 0) &&
-										(thissession->smallerIPAccelerator != localID)) ||
+							if ((tcph->syn == 0) && (tcph->ack == 1) && (tcph->fin == 0))
+							{
 
-										((iph->saddr == smallerIP) &&
-												(thissession->smallerIPAccelerator == localID) &&
-												(thissession->largerIPAccelerator != 0) &&
-												(thissession->largerIPAccelerator != localID))) &&
-										(thissession->state == TCP_ESTABLISHED))
-								{
+								if (remoteID == 0)
+								{ // Accelerator ID was not found.
+
+									saveacceleratorid(largerIP, localID, iph, thissession);
+
+									__set_tcp_option((__u8 *)iph,32,6,localID); // Add the Accelerator ID to this packet.
+
+									peerID = (iph->saddr == largerIP) ?
+											thissession->smallerIPAccelerator : thissession->largerIPAccelerator;
+									partition = get_dictionary_partition(iph, tcph);
+									thispeer = get_peer_dictionary(me, peerID);
+									compressor = (thispeer != NULL) ? thispeer->compressor : me->compressor;
+									hubpeer = ((thispeer != NULL) && (dictionary_hub == true)) ? thispeer - me->peers : HUB_NO_PEER;
+									format = get_session_dedup_format(thissession);
+									hello = (iph->saddr == largerIP) ? thissession->smallerIPHello : thissession->largerIPHello;
+									flush_restarted(me, (thispeer != NULL) ? &thispeer->compressorflush : &me->compressorflush,
+											compressor, hubpeer, peerID, hello, "compressor", true, false);
+
+									if ((((iph->saddr == largerIP) &&
+											(thissession->largerIPAccelerator == localID) &&
+											(thissession->smallerIPAccelerator != 0) &&
+											(thissession->smallerIPAccelerator != localID)) ||
+
+											((iph->saddr == smallerIP) &&
+													(thissession->smallerIPAccelerator == localID) &&
+													(thissession->largerIPAccelerator != 0) &&
+													(thissession->largerIPAccelerator != localID))) &&
+											(thissession->state == TCP_ESTABLISHED))
+									{
 
-									/*
-									 * Do some acceleration!
-									 */
+										/*
+										 * Do some acceleration!
+										 */
 
-									if (DEBUG_WORKER == true)
-									{
-										sprintf(message, "Worker: Compressing packet.\n");
-										logger(LOG_INFO, message);
-									}
+										if (DEBUG_WORKER == true)
+										{
+											sprintf(message, "Worker: Compressing packet.\n");
+											logger(LOG_INFO, message);
+										}
 
-									if(compression == true){
-										tcp_compress((__u8 *)iph, me->optimization.lzbuffer,state_compress);
-									}
+										if(compression == true){
+											tcp_compress((__u8 *)iph, me->optimization.lzbuffer,state_compress);
+										}
 
-									if(deduplication == true){
-										// Check Sequence Number to detect retransmission (or out of order segment)
-										if(checkseqnumber(largerIP, iph, tcph, thissession)){
-											updateseqnumber(largerIP, iph, tcph, thissession);
-											// printf("Before tcp_optimize worker %d\n",me->workernum);
-											tcp_optimize(me->compressor,(__u8 *)iph, me->optimization.dedup_buffer);
-										}else{
-											if (DEBUG_OPTIMIZATION == true)
-											{
-												sprintf(message, "Worker: Packet not optimized.\n");
-												logger(LOG_INFO, message);
+										if(deduplication == true){
+											// Packets of this flow the far host acknowledged can be referenced
+											tcp_acked_batched(&batch, compressor, (__u8 *)iph, (iph->saddr == largerIP) ?
+													thissession->largerIPAcked : thissession->smallerIPAcked);
+											// Check Sequence Number to detect retransmission (or out of order segment)
+											if(checkseqnumber(largerIP, iph, tcph, thissession)){
+												updateseqnumber(largerIP, iph, tcph, thissession);
+												if (dictionary_peer_mismatch(hello) == 0) {
+													// printf("Before tcp_optimize worker %d\n",me->workernum);
+													tcp_optimize_batched(&batch, compressor, partition, hubpeer, format, (__u8 *)iph,
+															me->optimization.lzbuffer, state_compress);
+												} else { // The peer dictionaries do not match ours, sent as it is
+													tcp_cache_optim_batched(&batch, compressor, partition, hubpeer, format, (__u8 *)iph,
+															me->optimization.lzbuffer, state_compress);
+												}
+											}else if(tcp_resend_batched(&batch, compressor, format, (__u8 *)iph,
+													me->optimization.lzbuffer, state_compress) == ERROR){
+												if (DEBUG_OPTIMIZATION == true)
+												{
+													sprintf(message, "Worker: Packet not optimized.\n");
+													logger(LOG_INFO, message);
+												}
+												// printf("Before tcp_cache_optim worker %d\n",me->workernum);
+												tcp_cache_optim_batched(&batch, compressor, partition, hubpeer, format, (__u8 *)iph,
+														me->optimization.lzbuffer, state_compress);
 											}
-											// printf("Before tcp_cache_optim worker %d\n",me->workernum);
-											tcp_cache_optim(me->compressor,(__u8 *)iph);
 										}
 									}
-								}
-								else
-								{
-									if (DEBUG_WORKER == true)
+									else
 									{
-										sprintf(message, "Worker: Not compressing packet.\n");
-										logger(LOG_INFO, message);
-									}
-									if(deduplication == true){
-										updateseqnumber(largerIP, iph, tcph, thissession);
-										// printf("Before tcp_cache_optim worker %d\n",me->workernum);
-										tcp_cache_optim(me->compressor,(__u8 *)iph); // We cache it anyway
+										if (DEBUG_WORKER == true)
+										{
+											sprintf(message, "Worker: Not compressing packet.\n");
+											logger(LOG_INFO, message);
+										}
+										if(deduplication == true){
+											updateseqnumber(largerIP, iph, tcph, thissession);
+											// printf("Before tcp_cache_optim worker %d\n",me->workernum);
+											tcp_cache_optim_batched(&batch, compressor, partition, hubpeer, format, (__u8 *)iph,
+													me->optimization.lzbuffer, state_compress); // We cache it anyway
+										}
 									}
 								}
 							}
-						}
 
-						if (tcph->rst == 1)
-						{ // Session was reset.
+							if (tcph->rst == 1)
+							{ // Session was reset.
 
-							if (DEBUG_WORKER == true)
-							{
-								sprintf(message, "Worker: Session was reset.\n");
-								logger(LOG_INFO, message);
+								if (DEBUG_WORKER == true)
+								{
+									sprintf(message, "Worker: Session was reset.\n");
+									logger(LOG_INFO, message);
+								}
+								clearsession(thissession);
+								thissession = NULL;
 							}
-							clearsession(thissession);
-							thissession = NULL;
-						}
 
-						closingsession(tcph, thissession);
+							closingsession(tcph, thissession);
 
-						if (thispacket != NULL)
-						{
-							/*
-							 * Changing anything requires the IP and TCP
-							 * checksum to need recalculated.
-							 */
+							changed[i] = true; // Sent once the batch is deduplicated.
 
-							checksum(thispacket->data);
+						} /* End NULL session check. */
+						else
+						{ /* Session was NULL. */
 							me->optimization.metrics.bytesout += ntohs(iph->tot_len);
-							nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)thispacket->data);
-							put_freepacket_buffer(thispacket);
-							thispacket = NULL;
 						}
+						me->optimization.metrics.packets++;
+					} /* End NULL packet check. */
+				} /* End compression enabled check, otherwise the packet is sent unchanged. */
+			}
 
-					} /* End NULL session check. */
-					else
-					{ /* Session was NULL. */
-						me->optimization.metrics.bytesout += ntohs(iph->tot_len);
-						nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, 0, NULL);
-						put_freepacket_buffer(thispacket);
-						thispacket = NULL;
-					}
-					me->optimization.metrics.packets++;
-				} /* End NULL packet check. */
-			} /* End compression enabled check. */
-			else
-			{  /* Compression is disabled */
-				nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, 0, NULL);
+			/*
+			 * Packets are deduplicated together once the whole batch is staged,
+			 * then sent in the order they were taken from the queue.
+			 */
+			dedup_batch_run(&batch, me->optimization.lzbuffer, state_compress);
+
+			for (i = 0; i < num; i++) {
+				thispacket = packets[i];
+				iph = (struct iphdr *) thispacket->data;
+
+				if (changed[i] == true)
+				{
+					/*
+					 * Changing anything requires the IP and TCP
+					 * checksum to need recalculated.
+					 */
+
+					checksum(thispacket->data);
+					me->optimization.metrics.bytesout += ntohs(iph->tot_len);
+					nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)thispacket->data);
+				}
+				else
+				{
+					nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, 0, NULL);
+				}
 				put_freepacket_buffer(thispacket);
 				thispacket = NULL;
 			}
@@ -272,12 +387,102 @@ void *optimization_thread(void *dummyPtr) {
 		free(me->optimization.lzbuffer);
 		free(me->optimization.dedup_buffer);
 		free(state_compress);
+		dedup_batch_free(&batch);
 		me->optimization.lzbuffer = NULL;
 		me->optimization.dedup_buffer = NULL;
 	}
 	return NULL;
 }
 
+/*
+ * Holds a packet that could not be deoptimized because it references a packet missing, until the accelerator
+ * that sent it answers the NACK (see recovery.c). Returns 0 if it cannot be held, so it is dropped.
+ */
+static int hold_packet(struct worker *me, struct packet *thispacket, pDeduplicator decompressor, unsigned int partition) {
+	unsigned int i;
+
+	if (!recovery_active()) return 0;
+	for (i = 0; i < RECOVERY_HELD; i++) {
+		if (me->held[i].packet == NULL) break;
+	}
+	if (i == RECOVERY_HELD) return 0;
+	me->held[i].packet = thispacket;
+	me->held[i].decompressor = decompressor;
+	me->held[i].partition = partition;
+	gettimeofday(&me->held[i].held, NULL);
+	me->numheld++;
+	recovery_held(me->workernum, me->numheld, RECOVERY_PACKET_HELD);
+	return 1;
+}
+
+/*
+ * Sends on a packet held, deoptimized (recovered) or dropped.
+ */
+static void release_packet(struct worker *me, unsigned int i, int recovered) {
+	struct packet *thispacket = me->held[i].packet;
+	struct iphdr *iph = (struct iphdr *) thispacket->data;
+
+	if (recovered) {
+		checksum(thispacket->data);
+		me->deoptimization.metrics.bytesout += ntohs(iph->tot_len);
+		nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)thispacket->data);
+	} else {
+		nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL);
+	}
+	put_freepacket_buffer(thispacket);
+	me->held[i].packet = NULL;
+	me->numheld--;
+	recovery_held(me->workernum, me->numheld, recovered ? RECOVERY_PACKET_RECOVERED : RECOVERY_PACKET_DROPPED);
+}
+
+/*
+ * Caches the packets missing sent by the accelerators that sent the packets held, and deoptimizes again the
+ * packet held of each segment. A packet still missing a reference is held on, and dropped when held for longer
+ * than RECOVERY_HOLD, as any other.
+ */
+static void recover_held_packets(struct worker *me, qlz_state_decompress *state_decompress) {
+	struct recovery_chunk chunk;
+	struct held_packet *held;
+	struct iphdr *iph;
+	struct tcphdr *tcph;
+	struct timeval now;
+	unsigned int i;
+	int result;
+
+	// Answers to packets no longer held are just taken
+	while (recovery_take_chunk(me->workernum, &chunk)) {
+		for (i = 0; i < RECOVERY_HELD; i++) {
+			held = &me->held[i];
+			if (held->packet == NULL) continue;
+			iph = (struct iphdr *) held->packet->data;
+			tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
+			if ((iph->saddr != chunk.nack.saddr) || (iph->daddr != chunk.nack.daddr) ||
+					(tcph->source != chunk.nack.source) || (tcph->dest != chunk.nack.dest) ||
+					(htonl(ntohl(tcph->seq) ^ 1 << 31) != chunk.nack.seq)) continue;
+			if (chunk.nack.format == DEDUP_FORMAT_INDEX) {
+				update_caches_at(held->decompressor, held->partition, chunk.data, ntohs(chunk.len),
+						(__u32) be64toh(chunk.nack.ref));
+			} else {
+				update_caches(held->decompressor, held->partition, chunk.data, ntohs(chunk.len));
+			}
+			result = tcp_deoptimize(held->decompressor, held->partition, (__u8 *)iph, me->deoptimization.dedup_buffer,
+					me->deoptimization.lzbuffer, state_decompress);
+			if (result != HASH_NOT_FOUND) release_packet(me, i, result == OK);
+			break;
+		}
+	}
+
+	if (me->numheld == 0) return;
+	gettimeofday(&now, NULL);
+	for (i = 0; (i < RECOVERY_HELD) && (me->numheld > 0); i++) {
+		held = &me->held[i];
+		if ((held->packet != NULL) && ((now.tv_sec - held->held.tv_sec) * 1000 +
+				(now.tv_usec - held->held.tv_usec) / 1000 > RECOVERY_HOLD)) {
+			release_packet(me, i, false);
+		}
+	}
+}
+
 void *deoptimization_thread(void *dummyPtr) {
 	struct worker *me = NULL;
 	struct packet *thispacket = NULL;
@@ -286,6 +491,13 @@ void *deoptimization_thread(void *dummyPtr) {
 	struct tcphdr *tcph = NULL;
 	__u32 largerIP, smallerIP, remoteID;
 	__u16 largerIPPort, smallerIPPort;
+	unsigned int partition;
+	struct peer_dictionary *thispeer;
+	pDeduplicator decompressor;
+	struct packet *packets[MAX_DEDUP_BATCH];
+	pDeduplicator prefetchpd[MAX_DEDUP_BATCH];
+	__u8 *prefetchpkt[MAX_DEDUP_BATCH];
+	u_int32_t num, i;
 	char message[LOGSZ];
 	qlz_state_decompress *state_decompress = (qlz_state_decompress *) malloc(
 			sizeof(qlz_state_decompress));
@@ -318,137 +530,174 @@ void *deoptimization_thread(void *dummyPtr) {
 
 		while (me->state >= STOPPING) {
 
-			thispacket = dequeue_packet(&me->deoptimization.queue, true);
-
-			if (thispacket != NULL) { // If a packet was taken from the queue.
-				iph = (struct iphdr *) thispacket->data;
-				tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
-
-				if (DEBUG_WORKER == true) {
-					sprintf(message, "Worker: IP Packet length is: %u\n",
-							ntohs(iph->tot_len));
-					logger(LOG_INFO, message);
+			num = dequeue_packets(&me->deoptimization.queue, packets, dedup_batch_size);
+			recover_held_packets(me, state_decompress);
+
+			/*
+			 * The dictionary entries referenced by the deduplicated packets of the batch are
+			 * prefetched together, then the packets are deoptimized in the order they were taken from the queue.
+			 */
+			if ((deduplication == true) && (compression == false)) {
+				for (i = 0; i < num; i++) {
+					iph = (struct iphdr *) packets[i]->data;
+					remoteID = (__u32) __get_tcp_option((__u8 *)iph,32);
+					prefetchpd[i] = ((remoteID != 0) && (__get_tcp_option((__u8 *)iph,31) != 0)) ?
+							find_peer_decompressor(me, remoteID) : NULL;
+					prefetchpkt[i] = (__u8 *)iph;
 				}
-				me->deoptimization.metrics.bytesin += ntohs(iph->tot_len);
-				remoteID = (__u32) __get_tcp_option((__u8 *)iph,32);/* Check what IP address is larger. */
-				sort_sockets				(&largerIP, &largerIPPort, &smallerIP, &smallerIPPort,
-						iph->saddr,tcph->source,iph->daddr,tcph->dest);
+				tcp_deoptimize_prefetch(prefetchpd, prefetchpkt, num);
+			}
 
-				if (DEBUG_WORKER == true)
-				{
-					sprintf(message, "Worker: Searching for session.\n");
-					logger(LOG_INFO, message);
-				}
+			for (i = 0; i < num; i++) {
+				thispacket = packets[i];
 
-				thissession = getsession(largerIP, largerIPPort, smallerIP,smallerIPPort);
+				if (thispacket != NULL) { // If a packet was taken from the queue.
+					iph = (struct iphdr *) thispacket->data;
+					tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
 
-				if (thissession != NULL)
-				{
+					if (DEBUG_WORKER == true) {
+						sprintf(message, "Worker: IP Packet length is: %u\n",
+								ntohs(iph->tot_len));
+						logger(LOG_INFO, message);
+					}
+					me->deoptimization.metrics.bytesin += ntohs(iph->tot_len);
+					remoteID = (__u32) __get_tcp_option((__u8 *)iph,32);/* Check what IP address is larger. */
+					sort_sockets				(&largerIP, &largerIPPort, &smallerIP, &smallerIPPort,
+							iph->saddr,tcph->source,iph->daddr,tcph->dest);
 
 					if (DEBUG_WORKER == true)
 					{
-						sprintf(message, "Worker: Found a session.\n");
+						sprintf(message, "Worker: Searching for session.\n");
 						logger(LOG_INFO, message);
 					}
 
-					if ((tcph->syn == 0) && (tcph->ack == 1) && (tcph->fin == 0))
-					{
+					thissession = getsession(largerIP, largerIPPort, smallerIP,smallerIPPort);
 
-						if (remoteID != 0){
+					if (thissession != NULL)
+					{
 
-							saveacceleratorid(largerIP, remoteID, iph, thissession);
+						if (DEBUG_WORKER == true)
+						{
+							sprintf(message, "Worker: Found a session.\n");
+							logger(LOG_INFO, message);
+						}
 
-							if (__get_tcp_option((__u8 *)iph,31) != 0)
-							{ // Packet is flagged as compressed.
+						if ((tcph->syn == 0) && (tcph->ack == 1) && (tcph->fin == 0))
+						{
 
-								if (DEBUG_WORKER == true)
-								{
-									sprintf(message, "Worker: Packet is deduplicated.\n");
-									logger(LOG_INFO, message);
+							if (remoteID != 0){
+
+								saveacceleratorid(largerIP, remoteID, iph, thissession);
+								saveacknumber(largerIP, iph, tcph, thissession);
+								partition = get_dictionary_partition(iph, tcph);
+								thispeer = get_peer_dictionary(me, remoteID);
+								decompressor = (thispeer != NULL) ? thispeer->decompressor : me->decompressor;
+								// Indexed packets of a restarted peer name its new packets from pktId 1 again;
+								// other decompressors find packets by content, the old ones are just not referenced.
+								// A decompressor of its own goes back to the sizes the peer restarted with.
+								if (decompressor->indexed || (decompressor != me->decompressor)) {
+									flush_restarted(me, (thispeer != NULL) ? &thispeer->decompressorflush : &me->decompressorflush,
+											decompressor, HUB_NO_PEER, remoteID,
+											(iph->saddr == largerIP) ? thissession->largerIPHello : thissession->smallerIPHello, "decompressor",
+											decompressor->indexed, decompressor != me->decompressor);
 								}
 
-								if (((iph->saddr == largerIP) &&
-										(thissession->smallerIPAccelerator == localID)) ||
-										((iph->saddr == smallerIP) &&
-												(thissession->largerIPAccelerator == localID)))
-								{
+								if (__get_tcp_option((__u8 *)iph,31) != 0)
+								{ // Packet is flagged as compressed.
 
-									/*
-									 * Decompress this packet!
-									 */
-									if(compression == true){
-										if (tcp_decompress((__u8 *)iph, me->deoptimization.lzbuffer, state_decompress) == 0)
-										{ // Decompression failed if 0.
-											nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL); // Decompression failed drop.
-											put_freepacket_buffer(thispacket);
-											thispacket = NULL;
-										}
+									if (DEBUG_WORKER == true)
+									{
+										sprintf(message, "Worker: Packet is deduplicated.\n");
+										logger(LOG_INFO, message);
 									}
 
-									if (deduplication == true){
-										updateseqnumber(largerIP, iph, tcph, thissession);
-										// printf("Before tcp_deoptimize worker %d\n",me->workernum);
-										result = tcp_deoptimize(me->decompressor,(__u8 *)iph, me->deoptimization.dedup_buffer);
-										if (result == ERROR)
-										{ // Decompression failed if 0.
-											nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL); // Decompression failed drop.
-											put_freepacket_buffer(thispacket);
-											thispacket = NULL;
-										}else if(result == HASH_NOT_FOUND){
-											nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL); // Decompression failed drop.
-											put_freepacket_buffer(thispacket);
-											thispacket = NULL;
+									if (((iph->saddr == largerIP) &&
+											(thissession->smallerIPAccelerator == localID)) ||
+											((iph->saddr == smallerIP) &&
+													(thissession->largerIPAccelerator == localID)))
+									{
+
+										/*
+										 * Decompress this packet!
+										 */
+										if(compression == true){
+											if (tcp_decompress((__u8 *)iph, me->deoptimization.lzbuffer, state_decompress) == 0)
+											{ // Decompression failed if 0.
+												nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL); // Decompression failed drop.
+												put_freepacket_buffer(thispacket);
+												thispacket = NULL;
+											}
 										}
-									}
 
-								}
-							}else{
-								if (deduplication == true){
-									//We must cache packets even if they are not compressed
-									// printf("Before tcp_cache_deoptim worker %d\n",me->workernum);
-									tcp_cache_deoptim(me->decompressor,(__u8 *)iph);
+										if (deduplication == true){
+											updateseqnumber(largerIP, iph, tcph, thissession);
+											// printf("Before tcp_deoptimize worker %d\n",me->workernum);
+											result = tcp_deoptimize(decompressor, partition, (__u8 *)iph, me->deoptimization.dedup_buffer,
+													me->deoptimization.lzbuffer, state_decompress);
+											if (result == ERROR)
+											{ // Decompression failed if 0.
+												nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL); // Decompression failed drop.
+												put_freepacket_buffer(thispacket);
+												thispacket = NULL;
+											}else if(result == HASH_NOT_FOUND){
+												// Held until the peer sends the packet missing, if possible
+												if (!hold_packet(me, thispacket, decompressor, partition)) {
+													nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL); // Decompression failed drop.
+													put_freepacket_buffer(thispacket);
+												}
+												thispacket = NULL;
+											}
+										}
+
+									}
+								}else{
+									if (deduplication == true){
+										//We must cache packets even if they are not compressed
+										// printf("Before tcp_cache_deoptim worker %d\n",me->workernum);
+										tcp_cache_deoptim(decompressor, partition, (__u8 *)iph);
+									}
 								}
 							}
 						}
-					}
 
-					if (tcph->rst == 1)
-					{ // Session was reset.
+						if (tcph->rst == 1)
+						{ // Session was reset.
 
-						if (DEBUG_WORKER == true)
-						{
-							sprintf(message, "Worker: Session was reset.\n");
-							logger(LOG_INFO, message);
+							if (DEBUG_WORKER == true)
+							{
+								sprintf(message, "Worker: Session was reset.\n");
+								logger(LOG_INFO, message);
+							}
+							clearsession(thissession);
+							thissession = NULL;
 						}
-						clearsession(thissession);
-						thissession = NULL;
-					}
 
-					closingsession(tcph, thissession);
+						closingsession(tcph, thissession);
 
-					if (thispacket != NULL)
-					{
-						/*
-						 * Changing anything requires the IP and TCP
-						 * checksum to need recalculated.
-						 */
-						checksum(thispacket->data);
+						if (thispacket != NULL)
+						{
+							/*
+							 * Changing anything requires the IP and TCP
+							 * checksum to need recalculated.
+							 */
+							checksum(thispacket->data);
+							me->deoptimization.metrics.bytesout += ntohs(iph->tot_len);
+							nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)thispacket->data);
+							put_freepacket_buffer(thispacket);
+							thispacket = NULL;
+						}
+
+					} /* End NULL session check. */
+					else
+					{ /* Session was NULL. */
 						me->deoptimization.metrics.bytesout += ntohs(iph->tot_len);
-						nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)thispacket->data);
+						nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, 0, NULL);
 						put_freepacket_buffer(thispacket);
 						thispacket = NULL;
 					}
-
-				} /* End NULL session check. */
-				else
-				{ /* Session was NULL. */
-					me->deoptimization.metrics.bytesout += ntohs(iph->tot_len);
-					nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, 0, NULL);
-					put_freepacket_buffer(thispacket);
-					thispacket = NULL;
-				}
-				me->deoptimization.metrics.packets++;
-			} /* End NULL packet check. */
+					me->deoptimization.metrics.packets++;
+				} /* End NULL packet check. */
+			}
 		} /* End working loop. */
 		free(me->deoptimization.lzbuffer);
 		free(me->deoptimization.dedup_buffer);
@@ -487,18 +736,231 @@ void increment_worker_sessions(int i) {
 	workers[i].sessions += 1;
 	pthread_mutex_unlock(&workers[i].lock); // Lose lock on worker.
 }
+/*
+ * Wakes up the deoptimization thread of a worker waiting for packets, to look at the packets it holds.
+ */
+void wake_deoptimization(int i) {
+	pthread_mutex_lock(&workers[i].deoptimization.queue.lock);
+	pthread_cond_signal(&workers[i].deoptimization.queue.signal);
+	pthread_mutex_unlock(&workers[i].deoptimization.queue.lock);
+}
+
 void decrement_worker_sessions(int i) {
 	pthread_mutex_lock(&workers[i].lock); // Grab lock on worker.
 	workers[i].sessions -= 1;
 	pthread_mutex_unlock(&workers[i].lock); // Lose lock on worker.
 }
 
+/*
+ * Creates the compressor and decompressor dictionaries of a worker,
+ * the default ones (peerID 0) or those used with one remote accelerator.
+ * Returns -1 (nothing left allocated) if there is not enough memory for those of a remote accelerator.
+ */
+static int create_dictionaries(int i, __u32 peerID, pDeduplicator *compressor, pDeduplicator *decompressor) {
+	check_dedup_format();
+	if (unified_dictionary == true) {
+		/* One dictionary serves both directions; see newUnifiedDeduplicator(). */
+		*compressor = new_dictionary(i, peerID, "u", true);
+		*decompressor = *compressor;
+		if (*compressor == NULL) return -1;
+	} else {
+		*compressor = new_dictionary(i, peerID, "c", false);
+		*decompressor = (*compressor != NULL) ? new_dictionary(i, peerID, "d", false) : NULL;
+		if (*decompressor == NULL) {
+			if (*compressor != NULL) freeDeduplicator(*compressor);
+			return -1;
+		}
+		setup_dictionary_partitions(*decompressor);
+		start_dictionary_maintenance(*decompressor);
+	}
+	setup_dictionary_partitions(*compressor);
+	if (peerID == 0) {
+		setup_dictionary_hub(*compressor);
+	}
+	setup_dictionary_resemblance(*compressor);
+	setup_dictionary_acked(*compressor);
+	setup_dictionary_helpers(*compressor, workers[i].helpers);
+	start_dictionary_maintenance(*compressor);
+	return 0;
+}
+
+/*
+ * Sets up a remote accelerator of a hub worker: the worker compressor is used to send to it,
+ * and its own decompressor if dictionaries are per peer. Returns -1 if there is not enough memory.
+ */
+static int create_hub_peer(struct worker *thisworker, struct peer_dictionary *thispeer) {
+	thispeer->compressor = thisworker->compressor;
+	if (peer_dictionaries == true) {
+		thispeer->decompressor = new_dictionary(thisworker->workernum, thispeer->peerID, "d", false);
+		if (thispeer->decompressor == NULL) return -1;
+	} else {
+		thispeer->decompressor = thisworker->decompressor;
+	}
+	if (setHubPeer(thisworker->compressor, thispeer - thisworker->peers, get_dictionary_size(thispeer->peerID)) != 0) {
+		if (thispeer->decompressor != thisworker->decompressor) freeDeduplicator(thispeer->decompressor);
+		return -1;
+	}
+	if (thispeer->decompressor != thisworker->decompressor) start_dictionary_maintenance(thispeer->decompressor);
+	return 0;
+}
+
+/*
+ * Packets of the dictionaries a worker keeps for a remote accelerator, counted in peer_dictionaries_total.
+ */
+static unsigned int peer_dictionary_pkts(__u32 peerID) {
+	if (dictionary_hub == true) return (peer_dictionaries == true) ? get_dictionary_size(peerID) : 0;
+	return (unified_dictionary == true) ? get_dictionary_size(peerID) : 2 * get_dictionary_size(peerID);
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+static struct peer_dictionary *lookup_peer_dictionary(struct worker *thisworker, __u32 peerID) {
+	unsigned int p;
+
+	for (p = 0; p < thisworker->numpeers; p++) {
+		if (thisworker->peers[p].peerID == peerID) return &thisworker->peers[p];
+	}
+	return NULL;
+}
+
+// UNSAFE FUNCTION, must be called inside code with locks
+static int peer_dictionary_room(struct worker *thisworker, __u32 peerID) {
+	return (thisworker->numpeers < peer_dictionaries_max) &&
+			(thisworker->peerpkts + peer_dictionary_pkts(peerID) <= get_peer_dictionaries_total());
+}
+
+/* Dictionaries of a remote accelerator being created (see peer_dictionary_allocator). */
+struct peer_allocation {
+	struct worker *thisworker;
+	struct peer_dictionary *thispeer;
+};
+
+/*
+ * Creates the dictionaries of a remote accelerator in background, so the worker threads never wait for them.
+ */
+static void *peer_dictionary_allocator(void *data) {
+	struct worker *thisworker = ((struct peer_allocation *) data)->thisworker;
+	struct peer_dictionary *thispeer = ((struct peer_allocation *) data)->thispeer;
+	char message[LOGSZ];
+	char strIP[INET_ADDRSTRLEN];
+	int result;
+
+	free(data);
+	if (dictionary_hub == true) {
+		result = create_hub_peer(thisworker, thispeer);
+	} else {
+		result = create_dictionaries(thisworker->workernum, thispeer->peerID, &thispeer->compressor, &thispeer->decompressor);
+	}
+	inet_ntop(AF_INET, &thispeer->peerID, strIP, INET_ADDRSTRLEN);
+	if (result != 0) {
+		pthread_mutex_lock(&thisworker->lock);
+		thisworker->peerpkts -= thispeer->pkts;
+		thispeer->pkts = 0;
+		pthread_mutex_unlock(&thisworker->lock);
+		__atomic_store_n(&thispeer->state, PEER_DICT_FAILED, __ATOMIC_RELEASE);
+		sprintf(message, "Worker %d: not enough memory for the dictionaries of accelerator %s, using the worker ones\n",
+				thisworker->workernum, strIP);
+		logger(LOG_INFO, message);
+		return NULL;
+	}
+	__atomic_store_n(&thispeer->state, PEER_DICT_READY, __ATOMIC_RELEASE);
+	sprintf(message, "Worker %d: created dictionaries for accelerator %s\n", thisworker->workernum, strIP);
+	logger(LOG_INFO, message);
+	return NULL;
+}
+
+/*
+ * Returns the dictionaries used with a remote accelerator, created in background the first time it is seen.
+ * The worker ones are used (NULL is returned) if dictionaries are not per peer, until those of the peer are ready,
+ * or if there was no room for them: already peer_dictionaries_max peers, peer_dictionaries_total packets
+ * or not enough memory.
+ * In hub mode the index of the peer in the worker is its hub peer number.
+ */
+struct peer_dictionary *get_peer_dictionary(struct worker *thisworker, __u32 peerID) {
+	struct peer_dictionary *thispeer = NULL;
+	struct peer_allocation *allocation;
+	pthread_t t;
+	pthread_attr_t attr;
+	int result = -1;
+
+	if (((peer_dictionaries == false) && (dictionary_hub == false)) || (peerID == 0)) {
+		return NULL;
+	}
+	pthread_mutex_lock(&thisworker->lock);
+	thispeer = lookup_peer_dictionary(thisworker, peerID);
+	if ((thispeer == NULL) && peer_dictionary_room(thisworker, peerID)) {
+		thispeer = &thisworker->peers[thisworker->numpeers];
+		thispeer->peerID = peerID;
+		thispeer->state = PEER_DICT_ALLOCATING;
+		thispeer->pkts = peer_dictionary_pkts(peerID);
+		allocation = malloc(sizeof(struct peer_allocation));
+		if (allocation != NULL) {
+			allocation->thisworker = thisworker;
+			allocation->thispeer = thispeer;
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			result = pthread_create(&t, &attr, peer_dictionary_allocator, (void *) allocation);
+			pthread_attr_destroy(&attr);
+		}
+		if (result == 0) {
+			thisworker->peerpkts += thispeer->pkts;
+			thisworker->numpeers++;
+		} else {
+			free(allocation); // Tried again with the next packet
+		}
+		thispeer = NULL;
+	}
+	pthread_mutex_unlock(&thisworker->lock);
+	if ((thispeer == NULL) || (__atomic_load_n(&thispeer->state, __ATOMIC_ACQUIRE) != PEER_DICT_READY)) return NULL;
+	return thispeer;
+}
+
+pDeduplicator get_peer_decompressor(struct worker *thisworker, __u32 peerID) {
+	struct peer_dictionary *thispeer = get_peer_dictionary(thisworker, peerID);
+	return (thispeer != NULL) ? thispeer->decompressor : thisworker->decompressor;
+}
+
+/*
+ * Same as get_peer_dictionary, but no dictionaries are created: returns the compressor or the decompressor
+ * worker i uses with a remote accelerator, NULL if it has none yet (while they are being created,
+ * or there is room for them).
+ */
+pDeduplicator find_worker_peer_dictionary(int i, __u32 peerID, int compressor) {
+	struct worker *thisworker = &workers[i];
+	struct peer_dictionary *thispeer;
+	pDeduplicator pd;
+	int state;
+
+	if (((peer_dictionaries == false) && (dictionary_hub == false)) || (peerID == 0)) {
+		return compressor ? thisworker->compressor : thisworker->decompressor;
+	}
+	pthread_mutex_lock(&thisworker->lock);
+	thispeer = lookup_peer_dictionary(thisworker, peerID);
+	state = (thispeer != NULL) ? __atomic_load_n(&thispeer->state, __ATOMIC_ACQUIRE) : PEER_DICT_ALLOCATING;
+	if (state == PEER_DICT_READY) pd = compressor ? thispeer->compressor : thispeer->decompressor;
+	else if ((thispeer != NULL) ? (state == PEER_DICT_ALLOCATING) : peer_dictionary_room(thisworker, peerID)) pd = NULL;
+	else pd = compressor ? thisworker->compressor : thisworker->decompressor;
+	pthread_mutex_unlock(&thisworker->lock);
+	return pd;
+}
+
+pDeduplicator find_peer_decompressor(struct worker *thisworker, __u32 peerID) {
+	return find_worker_peer_dictionary(thisworker->workernum, peerID, false);
+}
+
 void create_worker(int i) {
 	initialize_worker_processor(&workers[i].optimization);
 	initialize_worker_processor(&workers[i].deoptimization);
 	workers[i].workernum = i;
-	workers[i].compressor = newDeduplicator();
-	workers[i].decompressor = newDeduplicator();
+	workers[i].helpers = new_dedup_helpers(i);
+	create_dictionaries(i, 0, &workers[i].compressor, &workers[i].decompressor);
+	workers[i].numpeers = 0;
+	workers[i].peerpkts = 0;
+	workers[i].peers = NULL;
+	memset(workers[i].held, 0, sizeof(workers[i].held));
+	workers[i].numheld = 0;
+	if ((peer_dictionaries == true) || (dictionary_hub == true)) {
+		workers[i].peers = calloc(peer_dictionaries_max, sizeof(struct peer_dictionary));
+	}
 	workers[i].sessions = 0;
 	pthread_mutex_init(&workers[i].lock, NULL); // Initialize the worker lock.
 	pthread_create(&workers[i].optimization.t_processor, NULL,
@@ -516,11 +978,31 @@ void set_worker_state_stopping(struct worker *thisworker) {
 
 void shutdown_workers() {
 	int i;
+	unsigned int p;
 	for (i = 0; i < get_workers(); i++) {
 		pthread_cond_signal(&workers[i].optimization.queue.signal);
 		pthread_cond_signal(&workers[i].deoptimization.queue.signal);
 		//		set_worker_state_stopping(i);
 	}
+	/* Shared dictionaries are left for the next opennopd. */
+	for (i = 0; i < get_workers(); i++) {
+		releaseSharedDeduplicator(workers[i].compressor);
+		if (workers[i].decompressor != workers[i].compressor) {
+			releaseSharedDeduplicator(workers[i].decompressor);
+		}
+		pthread_mutex_lock(&workers[i].lock);
+		for (p = 0; p < workers[i].numpeers; p++) {
+			if (__atomic_load_n(&workers[i].peers[p].state, __ATOMIC_ACQUIRE) != PEER_DICT_READY) continue;
+			if (workers[i].peers[p].compressor != workers[i].compressor) {
+				releaseSharedDeduplicator(workers[i].peers[p].compressor);
+			}
+			if ((workers[i].peers[p].decompressor != workers[i].peers[p].compressor) &&
+					(workers[i].peers[p].decompressor != workers[i].decompressor)) {
+				releaseSharedDeduplicator(workers[i].peers[p].decompressor);
+			}
+		}
+		pthread_mutex_unlock(&workers[i].lock);
+	}
 }
 
 void rejoin_worker(int i) {
@@ -746,3 +1228,17 @@ pDeduplicator get_worker_decompressor(int i) {
 	return workers[i].decompressor;
 }
 
+unsigned int get_worker_peers(int i) {
+	unsigned int numpeers;
+	pthread_mutex_lock(&workers[i].lock);
+	numpeers = workers[i].numpeers;
+	pthread_mutex_unlock(&workers[i].lock);
+	return numpeers;
+}
+
+/* Peers are never removed, so the entry stays valid. NULL until its dictionaries are ready, or if they failed. */
+struct peer_dictionary *get_worker_peer(int i, unsigned int p) {
+	if (__atomic_load_n(&workers[i].peers[p].state, __ATOMIC_ACQUIRE) != PEER_DICT_READY) return NULL;
+	return &workers[i].peers[p];
+}
+
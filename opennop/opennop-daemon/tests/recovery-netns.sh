@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# Decode miss recovery test (see include/recovery.h), run as root from the opennop-daemon directory once built.
+#
+# Two accelerators, each opennopd in a network namespace of its own, between a client and a server namespace:
+#
+#   client 192.168.1.1 -- 192.168.1.254 acc-a 10.0.0.1 -- 10.0.0.2 acc-b 192.168.2.254 -- 192.168.2.1 server
+#
+# The server sends the same file several times, deduplicated by acc-b and uncompressed by acc-a. The link from acc-b
+# to acc-a loses packets (netem), so acc-a misses packets that later ones reference: it holds them, sends NACKs, and
+# acc-b answers with the packets missing. The files must arrive intact and acc-a must have recovered packets.
+# Each daemon runs in a mount namespace of its own, with its own /etc/opennop, /tmp (CLI socket) and /var/run.
+
+OPENNOPD=${OPENNOPD:-$PWD/opennopd/opennopd}
+OPENNOP=${OPENNOP:-$PWD/opennop/opennop}
+LOSS=${LOSS:-3%}
+RUNS=${RUNS:-5}
+PORT=5001
+WORK=$(mktemp -d /tmp/recovery-netns.XXXXXX)
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill $pid 2>/dev/null; done
+	sleep 1
+	for ns in client acc-a acc-b server; do ip netns del $ns 2>/dev/null; done
+	rm -rf $WORK
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $1"
+	exit 1
+}
+
+[ $(id -u) -eq 0 ] || fail "must be run as root"
+[ -x $OPENNOPD ] && [ -x $OPENNOP ] || fail "opennopd and opennop not built ($OPENNOPD, $OPENNOP)"
+mkdir -p /etc/opennop # Mount point of the configuration of each daemon
+
+for ns in client acc-a acc-b server; do
+	ip netns add $ns || fail "cannot create namespace $ns"
+	ip netns exec $ns ip link set lo up
+done
+ip link add lan-a type veth peer name lan-c
+ip link add wan-a type veth peer name wan-b
+ip link add lan-b type veth peer name lan-s
+ip link set lan-c netns client
+ip link set lan-a netns acc-a
+ip link set wan-a netns acc-a
+ip link set wan-b netns acc-b
+ip link set lan-b netns acc-b
+ip link set lan-s netns server
+
+ip netns exec client ip addr add 192.168.1.1/24 dev lan-c
+ip netns exec acc-a ip addr add 192.168.1.254/24 dev lan-a
+ip netns exec acc-a ip addr add 10.0.0.1/24 dev wan-a
+ip netns exec acc-b ip addr add 10.0.0.2/24 dev wan-b
+ip netns exec acc-b ip addr add 192.168.2.254/24 dev lan-b
+ip netns exec server ip addr add 192.168.2.1/24 dev lan-s
+for dev in client:lan-c acc-a:lan-a acc-a:wan-a acc-b:wan-b acc-b:lan-b server:lan-s; do
+	ip netns exec ${dev%%:*} ip link set ${dev#*:} up
+done
+ip netns exec client ip route add default via 192.168.1.254
+ip netns exec server ip route add default via 192.168.2.254
+ip netns exec acc-a ip route add 192.168.2.0/24 via 10.0.0.2
+ip netns exec acc-b ip route add 192.168.1.0/24 via 10.0.0.1
+# The accelerators add TCP options, so segments must leave room for them
+ip netns exec client ip link set lan-c mtu 1400
+ip netns exec server ip link set lan-s mtu 1400
+ip netns exec acc-b tc qdisc add dev wan-b root netem loss $LOSS
+
+for acc in acc-a:10.0.0.1 acc-b:10.0.0.2; do
+	ns=${acc%%:*}
+	mkdir -p $WORK/$ns
+	cat > $WORK/$ns/opennop.conf <<EOF
+optimization deduplication
+localid ${acc#*:}
+thrnum 1
+recovery_port $PORT
+EOF
+	ip netns exec $ns sysctl -q -w net.ipv4.ip_forward=1
+	ip netns exec $ns iptables -A FORWARD -j NFQUEUE --queue-num 0 -p TCP
+	ip netns exec $ns unshare -m sh -c "mount --make-rprivate / && mount --bind $WORK/$ns /etc/opennop && \
+			mount -t tmpfs tmpfs /tmp && mount -t tmpfs tmpfs /var/run && exec $OPENNOPD -n" > $WORK/$ns.log 2>&1 &
+	PIDS="$PIDS $!"
+done
+sleep 2
+for pid in $PIDS; do kill -0 $pid 2>/dev/null || fail "opennopd did not start"; done
+
+# A file repeating the same block, so later packets reference earlier ones
+mkdir -p $WORK/www
+head -c 262144 /dev/urandom > $WORK/block
+for i in $(seq 16); do cat $WORK/block; done > $WORK/www/data
+ip netns exec server python3 -m http.server 8080 --bind 192.168.2.1 --directory $WORK/www > /dev/null 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+
+for i in $(seq $RUNS); do
+	ip netns exec client curl -s -m 60 -o $WORK/got http://192.168.2.1:8080/data || fail "transfer $i did not finish"
+	cmp -s $WORK/got $WORK/www/data || fail "transfer $i corrupted"
+done
+
+counter() { # counter <daemon pid> <name>
+	nsenter -t $1 -m -n $OPENNOP show recovery | awk -v name="$2.value" '$1 == name { print $2 }'
+}
+set -- $PIDS
+held=$(counter $1 packets_held)
+recovered=$(counter $1 packets_recovered)
+answered=$(counter $2 chunks_sent)
+echo "acc-a: packets_held $held packets_recovered $recovered, acc-b: chunks_sent $answered"
+[ "${recovered:-0}" -gt 0 ] || fail "no packet recovered"
+[ "${answered:-0}" -gt 0 ] || fail "no NACK answered"
+echo "PASS"